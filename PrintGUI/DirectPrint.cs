@@ -0,0 +1,144 @@
+using System;
+using System.Drawing;
+using System.Drawing.Imaging;
+using System.Drawing.Printing;
+using System.IO;
+using System.IO.MemoryMappedFiles;
+using System.Text.Json;
+using System.Threading;
+
+namespace PrintGUI
+{
+    /// <summary>
+    /// One horizontal band of a print, as written by the server. Bands
+    /// of a memory spool have no file, they are rows of the buffer
+    /// </summary>
+    internal class SpoolBand
+    {
+        public string file { get; set; } = "";
+        public int top { get; set; }
+        public int height { get; set; }
+    }
+
+    /// <summary>
+    /// Banded spool manifest: physical size, resolution, band files and
+    /// whether the page is landscape
+    /// </summary>
+    internal class SpoolManifest
+    {
+        public int dpi { get; set; }
+        public int width_pixels { get; set; }
+        public int height_pixels { get; set; }
+        public SpoolBand[] bands { get; set; } = new SpoolBand[0];
+        // Bands are unturned, the driver turns the landscape page
+        public bool landscape { get; set; }
+        // Bands are still being written, each appears once complete
+        public bool streaming { get; set; }
+        // Name of the shared memory holding the print as BGRX rows,
+        // empty when the bands are files
+        public string memory { get; set; } = "";
+        public int stride { get; set; }
+    }
+
+    internal static class DirectPrint
+    {
+        // Longest to wait for the server to finish one streamed band
+        private static readonly TimeSpan BandTimeout = TimeSpan.FromMinutes(30);
+
+        /// <summary>
+        /// Wait for a streamed band to be written. The server leaves
+        /// the manifest's .failed file when the render fails
+        /// </summary>
+        private static void WaitForBand(string path, string manifestPath)
+        {
+            var deadline = DateTime.Now + BandTimeout;
+
+            while (!File.Exists(path))
+            {
+                if (File.Exists(manifestPath + ".failed"))
+                {
+                    throw new IOException("Render failed before " + Path.GetFileName(path));
+                }
+
+                if (DateTime.Now > deadline)
+                {
+                    throw new TimeoutException("Timed out waiting for " + Path.GetFileName(path));
+                }
+
+                Thread.Sleep(100);
+            }
+        }
+
+        /// <summary>
+        /// A band of a memory spool as a bitmap over its rows, nothing is copied
+        /// </summary>
+        private static Bitmap MemoryBand(MemoryMappedViewAccessor view, SpoolManifest manifest, SpoolBand band)
+        {
+            nint rows = view.SafeMemoryMappedViewHandle.DangerousGetHandle() + (nint)view.PointerOffset;
+
+            return new Bitmap(manifest.width_pixels, band.height, manifest.stride, PixelFormat.Format32bppRgb,
+                rows + (nint)band.top * manifest.stride);
+        }
+
+        /// <summary>
+        /// Print a banded spool manifest through GDI at the print's own resolution
+        /// </summary>
+        /// <param name="manifestPath">Manifest json written by the server</param>
+        /// <param name="printerName">Printer to use, or null for the default printer</param>
+        public static void Print(string manifestPath, string? printerName)
+        {
+            var manifest = JsonSerializer.Deserialize<SpoolManifest>(File.ReadAllText(manifestPath))!;
+            string directory = Path.GetDirectoryName(Path.GetFullPath(manifestPath)) ?? "";
+
+            // Page units are hundredths of an inch
+            float scale = 100f / manifest.dpi;
+
+            using var document = new PrintDocument();
+
+            if (printerName != null)
+            {
+                document.PrinterSettings.PrinterName = printerName;
+            }
+
+            document.DocumentName = Path.GetFileNameWithoutExtension(manifestPath);
+            document.PrintController = new StandardPrintController();
+            document.OriginAtMargins = false;
+            document.DefaultPageSettings.Margins = new Margins(0, 0, 0, 0);
+
+            // The paper is the print as it comes off the roll. A
+            // landscape page lies across it, so the unturned bands are
+            // drawn in page coordinates and the driver turns them
+            int pageWidth = manifest.landscape ? manifest.height_pixels : manifest.width_pixels;
+            int pageHeight = manifest.landscape ? manifest.width_pixels : manifest.height_pixels;
+            document.DefaultPageSettings.PaperSize = new PaperSize("BLUEPRINT",
+                (int)Math.Ceiling(pageWidth * scale), (int)Math.Ceiling(pageHeight * scale));
+            document.DefaultPageSettings.Landscape = manifest.landscape;
+
+            // The server holds a memory spool until this reports back
+            using var spool = manifest.memory != "" ? MemoryMappedFile.OpenExisting(manifest.memory) : null;
+            using var view = spool?.CreateViewAccessor(0, 0, MemoryMappedFileAccess.Read);
+
+            document.PrintPage += (sender, e) =>
+            {
+                // Only one band is decoded at a time, so memory stays
+                // bounded by the band height whatever the print length
+                foreach (var band in manifest.bands)
+                {
+                    if (manifest.streaming)
+                    {
+                        WaitForBand(Path.Combine(directory, band.file), manifestPath);
+                    }
+
+                    using var bitmap = view != null ? MemoryBand(view, manifest, band) : new Bitmap(Path.Combine(directory, band.file));
+
+                    e.Graphics!.DrawImage(bitmap, new RectangleF(0, band.top * scale,
+                        bitmap.Width * scale, bitmap.Height * scale));
+                }
+
+                e.HasMorePages = false;
+            };
+
+            document.Print();
+        }
+    }
+}
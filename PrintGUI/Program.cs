@@ -1,6 +1,7 @@
 ﻿using System;
 using System.Drawing;
 using System.IO;
+using System.IO.Pipes;
 using System.Runtime.InteropServices;
 using System.Windows.Forms;
 using System.Diagnostics;
@@ -13,73 +14,304 @@ namespace PrintGUI // Note: actual namespace depends on the project name.
         [DllImport("user32.dll")]
         private static extern bool SetForegroundWindow(IntPtr hWnd);
 
+        private delegate void WinEventDelegate(IntPtr hWinEventHook, uint eventType, IntPtr hwnd,
+            int idObject, int idChild, uint dwEventThread, uint dwmsEventTime);
+
+        [DllImport("user32.dll")]
+        private static extern IntPtr SetWinEventHook(uint eventMin, uint eventMax, IntPtr hmodWinEventProc,
+            WinEventDelegate lpfnWinEventProc, uint idProcess, uint idThread, uint dwFlags);
+
+        [DllImport("user32.dll")]
+        private static extern bool UnhookWinEvent(IntPtr hWinEventHook);
+
+        [DllImport("user32.dll", CharSet = CharSet.Unicode)]
+        private static extern int GetWindowText(IntPtr hWnd, System.Text.StringBuilder text, int count);
+
+        private const uint EVENT_OBJECT_DESTROY = 0x8001;
+        private const uint EVENT_OBJECT_SHOW = 0x8002;
+        private const uint WINEVENT_OUTOFCONTEXT = 0x0000;
+        private const int OBJID_WINDOW = 0;
+
+        // Give up if the wizard never shows within this long
+        private const int OpenTimeoutMs = 60000;
+
+        // Keep the hook callback alive for as long as the hook is installed
+        private static WinEventDelegate? winEventProc;
+
+        // True under --serve, where a closed wizard doesn't end the process
+        private static bool serving = false;
+
+        // Hand-offs sent to the wizard, oldest first. A wizard window
+        // that shows belongs to the oldest one still without a window
+        private static readonly List<Handoff> handoffs = new();
+
+        // The Print Pictures drop target, created once under --serve
+        private static IDropTarget? dropTarget;
+
+        private const string PipeName = "BLUEPRINT-PrintGUI";
+
+        [STAThread]
         static void Main(string[] args)
         {
+            // Runtime startup, from the process being created to Main
+            double startup = (DateTime.Now - Process.GetCurrentProcess().StartTime).TotalMilliseconds;
+
             if (args.Length == 0)
             {
                 Console.WriteLine("No file specified");
                 return;
             }
 
-            int num_open_start = NumOpenPrintWindows();
+            if (args[0] == "--serve")
+            {
+                Serve();
+                return;
+            }
 
-            System.Threading.Thread.Sleep(50);
+            var handoff = new Handoff(args[0] == "--direct" || args[0] == "--vector" ? args[1..] : args,
+                Environment.GetEnvironmentVariable("BLUEPRINT_PRINTER_NAME"));
+            handoff.Timings["startup"] = startup;
 
-            Console.WriteLine("Printing file:");
-            Console.WriteLine(args[0]);
-            OpenPrintPictures(args[0]);
+            if (args[0] == "--direct" || args[0] == "--vector")
+            {
+                Spool(handoff, args[0]);
+                return;
+            }
+
+            // Watch for the wizard window opening and closing instead
+            // of polling every process's window title
+            IntPtr hook = InstallHook();
+            handoff.Mark("hook");
+
+            Console.WriteLine("Printing files:");
+            foreach (var filename in handoff.Files)
+            {
+                Console.WriteLine(filename);
+            }
+            OpenPrintPictures(handoff);
             Console.WriteLine("Done");
 
-            // Bring the print window to the foreground
-            Process[] processes = Process.GetProcesses();
+            // Sleep in the message loop until the hook sees the wizard close
+            System.Windows.Forms.Application.Run();
+
+            UnhookWinEvent(hook);
+        }
+
+        /// <summary>
+        /// Stay running and take hand-offs over a named pipe, so each print
+        /// skips .NET startup, COM initialisation and the drop target lookup
+        /// </summary>
+        private static void Serve()
+        {
+            serving = true;
+            IntPtr hook = InstallHook();
+
+            // Hand-offs are run on this STA thread, where COM and the hook live
+            var invoker = new Control();
+            invoker.CreateControl();
+
+            var listener = new Thread(() => Listen(invoker)) { IsBackground = true, Name = "pipe" };
+            listener.Start();
+
+            Console.WriteLine("Serving hand-offs on " + PipeName);
+            System.Windows.Forms.Application.Run();
+
+            UnhookWinEvent(hook);
+        }
 
-            foreach (var process in processes)
+        /// <summary>
+        /// One json command per connection: flags, files and printer_name
+        /// as the command line and environment would give them. Replies ok
+        /// once the hand-off is queued
+        /// </summary>
+        private static void Listen(Control invoker)
+        {
+            while (true)
             {
-                if (process.MainWindowTitle
-                           .IndexOf("Print Pictures", StringComparison.InvariantCulture) > -1)
+                using var pipe = new NamedPipeServerStream(PipeName, PipeDirection.InOut, 1);
+                pipe.WaitForConnection();
+
+                double received = 0;
+                var reader = new StreamReader(pipe);
+                var writer = new StreamWriter(pipe) { AutoFlush = true };
+
+                try
                 {
-                    SetForegroundWindow(process.MainWindowHandle);
-                    break;
+                    var clock = Stopwatch.StartNew();
+                    var command = System.Text.Json.JsonSerializer.Deserialize<HelperCommand>(reader.ReadLine() ?? "")!;
+                    received = clock.Elapsed.TotalMilliseconds;
+
+                    invoker.BeginInvoke(new Action(() => Run(command, received)));
+                    writer.WriteLine("ok");
+                }
+                catch (Exception e)
+                {
+                    Console.WriteLine("Bad command: " + e.Message);
+
+                    try
+                    {
+                        writer.WriteLine("error " + e.Message);
+                    }
+                    catch (IOException)
+                    {
+                        // The server hung up first
+                    }
                 }
             }
+        }
 
-            int num_times_wrong = 0;
+        private static void Run(HelperCommand command, double received)
+        {
+            var handoff = new Handoff(command.files, command.printer_name);
+            handoff.Timings["command"] = received;
 
-            while (true)
+            if (command.flags.Contains("--direct") || command.flags.Contains("--vector"))
+            {
+                // Spools take a while, keep the message loop free for the wizard
+                string mode = command.flags.Contains("--direct") ? "--direct" : "--vector";
+                Task.Run(() => Spool(handoff, mode));
+                return;
+            }
+
+            try
             {
-                int num_open_now = NumOpenPrintWindows();
+                OpenPrintPictures(handoff);
+            }
+            catch (Exception e)
+            {
+                // Keep serving the next print
+                Console.WriteLine("Hand-off failed: " + e.Message);
+                ReportStatus(handoff, "failed");
+                Finish(handoff);
+            }
+        }
 
-                if (num_open_now == num_open_start)
+        /// <summary>
+        /// Print a manifest without the wizard: --direct spools its bands
+        /// through GDI, --vector prints its pdf page as vector
+        /// </summary>
+        private static void Spool(Handoff handoff, string mode)
+        {
+            string? printerName = string.IsNullOrEmpty(handoff.PrinterName) ? null : handoff.PrinterName;
+
+            try
+            {
+                if (mode == "--direct")
                 {
-                    num_times_wrong++;
-                } else
+                    DirectPrint.Print(handoff.Files[0], printerName);
+                }
+                else
                 {
-                    num_times_wrong = 0;
+                    VectorPrint.Print(handoff.Files[0], printerName);
                 }
+            }
+            catch (Exception e) when (serving)
+            {
+                // One bad manifest shouldn't take the helper down
+                Console.WriteLine("Spool failed: " + e.Message);
+                ReportStatus(handoff, "failed");
+                return;
+            }
+
+            handoff.Mark("spool");
+            ReportStatus(handoff, "spooled");
+        }
 
-                if (num_times_wrong == 10000)
+        private static IntPtr InstallHook()
+        {
+            winEventProc = new WinEventDelegate(OnWinEvent);
+
+            return SetWinEventHook(EVENT_OBJECT_DESTROY, EVENT_OBJECT_SHOW, IntPtr.Zero,
+                winEventProc, 0, 0, WINEVENT_OUTOFCONTEXT);
+        }
+
+        private static void OnWinEvent(IntPtr hWinEventHook, uint eventType, IntPtr hwnd,
+            int idObject, int idChild, uint dwEventThread, uint dwmsEventTime)
+        {
+            if (idObject != OBJID_WINDOW || idChild != 0)
+            {
+                return;
+            }
+
+            if (eventType == EVENT_OBJECT_SHOW)
+            {
+                var handoff = handoffs.Find(waiting => waiting.Window == IntPtr.Zero);
+                if (handoff == null)
+                {
+                    return;
+                }
+
+                var title = new System.Text.StringBuilder(256);
+                GetWindowText(hwnd, title, title.Capacity);
+
+                if (title.ToString().IndexOf("Print Pictures", StringComparison.InvariantCulture) > -1)
+                {
+                    // Bring the print window to the foreground. From the
+                    // drop to here is the wizard decoding the files
+                    handoff.Window = hwnd;
+                    SetForegroundWindow(hwnd);
+                    handoff.Mark("wizard");
+                    ReportStatus(handoff, "opened");
+                }
+            }
+            else if (eventType == EVENT_OBJECT_DESTROY)
+            {
+                var handoff = handoffs.Find(open => open.Window == hwnd);
+                if (handoff == null)
                 {
                     return;
                 }
+
+                // The job has been handed to the spooler (or cancelled)
+                handoff.Mark("dialog");
+                ReportStatus(handoff, "closed");
+                Finish(handoff);
             }
         }
 
-        public static int NumOpenPrintWindows()
+        /// <summary>
+        /// Forget a hand-off that is over, ending the process unless serving
+        /// </summary>
+        private static void Finish(Handoff handoff)
         {
-            string[] result = new string[50];
-            int count = 0;
-            Process[] processes = Process.GetProcesses();
-            foreach (var process in processes)
+            handoff.OpenTimeout?.Stop();
+            handoffs.Remove(handoff);
+
+            if (!serving)
             {
-                if (process.MainWindowTitle
-                           .IndexOf("Print Pictures", StringComparison.InvariantCulture) > -1)
-                {
-                    result[count] = process.MainWindowTitle;
-                    count++;
-                }
+                System.Windows.Forms.Application.ExitThread();
+            }
+        }
+
+        /// <summary>
+        /// Tell the server how the hand-off is going
+        /// </summary>
+        /// <param name="handoff">The hand-off, its files and timings are sent with the status</param>
+        /// <param name="status">opened, closed, timeout, spooled or failed</param>
+        private static void ReportStatus(Handoff handoff, string status)
+        {
+            Console.WriteLine("Print window " + status);
+
+            string? url = Environment.GetEnvironmentVariable("BLUEPRINT_STATUS_URL");
+
+            if (string.IsNullOrEmpty(url))
+            {
+                return;
             }
 
-            return count;
+            try
+            {
+                using var client = new System.Net.Http.HttpClient { Timeout = TimeSpan.FromSeconds(2) };
+                var body = System.Text.Json.JsonSerializer.Serialize(new { files = handoff.Files, status = status, timings = handoff.Timings });
+                var content = new System.Net.Http.StringContent(body, System.Text.Encoding.UTF8, "application/json");
+
+                client.PostAsync(url, content).Wait();
+            }
+            catch (Exception e)
+            {
+                // The server not listening shouldn't stop the print
+                Console.WriteLine("Could not report status: " + e.Message);
+            }
         }
 
         [ComImport]
@@ -111,21 +343,98 @@ namespace PrintGUI // Note: actual namespace depends on the project name.
         /// <summary>
         /// Open Print Pictures dialog
         /// </summary>
-        /// <param name="filename">File to print</param>
-        public static void OpenPrintPictures(string filename)
+        /// <param name="handoff">Files to print as one job</param>
+        public static void OpenPrintPictures(Handoff handoff)
         {
-            var dataObj = new DataObject(DataFormats.FileDrop, new string[] { filename });
+            handoffs.Add(handoff);
+
+            // Give up if the wizard never shows
+            handoff.OpenTimeout = new System.Windows.Forms.Timer { Interval = OpenTimeoutMs };
+            handoff.OpenTimeout.Tick += (sender, e) =>
+            {
+                handoff.OpenTimeout.Stop();
+
+                if (handoff.Window == IntPtr.Zero)
+                {
+                    ReportStatus(handoff, "timeout");
+                    Finish(handoff);
+                }
+            };
+            handoff.OpenTimeout.Start();
+
+            var dataObj = new DataObject(DataFormats.FileDrop, handoff.Files);
             var memoryStream = new MemoryStream(4);
             var buffer = new byte[] { 5, 0, 0, 0 };
 
             memoryStream.Write(buffer, 0, buffer.Length);
             dataObj.SetData("Preferred DropEffect", memoryStream);
+            handoff.Mark("data_object");
+
+            if (dropTarget == null)
+            {
+                var CLSID_PrintPhotosDropTarget = new Guid("60fd46de-f830-4894-a628-6fa81bc0190d");
+                var dropTargetType = Type.GetTypeFromCLSID(CLSID_PrintPhotosDropTarget, true)!;
+                handoff.Mark("clsid_lookup");
+
+                dropTarget = (IDropTarget)Activator.CreateInstance(dropTargetType)!;
+                handoff.Mark("create_instance");
+            }
+
+            try
+            {
+                dropTarget.Drop(dataObj, 0, new Point(), 0);
+            }
+            catch (COMException) when (serving)
+            {
+                // The cached drop target went bad, make a fresh one next time
+                dropTarget = null;
+                throw;
+            }
 
-            var CLSID_PrintPhotosDropTarget = new Guid("60fd46de-f830-4894-a628-6fa81bc0190d");
-            var dropTargetType = Type.GetTypeFromCLSID(CLSID_PrintPhotosDropTarget, true);
-            var dropTarget = (IDropTarget)Activator.CreateInstance(dropTargetType);
+            handoff.Mark("drop");
+        }
+    }
 
-            dropTarget.Drop(dataObj, 0, new Point(), 0);
+    /// <summary>
+    /// A command sent down the helper's pipe
+    /// </summary>
+    internal class HelperCommand
+    {
+        public string[] flags { get; set; } = new string[0];
+        public string[] files { get; set; } = new string[0];
+        public string? printer_name { get; set; }
+    }
+
+    /// <summary>
+    /// One print handed to PrintGUI, with the wizard window it opened and
+    /// the milliseconds spent in each phase so far
+    /// </summary>
+    internal class Handoff
+    {
+        public string[] Files;
+        public string? PrinterName;
+        public IntPtr Window = IntPtr.Zero;
+        public System.Windows.Forms.Timer? OpenTimeout;
+        public readonly Dictionary<string, double> Timings = new();
+
+        private readonly Stopwatch clock = Stopwatch.StartNew();
+        private double lastMark = 0;
+
+        public Handoff(string[] files, string? printerName)
+        {
+            Files = files;
+            PrinterName = printerName;
+        }
+
+        /// <summary>
+        /// Record the time since the previous mark as a phase
+        /// </summary>
+        /// <param name="phase">Name the phase is reported under</param>
+        public void Mark(string phase)
+        {
+            double now = clock.Elapsed.TotalMilliseconds;
+            Timings[phase] = now - lastMark;
+            lastMark = now;
         }
     }
-}
\ No newline at end of file
+}
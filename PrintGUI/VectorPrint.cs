@@ -0,0 +1,169 @@
+using System;
+using System.Drawing.Printing;
+using System.IO;
+using System.Runtime.InteropServices;
+using System.Text.Json;
+
+namespace PrintGUI
+{
+    /// <summary>
+    /// Vector spool manifest: the pdf page to print and its planned physical size
+    /// </summary>
+    internal class VectorManifest
+    {
+        public string pdf { get; set; } = "";
+        public int page { get; set; }
+        public double width_inches { get; set; }
+        public double height_inches { get; set; }
+        public bool rotate { get; set; }
+    }
+
+    internal static class VectorPrint
+    {
+        // poppler and cairo ship in vips-dev-8.14/bin, which the server
+        // puts on PATH before starting PrintGUI
+        [DllImport("libpoppler-glib-8.dll")]
+        private static extern IntPtr poppler_document_new_from_file([MarshalAs(UnmanagedType.LPUTF8Str)] string uri,
+            IntPtr password, out IntPtr error);
+
+        [DllImport("libpoppler-glib-8.dll")]
+        private static extern IntPtr poppler_document_get_page(IntPtr document, int index);
+
+        [DllImport("libpoppler-glib-8.dll")]
+        private static extern void poppler_page_get_size(IntPtr page, out double width, out double height);
+
+        [DllImport("libpoppler-glib-8.dll")]
+        private static extern void poppler_page_render_for_printing(IntPtr page, IntPtr cairo);
+
+        [DllImport("libgobject-2.0-0.dll")]
+        private static extern void g_object_unref(IntPtr obj);
+
+        [DllImport("libcairo-2.dll")]
+        private static extern IntPtr cairo_win32_printing_surface_create(IntPtr hdc);
+
+        [DllImport("libcairo-2.dll")]
+        private static extern IntPtr cairo_create(IntPtr surface);
+
+        [DllImport("libcairo-2.dll")]
+        private static extern void cairo_translate(IntPtr cairo, double x, double y);
+
+        [DllImport("libcairo-2.dll")]
+        private static extern void cairo_rotate(IntPtr cairo, double angle);
+
+        [DllImport("libcairo-2.dll")]
+        private static extern void cairo_scale(IntPtr cairo, double x, double y);
+
+        [DllImport("libcairo-2.dll")]
+        private static extern void cairo_destroy(IntPtr cairo);
+
+        [DllImport("libcairo-2.dll")]
+        private static extern void cairo_surface_finish(IntPtr surface);
+
+        [DllImport("libcairo-2.dll")]
+        private static extern void cairo_surface_destroy(IntPtr surface);
+
+        [DllImport("gdi32.dll")]
+        private static extern int GetDeviceCaps(IntPtr hdc, int index);
+
+        private const int LOGPIXELSX = 88;
+        private const int LOGPIXELSY = 90;
+        private const int PHYSICALOFFSETX = 112;
+        private const int PHYSICALOFFSETY = 113;
+
+        /// <summary>
+        /// Print a pdf page as vector through cairo's GDI printing surface, scaled to its planned size
+        /// </summary>
+        /// <param name="manifestPath">Manifest json written by the server</param>
+        /// <param name="printerName">Printer to use, or null for the default printer</param>
+        public static void Print(string manifestPath, string? printerName)
+        {
+            var manifest = JsonSerializer.Deserialize<VectorManifest>(File.ReadAllText(manifestPath))!;
+            string directory = Path.GetDirectoryName(Path.GetFullPath(manifestPath)) ?? "";
+
+            IntPtr document = poppler_document_new_from_file(new Uri(Path.Combine(directory, manifest.pdf)).AbsoluteUri,
+                IntPtr.Zero, out IntPtr error);
+
+            if (document == IntPtr.Zero)
+            {
+                throw new IOException("Could not open " + manifest.pdf);
+            }
+
+            IntPtr page = poppler_document_get_page(document, manifest.page);
+            poppler_page_get_size(page, out double pageWidth, out double pageHeight);
+
+            using var printDocument = new PrintDocument();
+
+            if (printerName != null)
+            {
+                printDocument.PrinterSettings.PrinterName = printerName;
+            }
+
+            // Page units are hundredths of an inch
+            printDocument.DocumentName = Path.GetFileNameWithoutExtension(manifest.pdf);
+            printDocument.PrintController = new StandardPrintController();
+            printDocument.OriginAtMargins = false;
+            printDocument.DefaultPageSettings.Margins = new Margins(0, 0, 0, 0);
+            printDocument.DefaultPageSettings.PaperSize = new PaperSize("BLUEPRINT",
+                (int)Math.Ceiling(manifest.width_inches * 100), (int)Math.Ceiling(manifest.height_inches * 100));
+
+            printDocument.PrintPage += (sender, e) =>
+            {
+                IntPtr hdc = e.Graphics!.GetHdc();
+
+                try
+                {
+                    // The surface draws in device pixels from the
+                    // printable area's corner
+                    double dpiX = GetDeviceCaps(hdc, LOGPIXELSX);
+                    double dpiY = GetDeviceCaps(hdc, LOGPIXELSY);
+
+                    IntPtr surface = cairo_win32_printing_surface_create(hdc);
+                    IntPtr cairo = cairo_create(surface);
+
+                    cairo_translate(cairo, -GetDeviceCaps(hdc, PHYSICALOFFSETX), -GetDeviceCaps(hdc, PHYSICALOFFSETY));
+
+                    // Points to device pixels at the planned width, which
+                    // keeps the page's aspect as the raster path does. The
+                    // page is turned clockwise first when it prints rotated
+                    double printedWidth = manifest.rotate ? pageHeight : pageWidth;
+                    double inchesPerPoint = manifest.width_inches / printedWidth;
+                    double scaleX = inchesPerPoint * dpiX;
+                    double scaleY = inchesPerPoint * dpiY;
+
+                    if (manifest.rotate)
+                    {
+                        cairo_translate(cairo, printedWidth * scaleX, 0);
+                        cairo_rotate(cairo, Math.PI / 2);
+                        cairo_scale(cairo, scaleY, scaleX);
+                    }
+                    else
+                    {
+                        cairo_scale(cairo, scaleX, scaleY);
+                    }
+
+                    poppler_page_render_for_printing(page, cairo);
+
+                    cairo_destroy(cairo);
+                    cairo_surface_finish(surface);
+                    cairo_surface_destroy(surface);
+                }
+                finally
+                {
+                    e.Graphics.ReleaseHdc(hdc);
+                }
+
+                e.HasMorePages = false;
+            };
+
+            try
+            {
+                printDocument.Print();
+            }
+            finally
+            {
+                g_object_unref(page);
+                g_object_unref(document);
+            }
+        }
+    }
+}
@@ -0,0 +1,117 @@
+import itertools
+import math
+import threading
+import time
+
+# Admission for requests that decode an upload the moment they arrive,
+# so a rush of big files queues instead of every request decoding at
+# once and all of them crawling. At most slots are in at a time, and
+# past the first only while room() says the memory governor has some.
+# The rest wait in arrival order, each with its place in line and an
+# ETA from the seconds the cost model predicts for those ahead. Once
+# the line is full or its wait too long, newcomers are turned away
+
+
+class Busy(Exception):
+    # Turned away, with the place in line it would have had and the
+    # seconds until that was likely to get in
+    def __init__(self, position, eta):
+        super().__init__("busy")
+        self.position = position
+        self.eta = eta
+
+
+class Gate:
+
+    def __init__(self, slots, room, queue_max):
+        self.condition = threading.Condition()
+        self.slots = max(1, slots)
+        self.room = room
+        self.queue_max = queue_max
+        self.tickets = itertools.count()
+        # Tickets in line in arrival order, those in with when they got
+        # in, and each one's predicted seconds
+        self.waiting = []
+        self.running = {}
+        self.seconds = {}
+
+    def check(self, longest=math.inf):
+        # Raise Busy when a newcomer would be turned away: the line is
+        # full, or it would wait longer than longest seconds
+        with self.condition:
+            self.refuse(longest)
+
+    def refuse(self, longest):
+        eta = self.waitAt(len(self.waiting))
+
+        if len(self.waiting) >= self.queue_max or (self.waiting and eta > longest):
+            raise Busy(len(self.waiting) + 1, eta)
+
+    def join(self, seconds, longest=math.inf):
+        # A place in line for a request predicted to take seconds, or
+        # Busy
+        with self.condition:
+            self.refuse(longest)
+
+            ticket = next(self.tickets)
+            self.waiting.append(ticket)
+            self.seconds[ticket] = seconds
+
+            return ticket
+
+    def waitAt(self, position):
+        # Predicted seconds until the request at position in line gets
+        # in: what those running have left and the seconds of those
+        # ahead, shared across the slots
+        now = time.time()
+        left = sum(max(0, self.seconds[ticket] - (now - start)) for ticket, start in self.running.items())
+        ahead = sum(self.seconds[ticket] for ticket in self.waiting[:position])
+
+        return (left + ahead) / self.slots
+
+    def status(self, ticket):
+        # (position, eta) of a ticket in line, 1 first, or (0, 0) once
+        # it's in
+        with self.condition:
+            if ticket not in self.waiting:
+                return 0, 0
+
+            position = self.waiting.index(ticket)
+
+            return position + 1, self.waitAt(position)
+
+    def enter(self, ticket, timeout):
+        # Wait up to timeout seconds for a ticket's turn, True once it's
+        # in and False while it's still in line
+        deadline = time.time() + timeout
+
+        with self.condition:
+            while not self.turn(ticket):
+                left = deadline - time.time()
+                if left <= 0:
+                    return False
+
+                # Memory frees without anyone here saying so
+                self.condition.wait(min(left, 0.25))
+
+            self.waiting.remove(ticket)
+            self.running[ticket] = time.time()
+            self.condition.notify_all()
+
+            return True
+
+    def turn(self, ticket):
+        # The first in line goes in when nothing else is, or when a slot
+        # and memory are free
+        return self.waiting[0] == ticket and \
+            (not self.running or (len(self.running) < self.slots and self.room()))
+
+    def leave(self, ticket):
+        # Done, or given up waiting. Leaving twice is harmless
+        with self.condition:
+            if ticket in self.waiting:
+                self.waiting.remove(ticket)
+
+            self.running.pop(ticket, None)
+            self.seconds.pop(ticket, None)
+            self.condition.notify_all()
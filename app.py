@@ -1,20 +1,64 @@
 from flask import Flask
 from flask import request
 from flask import send_file
+from flask import Response
+from flask import g
 from markupsafe import escape
-
-from PIL import Image
-from PIL import ImageDraw
-import pypdfium2 as pdfium
+from werkzeug.utils import safe_join
 
 import time
 import json
 import shutil
 import os
+import re
+import sys
 import subprocess
 import time
 import math
-import io
+import base64
+import hashlib
+import threading
+import collections
+import concurrent.futures
+import contextlib
+import platform
+import ctypes
+import mmap
+import mimetypes
+import zlib
+import tempfile
+import sqlite3
+import uuid
+
+import jobs
+import metrics
+import tracing
+import profiling
+import printers
+import printlog
+import precompress
+import workers
+import printerstate
+import costmodel
+import cacheindex
+import admission
+import priority
+import sharedcache
+import officeconvert
+import pdfimage
+import jpegstrips
+import jpegtransform
+
+# Everything written while rendering goes under BLUEPRINT_STORAGE_DIR
+# when it's set, a fast volume say: vips temp files, spool files,
+# spilled sources and previews. Unset keeps them beside app.py and vips
+# temp files in the system temp dir
+STORAGE_DIR = os.environ.get("BLUEPRINT_STORAGE_DIR", "")
+TEMP_DIR = os.path.join(STORAGE_DIR, "tmp") if STORAGE_DIR else ""
+if TEMP_DIR:
+    os.makedirs(TEMP_DIR, exist_ok=True)
+    # vips makes new_temp_file files in TMPDIR
+    os.environ["TMPDIR"] = TEMP_DIR
 
 # Add vips-dev-8.14 to path by getting current executable path
 # and adding "/vips-dev-8.10/bin" to it
@@ -24,23 +68,833 @@ try:
 except Exception as e:
     print("Error importing pyvips: " + str(e))
 
-# Set the max image size to infinity
-Image.MAX_IMAGE_PIXELS = None
+# pdfium is an optional second pdf rasteriser, see PDF_BACKEND
+try:
+    import pypdfium2
+except ImportError:
+    pypdfium2 = None
+
+# Limits for the vips operation cache, which shares repeated
+# loads and resizes between renders
+VIPS_CACHE_MAX = int(os.environ.get("BLUEPRINT_VIPS_CACHE_MAX", "100"))
+VIPS_CACHE_MAX_BYTES = int(os.environ.get("BLUEPRINT_VIPS_CACHE_MB", "100")) * 1024 * 1024
+VIPS_CACHE_MAX_FILES = int(os.environ.get("BLUEPRINT_VIPS_CACHE_FILES", "100"))
+
+try:
+    tracing.traceOperations(pyvips)
+    profiling.profileOperations(pyvips)
+
+    pyvips.cache_set_max(VIPS_CACHE_MAX)
+    pyvips.cache_set_max_mem(VIPS_CACHE_MAX_BYTES)
+    pyvips.cache_set_max_files(VIPS_CACHE_MAX_FILES)
+except Exception as e:
+    print("Error configuring vips cache: " + str(e))
+
+# Resolution vector documents are rasterised at for print
+VECTOR_PRINT_DPI = int(os.environ.get("BLUEPRINT_VECTOR_DPI", "300"))
+# Big pdf pages and svgs render with a poppler document or rsvg handle
+# of their own for each of up to this many columns at least
+# VECTOR_CLONE_MIN_WIDTH wide, see cloneColumns. 1 renders every page
+# from one document
+VECTOR_RENDER_CLONES = int(os.environ.get("BLUEPRINT_VECTOR_RENDER_CLONES", "0")) or os.cpu_count() or 1
+VECTOR_CLONE_MIN_WIDTH = 1024
+VECTOR_CLONE_MIN_PIXELS = 50 * 1000 * 1000
+# Columns of svg are culled in cells this tall: cells a small render
+# of the svg, SVG_CULL_MASK_WIDTH wide, shows nothing in aren't drawn
+SVG_CULL_CELL_HEIGHT = 1024
+SVG_CULL_MASK_WIDTH = 2048
+# Rasteriser for pdf prints: "poppler" through vips pdfload, "pdfium"
+# through pypdfium2 when it's installed, or "auto" to pick per page
+# from what its content stream is made of, see pdfBackend. Previews
+# always use poppler, they're small
+PDF_BACKEND = os.environ.get("BLUEPRINT_PDF_BACKEND", "poppler")
+# pdfium draws a page in one go rather than tile by tile as poppler
+# does, so bigger pages always go to poppler
+PDFIUM_MAX_PIXELS = int(os.environ.get("BLUEPRINT_PDFIUM_MAX_MEGAPIXELS", "600")) * 1000 * 1000
+# auto sends a page to pdfium once it has this many path operators to
+# each text one, and at least PDFIUM_MIN_PATHS of them: pdfium fills
+# big CAD drawings much faster, poppler lays out text faster
+PDFIUM_PATHS_PER_TEXT = 50
+PDFIUM_MIN_PATHS = 20000
+# Prints below this dpi are enlarged to it before spooling, 0 leaves
+# scaling to the driver
+PRINT_UPSCALE_DPI = int(os.environ.get("BLUEPRINT_PRINT_UPSCALE_DPI", "0"))
+PRINT_UPSCALE_KERNEL = os.environ.get("BLUEPRINT_PRINT_UPSCALE_KERNEL", "lanczos3")
+# Resample every print, up or down, to exactly the printer's native
+# dpi across the paper, so the driver gets its device grid 1:1 and does
+# no scaling. Replaces PRINT_UPSCALE_DPI when set
+PRINT_DEVICE_GRID = os.environ.get("BLUEPRINT_DEVICE_GRID", "0") == "1"
+# Never enlarge a print: sources below the dpi the upscale or device
+# grid would take them to spool their own pixels, with their physical
+# size in the spool's resolution for the driver to scale to. Spools and
+# renders of small sources stay as small as the sources. Reductions to
+# the grid or a preset's cap still happen
+PRINT_NATIVE_PIXELS = os.environ.get("BLUEPRINT_NATIVE_PIXELS", "0") == "1"
+# Photos are enlarged through this vips interpolator, "nohalo" or
+# "lbb" say, instead of the PRINT_UPSCALE_KERNEL resize when it's set.
+# Sources of at most HARD_EDGED_MAX_COLOURS colours, pixel art and QR
+# codes, enlarge with nearest so their edges stay hard
+PRINT_ENLARGE_INTERPOLATOR = os.environ.get("BLUEPRINT_PRINT_ENLARGE_INTERPOLATOR", "")
+HARD_EDGED_MAX_COLOURS = 32
+# Colours are counted on the statistics thumbnail, whose filtered edges
+# blend a few pixels of in-between colours, so only those covering
+# this share of it count
+HARD_EDGED_MIN_SHARE = 0.001
+
+# Render presets by options["quality"]: the most dpi a print spools
+# at, the kernel it reduces with, the kernel or interpolator it
+# enlarges with, whether it's colour managed into the paper profile
+# and sharpened, and its spool depth and compression. None keeps the
+# server's own setting, so standard renders as every print always has
+PRINT_PRESETS = {
+    "draft": {"max_dpi": 150, "reduce_kernel": "linear", "enlarge_kernel": "linear", "enlarge_interpolator": None,
+              "colour_managed": False, "sharpen": False, "spool_depth": 8, "compression": "none"},
+    "standard": {"max_dpi": None, "reduce_kernel": "lanczos3", "enlarge_kernel": None, "enlarge_interpolator": None,
+                 "colour_managed": True, "sharpen": True, "spool_depth": None, "compression": None},
+    "fine": {"max_dpi": None, "reduce_kernel": "lanczos3", "enlarge_kernel": None, "enlarge_interpolator": "nohalo",
+             "colour_managed": True, "sharpen": True, "spool_depth": None, "compression": None},
+}
+
+# Auto trim, ink estimates and blank page checks all read one
+# thumbnail of each upload and page this many pixels across, decoded
+# once into memory. Anything within TRIM_THRESHOLD of white is margin
+STATISTICS_THUMBNAIL_SIZE = 512
+TRIM_THRESHOLD = int(os.environ.get("BLUEPRINT_TRIM_THRESHOLD", "10"))
+STATISTICS_CACHE_MAX = 64
+# Uploads whose pixels are all grey, scans and most plots, print from
+# one band end to end for a third of the memory and spool of RGB. A
+# pixel is grey within GREY_TOLERANCE levels between its channels.
+# Prints with a paper profile stay RGB for lcms
+PRINT_GREY = os.environ.get("BLUEPRINT_PRINT_GREY", "1") == "1"
+GREY_TOLERANCE = 6
+# Line art, grey uploads with at least BILEVEL_FRACTION of their
+# pixels near black or white, spools as 1-bit once it's resampled
+PRINT_BILEVEL = os.environ.get("BLUEPRINT_PRINT_BILEVEL", "0") == "1"
+BILEVEL_FRACTION = 0.97
+
+# Raster previews are downsampled in linear light so thin lines keep
+# their weight. The linear shrink runs once per upload, to a base of
+# PREVIEW_BASE_SIZE pixels that previews are resized from
+PREVIEW_LINEAR = os.environ.get("BLUEPRINT_PREVIEW_LINEAR", "1") == "1"
+PREVIEW_BASE_SIZE = 1024
+PREVIEW_BASES_MAX = 32
+
+# pdf pages and svgs whose parsed size is kept, see documentHeader
+DOCUMENT_HEADERS_MAX = 32
+
+# Frame picker contact sheets show up to FRAMES_MAX frames, each
+# FRAME_THUMBNAIL_SIZE pixels across
+FRAME_THUMBNAIL_SIZE = 128
+FRAMES_MAX = 64
+# The area picker shows the upload this many pixels across
+AREA_THUMBNAIL_SIZE = 512
+# Files queued together each show a thumbnail this many pixels across,
+# made on QUEUE_THUMBNAIL_THREADS as soon as the upload is stored.
+# Up to QUEUE_THUMBNAILS_MAX are kept
+QUEUE_THUMBNAIL_SIZE = 256
+QUEUE_THUMBNAIL_THREADS = 2
+QUEUE_THUMBNAILS_MAX = 64
+
+# DeepZoom tile geometry for the detail viewer, levels at or under
+# ZOOM_KEEP_PIXELS are rendered once and held in memory
+ZOOM_TILE_SIZE = 256
+ZOOM_TILE_OVERLAP = 1
+ZOOM_KEEP_PIXELS = 4 * 1024 * 1024
+ZOOM_SESSIONS_MAX = 8
+# Tiles this far around each one served are encoded ahead on
+# ZOOM_PREFETCH_THREADS, keeping up to ZOOM_TILES_MAX per view
+ZOOM_PREFETCH = int(os.environ.get("BLUEPRINT_ZOOM_PREFETCH", "1"))
+ZOOM_PREFETCH_THREADS = 2
+ZOOM_TILES_MAX = 256
+# Tiles that aren't painted yet are answered at once with a stand-in
+# scaled up from a coarser tile while they paint in the background, and
+# the viewer hears over /zoom/<id>/events when to fetch them again
+ZOOM_BACKGROUND = os.environ.get("BLUEPRINT_ZOOM_BACKGROUND", "1") == "1"
+# Coarser levels searched for a tile to scale up as the stand-in
+ZOOM_PLACEHOLDER_LEVELS = 4
+
+# lcms rendering intent for colour managed prints
+RENDER_INTENT = os.environ.get("BLUEPRINT_RENDER_INTENT", "perceptual")
+# Soft proofed previews go back from the paper profile to the screen
+# with this intent, relative keeps the paper white on the mockup
+SOFT_PROOF_INTENT = os.environ.get("BLUEPRINT_SOFT_PROOF_INTENT", "relative")
+# Native resolution of the printer, never rasterise finer than this
+PRINTER_NATIVE_DPI = min(printer["native_dpi"] for printer in printers.selected())
+
+# Where helper processes can reach this server
+SERVER_URL = os.environ.get("BLUEPRINT_SERVER_URL", "http://127.0.0.1:5000")
+
+# Hand prints to a PrintGUI kept running under --serve, over its named
+# pipe, instead of starting PrintGUI for each one. Needs a PrintGUI
+# that takes --serve, so it's off until the Executable is rebuilt
+PRINTGUI_HELPER = os.environ.get("BLUEPRINT_PRINTGUI_HELPER", "0") == "1"
+PRINTGUI_PIPE = r"\\.\pipe\BLUEPRINT-PrintGUI"
+
+# How prints reach the printer: "wizard" opens Print Pictures,
+# "direct" spools bands through GDI at the print's own resolution
+PRINT_BACKEND = os.environ.get("BLUEPRINT_PRINT_BACKEND", "wizard")
+
+# Serve renders for kiosks under /worker instead of printing them, see
+# workers.py. A worker needs the kiosk's printer profiles
+WORKER_MODE = os.environ.get("BLUEPRINT_WORKER", "0") == "1"
+# Gang sheets pack several small prints onto one roll, GANG_GAP_INCHES
+# apart and composed at GANG_DPI, up to GANG_MAX prints a sheet
+GANG_GAP_INCHES = float(os.environ.get("BLUEPRINT_GANG_GAP", "0.5"))
+GANG_DPI = int(os.environ.get("BLUEPRINT_GANG_DPI", "300"))
+GANG_MAX = 16
+# Batches submit up to BATCH_MAX_ITEMS prints in one request, the last
+# BATCHES_MAX of them are kept for their progress
+BATCH_MAX_ITEMS = int(os.environ.get("BLUEPRINT_BATCH_MAX_ITEMS", "200"))
+BATCHES_MAX = 50
+
+# Prints wider than their printer split into panels that overlap by
+# PANEL_OVERLAP_INCHES when options["panels"] is set, with
+# registration crosses PANEL_MARK_INCHES across on every seam
+PANEL_OVERLAP_INCHES = float(os.environ.get("BLUEPRINT_PANEL_OVERLAP", "1"))
+PANEL_MARK_INCHES = 0.5
+
+# Prints are stamped bottom left with who printed them, when and from
+# what file, in LABEL_FONT at its point size on paper. Rendered labels
+# are kept, up to LABEL_CACHE_MAX of them
+PRINT_LABEL = os.environ.get("BLUEPRINT_PRINT_LABEL", "1") == "1"
+LABEL_FONT = os.environ.get("BLUEPRINT_LABEL_FONT", "sans 9")
+LABEL_MARGIN_INCHES = 0.25
+LABEL_CACHE_MAX = 32
+
+# Single pdf pages that need no raster step print as vector through
+# PrintGUI's --vector mode instead of being rasterised here
+PDF_PASSTHROUGH = os.environ.get("BLUEPRINT_PDF_PASSTHROUGH", "0") == "1"
+# jpegs and tiffs whose print would leave every pixel as it is go to
+# the wizard as uploaded, without a decode or a spool encode. With
+# BLUEPRINT_JPEGTRAN set a jpeg that only needs turning or cropping to
+# an area is turned and cropped losslessly on the way
+FILE_PASSTHROUGH = os.environ.get("BLUEPRINT_FILE_PASSTHROUGH", "0") == "1"
+FILE_PASSTHROUGH_TYPES = {"image/jpeg": "jpg", "image/tiff": "tif", "image/tif": "tif"}
+# All pages batches leave out blank pages, found from each page's
+# statistics thumbnail before anything renders at full size
+PDF_SKIP_BLANK = os.environ.get("BLUEPRINT_PDF_SKIP_BLANK", "1") == "1"
+# Printer for the direct backend, empty for the Windows default
+PRINTER_NAME = os.environ.get("BLUEPRINT_PRINTER_NAME", "")
+# Rows per band file for the direct backend
+DIRECT_BAND_HEIGHT = int(os.environ.get("BLUEPRINT_DIRECT_BAND_HEIGHT", "1024"))
+# Hand direct prints to PrintGUI before their bands are written, for
+# it to draw each one as it lands. Needs a PrintGUI that waits for
+# bands, so it's off until the Executable is rebuilt
+DIRECT_STREAM = os.environ.get("BLUEPRINT_DIRECT_STREAM", "0") == "1"
+# Direct prints whose pixels fit in this many MB render into one
+# shared memory buffer PrintGUI draws from, instead of band files it
+# reads back off the disc. Needs a PrintGUI that maps spools, so it's
+# 0, off, until the Executable is rebuilt
+MEMORY_SPOOL_MAX_BYTES = int(os.environ.get("BLUEPRINT_MEMORY_SPOOL_MB", "0")) * 1024 * 1024
+
+# Spool file encoder settings
+SPOOL_COMPRESSION = os.environ.get("BLUEPRINT_SPOOL_COMPRESSION", "none")
+# Effort for deflate (1-9) and zstd (1-22), low trades file size for
+# throughput. 0 keeps the encoder's default
+SPOOL_COMPRESSION_LEVEL = int(os.environ.get("BLUEPRINT_SPOOL_COMPRESSION_LEVEL", "0"))
+SPOOL_TILE_SIZE = int(os.environ.get("BLUEPRINT_SPOOL_TILE_SIZE", "512"))
+# Spool tile sizes measured fastest by `python bench.py --tune-tiles`,
+# by machine and then by the loader the print started from. Setting
+# BLUEPRINT_SPOOL_TILE_SIZE overrides them
+TILE_TUNING_FILE = os.environ.get("BLUEPRINT_TILE_TUNING", "tile_tuning.json")
+
+# Threads rendering print jobs in the background, per printer. Renders
+# run ahead of the operator, so up to this many can be ready on disc
+# while the printer's dialog is still open
+PRINT_WORKERS = int(os.environ.get("BLUEPRINT_PRINT_WORKERS", "2"))
+# Prints render shortest predicted first, each second a print waits
+# taking this many seconds off its predicted render time, see costmodel
+PRINT_AGEING = float(os.environ.get("BLUEPRINT_PRINT_AGEING", "1"))
+# Longest a ready print waits for PrintGUI to report the printer's
+# previous hand-off finished before it is sent anyway
+HANDOFF_TIMEOUT_SECONDS = int(os.environ.get("BLUEPRINT_HANDOFF_TIMEOUT", "900"))
+
+# Soft limit on vips pixel memory across all renders, print jobs wait
+# for room under it and decode to disc when they can't fit at all
+RENDER_MEMORY_SOFT_LIMIT = int(os.environ.get("BLUEPRINT_RENDER_MEMORY_MB", "4096")) * 1024 * 1024
+
+# Previews decode as they're asked for, INGEST_SLOTS at a time and past
+# the first only while vips memory is under the soft limit. The rest
+# wait in line up to INGEST_WAIT_SECONDS, with their place and an ETA.
+# Past INGEST_QUEUE_MAX waiting or a longer predicted wait, requests
+# get a 429 with Retry-After instead
+INGEST_SLOTS = int(os.environ.get("BLUEPRINT_INGEST_SLOTS", str(os.cpu_count() or 4)))
+INGEST_QUEUE_MAX = int(os.environ.get("BLUEPRINT_INGEST_QUEUE", "16"))
+INGEST_WAIT_SECONDS = float(os.environ.get("BLUEPRINT_INGEST_WAIT", "20"))
+
+# Threads renders fan their pages, strips and thumbnails out on, all
+# renders together. As many as vips has workers unless set
+RENDER_THREADS = int(os.environ.get("BLUEPRINT_RENDER_THREADS", "0")) or \
+    int(os.environ.get("VIPS_CONCURRENCY", "0")) or os.cpu_count() or 1
+# Threads kept back for interactive previews when a print splits its
+# pages across the vips pool
+PREVIEW_THREADS = int(os.environ.get("BLUEPRINT_PREVIEW_THREADS", "2"))
+# Longest a print write pauses between tiles for running previews
+PRINT_YIELD_SECONDS = 0.25
+
+# Each print job writes its spool files and UCF copies to its own
+# directory in here
+SPOOL_DIR = os.environ.get("BLUEPRINT_SPOOL_DIR", os.path.join(STORAGE_DIR, "spool"))
+# Job directories older than this are removed when new jobs start
+SPOOL_KEEP_SECONDS = 24 * 60 * 60
+# Prints at least this many inches long keep their upload and a job
+# manifest in their spool directory until handed off, so a restart
+# picks them up again. Direct spools resume from the bands already
+# written
+CHECKPOINT_INCHES = float(os.environ.get("BLUEPRINT_CHECKPOINT_INCHES", "60"))
+CHECKPOINT_MANIFEST = "job.json"
+# A print of the same upload, plan and user within this many seconds
+# of the last is taken for a double click and answered with the first
+# job instead of rendering it again
+PRINT_DEDUP_SECONDS = float(os.environ.get("BLUEPRINT_PRINT_DEDUP_SECONDS", "120"))
+# Hand-offs remembered for printing another copy
+SPOOLED_PRINTS_MAX = 1000
+# Banded prints remembered for later prints of the same upload and
+# geometry to reuse the bands of, see writeBands
+BAND_REVISIONS_MAX = 32
+# Render a print up to its label while the print confirmation is open
+# and the user types their id, for the print to pick up, see
+# startRehearsal
+PRINT_REHEARSAL = os.environ.get("BLUEPRINT_PRINT_REHEARSAL", "1") == "1"
+
+# How long a preview request waits for a newer one to replace it
+PREVIEW_COALESCE_SECONDS = int(os.environ.get("BLUEPRINT_PREVIEW_COALESCE_MS", "150")) / 1000
+
+# Once a preview is served, render the paper widths and sides the user
+# is likely to click through next while the kiosk is idle, so those
+# clicks answer from the preview cache. See warmPreviews
+PREVIEW_WARMING = os.environ.get("BLUEPRINT_PREVIEW_WARMING", "1") == "1"
+# The paper widths index.html offers
+PREVIEW_WARM_WIDTHS = [17, 24, 36, 44]
+# How often warming looks for the kiosk to be idle
+PREVIEW_WARM_POLL_SECONDS = 0.25
+
+# Encoding for previews, "webp" for clients that accept it and jpeg
+# flattened onto the mockup for those that don't, or "png" for all
+PREVIEW_FORMAT = os.environ.get("BLUEPRINT_PREVIEW_FORMAT", "webp")
+PREVIEW_JPEG_QUALITY = 80
+
+# Byte budget for encoded previews held in memory before they spill
+# to the cache dir
+PREVIEW_MEMORY_MAX_BYTES = int(os.environ.get("BLUEPRINT_PREVIEW_MEMORY_MB", "64")) * 1024 * 1024
+# Byte budget for previews spilled to the cache dir, the oldest are
+# removed past it
+PREVIEW_DIR_MAX_BYTES = int(os.environ.get("BLUEPRINT_PREVIEW_DIR_MB", "512")) * 1024 * 1024
+
+# How much smaller the first phase of a progressive preview renders
+PREVIEW_QUICK_SHRINK = 4
+# Seconds a progressive preview's first phase should take. Once
+# previews of a type have been timed, the first phase shrinks as far
+# as PREVIEW_MAX_SHRINK for the cost model to predict it in budget, and
+# is skipped when the finished preview fits it anyway. 0 always renders
+# the first phase at PREVIEW_QUICK_SHRINK
+PREVIEW_BUDGET_SECONDS = float(os.environ.get("BLUEPRINT_PREVIEW_BUDGET_MS", "250")) / 1000
+PREVIEW_MAX_SHRINK = 32
+# Recent preview timings the preview cost model is fitted from, refit
+# every PREVIEW_TIMINGS_REFIT of them
+PREVIEW_TIMINGS_MAX = 512
+PREVIEW_TIMINGS_REFIT = 16
+
+# Previews render at the client's display size and pixel ratio, as a
+# scale of the mockup's own pixels within these bounds, in steps of
+# PREVIEW_SCALE_STEP so small resizes share cached previews
+PREVIEW_SCALE_MIN = 0.25
+PREVIEW_SCALE_MAX = 4
+PREVIEW_SCALE_STEP = 0.25
+
+# Longest side of the upright texture the client recomposes previews
+# from when only their geometry changes, see /texture
+PREVIEW_TEXTURE_MAX = 4096
+
+# Preview responses remembered for repeat requests
+PREVIEW_RESULTS_MAX = 256
+# Render plans of recent previews kept for the prints made from them
+RENDER_PLANS_MAX = 256
+
+# Ink estimates take a channel at full coverage to lay down
+# INK_ML_PER_SQUARE_INCH
+INK_ML_PER_SQUARE_INCH = float(os.environ.get("BLUEPRINT_INK_ML_PER_SQ_IN", "0.01"))
+
+# Byte budget for decoded uploads kept between renders
+SOURCE_CACHE_MAX_BYTES = int(os.environ.get("BLUEPRINT_SOURCE_CACHE_MB", "2048")) * 1024 * 1024
+# Decoded sources held in RAM are kept as tiled tiff in this
+# compression, each tile decompressed when a render reads it, or
+# "none" for raw pixels
+SOURCE_COMPRESSION = os.environ.get("BLUEPRINT_SOURCE_COMPRESSION", "zstd")
+SOURCE_TILE_SIZE = 256
+# Metadata a loaded upload keeps, see ingestMetadata, the rest is XMP,
+# IPTC, EXIF and Photoshop thumbnails nothing here reads
+INGEST_METADATA = {"icc-profile-data", "orientation", "n-pages", "page-height", "vips-loader", "resolution-unit",
+                   # vips' own header fields, which get_fields lists too
+                   "width", "height", "bands", "format", "coding", "interpretation", "xoffset", "yoffset", "xres",
+                   "yres", "filename"}
+# Decoded uploads bigger than this are kept in a disc temp file instead of RAM
+SOURCE_MEMORY_MAX_BYTES = int(os.environ.get("BLUEPRINT_SOURCE_MEMORY_MB", "512")) * 1024 * 1024
+# jpegs of at least this many megapixels with restart markers decode
+# in strips on every core, when they fit in SOURCE_MEMORY_MAX_BYTES
+PARALLEL_JPEG_PIXELS = int(os.environ.get("BLUEPRINT_PARALLEL_JPEG_MEGAPIXELS", "40")) * 1000 * 1000
+# Spilled sources are kept as .v files here, so a later miss, even in
+# another worker process, maps the decoded pixels instead of decoding
+SOURCE_DIR = os.environ.get("BLUEPRINT_SOURCE_DIR", os.path.join(STORAGE_DIR, "sources"))
+# Previews spilled from memory
+PREVIEW_DIR = os.path.join(STORAGE_DIR, "cache")
+# sqlite index of spilled sources, preview plans and preview images,
+# so they're found again after a restart. Empty keeps them in memory
+CACHE_INDEX_FILE = os.environ.get("BLUEPRINT_CACHE_INDEX", os.path.join(STORAGE_DIR, "cache_index.sqlite3"))
+# Temporary files this old are left from a crashed job or process
+ORPHAN_SECONDS = 60 * 60
+SOURCE_DIR_MAX_BYTES = int(os.environ.get("BLUEPRINT_SOURCE_DIR_MB", "8192")) * 1024 * 1024
+# Uploads over either limit are refused before anything decodes them,
+# a 100k pixel square png would otherwise ask for 40 GB
+MAX_UPLOAD_BYTES = int(os.environ.get("BLUEPRINT_MAX_UPLOAD_MB", "512")) * 1024 * 1024
+# gzip uploads, svgs and uncompressed pdfs from app.js, are inflated in
+# steps of at most this much output, so one can't balloon past
+# MAX_UPLOAD_BYTES between checks
+INFLATE_STEP_BYTES = 1024 * 1024
+MAX_SOURCE_PIXELS = int(os.environ.get("BLUEPRINT_MAX_MEGAPIXELS", "1000")) * 1000 * 1000
+# Chunked uploads resume after a dropped connection. At most
+# CHUNKED_UPLOADS_MAX are in flight, one idle for CHUNKED_UPLOAD_SECONDS
+# is given up on, and the header is probed once CHUNKED_PROBE_BYTES
+# have arrived
+CHUNKED_UPLOADS_MAX = 8
+CHUNKED_UPLOAD_SECONDS = 60 * 60
+CHUNKED_PROBE_BYTES = 1024 * 1024
+# Scans stitched with /stitch are taken to overlap by about
+# STITCH_OVERLAP of each part's width or height, and the join is
+# searched for up to STITCH_SEARCH_PIXELS either side of that
+STITCH_OVERLAP = float(os.environ.get("BLUEPRINT_STITCH_OVERLAP", "0.2"))
+STITCH_SEARCH_PIXELS = 300
+# Preview names are never reused, so browsers may keep them for good,
+# as they do scripts and styles index.html links with their content
+# hash. Static images keep for STATIC_MAX_AGE seconds, anything else
+# revalidates so an update shows on the next load
+PREVIEW_CACHE_CONTROL = "public, max-age=31536000, immutable"
+STATIC_MAX_AGE = int(os.environ.get("BLUEPRINT_STATIC_MAX_AGE", "86400"))
+STATIC_CACHED_TYPES = [".png", ".jpg", ".gif", ".ico", ".svg", ".webmanifest", ".xml"]
+# Under serve.py the worker asks to be replaced once vips's memory
+# highwater passes this and nothing is in flight, 0 never recycles
+RECYCLE_HIGHWATER_BYTES = int(os.environ.get("BLUEPRINT_RECYCLE_HIGHWATER_MB", "0")) * 1024 * 1024
+RECYCLE_CHECK_SECONDS = 30
+# How often a running print job's memory and temp files are sampled
+JOB_USAGE_SAMPLE_SECONDS = 0.25
+# How often vips memory is drawn into the trace while slow requests
+# are being caught, see traceSlowRequest
+TRACE_MEMORY_SAMPLE_SECONDS = 0.1
+# Once nothing has happened for MAINTENANCE_IDLE_SECONDS the server
+# drops the vips cache, decoded sources unused for COLD_SOURCE_SECONDS
+# and preview bases, then hands freed heap back to the OS
+MAINTENANCE_IDLE_SECONDS = int(os.environ.get("BLUEPRINT_MAINTENANCE_IDLE_SECONDS", "120"))
+COLD_SOURCE_SECONDS = 15 * 60
+# Byte budget for raw uploads held behind render handles
+UPLOAD_STORE_MAX_BYTES = int(os.environ.get("BLUEPRINT_UPLOAD_STORE_MB", "1024")) * 1024 * 1024
+# sqlite database every print is logged to, and the most entries one
+# page of the log returns
+PRINT_LOG_FILE = os.environ.get("BLUEPRINT_PRINT_LOG", "print_log.sqlite3")
+PRINT_LOG_PAGE_MAX = 500
 
 app = Flask(__name__)
 
+print_log = printlog.PrintLog(PRINT_LOG_FILE)
+
+# Entries are validated as they're looked up, so opening it touches
+# none of the files it lists
+cache_index = None
+if CACHE_INDEX_FILE:
+    try:
+        cache_index = cacheindex.CacheIndex(CACHE_INDEX_FILE)
+    except sqlite3.Error as e:
+        print("Could not open the cache index: " + str(e))
+# Index writes happen off the request threads, in order
+cache_index_pool = concurrent.futures.ThreadPoolExecutor(max_workers=1)
+# Copies to the shared cache go behind the renders that made them
+shared_cache_pool = concurrent.futures.ThreadPoolExecutor(max_workers=1, initializer=priority.background)
+
+# Every render's fan out of pages, strips and thumbnails runs on one
+# set of threads, see jobs.RenderPool
+render_pool = jobs.RenderPool(RENDER_THREADS)
+
+# Print renders run on a queue per printer instead of in the request
+# thread, so every printer can be kept busy
+print_queues = {printer["id"]: jobs.JobQueue(PRINT_WORKERS, ageing=PRINT_AGEING, initializer=priority.background)
+                for printer in printers.selected()}
+
+# Predicts render seconds for the queues from the renders timed so far
+render_costs = costmodel.CostModel()
+# and for previews, from those this run has timed
+preview_costs = costmodel.CostModel()
+preview_timings = collections.deque(maxlen=PREVIEW_TIMINGS_MAX)
+preview_timings_count = 0
+preview_timings_lock = threading.Lock()
+try:
+    render_costs.train(print_log.costHistory())
+except sqlite3.Error as e:
+    print("Could not load render costs: " + str(e))
+
+# Held while a job's paper config is committed and handed to PrintGUI,
+# so the driver picks up the config that belongs to that print
+printer_locks = {printer["id"]: threading.Lock() for printer in printers.selected()}
+
+# Prints waiting to be ganged, by sheet id, see addToGang
+gang_sheets = {}
+gang_lock = threading.Lock()
+
+# Jobs of each batch by batch id, oldest first, see submitBatch
+batches = collections.OrderedDict()
+batches_lock = threading.Lock()
+
+# Latest print job of each upload, plan and user, see duplicatePrint
+recent_prints = collections.OrderedDict()
+recent_prints_lock = threading.Lock()
+
+# What each job handed off, by job id, so another copy can be sent from
+# the same spool files without rendering them again
+spooled_prints = collections.OrderedDict()
+spooled_prints_lock = threading.Lock()
+
+# Band files of recent direct prints by their revision, the upload and
+# everything but the label that decides their pixels, least recently
+# written first
+band_revisions = collections.OrderedDict()
+band_revisions_lock = threading.Lock()
+
+# The print being rehearsed by its revision, see startRehearsal. One
+# at a time, the kiosk only has one confirmation open
+rehearsals = {}
+rehearsals_lock = threading.Lock()
+rehearsal_pool = concurrent.futures.ThreadPoolExecutor(max_workers=1, initializer=priority.background)
+
+# Files of each printer's last hand-off and PrintGUI's latest status
+# for every file handed off, by full path
+handoffs = {}
+handoff_status = {}
+# Whether PrintGUI has ever posted a status. The committed Executable
+# never does, and hand-offs aren't waited on until one has
+handoff_reporting = False
+handoff_condition = threading.Condition()
+# Shared memory of each memory spool by its manifest's full path, held
+# until PrintGUI is done with it
+memory_spools = {}
+
+# Ids of jobs queued again after a restart, see resumePrints
+resumed_jobs = set()
+
+# Hand-offs of the render this thread is doing for a kiosk, None when
+# it prints itself
+worker_capture = threading.local()
+
+# Preview currently being written for each upload, and for warming
+# under WARM_RENDER
+preview_renders = {}
+preview_lock = threading.Lock()
+WARM_RENDER = "warm"
+
+# Speculative previews render one at a time, and stop once a newer
+# preview or a print bumps warm_generation
+warm_pool = concurrent.futures.ThreadPoolExecutor(max_workers=1, initializer=priority.background)
+warm_generation = 0
+
+# Latest preview request for each upload, and recent preview responses
+# by ETag
+preview_generations = {}
+preview_results = collections.OrderedDict()
+# Geometry each preview was planned with by plan id, so a print of the
+# preview reuses it instead of planning again
+render_plans = collections.OrderedDict()
+
+
+# Requests being handled, so a worker is only recycled between them,
+# and when the last one finished
+active_requests = 0
+last_request_end = time.time()
+active_requests_lock = threading.Lock()
+
+
+@app.before_request
+def startRequestTimer():
+    global active_requests
+
+    g.request_start = time.time()
+    g.trace_start = tracing.now()
+    if tracing.SLOW_SECONDS > 0:
+        g.trace_memory = trackedMemory()
+    profiling.label(request.endpoint)
+
+    with active_requests_lock:
+        active_requests += 1
+
+
+@app.after_request
+def endRequest(response):
+    # Counted until the server closes the response, so streamed
+    # responses count while they stream
+    def finished():
+        global active_requests, last_request_end
+
+        with active_requests_lock:
+            active_requests -= 1
+            last_request_end = time.time()
+
+    response.call_on_close(finished)
+
+    return response
+
+
+@app.after_request
+def traceSlowRequest(response):
+    # With BLUEPRINT_TRACE_SLOW_SECONDS, keep the trace of a request
+    # that turns out slower than that, timed to when its response
+    # closes. What it asked for is noted now, while the request is
+    # still here to read, the upload's header only once it's slow
+    if tracing.SLOW_SECONDS <= 0 or "request_start" not in g:
+        return response
+
+    start, trace_start, endpoint = g.request_start, g.trace_start, request.endpoint or "unknown"
+    body = request.get_json(silent=True) if request.is_json else None
+    body = body if isinstance(body, dict) else {}
+    details = {"path": request.path, "method": request.method, "status": response.status_code,
+               "options": body.get("options"), "memory_at_start": g.get("trace_memory")}
+
+    def finished():
+        seconds = time.time() - start
+        if not tracing.slow(seconds):
+            return
+
+        try:
+            path = tracing.keepSlow(endpoint, trace_start, tracing.now(), seconds=round(seconds, 3),
+                                    upload=uploadDetails(body.get("handle")), **details, **trackedMemoryStats())
+            print("Slow request kept as " + path)
+        except Exception as e:
+            print("Could not keep slow request trace: " + str(e))
+
+    response.call_on_close(finished)
+
+    return response
+
+
+def uploadDetails(handle):
+    # Type, size and header of an upload for a slow request's trace,
+    # looked up without counting as a cache hit
+    with upload_store_lock:
+        stored = upload_store.get(handle)
+
+    if stored == None:
+        return None
+
+    details = {"content_type": stored["content_type"], "bytes": len(stored["data"])}
+
+    try:
+        header = pyvips.Image.new_from_buffer(stored["data"], "")
+        details.update(width=header.width, height=header.height, bands=header.bands, format=header.format,
+                       loader=header.get("vips-loader"))
+    except pyvips.Error:
+        pass
+
+    return details
+
+
+@app.after_request
+def observeRequest(response):
+    # Streamed responses are timed up to their first byte
+    if "request_start" in g:
+        request_seconds.observe(time.time() - g.request_start, endpoint=request.endpoint or "unknown")
+
+    return response
+
+
+@app.after_request
+def cacheStatic(response):
+    # Static files are sent conditionally, with an ETag and
+    # Last-Modified, so revalidating them costs a 304
+    if request.endpoint == "static" or request.endpoint == "index":
+        if precompress.compressible(request.path) or request.endpoint == "index":
+            response.vary.add("Accept-Encoding")
+
+        if request.endpoint == "static" and request.args.get("v"):
+            response.headers["Cache-Control"] = PREVIEW_CACHE_CONTROL
+        elif os.path.splitext(request.path)[1] in STATIC_CACHED_TYPES:
+            response.cache_control.no_cache = None
+            response.cache_control.public = True
+            response.cache_control.max_age = STATIC_MAX_AGE
+        else:
+            response.cache_control.no_cache = True
+
+    return response
+
+
+@app.before_request
+def sendCompressed():
+    # Text files under static/ go out as the copy precompress.py made
+    # in the best encoding the browser takes, never compressed here
+    if request.endpoint != "static":
+        return None
+
+    path = safe_join(app.static_folder, request.view_args["filename"])
+    if path == None or not precompress.compressible(path) or not os.path.isfile(path):
+        return None
+
+    encoding = acceptedEncoding(path)
+    if encoding == None:
+        return None
+
+    response = send_file(encoding[1], mimetype=mimetypes.guess_type(path)[0], conditional=True)
+    response.headers["Content-Encoding"] = encoding[0]
+
+    return response
+
+
+def acceptedEncoding(path):
+    # (encoding, copy path) of the preferred up to date copy of path the
+    # request accepts, or None to send it as it is
+    for encoding, suffix in precompress.ENCODINGS:
+        copy = path + suffix
+
+        if request.accept_encodings.quality(encoding) > 0 and os.path.exists(copy) and \
+                os.path.getmtime(copy) >= os.path.getmtime(path):
+            return encoding, copy
+
+    return None
+
+
+# index.html with its script and style links versioned, in each
+# encoding, rebuilt when any of those files change
+index_page = {"mtime": None, "bodies": {}, "etag": None}
+index_page_lock = threading.Lock()
+
+
+def indexPage():
+    # Versions are the linked file's content hash, so its URL changes
+    # exactly when it does and browsers can keep it for good
+    index_path = os.path.join(app.static_folder, "index.html")
+
+    with open(index_path) as f:
+        html = f.read()
+
+    links = re.findall(r'(?:src|href)="(static/[^"?]+\.(?:js|css))"', html)
+    mtime = max([os.path.getmtime(index_path)] +
+                [os.path.getmtime(os.path.join(app.root_path, link)) for link in links])
+
+    with index_page_lock:
+        if index_page["mtime"] == mtime:
+            return index_page
+
+        for link in set(links):
+            with open(os.path.join(app.root_path, link), "rb") as f:
+                version = uploadHash(f.read())[:12]
+
+            html = html.replace('"' + link + '"', '"' + link + "?v=" + version + '"')
+
+        data = html.encode()
+        bodies = {"identity": data}
+
+        for encoding, suffix in precompress.ENCODINGS:
+            encoded = precompress.compress(data, encoding)
+            if encoded != None and len(encoded) < len(data):
+                bodies[encoding] = encoded
+
+        index_page.update(mtime=mtime, bodies=bodies, etag=uploadHash(data))
+
+        return index_page
+
 
 @app.route("/")
 def index():
     # Return index.html from static/ directory
-    return app.send_static_file("index.html")
+    page = indexPage()
+
+    encoding = "identity"
+    for name, suffix in precompress.ENCODINGS:
+        if name in page["bodies"] and request.accept_encodings.quality(name) > 0:
+            encoding = name
+            break
+
+    etag = page["etag"] + "-" + encoding
+
+    if request.if_none_match.contains(etag):
+        return "", 304, {"ETag": '"' + etag + '"'}
+
+    headers = {"Content-Type": "text/html; charset=utf-8", "ETag": '"' + etag + '"'}
+    if encoding != "identity":
+        headers["Content-Encoding"] = encoding
+
+    return page["bodies"][encoding], 200, headers
+
+
+# Raster types vips can open directly
+supported_images = ["image/jpeg", "image/jpg", "image/png",
+                    "image/gif", "image/bmp", "image/tiff", "image/tif", "image/webp",
+                    "image/avif", "image/jxl", "image/jp2"]
+
+# Vector types that get rasterised first
+supported_documents = ["application/pdf", "image/svg+xml"]
+
+
+def supportedType(content_type):
+    # Whether uploads of a type are taken. Office documents are, when
+    # there is a converter pool to turn them into pdfs
+    return content_type in supported_images or content_type in supported_documents or \
+        (officeconvert.enabled() and content_type in officeconvert.TYPES)
+
+
+def convertUpload(data, content_type):
+    # An upload as it's kept: Office documents as the pdf they convert
+    # to, and a pdf that only wraps one full page picture as that
+    # picture, for the raster path at its native resolution. Anything
+    # else as it is. Raises officeconvert.ConversionError
+    if content_type in officeconvert.TYPES:
+        with stage("office_convert"):
+            data, content_type = officeconvert.convert(data, content_type), "application/pdf"
+
+    if content_type == "application/pdf":
+        with stage("pdf_inspect"):
+            embedded = pdfimage.embeddedImage(data)
+
+        # Only when vips can open what came out
+        if embedded != None:
+            try:
+                pyvips.Image.new_from_buffer(embedded[1], "")
+                return embedded[1], embedded[0]
+            except pyvips.Error:
+                pass
+
+    return data, content_type
+
+
+# Animated and multi-page types, options["page"] picks the frame or
+# page that prints. tiff pages are read from their own IFDs, so only
+# the chosen page's strips or tiles are ever decoded
+framed_images = ["image/gif", "image/webp", "image/tiff", "image/tif"]
+
+# The only vips loaders uploads can reach, by the types above. Every
+# other loader is blocked, so sniffing an upload runs a few magic byte
+# checks and fits, nifti, matlab, openslide and the rest never load.
+# bmp has no native loader, magick is still tried last for it
+supported_loaders = {
+    "image/jpeg": "VipsForeignLoadJpeg",
+    "image/png": "VipsForeignLoadPng",
+    "image/gif": "VipsForeignLoadNsgif",
+    "image/bmp": "VipsForeignLoadMagick",
+    "image/tiff": "VipsForeignLoadTiff",
+    "image/webp": "VipsForeignLoadWebp",
+    "image/avif": "VipsForeignLoadHeif",
+    "image/jxl": "VipsForeignLoadJxl",
+    "image/jp2": "VipsForeignLoadJp2k",
+    "application/pdf": "VipsForeignLoadPdf",
+    "image/svg+xml": "VipsForeignLoadSvg",
+}
+# Spilled sources are reopened from .v files
+internal_loaders = ["VipsForeignLoadVips", "VipsForeignLoadTiff"]
+
+try:
+    pyvips.operation_block_set("VipsForeignLoad", True)
+
+    for loader in list(supported_loaders.values()) + internal_loaders:
+        pyvips.operation_block_set(loader, False)
+except Exception as e:
+    print("Error restricting vips loaders: " + str(e))
 
 
 @app.route("/renderImage", methods=["POST"])
 def renderImage():
-    # Start timer:
-    start_time = time.time()
-
     # Always return a jpg or an error
     # Takes in a pdf or jpg
     # Returns a jpg
@@ -54,341 +908,5762 @@ def renderImage():
     options = json.loads(options)
 
     # Check the file type
-    supported_images = ["image/jpeg", "image/jpg", "image/png",
-                       "image/gif", "image/bmp", "image/tiff", "image/tif", "image/webp"]
-    image = None
+    if not supportedType(file.content_type):
+        # Return 415 Unsupported Media Type
+        return {"error": "Unsupported Media Type"}, 415, {"Content-Type": "application/json"}
+
+    # Read the upload once, every loader works from these bytes
+    data = file.read()
 
-    if file.content_type in supported_images:
-        # If it's a jpg, just return it with the options rendered
+    try:
+        data, content_type = convertUpload(data, file.content_type)
+    except officeconvert.ConversionError as e:
+        return {"error": "Could not convert document: " + str(e)}, 415, {"Content-Type": "application/json"}
 
-        # turn file into a PIL image
-        image = Image.open(file)
+    error = uploadError(data, content_type)
+    if error != None:
+        return {"error": error[0]}, error[1], {"Content-Type": "application/json"}
 
-    elif file.content_type == "application/pdf":
-        image = convertPDF(file, options)
+    return renderUpload(data, content_type, options, uploadHash(data))
 
-    elif file.content_type == "image/svg+xml":
-        image = convertSVG(file, options)
 
+@app.route("/upload", methods=["POST"])
+def upload():
+    # Store an upload once and return a handle for later renders,
+    # so option changes don't re-send the whole file
+    if request.files:
+        # Multipart form upload
+        file = request.files["file"]
+        content_type = file.content_type
     else:
+        # Raw body upload, the content type is the file's type
+        content_type = request.mimetype
+
+    # Check the file type
+    if not supportedType(content_type):
         # Return 415 Unsupported Media Type
         return {"error": "Unsupported Media Type"}, 415, {"Content-Type": "application/json"}
 
+    if request.content_length != None and request.content_length > MAX_UPLOAD_BYTES:
+        return {"error": "Upload too large"}, 413, {"Content-Type": "application/json"}
 
-    if image == None:
-        return "Error: Unsupported file type"
-    else :
-        image, width, height, dpi = calculateJPG(image, options)
-        
-    if (options["print"]):
-        printPhoto(image, width, height, dpi)
+    # While memory is full and previews are queued past their limit, a
+    # new upload would only add to them
+    if not ingestRoom():
+        try:
+            ingest_gate.check(INGEST_WAIT_SECONDS)
+        except admission.Busy as busy:
+            return busyResponse(busy.position, busy.eta)
 
-    image = previewPhoto(image, width, height, options["paper_width"])
+    # A gzip body is inflated as it's read, by the loader probing it too
+    stream = request.stream
+    if not request.files and request.headers.get("Content-Encoding", "").lower() == "gzip":
+        stream = InflatingStream(request.stream)
 
-    # Save to temp output file with timestamp
-    timestamp = str(time.time())
-    #replace the decimal
-    timestamp = timestamp.replace(".", "_")
-    image.save("cache/" + timestamp + "output.png")
+    if request.files or content_type in officeconvert.TYPES or content_type == "application/pdf":
+        # Office documents and pdfs are read whole to convert and look
+        # inside, there's no header worth probing
+        try:
+            if request.files:
+                data = file.read()
+            elif isinstance(stream, InflatingStream):
+                data = stream.read()
+            else:
+                data = request.get_data()
+        except UploadTooLarge:
+            return {"error": "Upload too large"}, 413, {"Content-Type": "application/json"}
+        except zlib.error:
+            return {"error": "Upload isn't valid gzip"}, 400, {"Content-Type": "application/json"}
 
-    # Stop timer
-    end_time = time.time()
-    print("Rendered image in " + str(end_time - start_time) + " seconds")
+        try:
+            data, content_type = convertUpload(data, content_type)
+        except officeconvert.ConversionError as e:
+            return {"error": "Could not convert document: " + str(e)}, 415, {"Content-Type": "application/json"}
 
-    # Return body, status code, headers, size, and dpi
-    return {"image_url": "/getImage/" + timestamp, "width": width, "height": height, "dpi": dpi}, 200, {"Content-Type": "application/json"}
+        error = uploadError(data, content_type) or originalSizeError(request.args)
+        if error != None:
+            return {"error": error[0]}, error[1], {"Content-Type": "application/json"}
 
+        handle = storeRequestUpload(data, content_type)
+        size = {}
 
-@app.route("/getImage/<timestamp>", methods=["GET"])
-def getImage(timestamp):
-    # Get timestamp from request
+        if content_type == "application/pdf":
+            try:
+                size["page_count"] = pdfPageCount(data)
+            except pyvips.Error:
+                pass
 
-    # Check if the file exists
-    if os.path.exists("cache/" + escape(timestamp) + "output.png"):
-        # Return body, status code, headers
-        return send_file("cache/" + escape(timestamp) + "output.png", mimetype="image/png")
-    else:
-        return "Error: File not found"
+        return {"handle": handle, **size}, 200, {"Content-Type": "application/json"}
 
+    # Let vips parse the header straight off the socket while the
+    # body is hashed and kept as it arrives
+    source = UploadSource(stream)
 
-def convertPDF(file, options):
-    print("Rendering from PDF...")
+    try:
+        header = pyvips.Image.new_from_source(source.source, "")
+        size = {"width": header.width, "height": header.height}
+    except pyvips.Error:
+        # Not every loader can probe from a stream, the renders
+        # will still report any real decode error
+        header = None
+        size = {}
 
-    pdf = pdfium.PdfDocument(file)
-    page = pdf[0]
+    try:
+        data, handle = source.drain()
+    except UploadTooLarge:
+        return {"error": "Upload too large"}, 413, {"Content-Type": "application/json"}
+    except zlib.error:
+        return {"error": "Upload isn't valid gzip"}, 400, {"Content-Type": "application/json"}
 
-    width = page.get_width()
-    height = page.get_height()
+    error = uploadError(data, content_type, header) or originalSizeError(request.args)
+    if error != None:
+        return {"error": error[0]}, error[1], {"Content-Type": "application/json"}
 
-    min_side_length = min(width, height)
-    desPixels = options["paper_width"] * 300 * 72
-    dpi = int(desPixels/min_side_length)
+    storeRequestUpload(data, content_type, handle)
 
-    image = page.render_to(
-        pdfium.BitmapConv.pil_image,
-        scale=dpi/72,  # pdf's units are in 1/72 of an inch, picos
-    )
+    return {"handle": handle, **size}, 200, {"Content-Type": "application/json"}
 
-    return image
 
-def convertSVG(file, options):
-    print("Rendering from SVG...")
-    # Convert the svg to an Image   
-    # Assume 8000px wide
+class UploadTooLarge(Exception):
+    pass
 
-    # Save svg to temp file
-    file.save("temp.svg")
 
-    # Convert the svg to a png
-    buf = pyvips.Image.thumbnail("temp.svg", 8000).write_to_buffer(".png", compression=9, strip=True, palette=True, Q=100)
+class InflatingStream:
+    # A gzip request body read as the bytes it inflates to, raising
+    # UploadTooLarge once they pass MAX_UPLOAD_BYTES and zlib.error
+    # when it isn't gzip
 
-    # Delete the temp file
-    os.remove("temp.svg")
+    def __init__(self, stream):
+        self.stream = stream
+        self.inflater = zlib.decompressobj(wbits=31)
+        self.buffer = b""
+        self.inflated = 0
 
-    print("Opening image...")
+    def read(self, size=-1):
+        while (size < 0 or len(self.buffer) < size) and not self.inflater.eof:
+            compressed = self.inflater.unconsumed_tail or self.stream.read(64 * 1024)
+            if not compressed:
+                raise zlib.error("gzip body ends early")
 
-    # Turn the output into an image, reading as utf-8
-    image = Image.open(io.BytesIO(buf))
+            chunk = inflateStep(self.inflater, compressed, self.inflated)
+            self.inflated += len(chunk)
+            self.buffer += chunk
 
-    print("Done!")
-    return image
+        if size < 0:
+            size = len(self.buffer)
 
-def calculateJPG(image, options):
-    # Render the options on the image
-    # Return the image
+        chunk, self.buffer = self.buffer[:size], self.buffer[size:]
+        return chunk
 
-    final_width_inches = 0
-    final_height_inches = 0
 
-    # Flip the image so that the long side is the width
-    if image.width > image.height and options["side"] == "short":
-        image = image.transpose(Image.ROTATE_90)
+def inflateStep(inflater, compressed, inflated):
+    # Up to INFLATE_STEP_BYTES inflated from compressed, the rest left
+    # as the inflater's unconsumed_tail, with inflated bytes so far
+    chunk = inflater.decompress(compressed, INFLATE_STEP_BYTES)
 
-    if image.width < image.height and options["side"] == "long":
-        image = image.transpose(Image.ROTATE_90)
+    if inflated + len(chunk) > MAX_UPLOAD_BYTES:
+        raise UploadTooLarge()
 
-    # Case 1: Specific height/width
-    if options["specific_width"] != None or options["specific_height"] != None:
-        # Resize the image to the specified width & height
-        if options["specific_width"] != None and options["specific_height"] == None: #specified width, calculate height
-            # Calc dpi
-            final_dpi = image.width / options["specific_width"]
-            final_width_inches = options["specific_width"]
-            final_height_inches = image.height / final_dpi
+    return chunk
 
-        elif options["specific_height"] != None and options["specific_width"] == None: #specified height, calculate width
-            # Calc dpi
-            final_dpi = image.height / options["specific_height"]
-            final_width_inches = image.width / final_dpi
-            final_height_inches = options["specific_height"]
 
-        else: #specified both, just resize
-            # Determine which is bounding dimension
-            if image.width / options["specific_width"] > image.height / options["specific_height"]:
-                # Width is bounding
-                final_dpi = image.width / options["specific_width"]
-                final_width_inches = options["specific_width"]
-                final_height_inches = image.height / final_dpi
-            else:
-                # Height is bounding
-                final_dpi = image.height / options["specific_height"]
-                final_width_inches = image.width / final_dpi
-                final_height_inches = options["specific_height"]
+def storeRequestUpload(data, content_type, handle=None, args=None):
+    # Store an upload along with what its query string says it is. A
+    # proxy is a browser-downscaled stand-in for previews and carries
+    # the original's pixel size, an original names the proxy it's for
+    if args == None:
+        args = request.args
 
-    # Case 2: Specific DPI
-    elif options["specific_dpi"] != None:
-        # Resize the image to the specified dpi
-        final_dpi = options["specific_dpi"]
+    handle = storeUpload(data, content_type, handle)
 
-        final_width_inches = image.width / final_dpi
-        final_height_inches = image.height / final_dpi
+    if args.get("original_width") and args.get("original_height"):
+        with upload_store_lock:
+            upload_store[handle]["original_size"] = [int(args["original_width"]), int(args["original_height"])]
 
-    # Case 3: Auto max size
-    else:
-        side_a = 0
-        side_b = 0
-        if (options["side"] == "short" and image.width > image.height) or (options["side"] == "long" and image.width < image.height):  # shorter sidea
-            side_a = image.height
-            side_b = image.width
-        else:
-            side_a = image.width
-            side_b = image.height
+    proxy = getUpload(args.get("proxy"))
+    if proxy != None:
+        proxy["original"] = handle
 
-        final_dpi = side_a / options["paper_width"]
+    # A file of a queue shows its thumbnail while the others upload
+    if args.get("thumbnail") == "1":
+        startThumbnail(handle)
 
-        final_height_inches = side_b / final_dpi
-        final_width_inches = options["paper_width"]
+    return handle
 
-    # Make sure all final sizes are ints
-    final_width_inches = int(final_width_inches)
-    final_height_inches = math.ceil(final_height_inches)
-    final_dpi = int(final_dpi)
 
-    print("Final width: " + str(final_width_inches) + " inches")
-    print("Final height: " + str(final_height_inches) + " inches")
+def originalSizeError(args):
+    # (message, status) when a proxy's original size isn't two whole
+    # numbers of pixels, else None
+    if not (args.get("original_width") and args.get("original_height")):
+        return None
 
-    return image, final_width_inches, final_height_inches, final_dpi
+    try:
+        if int(args["original_width"]) > 0 and int(args["original_height"]) > 0:
+            return None
+    except ValueError:
+        pass
 
+    return "Original size must be whole numbers of pixels", 400
 
-def encodedDistance(inches):
-    start = 65535
-    vector = [0, 1, 0, 1, 1, 0, 1, 0, 1, 1,
-              0, 1, 0, 1, 1, 0, 1, 0, 1, 1, 0, 1, 1]
-    # we always drop 39935
-    # we always rise 25600
-    result = []
-    stage = 0
 
-    for i in range(inches + 1):
-        if (vector[stage] == 0):
-            result.append(start - 39935)
-            start = start - 39935
-        else:
-            result.append(start + 25600)
-            start = start + 25600
+def startThumbnail(handle):
+    # Begin decoding an upload's queue thumbnail, returning its future
+    with queue_thumbnails_lock:
+        future = queue_thumbnails.get(handle)
+
+        if future == None:
+            future = queue_thumbnails[handle] = queue_thumbnail_pool.submit(queueThumbnail, handle)
 
-        stage = stage + 1
+            while len(queue_thumbnails) > QUEUE_THUMBNAILS_MAX:
+                queue_thumbnails.popitem(last=False)
 
-        if (stage == 23):
-            stage = 0
+        queue_thumbnails.move_to_end(handle)
 
-    return int(hex(result[i-1]), 16)
+    return future
 
 
-def setEpsonConfig(width, height):
-    setEpsonP8000Config(width, height)
-    setEpsonP9900Config(width, height)
+def queueThumbnail(handle):
+    # First page or frame of an upload at QUEUE_THUMBNAIL_SIZE, in
+    # memory, or None when it's gone or unreadable
+    stored = getUpload(handle)
+    if stored == None:
+        return None
 
-def setEpsonP8000Config(width, height):
-    configLocation = "C:\ProgramData\EPSON\EPSON SC-P8000 Series\E_31CL01LE.UCF"
-    filename_bak = "E_31CL01LE.UCF.bak"
-    filename = "E_31CL01LE.UCF"
+    try:
+        with stage("queue_thumbnail"):
+            thumbnail = pyvips.Image.thumbnail_buffer(stored["data"], QUEUE_THUMBNAIL_SIZE,
+                                                      height=QUEUE_THUMBNAIL_SIZE)
+            return toRGBA(ingestMetadata(thumbnail)).copy_memory()
+    except pyvips.Error:
+        return None
 
-    # Copy config file to current directory
-    shutil.copyfile(filename_bak, filename)
 
-    newWidth = min(44, width)
-    height = int(height * (newWidth / width))
-    width = newWidth
+@app.route("/uploads", methods=["POST"])
+def startChunkedUpload():
+    # Begin a chunked upload of size bytes, its query string says what
+    # it is as /upload's does. Returns the id its chunks are sent to
+    body = request.get_json()
+    content_type = body.get("content_type")
+    size = int(body.get("size", 0))
+    # size is of the gzip body for a compressed upload, its chunks are
+    # inflated as they arrive
+    inflater = zlib.decompressobj(wbits=31) if body.get("content_encoding") == "gzip" else None
 
-    print("Setting EPSON P8000 config to " + str(width) + " inches wide and " + str(height) + " inches tall")
+    if not supportedType(content_type):
+        return {"error": "Unsupported Media Type"}, 415, {"Content-Type": "application/json"}
 
-    with open(filename, 'r+b') as f:
-        newDec = encodedDistance(height)
-        newbytes = newDec.to_bytes(2, byteorder='big')
-        f.seek(0X0004173C)
-        f.write(newbytes)
+    if size > MAX_UPLOAD_BYTES:
+        return {"error": "Upload too large"}, 413, {"Content-Type": "application/json"}
 
-        newDec = encodedDistance(width)
-        newbytes = newDec.to_bytes(2, byteorder='big')
-        f.seek(0X00041738)
-        f.write(newbytes)
+    upload_id = os.urandom(16).hex()
 
-        if (height > width):
-            f.seek(0X00041736)
-            newDec = 0x00
-            newbytes = newDec.to_bytes(2, byteorder='big')
-            f.write(newbytes)
-        else:
-            f.seek(0X00041736)
-            newDec = 0x01
-            newbytes = newDec.to_bytes(2, byteorder='big')
-            f.write(newbytes)
-
-    # copy file to config location
-    shutil.copy(filename, configLocation)
-
-def setEpsonP9900Config(width, height):
-    configLocation = "C:\ProgramData\EPSON\EPSON Stylus Pro 9900\E_FCL0EHE.UCF"
-    filename_bak = "E_FCL0EHE.UCF.bak"
-    filename = "E_FCL0EHE.UCF"
-
-    # Copy config file to current directory
-    shutil.copyfile(filename_bak, filename)
-
-    newWidth = min(44, width)
-    height = int(height * (newWidth / width))
-    width = newWidth
-
-    print("Setting EPSON P9900 config to " + str(width) + " inches wide and " + str(height) + " inches tall")
-
-    with open(filename, 'r+b') as f:
-        encoded_height = encodedDistance(height)
-        encoded_height_bytes = encoded_height.to_bytes(2, byteorder='big')
-        f.seek(0X0004173C)
-        f.write(encoded_height_bytes)
-
-        encoded_width = encodedDistance(width)
-        encoded_width_bytes = encoded_width.to_bytes(2, byteorder='big')
-        f.seek(0X00041738)
-        f.write(encoded_width_bytes)
-
-        if (height > width):
-            f.seek(0X00041736)
-            encoded_portrait = 0x00
-            encoded_portrait_bytes = encoded_portrait.to_bytes(2, byteorder='big')
-            f.write(encoded_portrait_bytes)
+    with chunked_uploads_lock:
+        # Forget uploads the client gave up on, then the oldest if
+        # there are still too many
+        for stale_id in [key for key, upload in chunked_uploads.items()
+                         if time.time() - upload["used"] > CHUNKED_UPLOAD_SECONDS]:
+            del chunked_uploads[stale_id]
+
+        while len(chunked_uploads) >= CHUNKED_UPLOADS_MAX:
+            chunked_uploads.popitem(last=False)
+
+        chunked_uploads[upload_id] = {"content_type": content_type, "size": size, "args": dict(request.args),
+                                      "chunks": [], "received": 0, "hash": hashlib.blake2b(digest_size=16),
+                                      "header": None, "probed": False, "result": None, "used": time.time(),
+                                      "lock": threading.Lock(), "inflater": inflater, "inflated": 0}
+
+    return {"upload_id": upload_id}, 200, {"Content-Type": "application/json"}
+
+
+@app.route("/uploads/<upload_id>", methods=["GET", "PUT"])
+def chunkedUpload(upload_id):
+    # GET says how many bytes have arrived, so a client resumes from
+    # there. PUT appends the body at offset, which must be that count.
+    # The chunk completing the upload stores it and answers as /upload
+    with chunked_uploads_lock:
+        upload = chunked_uploads.get(upload_id)
+
+    if upload == None:
+        return {"error": "Upload not found"}, 404, {"Content-Type": "application/json"}
+
+    with upload["lock"]:
+        upload["used"] = time.time()
+
+        # A retried final chunk whose answer was lost
+        if upload["result"] != None:
+            return upload["result"][0], upload["result"][1], {"Content-Type": "application/json"}
+
+        if request.method == "GET":
+            return {"received": upload["received"]}, 200, {"Content-Type": "application/json"}
+
+        if request.args.get("offset", type=int) != upload["received"]:
+            return {"received": upload["received"]}, 409, {"Content-Type": "application/json"}
+
+        chunk = request.get_data()
+
+        if upload["received"] + len(chunk) > upload["size"]:
+            return {"error": "Chunk past the end of the upload"}, 400, {"Content-Type": "application/json"}
+
+        upload["received"] += len(chunk)
+        complete = upload["received"] == upload["size"]
+
+        if upload["inflater"] != None:
+            try:
+                chunk = inflateChunk(upload, chunk)
+            except UploadTooLarge:
+                upload["result"] = {"error": "Upload too large"}, 413
+            except zlib.error:
+                upload["result"] = {"error": "Upload isn't valid gzip"}, 400
+
+            if upload["result"] == None and complete and not upload["inflater"].eof:
+                upload["result"] = {"error": "Upload isn't valid gzip"}, 400
+
+            if upload["result"] != None:
+                upload["chunks"] = []
+                return upload["result"][0], upload["result"][1], {"Content-Type": "application/json"}
+
+        # Hash as chunks arrive, so completing doesn't read the whole
+        # file again
+        upload["chunks"].append(chunk)
+        upload["hash"].update(chunk)
+
+        # Probe once, completing probes again if this couldn't
+        if not upload["probed"] and upload["content_type"] in supported_images and \
+                (upload["received"] >= CHUNKED_PROBE_BYTES or complete):
+            upload["probed"] = True
+            upload["header"] = chunkedHeader(upload)
+
+            # Refuse an image with too many pixels before the rest of
+            # it is sent
+            if upload["header"] != None and upload["header"].width * upload["header"].height > MAX_SOURCE_PIXELS:
+                upload["result"] = {"error": "Image has too many pixels"}, 413
+                upload["chunks"] = []
+                return upload["result"][0], upload["result"][1], {"Content-Type": "application/json"}
+
+        if not complete:
+            return {"received": upload["received"]}, 200, {"Content-Type": "application/json"}
+
+        data = b"".join(upload["chunks"])
+        upload["chunks"] = []
+        header = upload["header"]
+
+        # A converted document is stored by the hash of its pdf
+        handle = upload["hash"].hexdigest()
+        content_type = upload["content_type"]
+
+        try:
+            data, content_type = convertUpload(data, content_type)
+            error = uploadError(data, content_type, header) or originalSizeError(upload["args"])
+        except officeconvert.ConversionError as e:
+            error = "Could not convert document: " + str(e), 415
+
+        if content_type != upload["content_type"]:
+            handle = None
+
+        if error != None:
+            upload["result"] = {"error": error[0]}, error[1]
         else:
-            f.seek(0X00041736)
-            encoded_portrait = 0x01
-            encoded_portrait_bytes = encoded_portrait.to_bytes(2, byteorder='big')
-            f.write(encoded_portrait_bytes)
+            handle = storeRequestUpload(data, content_type, handle, upload["args"])
+            size = {"width": header.width, "height": header.height} if header != None else {}
 
-    # copy file to config location
-    shutil.copy(filename, configLocation)
+            if content_type == "application/pdf":
+                try:
+                    size["page_count"] = pdfPageCount(data)
+                except pyvips.Error:
+                    pass
 
+            upload["result"] = {"handle": handle, **size}, 200
 
-def previewPhoto(image, width, height, paper_width):
-    # Create a 1000x862 blank image transparent image
-    preview = Image.new('RGBA', (1000, 862), (255, 255, 255, 0))
+        return upload["result"][0], upload["result"][1], {"Content-Type": "application/json"}
 
-    width_pix = 420 * (width / 44)
-    # Calc height from width
-    height_pix = width_pix * (height/width)
 
-    # Resize the image
-    image = image.resize((int(width_pix), int(height_pix)), Image.ANTIALIAS)
+def inflateChunk(upload, chunk):
+    # A gzip chunk of a chunked upload inflated, see inflateStep
+    inflated = b""
 
-    # Paste the image so bottom right aligns with 705 px X and 669 px Y
-    preview.paste(image, (705 - int(width_pix), 669 - int(height_pix)))
+    while chunk and not upload["inflater"].eof:
+        inflated += inflateStep(upload["inflater"], chunk, upload["inflated"] + len(inflated))
+        chunk = upload["inflater"].unconsumed_tail
 
-    return preview
+    upload["inflated"] += len(inflated)
 
+    return inflated
 
-def printPhoto(image, width, height, dpi):
-    setEpsonConfig(width, height)
 
-    # Convert to RGB (for images saved in CMYK that don't work in PNG)
-    image.convert('RGB').save("output.png")
-    # Save to temp output file
-    # image.save("output.png")
+def chunkedHeader(upload):
+    # Header of a chunked upload from the bytes so far, or None if its
+    # loader needs more of the file than has arrived
+    try:
+        return pyvips.Image.new_from_buffer(b"".join(upload["chunks"]), "")
+    except pyvips.Error:
+        return None
 
-    # Print the image
-    # Call PrintGUI/Executable/PrintGUI.exe
-    current_dir = os.path.dirname(os.path.realpath(__file__))
 
-    path = "PrintGUI/Executable/PrintGUI.exe"
+@app.route("/stitch", methods=["POST"])
+def stitch():
+    # Join uploads of a drawing scanned in overlapping sections, in
+    # order left to right or top to bottom, into one upload. The merge
+    # is a lazy vips pipeline, but it's encoded whole into the new
+    # upload's buffer, so the encode takes a turn in the ingest line
+    # and is admitted under the memory limit like any render
+    body = request.get_json()
+    handles = body.get("handles", [])
 
-    # Get cwd
-    cwd = os.getcwd()
+    if len(handles) < 2:
+        return {"error": "Stitching needs two or more uploads"}, 400, {"Content-Type": "application/json"}
 
-    print("Printing...")
-    print(cwd + "\\output.png")
+    parts = [getUpload(handle) for handle in handles]
+    if None in parts:
+        return {"error": "Upload not found"}, 404, {"Content-Type": "application/json"}
+
+    if any(part["content_type"] not in supported_images for part in parts):
+        return {"error": "Unsupported Media Type"}, 415, {"Content-Type": "application/json"}
 
-    p = subprocess.Popen([path, cwd + "\\output.png"], shell=False)
+    try:
+        images = [pyvips.Image.new_from_buffer(part["data"], "") for part in parts]
+    except pyvips.Error:
+        return {"error": "Unreadable image"}, 415, {"Content-Type": "application/json"}
 
-    # Delete cache files in cache dir
-    for file in os.listdir("cache"):
-        os.remove("cache/" + file)
-    
-    # Put a single file in cache dir
-    # to prevent github from deleting the dir
-    # image.save("cache/preview.png")
-    image.convert('RGB').save("cache/preview.png")
+    direction = body.get("direction") or stitchDirection(images)
 
+    if direction not in ["horizontal", "vertical"]:
+        return {"error": "Unknown direction"}, 400, {"Content-Type": "application/json"}
+
+    with stage("stitch"):
+        try:
+            mosaic = stitchImages(images, direction)
+        except pyvips.Error as error:
+            print("Stitch failed: " + str(error))
+            return {"error": "Scans could not be aligned"}, 422, {"Content-Type": "application/json"}
+
+    if mosaic.width * mosaic.height > MAX_SOURCE_PIXELS:
+        return {"error": "Image has too many pixels"}, 413, {"Content-Type": "application/json"}
+
+    try:
+        ticket = ingest_gate.join(render_costs.predict("image/tiff", mosaic.width * mosaic.height,
+                                                       sum(len(part["data"]) for part in parts)), INGEST_WAIT_SECONDS)
+    except admission.Busy as busy:
+        return busyResponse(busy.position, busy.eta)
+
+    try:
+        if not ingest_gate.enter(ticket, INGEST_WAIT_SECONDS):
+            return busyResponse(*ingest_gate.status(ticket))
+
+        # At most the mosaic's own pixels, the encoded buffer being
+        # no larger uncompressed
+        estimate = mosaic.width * mosaic.height * mosaic.bands * format_sizes[mosaic.format]
+
+        with renderAdmission(estimate), stage("stitch_encode"):
+            data = mosaic.tiffsave_buffer(tile=True, tile_width=SOURCE_TILE_SIZE, tile_height=SOURCE_TILE_SIZE,
+                                          compression=SOURCE_COMPRESSION, predictor="horizontal",
+                                          level=1 if SOURCE_COMPRESSION == "zstd" else 0)
+    finally:
+        ingest_gate.leave(ticket)
+
+    error = uploadError(data, "image/tiff", mosaic)
+    if error != None:
+        return {"error": error[0]}, error[1], {"Content-Type": "application/json"}
+
+    handle = storeUpload(data, "image/tiff")
+
+    return {"handle": handle, "width": mosaic.width, "height": mosaic.height}, 200, {"Content-Type": "application/json"}
+
+
+def stitchDirection(images):
+    # Sections of one drawing share the edge they were scanned along,
+    # so they join across whichever dimension matches more closely
+    heights = [image.height for image in images]
+    widths = [image.width for image in images]
+
+    return "horizontal" if max(heights) / min(heights) <= max(widths) / min(widths) else "vertical"
+
+
+def stitchImages(images, direction):
+    # Fold each section onto the mosaic so far with vips mosaic, which
+    # finds the exact join by correlating tie points around the
+    # expected overlap and feathers across the seam
+    depth = 16 if any(image.format == "ushort" for image in images) else 8
+    images = [toRGB(image, depth) for image in images]
+
+    mosaic = images[0]
+    for section in images[1:]:
+        if direction == "horizontal":
+            overlap = round(section.width * STITCH_OVERLAP)
+            # The middle of the overlap, in the mosaic and the section
+            xref, yref = mosaic.width - overlap // 2, min(mosaic.height, section.height) // 2
+            xsec, ysec = overlap // 2, min(mosaic.height, section.height) // 2
+        else:
+            overlap = round(section.height * STITCH_OVERLAP)
+            xref, yref = min(mosaic.width, section.width) // 2, mosaic.height - overlap // 2
+            xsec, ysec = min(mosaic.width, section.width) // 2, overlap // 2
+
+        mosaic = mosaic.mosaic(section, direction, xref, yref, xsec, ysec,
+                               harea=max(15, min(STITCH_SEARCH_PIXELS, overlap // 2)))
+
+    return mosaic
+
+
+def resolveUpload(stored, handle, options, full_resolution):
+    # The upload a render reads, its key and its options. Previews of a
+    # proxy read the proxy, planned at the original's pixel size, while
+    # prints and zooms need the original. Returns a None upload when
+    # that hasn't been uploaded
+    if stored.get("original_size") == None:
+        return stored, handle, options
+
+    if not full_resolution:
+        return stored, handle, dict(options, source_size=stored["original_size"])
+
+    original = getUpload(stored["original"]) if stored.get("original") else None
+
+    return original, stored.get("original"), options
+
+
+@app.route("/render", methods=["POST"])
+def render():
+    # Render a stored upload from its handle and the options json
+    body = request.get_json()
+
+    stored = getUpload(body["handle"])
+
+    if stored == None:
+        # The upload was evicted or never stored, client must re-upload
+        return {"error": "Unknown upload handle"}, 404, {"Content-Type": "application/json"}
+
+    # Plans are kept under the upload and options the preview was
+    # rendered from, which for a proxy aren't the print's
+    plan = None
+    if body["options"]["print"]:
+        preview, preview_handle, preview_options = resolveUpload(stored, body["handle"], body["options"], False)
+        plan = renderPlan(body.get("plan_id"), preview_handle, preview_options)
+
+    stored, handle, options = resolveUpload(stored, body["handle"], body["options"], body["options"]["print"])
+
+    if stored == None:
+        return {"error": "Original not uploaded"}, 428, {"Content-Type": "application/json"}
+
+    return renderUpload(stored["data"], stored["content_type"], options, handle, body.get("progressive", False), plan,
+                        body.get("inline", False))
+
+
+@app.route("/rehearsals", methods=["POST"])
+def rehearsal():
+    # Start rendering a stored upload's print while its confirmation is
+    # open, the print of the same options picks it up. Takes the body
+    # /render does
+    body = request.get_json()
+
+    stored = getUpload(body["handle"])
+
+    if stored == None:
+        return {"error": "Unknown upload handle"}, 404, {"Content-Type": "application/json"}
+
+    preview, preview_handle, preview_options = resolveUpload(stored, body["handle"], body["options"], False)
+    plan = renderPlan(body.get("plan_id"), preview_handle, preview_options)
+
+    stored, handle, options = resolveUpload(stored, body["handle"], body["options"], True)
+
+    if stored == None:
+        return {"error": "Original not uploaded"}, 428, {"Content-Type": "application/json"}
+
+    rehearsal_id = startRehearsal(stored["data"], stored["content_type"], options, handle, plan)
+
+    return {"rehearsal_id": rehearsal_id}, 202 if rehearsal_id != None else 200, {"Content-Type": "application/json"}
+
+
+@app.route("/rehearsals/<rehearsal_id>/cancel", methods=["POST"])
+def rehearsalCancel(rehearsal_id):
+    # The confirmation was closed without printing
+    cancelRehearsal(rehearsal_id)
+
+    return {}, 200, {"Content-Type": "application/json"}
+
+
+@app.route("/plan", methods=["POST"])
+def plan():
+    # Print size and dpi of a stored upload from its header alone,
+    # no pixels are decoded
+    body = request.get_json()
+
+    stored = getUpload(body["handle"])
+
+    if stored == None:
+        return {"error": "Unknown upload handle"}, 404, {"Content-Type": "application/json"}
+
+    stored, handle, options = resolveUpload(stored, body["handle"], body["options"], False)
+
+    data = stored["data"]
+    content_type = stored["content_type"]
+
+    if content_type == "application/pdf" and options.get("all_pages"):
+        page_options, plans = planPDFPages(data, options)
+    else:
+        source_width, source_height = sourceSize(data, content_type, options)
+        plans = [calculateSize(source_width, source_height, options)]
+
+    rotate, width, height, dpi = plans[0]
+    result = {"width": width, "height": height, "dpi": dpi, "rotate": rotate}
+
+    # Oversized prints either shrink to the roll or split into panels
+    max_width = max(printer["max_width"] for printer in printers.selected())
+    if width > max_width:
+        result["panels"] = panelLayout(width, max_width)[0] if options.get("panels") else 0
+
+    if len(plans) > 1:
+        result["pages"] = [{"width": width, "height": height, "dpi": dpi} for rotate, width, height, dpi in plans]
+
+    return result, 200, {"Content-Type": "application/json"}
+
+
+@app.route("/texture", methods=["POST"])
+def previewTexture():
+    # The upload upright, trimmed and at the size of the biggest print
+    # the mockup shows, with the mockup's geometry. The client scales,
+    # turns and places it for options that only change the print's
+    # size or side, and asks /render when the pixels change
+    body = request.get_json()
+
+    stored = getUpload(body["handle"])
+
+    if stored == None:
+        return {"error": "Unknown upload handle"}, 404, {"Content-Type": "application/json"}
+
+    stored, handle, options = resolveUpload(stored, body["handle"], previewScale(body["options"]), False)
+
+    data = stored["data"]
+    content_type = stored["content_type"]
+
+    if content_type == "application/pdf" and options.get("all_pages"):
+        return {"error": "Page batches preview on the server"}, 400, {"Content-Type": "application/json"}
+
+    mockup = previewMockup()
+    scale = options.get("preview_scale", 1)
+
+    # Plan the upload as a print one pixel to the inch, at the scale
+    # its longest side fills the texture
+    source_width, source_height = sourceSize(data, content_type, options)
+    size = min(PREVIEW_TEXTURE_MAX, math.ceil(max(mockup["width"], mockup["height"]) * scale))
+    texture_scale = size * mockup["max_width"] / (mockup["print_width"] * max(source_width, source_height, 1))
+
+    page = options.get("page", 0) if content_type == "application/pdf" or content_type in framed_images else 0
+    image = previewSource(data, False, source_width, source_height, page, trimBox(data, content_type, options), 1,
+                          PREVIEW_LINEAR and content_type in supported_images, texture_scale,
+                          sourceOrientation(data, content_type))
+    image = softProof(image, proofProfile(options))
+
+    # jpeg has no alpha to leave the mockup showing through
+    format = previewFormat(request.headers.get("Accept", ""))
+    format = "png" if format == "jpeg" else format
+
+    with previewPriority(), stage("preview_encode"):
+        buffer = encodePreview(toRGBA(image), format)
+
+    timestamp = str(time.time()).replace(".", "_") + "." + format
+    storePreviewImage(timestamp, buffer)
+
+    return {"image_url": "/getImage/" + timestamp, "mockup": mockup, "scale": scale}, 200, \
+        {"Content-Type": "application/json"}
+
+
+@app.route("/estimate", methods=["POST"])
+def estimate():
+    # Roll length and ink per CMYK channel for a print, estimated from
+    # thumbnails so it costs about as much as a rough preview
+    body = request.get_json()
+
+    stored = getUpload(body["handle"])
+
+    if stored == None:
+        return {"error": "Unknown upload handle"}, 404, {"Content-Type": "application/json"}
+
+    stored, handle, options = resolveUpload(stored, body["handle"], body["options"], False)
+
+    data = stored["data"]
+    content_type = stored["content_type"]
+
+    blank_pages = []
+    skipped_pages = []
+    if content_type == "application/pdf" and options.get("all_pages"):
+        page_options, plans = planPDFPages(data, options, skip_blank=True)
+
+        blank_pages = blankPages(data, pdfPageCount(data))
+        kept = [page["page"] for page in page_options]
+        skipped_pages = [page for page in blank_pages if page not in kept]
+    else:
+        page_options = [options]
+        plans = [calculateSize(*sourceSize(data, content_type, options), options)]
+
+    ink = [0, 0, 0, 0]
+    with stage("ink_estimate"):
+        for page, (rotate, width, height, dpi) in zip(page_options, plans):
+            page_ink = estimateInk(data, content_type, page, width, height)
+            ink = [total + channel for total, channel in zip(ink, page_ink)]
+
+    return {"roll_inches": sum(plan[2] for plan in plans),
+            "ink_ml": dict(zip(["cyan", "magenta", "yellow", "black"], [round(channel, 2) for channel in ink])),
+            "blank_pages": blank_pages, "skipped_pages": skipped_pages}, 200, {"Content-Type": "application/json"}
+
+
+@app.route("/gang", methods=["GET", "POST"])
+def gang():
+    # Add a print of a stored upload to the gang sheet for its printer
+    # and roll, or list the sheets waiting
+    if request.method == "POST":
+        body = request.get_json()
+
+        stored = getUpload(body["handle"])
+
+        if stored == None:
+            return {"error": "Unknown upload handle"}, 404, {"Content-Type": "application/json"}
+
+        stored, handle, options = resolveUpload(stored, body["handle"], body["options"], True)
+
+        if stored == None:
+            return {"error": "Original not uploaded"}, 428, {"Content-Type": "application/json"}
+
+        sheet_id, count = addToGang(stored["data"], stored["content_type"], options, handle)
+
+        if sheet_id == None:
+            return {"error": "Gang sheet is full"}, 409, {"Content-Type": "application/json"}
+
+        return {"sheet": sheet_id, "count": count}, 200, {"Content-Type": "application/json"}
+
+    with gang_lock:
+        return {sheet_id: len(entries) for sheet_id, entries in gang_sheets.items()}, 200, \
+            {"Content-Type": "application/json"}
+
+
+@app.route("/gang/<sheet_id>/print", methods=["POST"])
+def printGangSheet(sheet_id):
+    # Print a gang sheet as one job with one paper configuration
+    with gang_lock:
+        entries = gang_sheets.pop(sheet_id, None)
+
+    if not entries:
+        return {"error": "Unknown gang sheet"}, 404, {"Content-Type": "application/json"}
+
+    printer_id, paper_width = sheet_id.split("-")
+    printer = next(printer for printer in printers.selected() if printer["id"] == printer_id)
+
+    job = print_queues[printer_id].submit("gang", lambda job: printGang(entries, float(paper_width), job, printer))
+
+    return {"job_id": job.id, "status_url": "/jobs/" + job.id, "printer": printer_id}, 202, \
+        {"Content-Type": "application/json"}
+
+
+def addToGang(data, content_type, options, key):
+    # Hold a print for the gang sheet of its routed printer and roll
+    # Returns the sheet id and how many prints it holds, or None when full
+    printer = printers.route(printers.selected(), options["paper_width"], printerLoad)
+    sheet_id = printer["id"] + "-" + str(options["paper_width"])
+
+    with gang_lock:
+        entries = gang_sheets.setdefault(sheet_id, [])
+
+        if len(entries) >= GANG_MAX:
+            return None, len(entries)
+
+        entries.append({"data": data, "content_type": content_type, "options": options, "key": key})
+
+        return sheet_id, len(entries)
+
+
+@app.route("/batches", methods=["POST"])
+def submitBatch():
+    # Queue a set of prints from a script in one request. The form's
+    # manifest is json, {"options": {...}, "items": [...]}, where each
+    # item is {"file": form field} or {"handle": upload handle} with
+    # options of its own over the shared ones. Without items every file
+    # sent prints with the shared options. Everything is checked before
+    # anything is queued, and the prints spread over the printers'
+    # queues like any other
+    try:
+        manifest = json.loads(request.form.get("manifest") or "{}")
+        shared = manifest.get("options") or {}
+        items = manifest.get("items") or [{"file": name} for name in request.files]
+    except (ValueError, AttributeError):
+        return {"error": "Manifest isn't valid json"}, 400, {"Content-Type": "application/json"}
+
+    if not isinstance(shared, dict) or not isinstance(items, list) or \
+            not all(isinstance(item, dict) and isinstance(item.get("options") or {}, dict) for item in items):
+        return {"error": "Manifest isn't a batch"}, 400, {"Content-Type": "application/json"}
+
+    if not items:
+        return {"error": "Nothing to print"}, 400, {"Content-Type": "application/json"}
+
+    if len(items) > BATCH_MAX_ITEMS:
+        return {"error": "More than " + str(BATCH_MAX_ITEMS) + " prints"}, 413, {"Content-Type": "application/json"}
+
+    prints = []
+    for index, item in enumerate(items):
+        stored, error = batchUpload(item)
+
+        if error != None:
+            return {"error": error[0], "item": index}, error[1], {"Content-Type": "application/json"}
+
+        options = dict(shared)
+        options.update(item.get("options") or {})
+        options["print"] = True
+        prints.append((stored, options))
+
+    batch_id = uuid.uuid4().hex
+    queued = []
+
+    for (data, content_type, handle), options in prints:
+        job, printer_id, duplicate = queuePrint(data, content_type, options, handle)
+        queued.append((job, printer_id))
+
+    with batches_lock:
+        batches[batch_id] = queued
+
+        while len(batches) > BATCHES_MAX:
+            batches.popitem(last=False)
+
+    return {"batch_id": batch_id, "status_url": "/batches/" + batch_id,
+            "jobs": [job.id for job, printer_id in queued]}, 202, {"Content-Type": "application/json"}
+
+
+def batchUpload(item):
+    # (data, content_type, handle) an item of a batch prints, stored
+    # like any upload so repeats of one file share its caches. Returns
+    # it and None, or None and the (message, status) to refuse it with
+    if item.get("handle") != None:
+        stored = getUpload(item["handle"])
+
+        if stored == None:
+            return None, ("Unknown upload handle", 404)
+
+        return (stored["data"], stored["content_type"], item["handle"]), None
+
+    file = request.files.get(item.get("file") or "")
+    if file == None:
+        return None, ("No file " + str(item.get("file")), 400)
+
+    if not supportedType(file.content_type):
+        return None, ("Unsupported Media Type", 415)
+
+    try:
+        data, content_type = convertUpload(file.read(), file.content_type)
+    except officeconvert.ConversionError as e:
+        return None, ("Could not convert document: " + str(e), 415)
+
+    error = uploadError(data, content_type)
+    if error != None:
+        return None, error
+
+    return (data, content_type, storeUpload(data, content_type)), None
+
+
+@app.route("/batches/<batch_id>", methods=["GET"])
+def getBatch(batch_id):
+    # Progress of a batch across all its prints
+    with batches_lock:
+        queued = batches.get(batch_id)
+
+    if queued == None:
+        return {"error": "Unknown batch"}, 404, {"Content-Type": "application/json"}
+
+    return batchStatus(batch_id, queued), 200, {"Content-Type": "application/json"}
+
+
+@app.route("/batches/<batch_id>/cancel", methods=["POST"])
+def cancelBatch(batch_id):
+    # Cancel every print of a batch that hasn't finished
+    with batches_lock:
+        queued = batches.get(batch_id)
+
+    if queued == None:
+        return {"error": "Unknown batch"}, 404, {"Content-Type": "application/json"}
+
+    for job, printer_id in queued:
+        if job.finished == None:
+            job.cancel()
+
+    # Wake any waiting for the printer
+    with handoff_condition:
+        handoff_condition.notify_all()
+
+    return batchStatus(batch_id, queued), 200, {"Content-Type": "application/json"}
+
+
+def batchStatus(batch_id, queued):
+    # A batch's aggregate status: running while any print is, then
+    # done when every print is and failed when any isn't
+    counts = collections.Counter(job.status for job, printer_id in queued)
+
+    if any(job.finished == None for job, printer_id in queued):
+        status = "queued" if counts["queued"] == len(queued) else "running"
+    else:
+        status = "done" if counts["done"] == len(queued) else "failed"
+
+    return {
+        "id": batch_id,
+        "status": status,
+        "progress": round(sum(job.progress for job, printer_id in queued) / len(queued)),
+        "counts": dict(counts),
+        "jobs": [{"job_id": job.id, "printer": printer_id, "status": job.status, "progress": job.progress,
+                  "error": job.error} for job, printer_id in queued],
+    }
+
+
+@contextlib.contextmanager
+def stage(name):
+    # Time a render pipeline stage into the metrics and, when tracing,
+    # as a span
+    with tracing.span(name), stage_seconds.time(stage=name):
+        yield
+
+
+def printerLoad(printer):
+    # How poorly placed a printer is to take a print, for routing: ready
+    # printers first, then by the jobs they have queued
+    return (printerstate.rank(printer["id"]), print_queues[printer["id"]].load())
+
+
+def renderUpload(data, content_type, options, key, progressive=False, plan=None, inline=False):
+    renders_total.inc(content_type=content_type, kind="print" if options["print"] else "preview")
+
+    if (options["print"]):
+        cancelWarming()
+
+        # Queue the print and return straight away, the client polls
+        # the job for its status
+        job, printer_id, duplicate = queuePrint(data, content_type, options, key, plan)
+        response = {"job_id": job.id, "status_url": "/jobs/" + job.id, "printer": printer_id}
+
+        if duplicate:
+            response["duplicate"] = True
+
+        return response, 202, {"Content-Type": "application/json"}
+
+    # Same upload and geometry render the same preview, answer from
+    # the last render while its file is still around
+    options = dict(previewScale(options), preview_format=previewFormat(request.headers.get("Accept", "")))
+    etag = previewTag(key, previewGeometry(data, content_type, options))
+    cached = cachedPreview(etag)
+
+    if cached != None:
+        if request.headers.get("If-None-Match") == etag:
+            return "", 304, {"ETag": etag}
+
+        return inlinePreview(cached) if inline else cached, 200, {"Content-Type": "application/json", "ETag": etag}
+
+    # A real render goes ahead of any guessed at
+    cancelWarming()
+
+    # Hold the request briefly, if another preview of this upload
+    # arrives in the meantime only that one runs
+    if not coalescePreview(key):
+        return {"error": "Superseded by a newer render"}, 409, {"Content-Type": "application/json"}
+
+    # Wait for a turn to decode, or be told when to come back
+    try:
+        ticket = ingest_gate.join(previewSeconds(data, content_type, options), INGEST_WAIT_SECONDS)
+    except admission.Busy as busy:
+        return busyResponse(busy.position, busy.eta)
+
+    batch = content_type == "application/pdf" and options.get("all_pages")
+
+    if progressive and not batch:
+        response = Response(progressivePreview(data, content_type, options, key, etag, inline, ticket),
+                            mimetype="text/event-stream", headers={"Cache-Control": "no-cache", "ETag": etag})
+        # A stream closed before it starts never runs to leave
+        response.call_on_close(lambda: ingest_gate.leave(ticket))
+        return response
+
+    try:
+        if not ingest_gate.enter(ticket, INGEST_WAIT_SECONDS):
+            return busyResponse(*ingest_gate.status(ticket))
+
+        if batch:
+            body, status, headers = renderPDFBatch(data, options, key)
+        else:
+            body, status, headers = renderPreviewImage(data, content_type, options, key)
+    finally:
+        ingest_gate.leave(ticket)
+
+    if status == 200:
+        storePreview(etag, body)
+        headers = dict(headers, ETag=etag)
+
+        if not options.get("all_pages"):
+            warmPreviews(data, content_type, options, key)
+
+        if inline:
+            body = inlinePreview(body)
+
+    return body, status, headers
+
+
+def queuePrint(data, content_type, options, key, plan=None):
+    # Queue a print on the printer best placed to take it, or find the
+    # same print already queued. Returns the job, its printer's id and
+    # whether it was already queued
+    print_key = printKey(key or uploadHash(data), options)
+
+    # Headers are read before taking the lock, which every other print
+    # request waits on
+    printer = printers.route(printers.selected(), options["paper_width"], printerLoad)
+    pixels = 0 if pdfPassthrough(content_type, options, printer) or \
+        filePassthrough(data, content_type, options, printer, plan) != None else \
+        renderPixels(data, content_type, options, plan)
+
+    with recent_prints_lock:
+        job = duplicatePrint(print_key, options)
+
+        if job != None:
+            return job, recent_prints[print_key][1], True
+
+        job = print_queues[printer["id"]].submit("print",
+                                                 lambda job: timedPrint(data, content_type, options, key, job,
+                                                                        printer, plan, pixels),
+                                                 render_costs.predict(content_type, pixels, len(data)))
+
+        recent_prints[print_key] = (job, printer["id"])
+        recent_prints.move_to_end(print_key)
+
+    # Enough to replay the job later with replay.py
+    try:
+        print_log.appendJob(job.id, key or uploadHash(data), content_type, printer["id"], planOptions(options))
+    except sqlite3.Error as e:
+        print("Could not log job input: " + str(e))
+
+    return job, printer["id"], False
+
+
+def warmPreviews(data, content_type, options, key):
+    # Queue speculative previews of the options likely to be tried
+    # after these, replacing any still queued for an earlier preview
+    if not PREVIEW_WARMING:
+        return
+
+    generation = cancelWarming()
+    warm_pool.submit(warmAlternatives, data, content_type, options, key, generation)
+
+
+def cancelWarming():
+    # Stop speculative previews, killing the one rendering. Returns the
+    # generation warming queued from now on belongs to
+    global warm_generation
+
+    with preview_lock:
+        warm_generation += 1
+        rendering = preview_renders.pop(WARM_RENDER, None)
+
+        if rendering != None:
+            rendering.set_kill(True)
+
+        return warm_generation
+
+
+def warmOptions(options):
+    # Options the user is likely to try next, other paper widths on the
+    # same side first. Side only changes an auto sized print
+    sides = [options.get("side")]
+    if options.get("max_size") and options.get("specific_width") == None and \
+            options.get("specific_height") == None and options.get("specific_dpi") == None:
+        sides.append("long" if options.get("side") == "short" else "short")
+
+    return [dict(options, paper_width=width, side=side) for side in sides for width in PREVIEW_WARM_WIDTHS
+            if dict(options, paper_width=width, side=side) != options]
+
+
+def warmAlternatives(data, content_type, options, key, generation):
+    # Render warmOptions' previews into the preview and plan caches,
+    # each once the kiosk is idle, until warming is cancelled
+    for alternative in warmOptions(options):
+        if not warmIdle(generation):
+            return
+
+        try:
+            etag = previewTag(key, previewGeometry(data, content_type, alternative))
+            if cachedPreview(etag) != None:
+                continue
+
+            body, status, headers = renderPreviewImage(data, content_type, alternative, key, speculative=True)
+        except pyvips.Error as e:
+            print("Speculative preview failed: " + str(e))
+            return
+
+        with preview_lock:
+            current = warm_generation == generation
+
+        if status != 200 or not current:
+            return
+
+        storePreview(etag, body)
+
+
+def warmIdle(generation):
+    # Wait for no preview or print to be rendering, False if warming
+    # is cancelled meanwhile
+    while True:
+        with preview_lock:
+            if warm_generation != generation:
+                return False
+
+        if previews_active == 0 and not any(queue.load() for queue in print_queues.values()):
+            return True
+
+        time.sleep(PREVIEW_WARM_POLL_SECONDS)
+
+
+def inlinePreview(body):
+    # A preview response carrying its encoded image, so the client
+    # shows it without fetching image_url. Left as it is when the
+    # image has gone
+    timestamp = body["image_url"].split("/")[-1]
+    buffer = previewImage(timestamp)
+
+    if buffer == None:
+        try:
+            with open(previewFile(timestamp), "rb") as f:
+                buffer = f.read()
+        except OSError:
+            return body
+
+    return dict(body, image_data=base64.b64encode(buffer).decode(), image_type="image/" + timestamp.rsplit(".", 1)[1])
+
+
+def previewScale(options):
+    # Swap the client's viewport for the scale the mockup renders at to
+    # fill it, covering it as the display's background does
+    viewport = options.get("viewport")
+    options = {name: value for name, value in options.items() if name != "viewport"}
+
+    if viewport == None:
+        return options
+
+    mockup = previewMockup()
+    try:
+        scale = max(viewport["width"] / mockup["width"], viewport["height"] / mockup["height"]) * viewport["dpr"]
+    except (KeyError, TypeError, ZeroDivisionError):
+        return options
+
+    scale = math.ceil(scale / PREVIEW_SCALE_STEP) * PREVIEW_SCALE_STEP
+    options["preview_scale"] = min(max(scale, PREVIEW_SCALE_MIN), PREVIEW_SCALE_MAX)
+
+    return options
+
+
+def previewMockup():
+    # Mockup of the first selected printer, the one the display shows,
+    # with the max_width its print_width stands for
+    printer = printers.selected()[0]
+
+    return dict(printer["mockup"], max_width=printer["max_width"])
+
+
+def progressivePreview(data, content_type, options, key, etag, inline=False, ticket=None):
+    # Server-sent events for a two phase preview: a rough one straight
+    # from a heavier shrink-on-load, then the finished preview. Each
+    # event is a render response with its phase and status, and with
+    # inline its image, so a tweak costs one request. A ticket in the
+    # ingest line first sends a phase 0 event a second with its place
+    # in line until it's in, or a 429 once it has waited too long
+    try:
+        waited = time.time()
+
+        while ticket != None and not ingest_gate.enter(ticket, 1):
+            position, eta = ingest_gate.status(ticket)
+
+            if time.time() - waited >= INGEST_WAIT_SECONDS:
+                yield "data: " + json.dumps(dict(busyResponse(position, eta)[0], phase=0, status=429)) + "\n\n"
+                return
+
+            yield "data: " + json.dumps({"queued": True, "position": position, "eta": round(eta, 1), "phase": 0,
+                                         "status": 202}) + "\n\n"
+
+        quick = previewShrink(data, content_type, options)
+        phases = [(1, quick), (2, 1)] if quick != 1 else [(2, 1)]
+
+        for phase, shrink in phases:
+            body, status, headers = renderPreviewImage(data, content_type, options, key, shrink)
+
+            if phase == 2 and status == 200:
+                storePreview(etag, body)
+                warmPreviews(data, content_type, options, key)
+
+            if inline and status == 200:
+                body = inlinePreview(body)
+
+            yield "data: " + json.dumps(dict(body, phase=phase, status=status)) + "\n\n"
+
+            if status != 200:
+                return
+    except Exception as e:
+        print("Progressive preview failed: " + str(e))
+        yield "data: " + json.dumps({"error": str(e), "phase": 2, "status": 500}) + "\n\n"
+    finally:
+        if ticket != None:
+            ingest_gate.leave(ticket)
+
+
+def previewSeconds(data, content_type, options):
+    # Seconds the preview cost model expects a preview to take, what
+    # its place in the ingest line counts for those behind it
+    try:
+        return preview_costs.predict(content_type, previewPixels(data, content_type, options), len(data))
+    except (pyvips.Error, KeyError, TypeError, ValueError):
+        return 0
+
+
+def busyResponse(position, eta):
+    # 429 for a request turned away by the ingest line
+    retry_after = max(1, math.ceil(eta))
+
+    return {"error": "Server busy", "position": position, "eta": round(eta, 1), "retry_after": retry_after}, 429, \
+        {"Content-Type": "application/json", "Retry-After": str(retry_after)}
+
+
+def ingestRoom():
+    # Whether the memory governor has room for another preview decode
+    return trackedMemory() + memory_reserved < RENDER_MEMORY_SOFT_LIMIT
+
+
+def previewShrink(data, content_type, options):
+    # How much smaller a progressive preview's first phase renders so
+    # the cost model expects it inside PREVIEW_BUDGET_SECONDS, or 1 when
+    # the finished preview already is. Until previews have been timed
+    # there's nothing to predict from, and it's PREVIEW_QUICK_SHRINK
+    if PREVIEW_BUDGET_SECONDS <= 0 or not preview_costs.fitted(content_type):
+        return PREVIEW_QUICK_SHRINK
+
+    pixels = previewPixels(data, content_type, options)
+
+    if preview_costs.predict(content_type, pixels, len(data)) <= PREVIEW_BUDGET_SECONDS:
+        return 1
+
+    shrink = PREVIEW_QUICK_SHRINK
+    while shrink < PREVIEW_MAX_SHRINK and \
+            preview_costs.predict(content_type, pixels / shrink ** 2, len(data)) > PREVIEW_BUDGET_SECONDS:
+        shrink *= 2
+
+    return min(shrink, PREVIEW_MAX_SHRINK)
+
+
+def previewPixels(data, content_type, options):
+    # Pixels a finished preview draws the print at, from headers
+    source_width, source_height = sourceSize(data, content_type, options)
+    rotate, width, height, dpi = calculateSize(source_width, source_height, options)
+    width_pix, height_pix = previewSize(width, height, options.get("preview_scale", 1))
+
+    return width_pix * height_pix
+
+
+def timePreview(content_type, pixels, source_bytes, seconds):
+    # Record a preview's render time, refitting the preview cost model
+    # every so often
+    global preview_timings_count
+
+    with preview_timings_lock:
+        preview_timings.append((content_type, pixels, source_bytes, seconds))
+        preview_timings_count += 1
+        refit = preview_timings_count % PREVIEW_TIMINGS_REFIT == 0
+        history = list(preview_timings) if refit else None
+
+    if refit:
+        preview_costs.train(history)
+
+
+def renderPreviewImage(data, content_type, options, key, shrink=1, speculative=False):
+    # Start timer:
+    start_time = time.time()
+
+    # Preview only: plan the size from the file header, then
+    # shrink-on-load straight to the preview size
+    source_width, source_height = sourceSize(data, content_type, options)
+    with stage("geometry"):
+        rotate, width, height, dpi = calculateSize(source_width, source_height, options)
+
+    page = options.get("page", 0) if content_type == "application/pdf" or content_type in framed_images else 0
+    scale = options.get("preview_scale", 1)
+    image = previewSource(data, rotate, width, height, page, trimBox(data, content_type, options), shrink,
+                          PREVIEW_LINEAR and content_type in supported_images, scale,
+                          sourceOrientation(data, content_type))
+    image = softProof(image, proofProfile(options))
+
+    with stage("preview_composite"):
+        image = previewPhoto(image, width, height, options["paper_width"], scale)
+
+    timestamp = writePreview(image, key, options.get("preview_format", PREVIEW_FORMAT), speculative)
+    if timestamp == None:
+        return {"error": "Superseded by a newer render"}, 409, {"Content-Type": "application/json"}
+
+    # Stop timer
+    end_time = time.time()
+    print("Rendered image in " + str(end_time - start_time) + " seconds")
+
+    width_pix, height_pix = previewSize(width, height, scale)
+    timePreview(content_type, width_pix * height_pix / shrink ** 2, len(data), end_time - start_time)
+
+    # Return body, status code, headers, size, and dpi
+    return {"image_url": "/getImage/" + timestamp, "width": width, "height": height, "dpi": dpi,
+            "plan_id": storePlan(key, options, (rotate, width, height, dpi))}, 200, {"Content-Type": "application/json"}
+
+
+def planOptions(options):
+    # Options that decide a print's geometry, without those that only
+    # say what kind of render it is or how the preview is shown
+    return {name: value for name, value in options.items()
+            if name not in ["print", "preview", "preview_scale", "preview_format", "viewport", "another_copy",
+                            "soft_proof"]}
+
+
+def printKey(key, options):
+    # Identifies a print by its upload, normalised plan and user
+    plan = planOptions(options)
+    user = (plan.pop("label", None) or {}).get("college_id")
+
+    return key + "/" + str(user) + "/" + json.dumps(plan, sort_keys=True)
+
+
+def duplicatePrint(print_key, options):
+    # The job an identical print was submitted as moments ago, unless
+    # it failed, was cancelled or another copy was asked for. Called
+    # under recent_prints_lock
+    while recent_prints:
+        job, printer_id = next(iter(recent_prints.values()))
+        if time.time() - job.created <= PRINT_DEDUP_SECONDS:
+            break
+        recent_prints.popitem(last=False)
+
+    if options.get("another_copy") or print_key not in recent_prints:
+        return None
+
+    job = recent_prints[print_key][0]
+    if job.status in ["failed", "cancelled"] or job.cancelled:
+        return None
+
+    return job
+
+
+def storePlan(key, options, plan):
+    # Remember a preview's plan, returns its id
+    plan_id = previewTag(key, planOptions(options)).strip('"')
+
+    with preview_lock:
+        render_plans[plan_id] = (key, planOptions(options), plan)
+        render_plans.move_to_end(plan_id)
+
+        while len(render_plans) > RENDER_PLANS_MAX:
+            render_plans.popitem(last=False)
+
+    indexLater("plan", plan_id, RENDER_PLANS_MAX, value=[key, planOptions(options), plan])
+
+    if sharedcache.enabled():
+        shared_cache_pool.submit(sharePlan, plan_id, [key, planOptions(options), plan])
+
+    return plan_id
+
+
+def sharePlan(plan_id, value):
+    try:
+        sharedcache.putJson("plans", plan_id + ".json", value)
+    except OSError as e:
+        print("Could not share plan " + plan_id + ": " + str(e))
+
+
+def renderPlan(plan_id, key, options):
+    # The plan a preview of this upload was rendered with, if it was
+    # planned from the same options, else None and the print plans
+    # for itself
+    with preview_lock:
+        entry = render_plans.get(plan_id)
+
+    # Planned before a restart, or on another kiosk
+    if entry == None and plan_id != None:
+        indexed = indexEntry("plan", plan_id)
+        value = indexed[0] if indexed != None else \
+            sharedcache.getJson("plans", plan_id + ".json") if sharedcache.enabled() else None
+
+        if value != None:
+            entry = (value[0], value[1], tuple(value[2]))
+
+            with preview_lock:
+                render_plans[plan_id] = entry
+
+    if entry == None or entry[0] != key or entry[1] != planOptions(options):
+        cache_misses.inc(cache="plan")
+        return None
+
+    cache_hits.inc(cache="plan")
+    return entry[2]
+
+
+def previewGeometry(data, content_type, options):
+    # What a preview's pixels depend on, planned from headers, so
+    # options that come to the same print, a 36 in specific width on
+    # 36 in paper and max size say, share one cached preview
+    geometry = {name: options.get(name) for name in ["auto_trim", "preview_scale", "preview_format"]}
+    geometry["area"] = areaBox(options)
+    geometry["proof"] = proofProfile(options)
+
+    if content_type == "application/pdf" and options.get("all_pages"):
+        page_options, plans = planPDFPages(data, options)
+        geometry["pages"] = plans
+    else:
+        geometry["page"] = options.get("page", 0) if content_type == "application/pdf" or \
+            content_type in framed_images else 0
+        geometry["plan"] = calculateSize(*sourceSize(data, content_type, options), options)
+
+    return geometry
+
+
+def previewTag(key, options):
+    # ETag for a preview of an upload with the given options
+    options = json.dumps(options, sort_keys=True)
+    return '"' + hashlib.blake2b((key + options).encode(), digest_size=16).hexdigest() + '"'
+
+
+def cachedPreview(etag):
+    # Last response for this preview, if its image hasn't been cleared
+    with preview_lock:
+        body = preview_results.get(etag)
+
+    # Rendered before a restart, while its image is still on disc
+    if body == None:
+        indexed = indexEntry("preview", etag)
+
+        if indexed != None and os.path.exists(indexed[1]):
+            body = indexed[0]
+        elif indexed != None:
+            indexRemove("preview", etag)
+
+    with preview_lock:
+        if body == None:
+            cache_misses.inc(cache="preview")
+            return None
+
+        preview_results[etag] = body
+
+        if not previewExists(body["image_url"].split("/")[-1]):
+            del preview_results[etag]
+            cache_misses.inc(cache="preview")
+            return None
+
+        preview_results.move_to_end(etag)
+        cache_hits.inc(cache="preview")
+        return body
+
+
+def storePreview(etag, body):
+    with preview_lock:
+        preview_results[etag] = body
+
+        while len(preview_results) > PREVIEW_RESULTS_MAX:
+            preview_results.popitem(last=False)
+            cache_evictions.inc(cache="preview")
+
+    if cache_index != None and body.get("image_url"):
+        cache_index_pool.submit(indexPreview, etag, body)
+
+
+def indexPreview(etag, body):
+    # Write a preview's image to the cache dir, unless it has spilled
+    # there already, and index it so it's served after a restart
+    timestamp = body["image_url"].split("/")[-1]
+    path = previewFile(timestamp)
+    buffer = previewImage(timestamp)
+
+    try:
+        if buffer != None and not os.path.exists(path):
+            with open(path + ".part", "wb") as f:
+                f.write(buffer)
+            os.replace(path + ".part", path)
+    except OSError as e:
+        print("Could not keep preview " + timestamp + ": " + str(e))
+        return
+
+    if not os.path.exists(path):
+        return
+
+    indexPut("preview", etag, PREVIEW_RESULTS_MAX, value=body, path=path)
+
+
+def indexLater(kind, key, count, **entry):
+    # Index an entry on the index thread, see indexPut
+    if cache_index != None:
+        cache_index_pool.submit(indexPut, kind, key, count, **entry)
+
+
+def indexPut(kind, key, count=None, total=None, **entry):
+    # Index an entry, then forget the oldest of its kind past count of
+    # them or total bytes of files, removing their files. A file that can't
+    # be removed yet, mapped on Windows, is kept as the oldest to go on
+    # the next pass
+    if cache_index == None:
+        return
+
+    try:
+        cache_index.put(kind, key, **entry)
+
+        for old_key, path, size in cache_index.trim(kind, count, total):
+            try:
+                if path != None:
+                    os.remove(path)
+            except FileNotFoundError:
+                pass
+            except OSError:
+                cache_index.put(kind, old_key, path=path, bytes=size, used=0)
+    except sqlite3.Error as e:
+        print("Could not index " + kind + " " + key + ": " + str(e))
+
+
+def indexEntry(kind, key):
+    # (value, path) the index holds for key, or None
+    if cache_index == None:
+        return None
+
+    try:
+        return cache_index.get(kind, key)
+    except sqlite3.Error as e:
+        print("Could not read the cache index: " + str(e))
+        return None
+
+
+def indexRemove(kind, key):
+    if cache_index == None:
+        return
+
+    try:
+        cache_index.remove(kind, key)
+    except sqlite3.Error as e:
+        print("Could not update the cache index: " + str(e))
+
+
+def coalescePreview(key):
+    # Wait out the coalescing window, returns False if a newer preview
+    # request for the same upload came in while waiting
+    with preview_lock:
+        generation = preview_generations.get(key, 0) + 1
+        preview_generations[key] = generation
+
+    time.sleep(PREVIEW_COALESCE_SECONDS)
+
+    with preview_lock:
+        return preview_generations.get(key) == generation
+
+
+def writePreview(image, key, format=PREVIEW_FORMAT, speculative=False):
+    # Encode a preview into the preview store under a timestamp
+    # Returns the timestamp, or None if a newer preview of the same
+    # upload killed this one before it finished. Speculative previews
+    # don't hold up prints, and only cancelWarming kills them
+    timestamp = str(time.time())
+    #replace the decimal
+    timestamp = timestamp.replace(".", "_") + "." + format
+
+    if speculative:
+        key = WARM_RENDER
+
+    # Kill the pipeline of any earlier preview of this upload, its
+    # threadpool stops at the next tile
+    with preview_lock:
+        previous = preview_renders.get(key)
+        if previous != None:
+            previous.set_kill(True)
+        preview_renders[key] = image
+
+    try:
+        with previewPriority() if not speculative else contextlib.nullcontext(), stage("preview_encode"):
+            buffer = encodePreview(image, format, mockup=True)
+    except pyvips.Error:
+        with preview_lock:
+            superseded = preview_renders.get(key) is not image
+
+        if not superseded:
+            raise
+
+        return None
+    finally:
+        with preview_lock:
+            if preview_renders.get(key) is image:
+                del preview_renders[key]
+
+    storePreviewImage(timestamp, buffer)
+
+    return timestamp
+
+
+def printUpload(data, content_type, options, key, job=None, printer=None, plan=None):
+    # Render an upload at full resolution and send it to the printer,
+    # the first selected one unless routed elsewhere. plan is the
+    # (rotate, width, height, dpi) of the preview it was made from
+    if printer == None:
+        printer = printers.selected()[0]
+
+    if pdfPassthrough(content_type, options, printer):
+        with tracing.span("print_vector", printer=printer["id"]):
+            return printVector(data, options, job, printer)
+
+    passthrough = filePassthrough(data, content_type, options, printer, plan)
+    if passthrough != None:
+        with tracing.span("print_file", printer=printer["id"]):
+            result = printFile(data, content_type, passthrough, job, printer)
+
+        if result != None:
+            return result
+
+    with readinessTurn(printer, job):
+        if workers.WORKERS and not WORKER_MODE:
+            try:
+                return remotePrint(data, content_type, options, key or uploadHash(data), job, printer, plan)
+            except (OSError, ValueError, workers.WorkerError) as error:
+                print("Render worker failed, rendering here: " + str(error))
+
+        # The rehearsal holds its own admission while it renders, so
+        # it's claimed before the print takes one. Waiting for it under
+        # the print's reservation could leave neither fitting the limit
+        rehearsal = None
+        if not (content_type == "application/pdf" and options.get("all_pages")):
+            rehearsal = claimRehearsal(data, content_type, options, key, presetPrinter(printer, options), job, plan)
+
+        if job != None and job.cancelled:
+            raise Exception("Print cancelled")
+
+        with tracing.span("print", content_type=content_type, printer=printer["id"]), profiling.labelled("print"), \
+             renderAdmission(renderEstimate(data, content_type, options, key), job), \
+             jobUsage(job, content_type):
+            return printAdmitted(data, content_type, options, key, job, printer, plan, rehearsal)
+
+
+def remotePrint(data, content_type, options, key, job, printer, plan=None):
+    # Render a print on the upload's worker and hand off the spool files
+    # it sends back from here
+    worker, spilled = workers.pick(key)
+    directory = spoolDirectory(job)
+
+    try:
+        if splitsAcrossWorkers(data, content_type, options, plan):
+            return splitPrint(data, content_type, options, key, job, printer, plan, directory)
+
+        worker_renders.inc(worker=worker, spilled="1" if spilled else "0")
+
+        with tracing.span("print_remote", worker=worker, printer=printer["id"], spilled=spilled):
+            manifest = workers.render(worker, key, data, content_type,
+                                      {"options": options, "printer": printer["id"], "plan": plan}, directory)
+    except:
+        # A local retry makes the job's spool directory afresh
+        shutil.rmtree(directory, ignore_errors=True)
+        raise
+
+    for handoff in manifest["handoffs"]:
+        handOff(printer, handoff["width"], handoff["height"],
+                [os.path.join(directory, name) for name in handoff["files"]], handoff["flags"], job)
+
+    return dict(manifest["result"], worker=worker)
+
+
+def splitsAcrossWorkers(data, content_type, options, plan=None):
+    # Whether a print is long enough to render in bands across every
+    # worker. Only one banded spool can be split, not batches or panels
+    if PRINT_BACKEND != "direct" or len(workers.WORKERS) < 2 or options.get("panels") or \
+            (content_type == "application/pdf" and options.get("all_pages")):
+        return False
+
+    if plan == None:
+        plan = calculateSize(*sourceSize(data, content_type, options), options)
+
+    return plan[2] >= workers.SPLIT_INCHES
+
+
+def splitPrint(data, content_type, options, key, job, printer, plan, directory):
+    # Render a share of a print's bands on each worker at once, every
+    # worker running the same plan and only writing its own rows, then
+    # put the bands back in order in one manifest
+    ranked = workers.ranked(key)
+
+    def renderShare(index):
+        share_directory = os.path.join(directory, "share-" + str(index))
+        os.makedirs(share_directory)
+
+        with tracing.span("print_remote", worker=ranked[index], printer=printer["id"], share=index):
+            manifest = workers.render(ranked[index], key, data, content_type,
+                                      {"options": options, "printer": printer["id"], "plan": plan,
+                                       "band_share": [index, len(ranked)]}, share_directory)
+
+        return share_directory, manifest
+
+    with concurrent.futures.ThreadPoolExecutor(max_workers=len(ranked)) as pool:
+        shares = list(pool.map(renderShare, range(len(ranked))))
+
+    bands = []
+    for share_directory, manifest in shares:
+        with open(os.path.join(share_directory, "output.json")) as f:
+            spool = json.load(f)
+
+        for band in spool["bands"]:
+            os.replace(os.path.join(share_directory, band["file"]), os.path.join(directory, band["file"]))
+            bands.append(band)
+
+        shutil.rmtree(share_directory, ignore_errors=True)
+
+    spool["bands"] = sorted(bands, key=lambda band: band["top"])
+    if sum(band["height"] for band in bands) != spool["height_pixels"]:
+        raise workers.WorkerError("Bands missing from the split print")
+
+    with open(os.path.join(directory, "output.json"), "w") as f:
+        json.dump(spool, f)
+
+    handoff = shares[0][1]["handoffs"][0]
+    handOff(printer, handoff["width"], handoff["height"], [os.path.join(directory, "output.json")], handoff["flags"],
+            job)
+
+    return dict(shares[0][1]["result"], worker=ranked)
+
+
+def renderPixels(data, content_type, options, plan=None):
+    # Pixels a print renders at, all its pages, from headers alone
+    if content_type == "application/pdf" and options.get("all_pages"):
+        plans = planPDFPages(data, options)[1]
+    else:
+        plans = [plan if plan != None else calculateSize(*sourceSize(data, content_type, options), options)]
+
+    cap = optionsPreset(options)["max_dpi"] or math.inf
+
+    return int(sum(width * min(dpi, cap) * height * min(dpi, cap) for rotate, width, height, dpi in plans))
+
+
+def timedPrint(data, content_type, options, key, job, printer, plan, pixels):
+    # Print, then record how long the render took up to its hand-off and
+    # train the cost model on it. Vector and remote renders don't say
+    # how long this machine takes
+    start = time.time()
+    result = printUpload(data, content_type, options, key, job, printer, plan)
+
+    if pixels and "worker" not in result:
+        try:
+            print_log.appendCost(job.id, content_type, pixels, len(data), (job.rendered or time.time()) - start)
+            render_costs.train(print_log.costHistory())
+        except sqlite3.Error as e:
+            print("Could not log render cost: " + str(e))
+
+    return result
+
+
+def pdfPassthrough(content_type, options, printer):
+    # Whether a print can skip rasterising: one pdf page with nothing
+    # that needs its pixels, no trim or area and no paper profile to
+    # convert to
+    return PDF_PASSTHROUGH and content_type == "application/pdf" and not options.get("all_pages") and \
+        not options.get("auto_trim") and areaBox(options) == None and printer["icc_profile"] == None
+
+
+def filePassthrough(data, content_type, options, printer, plan=None):
+    # The (rotate, width, height, dpi, transform) plan a jpeg or tiff
+    # prints at when printing it would leave its pixels as they are,
+    # else None: nothing trims, labels, splits or colour manages it,
+    # it's plain 8-bit sRGB or grey and it spools at its own pixel
+    # size, taking a header and no decode to find out. It's stored
+    # upright and uncropped, or it's a jpeg jpegtran turns and crops
+    # exactly, when transform is its (turns, flip, box)
+    lossless = content_type == "image/jpeg" and jpegtransform.enabled()
+
+    if not FILE_PASSTHROUGH or PRINT_BACKEND != "wizard" or content_type not in FILE_PASSTHROUGH_TYPES or \
+            options.get("auto_trim") or (areaBox(options) != None and not lossless) or \
+            (PRINT_LABEL and isinstance(options.get("label"), dict)):
+        return None
+
+    printer = presetPrinter(printer, options)
+    if printer["icc_profile"] != None:
+        return None
+
+    try:
+        header = pyvips.Image.new_from_buffer(data, "")
+    except pyvips.Error:
+        return None
+
+    if header.format != "uchar" or header.hasalpha() or header.interpretation not in ["srgb", "b-w"] or \
+            header.bands not in [1, 3] or (imageOrientation(header) != 1 and not lossless) or \
+            header.get_typeof("icc-profile-data") != 0 or \
+            (header.get_typeof("n-pages") != 0 and header.get("n-pages") > 1):
+        return None
+
+    rotate, width, height, dpi = plan if plan != None else \
+        calculateSize(*sourceSize(data, content_type, options), options)
+
+    if (rotate and not lossless) or (options.get("panels") and width > printer["max_width"]):
+        return None
+
+    turns, flip = uprightTurns(imageOrientation(header), rotate)
+    transform = None
+    image = header
+
+    if turns or flip or areaBox(options) != None:
+        mcu = jpegtransform.mcuSize(data)
+        if mcu == None or not jpegtransform.exact(header.width, header.height, mcu, turns, flip):
+            return None
+
+        # The area grows out to whole MCUs, a few pixels at most
+        box = trimBox(data, content_type, options)
+        if box != None:
+            box = jpegtransform.snappedBox(trimPixels(header.width, header.height, box), header.width, header.height,
+                                           mcu)
+            image = header.crop(*box)
+
+        transform = turns, flip, box
+
+    # Both sides given can stretch it
+    turned_width, turned_height = (image.height, image.width) if turns % 2 else (image.width, image.height)
+    if abs(width / height - turned_width / turned_height) > 0.005 * turned_width / turned_height:
+        return None
+
+    scale, spool_dpi = spoolScale(image, width, dpi, printer, rotate)
+    if abs(scale - 1) > 0.001:
+        return None
+
+    return rotate, width, height, spool_dpi, transform
+
+
+def printFile(data, content_type, plan, job, printer):
+    # Hand the wizard the upload itself, a jpeg turned and cropped
+    # losslessly when it needs to be and with its JFIF density set to
+    # the dpi it prints at. None when the transform fails and the
+    # upload renders as usual
+    rotate, width, height, dpi, transform = plan
+
+    if transform != None:
+        with stage("lossless_transform"):
+            data = jpegtransform.transform(data, *transform)
+
+        if data == None:
+            return None
+
+    directory = spoolDirectory(job)
+
+    if content_type == "image/jpeg":
+        data = jfifDensity(data, dpi)
+
+    filename = os.path.join(directory, "output." + FILE_PASSTHROUGH_TYPES[content_type])
+    with open(filename, "wb") as f:
+        f.write(data)
+
+    handOff(printer, width, height, [filename], job=job)
+
+    return {"width": width, "height": height, "dpi": dpi, "printer": printer["id"]}
+
+
+def jfifDensity(data, dpi):
+    # data with its JFIF header's density set to dpi, or as it is when
+    # it starts without one
+    if data[2:4] != b"\xff\xe0" or data[6:11] != b"JFIF\x00":
+        return data
+
+    density = max(1, min(65535, round(dpi)))
+
+    return data[:13] + bytes([1]) + density.to_bytes(2, "big") * 2 + data[18:]
+
+
+def printVector(data, options, job, printer):
+    # Spool a pdf page as vector, sized by the same planner as rasters
+    directory = spoolDirectory(job)
+
+    rotate, width, height, dpi = calculateSize(*sourceSize(data, "application/pdf", options), options)
+
+    with open(os.path.join(directory, "source.pdf"), "wb") as f:
+        f.write(data)
+
+    manifest = {"pdf": "source.pdf", "page": options.get("page", 0), "width_inches": width, "height_inches": height,
+                "rotate": rotate}
+    with open(os.path.join(directory, "output.json"), "w") as f:
+        json.dump(manifest, f)
+
+    handOff(printer, width, height, [os.path.join(directory, "output.json")], ["--vector"], job)
+
+    return {"width": width, "height": height, "dpi": dpi, "printer": printer["id"]}
+
+
+def printAdmitted(data, content_type, options, key, job, printer, plan=None, rehearsal=None):
+    # Print render once it has been admitted under the memory limit,
+    # from its claimed rehearsal when there is one
+    start_time = time.time()
+
+    printer = presetPrinter(printer, options)
+
+    directory = spoolDirectory(job)
+
+    if content_type == "application/pdf" and options.get("all_pages"):
+        page_options, plans = planPDFPages(data, options, skip_blank=True)
+
+        pages = []
+        for page, (rotate, width, height, dpi) in zip(page_options, plans):
+            image, streamed = loadPrintSource(data, "application/pdf", page, key)
+            image = greyForPrint(image, data, "application/pdf", page, printer)
+            image, spool_dpi = fitForPrint(image, width, dpi, printer, rotate, streamed,
+                                           hard_edged=hardEdged(data, "application/pdf", page))
+            image = labelForPrint(image, options, spool_dpi, printer)
+            pages.append((image, width, height, spool_dpi))
+
+        printBatch(pages, directory, job, printer)
+
+        rotate, width, height, dpi = plans[0]
+    else:
+        if rehearsal != None:
+            image, (rotate, width, height, dpi), spool_dpi, landscape = rehearsal["print"]
+        else:
+            image, (rotate, width, height, dpi), spool_dpi, landscape = fittedPrint(data, content_type, options, key,
+                                                                                      printer, plan)
+
+        image = labelForPrint(image, options, spool_dpi, printer)
+        image = markRevision(image, key, options, printer)
+
+        if job != None and height >= CHECKPOINT_INCHES:
+            checkpointJob(directory, data, content_type, options, printer, (rotate, width, height, dpi))
+
+        try:
+            if options.get("panels") and width > printer["max_width"]:
+                printBatch(panelise(image, width, height, spool_dpi, printer), directory, job, printer)
+            else:
+                printPhoto(image, width, height, spool_dpi, directory, job, printer, landscape)
+        finally:
+            # Only a crash leaves the checkpoint behind
+            for name in (CHECKPOINT_MANIFEST, "upload"):
+                with contextlib.suppress(FileNotFoundError):
+                    os.remove(os.path.join(directory, name))
+
+            if rehearsal != None:
+                shutil.rmtree(rehearsal["directory"], ignore_errors=True)
+
+    print("Rendered print in " + str(time.time() - start_time) + " seconds")
+
+    return {"width": width, "height": height, "dpi": dpi, "printer": printer["id"]}
+
+
+def fittedPrint(data, content_type, options, key, printer, plan=None):
+    # A print loaded, planned and resampled to spool, all but its
+    # label. Returns the image, its (rotate, width, height, dpi) plan,
+    # the dpi it spools at and whether the driver turns it
+    image, streamed = loadPrintSource(data, content_type, options, key)
+    image = greyForPrint(image, data, content_type, options, printer)
+
+    if plan != None:
+        rotate, width, height, dpi = plan
+    else:
+        with stage("geometry"):
+            rotate, width, height, dpi = calculateSize(*uprightSize(image), options)
+
+    landscape = driverTurns(options, rotate, width, printer)
+
+    image, spool_dpi = fitForPrint(image, width, dpi, printer, rotate, streamed, not landscape,
+                                   hardEdged(data, content_type, options))
+
+    return image, (rotate, width, height, dpi), spool_dpi, landscape
+
+
+def startRehearsal(data, content_type, options, key, plan=None):
+    # Start rendering a print to its label at low priority, cancelling
+    # any other rehearsal. Returns the rehearsal's id, or None for
+    # prints that don't render here: vector pdfs, pdfs of all pages
+    # and prints sent to render workers
+    printer = presetPrinter(printers.route(printers.selected(), options["paper_width"], printerLoad), options)
+
+    if not PRINT_REHEARSAL or key == None or pdfPassthrough(content_type, options, printer) or \
+            filePassthrough(data, content_type, options, printer, plan) != None or \
+            (content_type == "application/pdf" and options.get("all_pages")) or (workers.WORKERS and not WORKER_MODE):
+        return None
+
+    revision = revisionKey(key, options, printer)
+    rehearsal_id = hashlib.blake2b(revision.encode(), digest_size=16).hexdigest()
+
+    with rehearsals_lock:
+        if revision in rehearsals:
+            return rehearsal_id
+
+    cancelRehearsal()
+
+    rehearsal = {"id": rehearsal_id, "done": threading.Event(), "cancelled": False, "print": None,
+                 "directory": spoolDirectory(None)}
+
+    with rehearsals_lock:
+        rehearsals[revision] = rehearsal
+
+    rehearsal_pool.submit(rehearse, rehearsal, data, content_type, options, key, printer, plan)
+
+    return rehearsal_id
+
+
+def rehearse(rehearsal, data, content_type, options, key, printer, plan):
+    # Write a print's fitted image to a .v file in the rehearsal's
+    # directory, which the print maps back. Gives way to previews, and
+    # stops when cancelled
+    try:
+        if rehearsal["cancelled"]:
+            return
+
+        with tracing.span("rehearsal", content_type=content_type, printer=printer["id"]), \
+                renderAdmission(renderEstimate(data, content_type, options, key)):
+            image, plan, spool_dpi, landscape = fittedPrint(data, content_type, options, key, printer, plan)
+
+            filename = os.path.join(rehearsal["directory"], "fitted.v")
+            watchProgress(image, lambda percent, eta: not rehearsal["cancelled"])
+
+            with stage("rehearsal_write"):
+                image.write_to_file(filename)
+
+        rehearsal["print"] = (pyvips.Image.new_from_file(filename), plan, spool_dpi, landscape)
+    except Exception as e:
+        if not rehearsal["cancelled"]:
+            print("Print rehearsal failed: " + str(e))
+    finally:
+        rehearsal["done"].set()
+
+        if rehearsal["cancelled"] or rehearsal["print"] == None:
+            shutil.rmtree(rehearsal["directory"], ignore_errors=True)
+
+
+def claimRehearsal(data, content_type, options, key, printer, job=None, plan=None):
+    # The rehearsal of this print, waiting for it to finish when it's
+    # still rendering, or None when there isn't one or it failed. The
+    # wait ends, cancelling the rehearsal, when the job is cancelled or
+    # once it's been as long as rendering the print directly would take
+    if key == None:
+        return None
+
+    with rehearsals_lock:
+        rehearsal = rehearsals.pop(revisionKey(key, options, printer), None)
+
+    # Any other is for a print that isn't coming
+    cancelRehearsal()
+
+    if rehearsal == None:
+        cache_misses.inc(cache="rehearsal")
+        return None
+
+    with stage("rehearsal_wait"):
+        deadline = None
+
+        while not rehearsal["done"].wait(1):
+            if deadline == None:
+                pixels = renderPixels(data, content_type, options, plan)
+                deadline = time.time() + render_costs.predict(content_type, pixels, len(data))
+
+            if (job != None and job.cancelled) or time.time() >= deadline:
+                rehearsal["cancelled"] = True
+                cache_misses.inc(cache="rehearsal")
+                return None
+
+    if rehearsal["print"] == None:
+        cache_misses.inc(cache="rehearsal")
+        return None
+
+    cache_hits.inc(cache="rehearsal")
+    return rehearsal
+
+
+def cancelRehearsal(rehearsal_id=None):
+    # Drop the rehearsal with this id, or any, killing its render
+    with rehearsals_lock:
+        for revision, rehearsal in list(rehearsals.items()):
+            if rehearsal_id == None or rehearsal["id"] == rehearsal_id:
+                del rehearsals[revision]
+                rehearsal["cancelled"] = True
+
+                # A finished one isn't written any more, clear it here
+                if rehearsal["done"].is_set():
+                    shutil.rmtree(rehearsal["directory"], ignore_errors=True)
+
+
+def greyForPrint(image, data, content_type, options, printer):
+    # Drop a grey upload to one band straight after loading, so every
+    # later stage handles a third of the pixels, and mark line art to
+    # spool as 1-bit. See PRINT_GREY
+    if not PRINT_GREY or printer["icc_profile"] != None:
+        return image
+
+    page = options.get("page", 0) if content_type == "application/pdf" or content_type in framed_images else 0
+    statistics = imageStatistics(data, page)
+
+    if not statistics["grey"]:
+        return image
+
+    if image.hasalpha():
+        image = image.flatten(background=paperWhite(image))
+
+    image = image.colourspace("grey16" if image.format == "ushort" else "b-w")
+
+    if PRINT_BILEVEL and statistics["bilevel"]:
+        image = image.copy()
+        image.set_type(pyvips.GValue.gint_type, "blueprint-bilevel", 1)
+
+    return image
+
+
+def driverTurns(options, rotate, width, printer):
+    # Whether a print that needs turning can spool unturned on a
+    # landscape page, for the driver to turn as it rasterises instead
+    # of a rot90 over every pixel here. Only the direct backend sets
+    # the page orientation, and labels and panels are laid out on the
+    # turned print
+    return rotate and PRINT_BACKEND == "direct" and printer["driver_rotates"] and \
+        not (options.get("panels") and width > printer["max_width"]) and \
+        not (PRINT_LABEL and isinstance(options.get("label"), dict))
+
+
+def panelLayout(width, max_width):
+    # Number of panels a print width inches wide splits into and the
+    # width of each, the panels overlapping by PANEL_OVERLAP_INCHES
+    overlap = min(PANEL_OVERLAP_INCHES, max_width / 2)
+    count = max(1, math.ceil((width - overlap) / (max_width - overlap)))
+
+    return count, (width + (count - 1) * overlap) / count, overlap
+
+
+def panelise(image, width, height, dpi, printer):
+    # Split an oversized print into overlapping panels, each a crop of
+    # the same lazy pipeline, so the panels spool concurrently and the
+    # full print is never held. Returns pages for printBatch
+    count, panel_width, overlap = panelLayout(width, printer["max_width"])
+    pixels_per_inch = image.width / width
+
+    image = toSpool(image, printer["spool_depth"])
+
+    # Registration crosses top and bottom of every seam, a small mask
+    # of one laid lazily over the areas under them, so the foot of a
+    # source streaming top to bottom isn't read before the panels are
+    mark = max(8, round(PANEL_MARK_INCHES * pixels_per_inch))
+    line = max(1, mark // 16)
+    cross = pyvips.Image.black(mark, mark).copy_memory()
+    cross = cross.draw_rect(255, 0, mark // 2 - line // 2, mark, line, fill=True)
+    cross = cross.draw_rect(255, mark // 2 - line // 2, 0, line, mark, fill=True)
+
+    for seam in range(1, count):
+        centre = round((seam * (panel_width - overlap) + overlap / 2) * pixels_per_inch)
+
+        for top in [mark, image.height - 2 * mark]:
+            left = min(max(0, centre - mark // 2), image.width - mark)
+            top = min(max(0, top), image.height - mark)
+
+            area = cross.ifthenelse([0] * image.bands, image.crop(left, top, mark, mark))
+            image = image.insert(area, left, top)
+
+    pages = []
+    for i in range(count):
+        left = round(i * (panel_width - overlap) * pixels_per_inch)
+        panel = image.crop(left, 0, min(round(panel_width * pixels_per_inch), image.width - left), image.height)
+
+        pages.append((panel, math.ceil(panel_width), height, dpi))
+
+    print("Split " + str(width) + " inch print into " + str(count) + " panels of " + str(round(panel_width, 2)) + " inches")
+
+    return pages
+
+
+def labelForPrint(image, options, dpi, printer):
+    # Stamp the print bottom left with the user and file name from
+    # options["label"] and the time it was printed. Only
+    # the small area under the label is computed and inserted back, the
+    # rest of the print streams past untouched
+    label = options.get("label")
+    if not PRINT_LABEL or not isinstance(label, dict):
+        return image
+
+    # Stamped with the server's clock, to the minute so one label
+    # serves every print sent that minute
+    fields = [label.get("college_id"), time.strftime("%Y-%m-%d %H:%M"), label.get("file_name")]
+    text = "  ".join(str(field) for field in fields if field)
+
+    mask = labelMask(text, LABEL_FONT, round(dpi))
+    margin = round(LABEL_MARGIN_INCHES * dpi)
+    if mask.width + margin > image.width or mask.height + margin > image.height:
+        return image
+
+    image = toSpool(image, printer["spool_depth"])
+
+    left = margin
+    top = image.height - margin - mask.height
+
+    # Black text on a white backing so it reads over any print. The
+    # backing is made, not read from the print, so a source streaming
+    # top to bottom isn't read at its foot before the spool starts
+    with stage("label"):
+        white = paperWhite(image)
+        area = (pyvips.Image.black(mask.width, mask.height, bands=image.bands) + white) \
+            .cast(image.format).copy(interpretation=image.interpretation)
+        area = mask.ifthenelse([0] * area.bands, area, blend=True)
+        image = image.insert(area, left, top)
+
+    # The rows the label covers, the only ones that differ between
+    # prints of a revision, see writeBands
+    image = image.copy()
+    image.set_type(pyvips.GValue.gint_type, "blueprint-label-top", top)
+    image.set_type(pyvips.GValue.gint_type, "blueprint-label-height", mask.height)
+
+    return image
+
+
+def markRevision(image, key, options, printer):
+    # Tag a print with its revision: the upload, the printer and every
+    # option but the label. Prints of one revision match outside their
+    # labels
+    if key == None:
+        return image
+
+    image = image.copy()
+    image.set_type(pyvips.GValue.gstr_type, "blueprint-revision", revisionKey(key, options, printer))
+
+    return image
+
+
+def revisionKey(key, options, printer):
+    plan = planOptions(options)
+    plan.pop("label", None)
+
+    return printKey(key, dict(plan, printer=printer["id"]))
+
+
+def labelRows(image):
+    # (top, height) of the label stamped on a print, or None
+    if image.get_typeof("blueprint-label-top") == 0:
+        return None
+
+    return image.get("blueprint-label-top"), image.get("blueprint-label-height")
+
+
+def labelMask(text, font, dpi):
+    # Text rendered by pango as a one band mask, with a little padding,
+    # rendered once for each (text, font, dpi)
+    key = (text, font, dpi)
+
+    with label_cache_lock:
+        if key in label_cache:
+            label_cache.move_to_end(key)
+            cache_hits.inc(cache="label")
+            return label_cache[key]
+
+    cache_misses.inc(cache="label")
+
+    # text is pango markup, file names mustn't be read as tags
+    mask = pyvips.Image.text(str(escape(text)), font=font, dpi=dpi)
+    padding = max(1, dpi // 24)
+    mask = mask.embed(padding, padding, mask.width + 2 * padding, mask.height + 2 * padding).copy_memory()
+
+    with label_cache_lock:
+        label_cache[key] = mask
+
+        while len(label_cache) > LABEL_CACHE_MAX:
+            label_cache.popitem(last=False)
+
+    return mask
+
+
+def optionsPreset(options):
+    # The render preset a print asks for, standard for anything else
+    return PRINT_PRESETS.get(options.get("quality"), PRINT_PRESETS["standard"])
+
+
+def presetPrinter(printer, options):
+    # The printer as a print of the options' preset renders for it: its
+    # paper profile, sharpening and spool depth dropped where the
+    # preset does without, and the preset along for the resamples and
+    # spool write, see printPreset
+    preset = optionsPreset(options)
+
+    return dict(printer, preset=options.get("quality") if options.get("quality") in PRINT_PRESETS else "standard",
+                icc_profile=printer["icc_profile"] if preset["colour_managed"] else None,
+                sharpen_sigma=printer["sharpen_sigma"] if preset["sharpen"] else 0,
+                spool_depth=preset["spool_depth"] or printer["spool_depth"])
+
+
+def printPreset(printer):
+    # Render preset a print for printer is rendering with
+    if printer == None:
+        return PRINT_PRESETS["standard"]
+
+    return PRINT_PRESETS[printer.get("preset", "standard")]
+
+
+def fitForPrint(image, width, dpi, printer, rotate=False, streamed=False, turn=True, hard_edged=False):
+    # The one resample a print gets before spooling, and its turn to
+    # print orientation when rotate is set. With turn unset a rotated
+    # print is sized for its turned width but left for the driver to
+    # turn. hard_edged sources enlarge with nearest, see hardEdged.
+    # Returns the image and the dpi it now prints at
+    source_dpi = turnedWidth(image, rotate) / width if width > 0 else 0
+
+    if PRINT_NATIVE_PIXELS and source_dpi > 0 and nativeDPI(image, width, printer, rotate) > source_dpi:
+        # Its own pixels at the exact dpi that spans width, rather than
+        # the whole dpi calculateSize rounds down to
+        return turnForPrint(image, rotate and turn, 1, lambda image: image, streamed), source_dpi
+
+    if not PRINT_DEVICE_GRID:
+        return upscaleForPrint(image, dpi, printer, rotate and turn, streamed, hard_edged)
+
+    # Snap to the device grid: width inches at native dpi, the height
+    # following the image's aspect. A preset's dpi cap makes its own
+    # grid for the driver to scale
+    native_dpi = min(printer["native_dpi"], printPreset(printer)["max_dpi"] or math.inf)
+    scale = width * native_dpi / turnedWidth(image, rotate)
+
+    def resample(image):
+        if abs(scale - 1) <= 0.001:
+            return image
+
+        with stage("device_grid"):
+            return resampleForPrint(image, scale, printer, hard_edged)
+
+    return turnForPrint(image, rotate and turn, scale, resample, streamed), native_dpi
+
+
+def spoolScale(image, width, dpi, printer, rotate=False):
+    # The scale fitForPrint resamples a print by and the dpi it then
+    # spools at, from the image's size alone
+    source_dpi = turnedWidth(image, rotate) / width if width > 0 else 0
+
+    if PRINT_NATIVE_PIXELS and source_dpi > 0 and nativeDPI(image, width, printer, rotate) > source_dpi:
+        return 1, source_dpi
+
+    if PRINT_DEVICE_GRID:
+        native_dpi = min(printer["native_dpi"], printPreset(printer)["max_dpi"] or math.inf)
+        return width * native_dpi / turnedWidth(image, rotate), native_dpi
+
+    cap = printPreset(printer)["max_dpi"] or math.inf
+    if dpi > cap:
+        return cap / dpi, cap
+
+    if PRINT_UPSCALE_DPI <= 0 or dpi <= 0 or dpi >= PRINT_UPSCALE_DPI:
+        return 1, dpi
+
+    target = min(PRINT_UPSCALE_DPI, PRINTER_NATIVE_DPI, cap)
+    return target / dpi, target
+
+
+def nativeDPI(image, width, printer, rotate=False):
+    # dpi fitForPrint takes a print width inches wide to: the device
+    # grid or the upscale target, or where neither enlarges, its own
+    if PRINT_DEVICE_GRID:
+        return min(printer["native_dpi"], printPreset(printer)["max_dpi"] or math.inf)
+
+    dpi = turnedWidth(image, rotate) / width
+    if PRINT_UPSCALE_DPI <= 0 or dpi >= PRINT_UPSCALE_DPI:
+        return dpi
+
+    return min(PRINT_UPSCALE_DPI, PRINTER_NATIVE_DPI, printPreset(printer)["max_dpi"] or math.inf)
+
+
+def upscaleForPrint(image, dpi, printer=None, rotate=False, streamed=False, hard_edged=False):
+    # Enlarge low resolution prints on the server with vips' vectorised
+    # resize, rather than leaving the driver to scale them on one
+    # thread. Prints over their preset's dpi cap are reduced to it.
+    # Returns the image and the dpi it now prints at
+    cap = printPreset(printer)["max_dpi"] or math.inf
+
+    if dpi > cap:
+        def reduce(image):
+            with stage("preset_reduce"):
+                return resampleForPrint(image, cap / dpi, printer, hard_edged)
+
+        return turnForPrint(image, rotate, cap / dpi, reduce, streamed), cap
+
+    if PRINT_UPSCALE_DPI <= 0 or dpi <= 0 or dpi >= PRINT_UPSCALE_DPI:
+        return turnForPrint(image, rotate, 1, lambda image: image, streamed), dpi
+
+    target = min(PRINT_UPSCALE_DPI, PRINTER_NATIVE_DPI, cap)
+
+    def resample(image):
+        with stage("upscale"):
+            return resampleForPrint(image, target / dpi, printer, hard_edged)
+
+    return turnForPrint(image, rotate, target / dpi, resample, streamed), target
+
+
+def turnForPrint(image, rotate, scale, resample, streamed=False):
+    # Resample a print by scale and turn it upright and to print
+    # orientation, in whichever order turns fewer pixels. The resample
+    # scales both axes alike, so it commutes with the turn: a print
+    # that shrinks is shrunk before it's turned and one that grows is
+    # turned first. A streamed source is buffered on disc to be turned,
+    # so a shrink first also makes that buffer smaller
+    if scale < 1:
+        image = resample(image)
+
+    orientation = imageOrientation(image)
+
+    # A flip alone reads rows in order, turns need the buffer
+    if streamed and uprightTurns(orientation, rotate)[0]:
+        with stage("decode"):
+            image = transposeBuffer(image)
+
+    image = orient(image, orientation, rotate)
+
+    if scale >= 1:
+        image = resample(image)
+
+    return image
+
+
+def turnedWidth(image, rotate):
+    # Width a loaded print will have once turnForPrint turns it
+    return image.height if uprightTurns(imageOrientation(image), rotate)[0] % 2 else image.width
+
+
+def resampleForPrint(image, scale, printer=None, hard_edged=False):
+    # Resize for print with a kernel chosen for the content: lanczos3
+    # to reduce, nearest to enlarge hard_edged art and the configured
+    # interpolator or kernel to enlarge photos, sharpened for the
+    # printer's media. The print's preset can swap any of them
+    preset = printPreset(printer)
+
+    if scale < 1:
+        return image.resize(scale, kernel=preset["reduce_kernel"])
+
+    if hard_edged:
+        return image.resize(scale, kernel="nearest")
+
+    enlarge_interpolator = preset["enlarge_interpolator"] or \
+        (PRINT_ENLARGE_INTERPOLATOR if preset["enlarge_kernel"] == None else None)
+
+    if enlarge_interpolator:
+        image = image.affine([scale, 0, 0, scale], interpolate=interpolator(enlarge_interpolator))
+    else:
+        image = image.resize(scale, kernel=preset["enlarge_kernel"] or PRINT_UPSCALE_KERNEL)
+
+    return outputSharpen(image, printer)
+
+
+def outputSharpen(image, printer):
+    # Unsharp mask on lightness after the enlargement. vips runs it on
+    # each resized tile while it's still in the threadpool's buffers,
+    # so it adds no pass over the full resolution image
+    if printer == None or printer["sharpen_sigma"] <= 0:
+        return image
+
+    # sharpen goes through LabS and back, which needs an RGB or grey
+    # source, CMYK prints go to the driver unsharpened
+    if image.interpretation not in ["srgb", "rgb16", "b-w", "grey16"]:
+        return image
+
+    return image.sharpen(sigma=printer["sharpen_sigma"])
+
+
+def hardEdged(data, content_type, options):
+    # Whether an upload has so few colours it's drawn rather than
+    # photographed, from its statistics thumbnail rather than the print
+    # source, which may only stream once
+    page = options.get("page", 0) if content_type == "application/pdf" or content_type in framed_images else 0
+
+    return imageStatistics(data, page)["hard_edged"]
+
+
+def interpolator(name):
+    # vips interpolators are stateless, one of each serves every print
+    with interpolators_lock:
+        if name not in interpolators:
+            interpolators[name] = pyvips.Interpolate.new(name)
+
+        return interpolators[name]
+
+
+def zoomMaxLevel(width, height):
+    # DeepZoom's full resolution level, level 0 is a single pixel
+    return math.ceil(math.log2(max(width, height, 1)))
+
+
+def zoomLevel(session, level):
+    # Lazy image for one DeepZoom level. The levels form a pyramid
+    # over the cached full-resolution source, each halved from the
+    # level above, so a level only ever reads the one above it. Small
+    # levels are kept in memory and large ones in .v files vips maps
+    with zoom_lock:
+        if level in session["levels"]:
+            return session["levels"][level]
+
+    image = cachedSource(session["data"], session["content_type"], session["options"], session["key"])
+    image = orient(image, imageOrientation(image), needsRotation(*uprightSize(image), session["options"]))
+
+    scale = 2 ** (level - zoomMaxLevel(image.width, image.height))
+
+    if scale < 1:
+        width = max(1, math.ceil(image.width * scale))
+        height = max(1, math.ceil(image.height * scale))
+
+        above = zoomLevel(session, level + 1)
+        image = above.resize(width / above.width, vscale=height / above.height)
+
+        with stage("zoom_level"):
+            if width * height <= ZOOM_KEEP_PIXELS:
+                image = image.copy_memory()
+            else:
+                temp = pyvips.Image.new_temp_file("%s.v")
+                image.write(temp)
+                image = temp
+
+    with zoom_lock:
+        session["levels"][level] = image
+
+    return image
+
+
+def spoolDirectory(job):
+    # Fresh directory for a print job's artefacts, clearing out
+    # directories from jobs long since printed
+    os.makedirs(SPOOL_DIR, exist_ok=True)
+
+    for name in os.listdir(SPOOL_DIR):
+        old = os.path.join(SPOOL_DIR, name)
+        if time.time() - os.path.getmtime(old) > SPOOL_KEEP_SECONDS and name not in resumed_jobs:
+            shutil.rmtree(old, ignore_errors=True)
+
+    directory = os.path.join(SPOOL_DIR, job.id if job != None else str(time.time()).replace(".", "_"))
+    # Resumed jobs pick up what they had written
+    os.makedirs(directory, exist_ok=job != None and job.id in resumed_jobs)
+
+    return directory
+
+
+def checkpointJob(directory, data, content_type, options, printer, plan):
+    # Keep what a print needs to render again in its spool directory,
+    # the manifest last so it only names a complete upload
+    with open(os.path.join(directory, "upload"), "wb") as f:
+        f.write(data)
+
+    with open(os.path.join(directory, CHECKPOINT_MANIFEST + ".part"), "w") as f:
+        json.dump({"content_type": content_type, "options": options, "printer": printer["id"], "plan": plan,
+                   "backend": PRINT_BACKEND}, f)
+
+    os.replace(os.path.join(directory, CHECKPOINT_MANIFEST + ".part"), os.path.join(directory, CHECKPOINT_MANIFEST))
+
+
+def resumePrints():
+    # Queue again the prints a crash or restart cut short, under their
+    # old job ids so they carry on in their own spool directories
+    if not os.path.isdir(SPOOL_DIR):
+        return
+
+    for name in os.listdir(SPOOL_DIR):
+        directory = os.path.join(SPOOL_DIR, name)
+
+        try:
+            with open(os.path.join(directory, CHECKPOINT_MANIFEST)) as f:
+                manifest = json.load(f)
+            with open(os.path.join(directory, "upload"), "rb") as f:
+                data = f.read()
+        except (OSError, ValueError):
+            continue
+
+        printer = next((printer for printer in printers.selected() if printer["id"] == manifest["printer"]), None)
+        if printer == None:
+            print("Can't resume print " + name + ", printer " + manifest["printer"] + " isn't selected")
+            continue
+
+        # Bands written by another backend can't be picked up
+        if manifest["backend"] != PRINT_BACKEND:
+            for spooled in os.listdir(directory):
+                if spooled not in (CHECKPOINT_MANIFEST, "upload"):
+                    os.remove(os.path.join(directory, spooled))
+
+        resumed_jobs.add(name)
+        key = storeUpload(data, manifest["content_type"])
+        plan = tuple(manifest["plan"])
+        print("Resuming print " + name)
+
+        print_queues[printer["id"]].submit(
+            "print", lambda job, data=data, manifest=manifest, key=key, printer=printer, plan=plan:
+                printUpload(data, manifest["content_type"], manifest["options"], key, job, printer, plan),
+            render_costs.predict(manifest["content_type"], renderPixels(data, manifest["content_type"],
+                                                                        manifest["options"], plan), len(data)), name)
+
+
+def planPDFPages(data, options, skip_blank=False):
+    # Plan every page of a pdf from its header, less its blank pages
+    # when skip_blank is set and PDF_SKIP_BLANK allows
+    # Returns the options for each page and its calculateSize plan
+    page_options = [dict(options, page=i) for i in range(pdfPageCount(data))]
+
+    if skip_blank and PDF_SKIP_BLANK:
+        blank = blankPages(data, len(page_options))
+
+        # A pdf of nothing but blank pages prints as it is
+        if len(blank) < len(page_options):
+            page_options = [page for page in page_options if page["page"] not in blank]
+
+    plans = []
+    for page in page_options:
+        source_width, source_height = sourceSize(data, "application/pdf", page)
+        plans.append(calculateSize(source_width, source_height, page))
+
+    return page_options, plans
+
+
+def blankPages(data, page_count):
+    # Numbers of the blank pages of a pdf, each rasterised at thumbnail
+    # size concurrently
+    statistics = render_pool.map(lambda page: imageStatistics(data, page), range(page_count))
+
+    return [page for page in range(page_count) if statistics[page]["blank"]]
+
+
+def renderPDFBatch(data, options, key):
+    # Preview every page of a pdf as a contact sheet
+    start_time = time.time()
+
+    page_options, plans = planPDFPages(data, options, skip_blank=True)
+    page_count = len(plans)
+    scale = options.get("preview_scale", 1)
+
+    # Render each page at preview size concurrently and lay them out
+    # in a grid
+    def pagePreview(i):
+        rotate, width, height, dpi = plans[i]
+        return toRGBA(previewSource(data, rotate, width, height, page_options[i]["page"],
+                                    trimBox(data, "application/pdf", page_options[i]), scale=scale))
+
+    thumbnails = render_pool.map(pagePreview, range(page_count))
+
+    sheet = pyvips.Image.arrayjoin(thumbnails, across=math.ceil(math.sqrt(page_count)), shim=10,
+                                   background=[255, 255, 255, 0], halign="centre", valign="centre")
+
+    # Show the sheet at the first page's print width
+    rotate, width, height, dpi = plans[0]
+    with stage("preview_composite"):
+        image = previewPhoto(sheet, width, max(1, round(width * sheet.height / sheet.width)), options["paper_width"],
+                             scale)
+
+    timestamp = writePreview(image, key, options.get("preview_format", PREVIEW_FORMAT))
+    if timestamp == None:
+        return {"error": "Superseded by a newer render"}, 409, {"Content-Type": "application/json"}
+
+    print("Rendered " + str(page_count) + " pages in " + str(time.time() - start_time) + " seconds")
+
+    pages = [{"width": width, "height": height, "dpi": dpi} for rotate, width, height, dpi in plans]
+
+    return {"image_url": "/getImage/" + timestamp, "width": plans[0][1], "height": plans[0][2], "dpi": plans[0][3],
+            "pages": pages}, 200, {"Content-Type": "application/json"}
+
+
+@app.route("/frames", methods=["POST"])
+def frames():
+    # Contact sheet of an animated upload's frames, or a tiff's pages,
+    # for picking the one to print. Each is decoded at thumbnail scale,
+    # tiffs from the smallest pyramid level or subifd that is big enough
+    body = request.get_json()
+
+    stored = getUpload(body["handle"])
+
+    if stored == None:
+        return {"error": "Unknown upload handle"}, 404, {"Content-Type": "application/json"}
+
+    if stored["content_type"] not in framed_images:
+        return {"frames": 1}, 200, {"Content-Type": "application/json"}
+
+    count = frameCount(stored["data"])
+    if count == 1:
+        return {"frames": 1}, 200, {"Content-Type": "application/json"}
+
+    shown = min(count, FRAMES_MAX)
+    across = math.ceil(math.sqrt(shown))
+
+    with stage("frame_sheet"):
+        thumbnails = [toRGBA(pyvips.Image.thumbnail_buffer(stored["data"], FRAME_THUMBNAIL_SIZE,
+                                                           height=FRAME_THUMBNAIL_SIZE, option_string="page=" + str(i)))
+                      for i in range(shown)]
+        sheet = pyvips.Image.arrayjoin(thumbnails, across=across, background=[255, 255, 255, 0],
+                                       halign="centre", valign="centre")
+
+        format = previewFormat(request.headers.get("Accept", ""))
+        timestamp = str(time.time()).replace(".", "_") + "." + format
+        storePreviewImage(timestamp, encodePreview(sheet, format))
+
+    return {"frames": count, "shown": shown, "across": across, "sheet_url": "/getImage/" + timestamp}, 200, \
+        {"Content-Type": "application/json"}
+
+
+@app.route("/area", methods=["POST"])
+def area():
+    # Thumbnail of an upload as the server reads it, unrotated and
+    # untrimmed, for drawing the area to print on. options["area"] is
+    # given as fractions of it
+    body = request.get_json()
+
+    stored = getUpload(body["handle"])
+
+    if stored == None:
+        return {"error": "Unknown upload handle"}, 404, {"Content-Type": "application/json"}
+
+    page = body.get("page", 0)
+    paged = stored["content_type"] == "application/pdf" or stored["content_type"] in framed_images
+
+    with stage("area_sheet"):
+        thumbnail = pyvips.Image.thumbnail_buffer(stored["data"], AREA_THUMBNAIL_SIZE, height=AREA_THUMBNAIL_SIZE,
+                                                  option_string="page=" + str(page) if paged and page else "")
+
+        format = previewFormat(request.headers.get("Accept", ""))
+        timestamp = str(time.time()).replace(".", "_") + "." + format
+        storePreviewImage(timestamp, encodePreview(toRGBA(thumbnail), format))
+
+    return {"sheet_url": "/getImage/" + timestamp, "width": thumbnail.width, "height": thumbnail.height}, 200, \
+        {"Content-Type": "application/json"}
+
+
+@app.route("/thumbnail", methods=["POST"])
+def thumbnail():
+    # Thumbnail of a queued upload, already decoding if it was uploaded
+    # asking for one
+    body = request.get_json()
+
+    if getUpload(body["handle"]) == None:
+        return {"error": "Unknown upload handle"}, 404, {"Content-Type": "application/json"}
+
+    image = startThumbnail(body["handle"]).result()
+    if image == None:
+        return {"error": "Unreadable image"}, 415, {"Content-Type": "application/json"}
+
+    format = previewFormat(request.headers.get("Accept", ""))
+    timestamp = str(time.time()).replace(".", "_") + "." + format
+    storePreviewImage(timestamp, encodePreview(image, format))
+
+    return {"sheet_url": "/getImage/" + timestamp, "width": image.width, "height": image.height}, 200, \
+        {"Content-Type": "application/json"}
+
+
+@app.route("/zoom", methods=["POST"])
+def startZoom():
+    # Open a zoomable view of a stored upload at print resolution
+    # Returns the DeepZoom geometry, tiles come from getZoomTile
+    body = request.get_json()
+
+    stored = getUpload(body["handle"])
+
+    if stored == None:
+        return {"error": "Unknown upload handle"}, 404, {"Content-Type": "application/json"}
+
+    stored, handle, options = resolveUpload(stored, body["handle"], body["options"], True)
+
+    if stored == None:
+        return {"error": "Original not uploaded"}, 428, {"Content-Type": "application/json"}
+
+    zoom_id = previewTag(handle, options).strip('"')
+
+    # Plan the full size from the header, rotated as it would print
+    source_width, source_height = sourceSize(stored["data"], stored["content_type"], options)
+    rotate = needsRotation(source_width, source_height, options)
+    width, height = (source_height, source_width) if rotate else (source_width, source_height)
+
+    with zoom_lock:
+        if zoom_id not in zoom_sessions:
+            zoom_sessions[zoom_id] = {"data": stored["data"], "content_type": stored["content_type"],
+                                      "options": options, "key": handle, "levels": {},
+                                      "tiles": collections.OrderedDict(), "width": width, "height": height,
+                                      # Tiles answered with a stand-in, and those of them since painted
+                                      "placeheld": set(), "painted": collections.deque(maxlen=ZOOM_TILES_MAX),
+                                      "painted_count": 0, "painted_condition": threading.Condition()}
+
+        zoom_sessions.move_to_end(zoom_id)
+
+        while len(zoom_sessions) > ZOOM_SESSIONS_MAX:
+            zoom_sessions.popitem(last=False)
+
+    return {"zoom_id": zoom_id, "width": width, "height": height, "tile_size": ZOOM_TILE_SIZE,
+            "overlap": ZOOM_TILE_OVERLAP, "max_level": zoomMaxLevel(width, height)}, 200, {"Content-Type": "application/json"}
+
+
+@app.route("/zoom/<zoom_id>/<int:level>/<int:col>_<int:row>.jpg", methods=["GET"])
+def getZoomTile(zoom_id, level, col, row):
+    # One DeepZoom tile, only the pixels under it are computed
+    with zoom_lock:
+        session = zoom_sessions.get(zoom_id)
+
+    if session == None:
+        return {"error": "Unknown zoom"}, 404, {"Content-Type": "application/json"}
+
+    if not zoomInRange(session, level, col, row):
+        return {"error": "Tile out of range"}, 404, {"Content-Type": "application/json"}
+
+    # Prefetched tiles may be ready, or part way through encoding
+    with zoom_lock:
+        future = session["tiles"].get((level, col, row))
+
+    if ZOOM_BACKGROUND:
+        future = future or submitZoomTile(session, (level, col, row))
+
+        if not future.done():
+            placeholder = zoomPlaceholder(session, level, col, row)
+
+            with zoom_lock:
+                session["placeheld"].add((level, col, row))
+
+            # It may have finished while the stand-in was made, and
+            # missed being announced
+            if not future.done():
+                prefetchZoomTiles(session, level, col, row)
+
+                # Never cached, the same url gets the painted tile
+                return Response(placeholder, mimetype="image/jpeg",
+                                headers={"Cache-Control": "no-store", "X-Blueprint-Placeholder": "1"})
+
+            with zoom_lock:
+                session["placeheld"].discard((level, col, row))
+
+    tile = future.result() if future != None else zoomTile(session, level, col, row)
+
+    if tile == None:
+        return {"error": "Tile out of range"}, 404, {"Content-Type": "application/json"}
+
+    prefetchZoomTiles(session, level, col, row)
+
+    return Response(tile, mimetype="image/jpeg", headers={"Cache-Control": "max-age=3600"})
+
+
+@app.route("/zoom/<zoom_id>/events", methods=["GET"])
+def zoomEvents(zoom_id):
+    # Stream the names of tiles answered with a stand-in as they finish
+    # painting, as server-sent events, until the view is dropped
+    with zoom_lock:
+        session = zoom_sessions.get(zoom_id)
+
+    if session == None:
+        return {"error": "Unknown zoom"}, 404, {"Content-Type": "application/json"}
+
+    def stream():
+        condition = session["painted_condition"]
+
+        with condition:
+            seen = session["painted_count"]
+
+        while True:
+            with condition:
+                condition.wait_for(lambda: session["painted_count"] != seen, timeout=15)
+                count = session["painted_count"]
+                painted = list(session["painted"])[-min(count - seen, len(session["painted"])):] if count != seen else []
+                seen = count
+
+            for level, col, row in painted:
+                yield "data: " + str(level) + "/" + str(col) + "_" + str(row) + "\n\n"
+
+            with zoom_lock:
+                if zoom_sessions.get(zoom_id) is not session:
+                    return
+
+            # Keeps the connection open through proxies
+            if not painted:
+                yield ": idle\n\n"
+
+    return Response(stream(), mimetype="text/event-stream", headers={"Cache-Control": "no-cache"})
+
+
+def zoomInRange(session, level, col, row):
+    # Whether a tile lies on its level, from the planned size alone
+    max_level = zoomMaxLevel(session["width"], session["height"])
+    if level < 0 or level > max_level:
+        return False
+
+    scale = 2 ** (level - max_level)
+
+    return col * ZOOM_TILE_SIZE < math.ceil(session["width"] * scale) and \
+        row * ZOOM_TILE_SIZE < math.ceil(session["height"] * scale)
+
+
+def submitZoomTile(session, name):
+    # Paint a tile on the prefetch pool, returning its future. Tiles
+    # answered with a stand-in are announced once painted
+    with zoom_lock:
+        if name in session["tiles"]:
+            return session["tiles"][name]
+
+        future = zoom_prefetch.submit(zoomTile, session, *name)
+        session["tiles"][name] = future
+
+        while len(session["tiles"]) > ZOOM_TILES_MAX:
+            session["tiles"].popitem(last=False)
+
+    future.add_done_callback(lambda future: zoomPainted(session, name))
+
+    return future
+
+
+def zoomPainted(session, name):
+    with zoom_lock:
+        if name not in session["placeheld"]:
+            return
+        session["placeheld"].discard(name)
+
+    with session["painted_condition"]:
+        session["painted"].append(name)
+        session["painted_count"] += 1
+        session["painted_condition"].notify_all()
+
+
+def zoomPlaceholder(session, level, col, row):
+    # Jpeg standing in for a tile still painting: the nearest coarser
+    # tile already painted, cropped to the same area and scaled up, or
+    # a single grey pixel the viewer stretches over the tile
+    left = col * ZOOM_TILE_SIZE - (ZOOM_TILE_OVERLAP if col > 0 else 0)
+    top = row * ZOOM_TILE_SIZE - (ZOOM_TILE_OVERLAP if row > 0 else 0)
+    width = ZOOM_TILE_SIZE + ZOOM_TILE_OVERLAP * (2 if col > 0 else 1)
+    height = ZOOM_TILE_SIZE + ZOOM_TILE_OVERLAP * (2 if row > 0 else 1)
+
+    for step in range(1, min(level, ZOOM_PLACEHOLDER_LEVELS) + 1):
+        factor = 2 ** step
+        coarse_col, coarse_row = col * ZOOM_TILE_SIZE // factor // ZOOM_TILE_SIZE, row * ZOOM_TILE_SIZE // factor // ZOOM_TILE_SIZE
+
+        with zoom_lock:
+            future = session["tiles"].get((level - step, coarse_col, coarse_row))
+
+        if future == None or not future.done() or future.exception() != None or future.result() == None:
+            continue
+
+        coarse = pyvips.Image.jpegload_buffer(future.result())
+        coarse_left = coarse_col * ZOOM_TILE_SIZE - (ZOOM_TILE_OVERLAP if coarse_col > 0 else 0)
+        coarse_top = coarse_row * ZOOM_TILE_SIZE - (ZOOM_TILE_OVERLAP if coarse_row > 0 else 0)
+
+        x = min(coarse.width - 1, max(0, left // factor - coarse_left))
+        y = min(coarse.height - 1, max(0, top // factor - coarse_top))
+        crop = coarse.crop(x, y, max(1, min(coarse.width - x, math.ceil(width / factor))),
+                           max(1, min(coarse.height - y, math.ceil(height / factor))))
+
+        return crop.resize(factor, kernel="linear").jpegsave_buffer(Q=60)
+
+    return zoomGrey()
+
+
+def zoomGrey():
+    global zoom_grey
+
+    if zoom_grey == None:
+        zoom_grey = (pyvips.Image.black(1, 1, bands=3) + 192).cast("uchar").jpegsave_buffer()
+
+    return zoom_grey
+
+
+def zoomTile(session, level, col, row):
+    # Encoded jpeg for one DeepZoom tile, None when it's out of range
+    image = zoomLevel(session, level)
+
+    left = col * ZOOM_TILE_SIZE - (ZOOM_TILE_OVERLAP if col > 0 else 0)
+    top = row * ZOOM_TILE_SIZE - (ZOOM_TILE_OVERLAP if row > 0 else 0)
+
+    if left >= image.width or top >= image.height:
+        return None
+
+    width = min(ZOOM_TILE_SIZE + ZOOM_TILE_OVERLAP * (2 if col > 0 else 1), image.width - left)
+    height = min(ZOOM_TILE_SIZE + ZOOM_TILE_OVERLAP * (2 if row > 0 else 1), image.height - top)
+
+    with stage("zoom_tile"):
+        return toRGB(image.crop(left, top, width, height)).jpegsave_buffer(Q=85)
+
+
+def prefetchZoomTiles(session, level, col, row):
+    # Start encoding the tiles around one just served, so the next
+    # pan finds them done while this one is still being sent
+    for row_step in range(-ZOOM_PREFETCH, ZOOM_PREFETCH + 1):
+        for col_step in range(-ZOOM_PREFETCH, ZOOM_PREFETCH + 1):
+            name = (level, col + col_step, row + row_step)
+
+            if name[1] < 0 or name[2] < 0 or (col_step, row_step) == (0, 0):
+                continue
+
+            if zoomInRange(session, *name):
+                submitZoomTile(session, name)
+
+
+def printJob(job_id):
+    # A print job from whichever printer's queue holds it
+    for queue in print_queues.values():
+        job = queue.get(job_id)
+        if job != None:
+            return job
+
+    return None
+
+
+@app.route("/log", methods=["GET", "POST"])
+def log():
+    # POST appends prints to the log, a list of entries or one entry.
+    # GET pages through it newest first, ?before= is the cursor the
+    # previous page returned or ?offset= skips to a range, ?college_id=
+    # filters to one user and ?total=1 counts the entries too
+    if request.method == "POST":
+        body = request.get_json()
+        entries = body if isinstance(body, list) else [body]
+        print_log.append(entries)
+
+        return {"logged": len(entries)}, 200, {"Content-Type": "application/json"}
+
+    try:
+        limit = min(max(1, int(request.args.get("limit", "50"))), PRINT_LOG_PAGE_MAX)
+        offset = max(0, int(request.args.get("offset", "0")))
+        before = request.args.get("before")
+        if before:
+            timestamp, entry_id = before.split(",")
+            before = [float(timestamp), int(entry_id)]
+        else:
+            before = None
+    except ValueError:
+        return {"error": "Bad limit or cursor"}, 400, {"Content-Type": "application/json"}
+
+    entries, following = print_log.page(limit, before, request.args.get("college_id"), offset)
+    page = {"entries": entries, "before": ",".join(str(value) for value in following) if following else None}
+
+    if request.args.get("total") == "1":
+        page["total"] = print_log.count(request.args.get("college_id"))
+
+    return page, 200, {"Content-Type": "application/json"}
+
+
+@app.route("/log/usage", methods=["GET"])
+def logUsage():
+    # What print jobs of each upload type cost the server, averaged
+    # over the print log
+    return print_log.usageByType(), 200, {"Content-Type": "application/json"}
+
+
+@app.route("/jobs/<job_id>", methods=["GET"])
+def getJob(job_id):
+    # Status of a background print job
+    job = printJob(job_id)
+
+    if job == None:
+        return {"error": "Unknown job"}, 404, {"Content-Type": "application/json"}
+
+    return job.toDict(), 200, {"Content-Type": "application/json"}
+
+
+@app.route("/jobs/<job_id>/cancel", methods=["POST"])
+def cancelJob(job_id):
+    # Cancel a queued print, or kill it mid-render
+    job = printJob(job_id)
+
+    if job == None:
+        return {"error": "Unknown job"}, 404, {"Content-Type": "application/json"}
+
+    job.cancel()
+
+    # Wake it if it's waiting for the printer
+    with handoff_condition:
+        handoff_condition.notify_all()
+
+    return job.toDict(), 200, {"Content-Type": "application/json"}
+
+
+@app.route("/jobs/<job_id>/copy", methods=["POST"])
+def copyJob(job_id):
+    # Print another copy of a finished job from the files it spooled,
+    # 410 once they are gone and the print has to be rendered again
+    with spooled_prints_lock:
+        spooled = spooled_prints.get(job_id)
+
+    if spooled == None or not all(os.path.exists(path) for path in spooled[3]):
+        return {"error": "Spool files gone"}, 410, {"Content-Type": "application/json"}
+
+    printer = spooled[0]
+    job = print_queues[printer["id"]].submit("copy", lambda job: printCopy(spooled, job))
+
+    return {"job_id": job.id, "status_url": "/jobs/" + job.id, "printer": printer["id"]}, 202, \
+        {"Content-Type": "application/json"}
+
+
+def printCopy(spooled, job):
+    # Hand the spool files of an earlier job to the printer again
+    printer, width, height, filenames, flags = spooled
+
+    handOff(printer, width, height, filenames, flags, job)
+
+    return {"width": width, "height": height, "printer": printer["id"]}
+
+
+def workerRefusal():
+    # Response refusing a /worker request, or None to serve it
+    if not WORKER_MODE:
+        return {"error": "Not a render worker"}, 404, {"Content-Type": "application/json"}
+
+    if request.headers.get("X-Blueprint-Worker-Token", "") != workers.TOKEN:
+        return {"error": "Bad worker token"}, 403, {"Content-Type": "application/json"}
+
+    return None
+
+
+@app.route("/worker/uploads/<key>", methods=["PUT"])
+def workerUpload(key):
+    # Hold an upload a kiosk will render here
+    refusal = workerRefusal()
+    if refusal != None:
+        return refusal
+
+    data = request.get_data()
+    if uploadHash(data) != key:
+        return {"error": "Upload doesn't match its hash"}, 400, {"Content-Type": "application/json"}
+
+    storeUpload(data, request.content_type, key)
+
+    return {"handle": key}, 200, {"Content-Type": "application/json"}
+
+
+@app.route("/worker/render/<key>", methods=["POST"])
+def workerRender(key):
+    # Render a kiosk's print of an upload held here and stream back its
+    # spool files, 428 when the kiosk has to send the upload first
+    refusal = workerRefusal()
+    if refusal != None:
+        return refusal
+
+    upload = getUpload(key)
+    if upload == None:
+        return {"error": "Upload not held"}, 428, {"Content-Type": "application/json"}
+
+    body = request.get_json()
+    if body.get("printer") not in printers.PRINTERS:
+        return {"error": "Unknown printer"}, 400, {"Content-Type": "application/json"}
+
+    printer = dict(printers.PRINTERS[body["printer"]], id=body["printer"])
+    plan = tuple(body["plan"]) if body.get("plan") != None else None
+
+    worker_capture.handoffs = []
+    worker_capture.band_share = body.get("band_share")
+    try:
+        result = printUpload(upload["data"], body["content_type"], body["options"], key, None, printer, plan)
+        captured = worker_capture.handoffs
+    finally:
+        worker_capture.handoffs = None
+        worker_capture.band_share = None
+
+    if not captured:
+        return {"error": "Nothing to print"}, 500, {"Content-Type": "application/json"}
+
+    # Every hand-off spools into the same directory
+    directory = os.path.dirname(captured[0]["files"][0])
+    manifest = {"result": result, "handoffs": [dict(handoff, files=[os.path.basename(name) for name in handoff["files"]])
+                                                for handoff in captured]}
+
+    archive = directory + ".tar"
+    with open(archive, "wb") as f:
+        workers.pack(directory, manifest, f)
+    shutil.rmtree(directory, ignore_errors=True)
+
+    response = send_file(archive, mimetype="application/x-tar")
+    response.call_on_close(lambda: os.remove(archive))
+
+    return response
+
+
+@app.route("/jobs/<job_id>/events", methods=["GET"])
+def jobEvents(job_id):
+    # Stream a job's status as server-sent events until it finishes
+    job = printJob(job_id)
+
+    if job == None:
+        return {"error": "Unknown job"}, 404, {"Content-Type": "application/json"}
+
+    def stream():
+        last = None
+        while True:
+            finished = job.finished != None
+            status = json.dumps(job.toDict())
+
+            # Only send when something changed
+            if status != last:
+                yield "data: " + status + "\n\n"
+                last = status
+
+            if finished:
+                return
+
+            time.sleep(0.5)
+
+    return Response(stream(), mimetype="text/event-stream", headers={"Cache-Control": "no-cache"})
+
+
+@app.route("/trace", methods=["GET"])
+def getTrace():
+    # Recorded spans for chrome://tracing or Perfetto, needs
+    # BLUEPRINT_TRACE=1
+    return tracing.export(), 200, {"Content-Type": "application/json",
+                                   "Content-Disposition": "attachment; filename=blueprint-trace.json"}
+
+
+@app.route("/profile", methods=["GET"])
+def getProfile():
+    # vips operations ranked by build time for each kind of request,
+    # with cache hits, needs BLUEPRINT_PROFILE=1. ?reset=1 starts over
+    result = profiling.report()
+
+    if request.args.get("reset") == "1":
+        profiling.reset()
+
+    return result, 200, {"Content-Type": "application/json"}
+
+
+@app.route("/ready", methods=["GET"])
+def getReady():
+    # 200 once warm up has finished, so a kiosk or proxy can wait for it
+    if not ready.is_set():
+        return {"ready": False}, 503, {"Content-Type": "application/json"}
+
+    return {"ready": True, "printers": {printer["id"]: printerstate.state(printer["id"]) for printer in printers.selected()}}, \
+        200, {"Content-Type": "application/json"}
+
+
+@app.route("/metrics", methods=["GET"])
+def getMetrics():
+    # Cache and render metrics for Prometheus to scrape
+    return metrics.render(), 200, {"Content-Type": "text/plain; version=0.0.4"}
+
+
+@app.route("/getImage/<timestamp>", methods=["GET"])
+def getImage(timestamp):
+    # Get timestamp from request
+
+    # Previews are named for the format they were encoded in
+    format = timestamp.rsplit(".", 1)[-1]
+    if format not in ["webp", "jpeg", "png"]:
+        return "Error: File not found"
+
+    # A name always holds the same preview, so it is its own strong
+    # ETag and a browser holding it never needs the body again
+    etag = '"' + timestamp + '"'
+    if request.headers.get("If-None-Match") == etag:
+        return "", 304, {"ETag": etag, "Cache-Control": PREVIEW_CACHE_CONTROL}
+
+    # Served straight from memory while it's held there
+    buffer = previewImage(timestamp)
+    if buffer != None:
+        return Response(buffer, mimetype="image/" + format, headers={"ETag": etag, "Cache-Control": PREVIEW_CACHE_CONTROL})
+
+    # Check if the file exists
+    if os.path.exists(previewFile(escape(timestamp))):
+        # send_file hands the server wsgi.file_wrapper, which servers
+        # with sendfile or TransmitFile send from without copying
+        response = send_file(previewFile(escape(timestamp)), mimetype="image/" + format, etag=False)
+        response.headers["ETag"] = etag
+        response.headers["Cache-Control"] = PREVIEW_CACHE_CONTROL
+        return response
+    else:
+        return "Error: File not found"
+
+
+# Latest hand-off status reported by PrintGUI, by spool file
+print_status = {}
+
+# PrintGUI running under --serve, once this process has started one.
+# The lock keeps to one pipe connection at a time, the helper serves
+# them one by one
+printgui_helper = None
+printgui_helper_lock = threading.Lock()
+
+# Hand-off phases already observed, by (files, phase), as every report
+# repeats the phases before it
+handoff_phases_seen = collections.OrderedDict()
+
+
+@app.route("/printStatus", methods=["GET", "POST"])
+def printStatus():
+    # PrintGUI posts here when the print window opens and closes
+    global handoff_reporting
+
+    if request.method == "POST":
+        body = request.get_json()
+
+        for filename in body["files"]:
+            print_status[os.path.basename(filename)] = {"status": body["status"], "time": time.time()}
+
+        # Wake prints waiting for this printer to be free
+        with handoff_condition:
+            handoff_reporting = True
+
+            for filename in body["files"]:
+                handoff_status[handoffPath(filename)] = body["status"]
+
+                if body["status"] in ["closed", "timeout", "spooled", "failed"]:
+                    releaseMemorySpool(filename)
+
+            handoff_condition.notify_all()
+
+        # PrintGUI's own timings, each phase once as it first reports it
+        for phase, milliseconds in (body.get("timings") or {}).items():
+            key = (tuple(body["files"]), phase)
+            if key not in handoff_phases_seen:
+                handoff_phases_seen[key] = True
+                handoff_seconds.observe(milliseconds / 1000, phase=phase)
+
+        while len(handoff_phases_seen) > 1000:
+            handoff_phases_seen.popitem(last=False)
+
+        print("Print window " + body["status"] + ": " + ", ".join(body["files"]))
+
+    return print_status, 200, {"Content-Type": "application/json"}
+
+
+def loadSource(data, content_type, options, access="random"):
+    # Open the upload as a lazy full-resolution vips image
+    # "sequential" access lets loaders keep only a few scanlines
+    if content_type == "application/pdf":
+        image = convertPDF(data, options, access)
+
+    elif content_type == "image/svg+xml":
+        image = convertSVG(data, options, access)
+
+    else:
+        # Pixels are only decoded when the preview or print output
+        # pulls them, and only the one frame of an animation
+        image = pyvips.Image.new_from_buffer(data, frameOption(content_type, options), access=access)
+
+        if content_type == "image/jpeg":
+            image = parallelJPEG(data, image)
+
+    page = options.get("page", 0) if content_type == "application/pdf" or content_type in framed_images else 0
+
+    return dropOpaqueAlpha(applyTrim(ingestMetadata(image), trimBox(data, content_type, options)), data, page)
+
+
+def ingestMetadata(image):
+    # image without the metadata prints don't use. Every operation
+    # copies its input's fields, and a Photoshop export's can run to
+    # megabytes of XMP and thumbnails carried through the whole graph,
+    # and into the spool by tiffsave
+    fields = [name for name in image.get_fields()
+              if name not in INGEST_METADATA and not name.startswith("blueprint-")]
+    if not fields:
+        return image
+
+    image = image.copy()
+    for name in fields:
+        image.remove(name)
+
+    return image
+
+
+def parallelJPEG(data, image):
+    # A big jpeg decoded now, its strips between restart markers each
+    # on a thread of their own, or image as it was when it's small,
+    # has no restart markers or wouldn't fit in memory. Those decode
+    # on libjpeg's one thread as the pipeline pulls them, with the
+    # other vips workers running the stages after it meanwhile
+    size = image.width * image.height * image.bands
+    if image.width * image.height < PARALLEL_JPEG_PIXELS or size > SOURCE_MEMORY_MAX_BYTES or \
+            trackedMemory() + size > RENDER_MEMORY_SOFT_LIMIT:
+        return image
+
+    strips = jpegstrips.strips(data, RENDER_THREADS)
+    if strips == None:
+        return image
+
+    def decode(strip):
+        return pyvips.Image.jpegload_buffer(strip[0]).copy_memory()
+
+    with stage("parallel_decode"):
+        decoded = render_pool.map(decode, strips)
+
+    # Joins keep the first strip's metadata, which is the file's. Not
+    # arrayjoin, its cells would pad the shorter last strip
+    joined = decoded[0]
+    for strip in decoded[1:]:
+        joined = joined.join(strip, "vertical")
+
+    joined = joined.copy()
+    joined.set_type(pyvips.GValue.gint_type, "blueprint-strips", len(decoded))
+
+    return joined
+
+
+# Bytes per band element for each vips format
+format_sizes = {"uchar": 1, "char": 1, "ushort": 2, "short": 2, "uint": 4, "int": 4,
+                "float": 4, "double": 8, "complex": 8, "dpcomplex": 16}
+
+# Decoded uploads, least recently used first
+source_cache = collections.OrderedDict()
+source_cache_bytes = 0
+source_cache_lock = threading.Lock()
+
+
+# Hits, misses and evictions for each of the server's caches
+cache_hits = metrics.counter("blueprint_cache_hits_total", "Lookups answered from a cache")
+cache_misses = metrics.counter("blueprint_cache_misses_total", "Lookups a cache could not answer")
+cache_evictions = metrics.counter("blueprint_cache_evictions_total", "Entries dropped to stay under a cache budget")
+
+# Time spent in each stage of the render pipeline, and per request
+stage_seconds = metrics.histogram("blueprint_stage_seconds", "Seconds spent in each render pipeline stage",
+                                  [0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10, 30, 60, 120, 300])
+request_seconds = metrics.histogram("blueprint_request_seconds", "Seconds to handle and send each HTTP response",
+                                    [0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10, 30])
+job_memory_bytes = metrics.histogram("blueprint_job_memory_bytes", "Peak vips memory over baseline of each print job",
+                                     [2 ** n * 1024 * 1024 for n in range(4, 15)])
+job_temp_bytes = metrics.histogram("blueprint_job_temp_bytes", "Temp and spool file bytes of each print job",
+                                   [2 ** n * 1024 * 1024 for n in range(4, 15)])
+handoff_seconds = metrics.histogram("blueprint_handoff_seconds",
+                                    "Seconds in each phase of handing a print to PrintGUI and its wizard",
+                                    [0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10, 30, 60])
+renders_total = metrics.counter("blueprint_renders_total", "Render requests by upload content type")
+worker_renders = metrics.counter("blueprint_worker_renders_total",
+                                 "Prints sent to a render worker, by worker and whether they spilled from the owner")
+
+metrics.gauge("blueprint_vips_tracked_bytes", "Pixel memory vips has allocated", lambda: trackedMemory())
+metrics.gauge("blueprint_vips_tracked_highwater_bytes", "Peak pixel memory vips has allocated",
+              lambda: trackedMemoryStats()["highwater"])
+metrics.gauge("blueprint_vips_open_files", "Files vips has open", lambda: trackedMemoryStats()["files"])
+metrics.gauge("blueprint_vips_tracked_allocations", "Pixel buffers vips has allocated and not freed",
+              lambda: pyvips.vips_lib.vips_tracked_get_allocs())
+metrics.gauge("blueprint_printers_not_ready", "Selected printers busy or offline at the last poll",
+              lambda: sum(1 for printer in printers.selected() if printerstate.rank(printer["id"]) > 0))
+metrics.gauge("blueprint_process_resident_bytes", "Resident memory of the server process", lambda: residentMemory())
+metrics.gauge("blueprint_process_huge_page_bytes", "Memory of the server process on transparent huge pages",
+              lambda: hugePageMemory())
+metrics.gauge("blueprint_source_cache_bytes", "Decoded source pixels held in memory", lambda: source_cache_bytes)
+metrics.gauge("blueprint_upload_store_bytes", "Raw upload bytes held behind handles", lambda: upload_store_bytes)
+metrics.gauge("blueprint_preview_memory_bytes", "Encoded previews held in memory", lambda: preview_images_bytes)
+metrics.gauge("blueprint_vips_cache_operations", "Operations in the vips operation cache", lambda: pyvips.cache_get_size())
+metrics.gauge("blueprint_vips_cache_max_operations", "Operation limit of the vips cache", lambda: pyvips.cache_get_max())
+metrics.gauge("blueprint_vips_cache_max_bytes", "Memory limit of the vips cache", lambda: pyvips.cache_get_max_mem())
+
+# Previews rendering right now, print writes give way to them
+previews_active = 0
+preview_priority = threading.Condition()
+
+# Zoomable views by id, see startZoom
+zoom_sessions = collections.OrderedDict()
+zoom_lock = threading.Lock()
+zoom_prefetch = concurrent.futures.ThreadPoolExecutor(max_workers=ZOOM_PREFETCH_THREADS)
+# Encoded grey pixel standing in for unpainted zoom tiles
+zoom_grey = None
+
+# Interpolators by name, see interpolator
+interpolators = {}
+interpolators_lock = threading.Lock()
+
+# Statistics by upload and page, see imageStatistics
+statistics_cache = collections.OrderedDict()
+statistics_cache_lock = threading.Lock()
+
+# Page sizes of parsed pdfs and svgs by upload and page
+document_headers = collections.OrderedDict()
+document_headers_lock = threading.Lock()
+
+# Linear light preview bases by upload and page, see previewBase
+preview_bases = collections.OrderedDict()
+preview_bases_lock = threading.Lock()
+
+# Pixel memory reserved by admitted renders
+memory_reserved = 0
+memory_condition = threading.Condition()
+
+# Previews admitted to decode and those waiting, see ingestRoom
+ingest_gate = admission.Gate(INGEST_SLOTS, lambda: ingestRoom(), INGEST_QUEUE_MAX)
+
+# Print renders in progress by printer id, and the condition renders
+# for printers that can't print now wait on, see readinessTurn
+readiness_renders = collections.Counter()
+readiness_condition = threading.Condition()
+
+# Decoded thumbnails of queued uploads by handle, see startThumbnail
+queue_thumbnails = collections.OrderedDict()
+queue_thumbnails_lock = threading.Lock()
+queue_thumbnail_pool = concurrent.futures.ThreadPoolExecutor(max_workers=QUEUE_THUMBNAIL_THREADS)
+
+# Encoded previews by timestamp, oldest first, and the sizes of
+# those spilled to the cache dir this run
+preview_images = collections.OrderedDict()
+preview_images_bytes = 0
+preview_images_lock = threading.Lock()
+preview_spills = collections.OrderedDict()
+preview_spills_bytes = 0
+
+
+# Raw uploads by handle, least recently used first
+upload_store = collections.OrderedDict()
+upload_store_bytes = 0
+upload_store_lock = threading.Lock()
+
+# Rendered label masks by (text, font, dpi), least recently used first
+label_cache = collections.OrderedDict()
+label_cache_lock = threading.Lock()
+
+# pdf rasteriser auto picked by (upload hash, page), see pdfBackend,
+# and the lock pdfium draws under
+PDF_BACKENDS_MAX = 256
+pdf_backends = collections.OrderedDict()
+pdf_backends_lock = threading.Lock()
+pdfium_lock = threading.Lock()
+
+# Usage of the print jobs being accounted, by job id, see jobUsage
+job_usage = {}
+job_usage_lock = threading.Lock()
+
+# Chunked uploads in flight by id, oldest first
+chunked_uploads = collections.OrderedDict()
+chunked_uploads_lock = threading.Lock()
+
+
+def uploadError(data, content_type, header=None):
+    # Check an upload against the size limits from its header alone
+    # Returns (message, status) to refuse it with, or None
+    if len(data) > MAX_UPLOAD_BYTES:
+        return "Upload too large", 413
+
+    # pdf and svg rasterise at a scale set by the paper, so only
+    # rasters can ask for unbounded pixels
+    if content_type not in supported_images:
+        return None
+
+    if header == None:
+        try:
+            header = pyvips.Image.new_from_buffer(data, "")
+        except pyvips.Error:
+            return "Unreadable image", 415
+
+    if header.width * header.height > MAX_SOURCE_PIXELS:
+        return "Image has too many pixels", 413
+
+    # Any page of a tiff can be picked to print, each page's IFD is
+    # read for its size without decoding it
+    if content_type in ["image/tiff", "image/tif"] and header.get_typeof("n-pages") != 0:
+        for page in range(1, header.get("n-pages")):
+            try:
+                page_header = pyvips.Image.new_from_buffer(data, "page=" + str(page))
+            except pyvips.Error:
+                return "Unreadable image", 415
+
+            if page_header.width * page_header.height > MAX_SOURCE_PIXELS:
+                return "Image has too many pixels", 413
+
+    return None
+
+
+def uploadHash(data):
+    # Content hash identifying an upload
+    return hashlib.blake2b(data, digest_size=16).hexdigest()
+
+
+def storeUpload(data, content_type, handle=None):
+    # Keep the raw bytes of an upload, returning its handle
+    global upload_store_bytes
+
+    handle = handle or uploadHash(data)
+
+    with upload_store_lock:
+        if handle not in upload_store:
+            upload_store[handle] = {"data": data, "content_type": content_type}
+            upload_store_bytes += len(data)
+
+        upload_store.move_to_end(handle)
+
+        # Evict least recently used uploads until back under budget
+        while upload_store_bytes > UPLOAD_STORE_MAX_BYTES and len(upload_store) > 1:
+            _, evicted = upload_store.popitem(last=False)
+            upload_store_bytes -= len(evicted["data"])
+            cache_evictions.inc(cache="upload")
+
+    return handle
+
+
+class UploadSource:
+    # Wraps a request body stream as a vips source, keeping every
+    # byte the loader reads and hashing it as it arrives
+
+    def __init__(self, stream):
+        self.stream = stream
+        self.chunks = []
+        self.hash = hashlib.blake2b(digest_size=16)
+
+        self.source = pyvips.SourceCustom()
+        self.source.on_read(self.read)
+
+    def read(self, size):
+        chunk = self.stream.read(size)
+
+        if chunk:
+            self.chunks.append(chunk)
+            self.hash.update(chunk)
+
+        return chunk
+
+    def drain(self):
+        # Read whatever the loader didn't need, return bytes and hash
+        while self.read(1024 * 1024):
+            pass
+
+        return b"".join(self.chunks), self.hash.hexdigest()
+
+
+def getUpload(handle):
+    # Look up a stored upload, or None if it isn't held any more
+    with upload_store_lock:
+        if handle not in upload_store:
+            cache_misses.inc(cache="upload")
+            return None
+
+        upload_store.move_to_end(handle)
+        cache_hits.inc(cache="upload")
+        return upload_store[handle]
+
+
+def trackedMemory():
+    # Bytes of pixel memory vips currently has allocated
+    return pyvips.vips_lib.vips_tracked_get_mem()
+
+
+def trackedMemoryStats():
+    # Current and peak vips pixel memory, and files vips has open
+    return {"memory": trackedMemory(), "highwater": pyvips.vips_lib.vips_tracked_get_mem_highwater(),
+            "files": pyvips.vips_lib.vips_tracked_get_files()}
+
+
+@contextlib.contextmanager
+def jobUsage(job, content_type):
+    # Account vips memory, open files and temp file bytes to a print
+    # job. vips only counts for the whole process, so while the job
+    # runs a sampler records how far each rises over where it stood
+    # when the job started. Jobs running together are each charged
+    # the whole rise, concurrent says how many shared it
+    if job == None:
+        yield
+        return
+
+    stats = trackedMemoryStats()
+    usage = {"memory": 0, "files": 0, "temp_bytes": 0, "concurrent": 1,
+             "baseline": {"memory": stats["memory"], "files": stats["files"], "temp_bytes": vipsTempBytes()}}
+
+    with job_usage_lock:
+        job_usage[job.id] = usage
+        for other in job_usage.values():
+            other["concurrent"] = max(other["concurrent"], len(job_usage))
+
+        if len(job_usage) == 1:
+            threading.Thread(target=sampleJobUsage, name="job-usage", daemon=True).start()
+
+    try:
+        yield
+    finally:
+        with job_usage_lock:
+            del job_usage[job.id]
+
+        sampleUsage(usage)
+        del usage["baseline"]
+
+        # Spool files are the job's alone
+        directory = os.path.join(SPOOL_DIR, job.id)
+        usage["temp_bytes"] += sum(os.path.getsize(os.path.join(directory, name)) for name in os.listdir(directory)) \
+            if os.path.isdir(directory) else 0
+
+        job.usage = usage
+        job_memory_bytes.observe(usage["memory"], content_type=content_type)
+        job_temp_bytes.observe(usage["temp_bytes"], content_type=content_type)
+
+        try:
+            print_log.appendUsage(job.id, content_type, usage)
+        except sqlite3.Error as e:
+            print("Could not log job usage: " + str(e))
+
+        print("Job " + job.id + " used " + str(usage["memory"] // (1024 * 1024)) + " MB, " + str(usage["files"]) +
+              " files and " + str(usage["temp_bytes"] // (1024 * 1024)) + " MB of temp files")
+
+
+def sampleJobUsage():
+    # Runs while any job is accounted
+    while True:
+        with job_usage_lock:
+            usages = list(job_usage.values())
+
+        if not usages:
+            return
+
+        for usage in usages:
+            sampleUsage(usage)
+
+        time.sleep(JOB_USAGE_SAMPLE_SECONDS)
+
+
+def sampleUsage(usage):
+    # Raise a job's peaks to how far usage stands over its baseline
+    stats = trackedMemoryStats()
+    baseline = usage["baseline"]
+
+    usage["memory"] = max(usage["memory"], stats["memory"] - baseline["memory"])
+    usage["files"] = max(usage["files"], stats["files"] - baseline["files"])
+    usage["temp_bytes"] = max(usage["temp_bytes"], vipsTempBytes() - baseline["temp_bytes"])
+
+
+def vipsTempBytes():
+    # Bytes in vips's temp files, those transposeBuffer and disc
+    # spilling write
+    directory = tempfile.gettempdir()
+    total = 0
+
+    for name in os.listdir(directory):
+        if name.startswith("vips-"):
+            try:
+                total += os.path.getsize(os.path.join(directory, name))
+            except OSError:
+                pass
+
+    return total
+
+
+@contextlib.contextmanager
+def renderAdmission(estimate, job=None):
+    # Hold a render until its estimated pixel memory fits under the
+    # soft limit alongside what vips and other admitted renders use
+    global memory_reserved
+
+    with memory_condition:
+        while memory_reserved > 0 and trackedMemory() + memory_reserved + estimate > RENDER_MEMORY_SOFT_LIMIT:
+            if job != None and job.cancelled:
+                raise Exception("Cancelled while waiting for memory")
+
+            memory_condition.wait(1)
+
+        memory_reserved += estimate
+
+    stats = trackedMemoryStats()
+    print("Admitted render needing " + str(estimate // (1024 * 1024)) + " MB, vips holding " +
+          str(stats["memory"] // (1024 * 1024)) + " MB (peak " + str(stats["highwater"] // (1024 * 1024)) +
+          " MB, " + str(stats["files"]) + " files)")
+
+    try:
+        yield
+    finally:
+        with memory_condition:
+            memory_reserved -= estimate
+            memory_condition.notify_all()
+
+
+@contextlib.contextmanager
+def readinessTurn(printer, job=None):
+    # Hold a render for a busy or offline printer while renders for
+    # printers that can print now are running, so they get the cpu and
+    # memory first. It still renders when nothing else is, so its spool
+    # is ready when the printer is
+    with readiness_condition:
+        waited = False
+
+        while printerstate.rank(printer["id"]) > 0 and \
+                any(count and printerstate.rank(printer_id) == 0 for printer_id, count in readiness_renders.items()):
+            if job != None and job.cancelled:
+                raise Exception("Cancelled while waiting for the printer")
+
+            if not waited:
+                print("Holding render for " + printer["id"] + ", it's " + printerstate.state(printer["id"]))
+                waited = True
+
+            readiness_condition.wait(1)
+
+        readiness_renders[printer["id"]] += 1
+
+    try:
+        yield
+    finally:
+        with readiness_condition:
+            readiness_renders[printer["id"]] -= 1
+            readiness_condition.notify_all()
+
+
+def readinessChanged():
+    # Printer states were polled, held renders may go now
+    with readiness_condition:
+        readiness_condition.notify_all()
+
+
+def renderEstimate(data, content_type, options, key=None):
+    # Pixel memory a full-resolution render of an upload is expected
+    # to need, from its header at four bytes per pixel. Streamed
+    # prints only hold a couple of tile rows
+    if content_type == "application/pdf" and options.get("all_pages"):
+        pages = [dict(options, page=i) for i in range(pdfPageCount(data))]
+    else:
+        pages = [options]
+
+    estimate = 0
+    for page in pages:
+        width, height = sourceSize(data, content_type, page)
+
+        if printStreams(data, content_type, page, key):
+            estimate += int(width * SPOOL_TILE_SIZE * 2 * 4)
+        else:
+            estimate += int(width * height * 4)
+
+    return estimate
+
+
+def sourceVariant(data, content_type, options):
+    # Documents decode to a different raster depending on the
+    # options, so they need the page and render scale in their cache
+    # key, and animations their frame. Trimmed sources are cropped to
+    # their trim box too
+    box = trimBox(data, content_type, options)
+    trim = "" if box == None else "@trim" + ",".join(str(round(edge, 6)) for edge in box)
+
+    if frameOption(content_type, options):
+        trim = "@" + frameOption(content_type, options) + trim
+
+    if content_type == "application/pdf":
+        page = documentHeader(data, content_type, options.get("page", 0))
+        scale = vectorScale(*trimmedSize(page["width"], page["height"], box), options)
+
+        return "@pdf" + str(options.get("page", 0)) + "/" + str(round(scale, 6)) + trim
+
+    elif content_type == "image/svg+xml":
+        header = documentHeader(data, content_type)
+        scale = vectorScale(*trimmedSize(header["width"], header["height"], box), options)
+
+        return "@svg" + str(round(scale, 6)) + trim
+
+    return trim
+
+
+def materialiseSource(image, key):
+    # Decode a lazy image once so later renders reuse the pixels
+    # Returns the decoded image and the bytes it costs the cache
+    estimate = image.width * image.height * image.bands * format_sizes[image.format]
+
+    # Spill when the image alone is too big, or when decoding it would
+    # take vips over the shared soft limit
+    if estimate > SOURCE_MEMORY_MAX_BYTES or trackedMemory() + estimate > RENDER_MEMORY_SOFT_LIMIT:
+        # Too big for RAM, decode to a .v file vips can mmap
+        return storeSource(image, key), 0
+
+    if SOURCE_COMPRESSION != "none":
+        return compressSource(image)
+
+    before = trackedMemory()
+    image = image.copy_memory()
+    used = trackedMemory() - before
+
+    return image, used if used > 0 else estimate
+
+
+def compressSource(image):
+    # Decode into a compressed tiled tiff in memory, costing the cache
+    # its compressed size. The tiff loader decompresses only the tiles
+    # a render asks for, the horizontal predictor and fast zstd keep
+    # that about as cheap as a memory copy
+    with stage("source_compress"):
+        buffer = image.tiffsave_buffer(tile=True, tile_width=SOURCE_TILE_SIZE, tile_height=SOURCE_TILE_SIZE,
+                                       compression=SOURCE_COMPRESSION, predictor="horizontal",
+                                       level=1 if SOURCE_COMPRESSION == "zstd" else 0)
+
+    # The image keeps a reference to the buffer it was opened from
+    compressed = pyvips.Image.new_from_buffer(buffer, "", access="random")
+
+    # Spool tuning goes by the upload's own loader, not this one
+    if image.get_typeof("vips-loader") != 0:
+        compressed = compressed.copy()
+        compressed.set_type(pyvips.GValue.gstr_type, "vips-loader", image.get("vips-loader"))
+
+    return compressed, len(buffer)
+
+
+def sourceCached(data, content_type, options, key=None):
+    # Whether cachedSource already holds the decoded pixels
+    key = (key or uploadHash(data)) + sourceVariant(data, content_type, options)
+
+    with source_cache_lock:
+        return key in source_cache
+
+
+def printStreams(data, content_type, options, key=None):
+    # Prints read their source top to bottom exactly once, so they
+    # stream from a sequential loader unless the decoded source is
+    # already to hand
+    return not sourceCached(data, content_type, options, key)
+
+
+def loadPrintSource(data, content_type, options, key=None):
+    # Full-resolution source for a print as loaded, unturned, and
+    # whether it streams from a sequential loader
+    if not printStreams(data, content_type, options, key):
+        return cachedSource(data, content_type, options, key), False
+
+    # A jpeg decoded in strips is in memory already, and can turn there
+    image = loadSource(data, content_type, options, access="sequential")
+
+    return image, image.get_typeof("blueprint-strips") == 0
+
+
+def transposeBuffer(image):
+    # Stream a sequential image into a disc temp file in fat strips
+    # so it can be rotated with bounded memory. vips mmaps the .v
+    # file, so rot90 only pages in the strips each output tile needs
+    temp = pyvips.Image.new_temp_file("%s.v")
+    image.write(temp)
+
+    return temp
+
+
+def cachedSource(data, content_type, options, key=None):
+    # Return the decoded full-resolution image for an upload, only
+    # decoding the first time these bytes are seen
+    global source_cache_bytes
+
+    key = (key or uploadHash(data)) + sourceVariant(data, content_type, options)
+
+    with source_cache_lock:
+        if key in source_cache:
+            source_cache.move_to_end(key)
+            source_cache[key]["used"] = time.time()
+            cache_hits.inc(cache="source")
+            return source_cache[key]["image"]
+
+    cache_misses.inc(cache="source")
+    tracing.instant("source cache miss", key=key)
+
+    # Spilled by this or another process already, or decoded by
+    # another kiosk, map it back
+    image, size = storedSource(key), 0
+
+    if image == None:
+        image = sharedSource(key)
+
+    if image == None:
+        with stage("decode"):
+            image, size = materialiseSource(loadSource(data, content_type, options), key)
+
+    with source_cache_lock:
+        if key not in source_cache:
+            source_cache[key] = {"image": image, "bytes": size, "used": time.time()}
+            source_cache_bytes += size
+
+        # Evict least recently used sources until back under budget
+        while source_cache_bytes > SOURCE_CACHE_MAX_BYTES and len(source_cache) > 1:
+            _, evicted = source_cache.popitem(last=False)
+            source_cache_bytes -= evicted["bytes"]
+            cache_evictions.inc(cache="source")
+
+    return image
+
+
+def sourceFile(key):
+    # Where a decoded source spills, named by a hash since the key
+    # holds the variant's punctuation
+    return os.path.join(SOURCE_DIR, hashlib.sha1(key.encode()).hexdigest() + ".v")
+
+
+def storedSource(key):
+    # Decoded source from the spill directory, or None. Opening a .v
+    # only maps it, the pixels are paged in as tiles touch them
+    path = sourceFile(key)
+
+    try:
+        image = pyvips.Image.new_from_file(path)
+    except pyvips.Error:
+        indexRemove("source", os.path.basename(path))
+        return None
+
+    # Marks it used, trimming keeps the most recently used
+    try:
+        if cache_index != None:
+            indexLater("source", os.path.basename(path), None, path=path, bytes=os.path.getsize(path))
+        else:
+            os.utime(path)
+    except OSError:
+        pass
+
+    cache_hits.inc(cache="source_file")
+    return image
+
+
+def sharedSource(key):
+    # A decoded source another kiosk put in the shared cache, or None.
+    # Mapped where it is, so only the tiles a render touches cross the
+    # network
+    path = sharedcache.lookup("sources", os.path.basename(sourceFile(key))) if sharedcache.enabled() else None
+    if path == None:
+        return None
+
+    try:
+        image = pyvips.Image.new_from_file(path)
+    except pyvips.Error:
+        return None
+
+    cache_hits.inc(cache="shared_source")
+    return image
+
+
+def shareSource(path):
+    try:
+        sharedcache.store("sources", os.path.basename(path), path)
+    except OSError as e:
+        print("Could not share " + path + ": " + str(e))
+
+
+def storeSource(image, key):
+    # Decode into the spill directory, written under a temporary name
+    # so other processes never map a part-written file
+    os.makedirs(SOURCE_DIR, exist_ok=True)
+
+    path = sourceFile(key)
+    temp = path[:-2] + "." + str(os.getpid()) + "." + str(threading.get_ident()) + ".v"
+
+    image.write_to_file(temp)
+
+    try:
+        os.replace(temp, path)
+    except OSError:
+        # Windows won't replace a file another process has mapped, the
+        # copy there holds the same pixels
+        os.remove(temp)
+
+    if cache_index != None:
+        indexPut("source", os.path.basename(path), total=SOURCE_DIR_MAX_BYTES, path=path, bytes=os.path.getsize(path))
+    else:
+        trimSourceDirectory()
+
+    if sharedcache.enabled():
+        shared_cache_pool.submit(shareSource, path)
+
+    return pyvips.Image.new_from_file(path)
+
+
+def trimSourceDirectory():
+    # Remove the least recently used spills once over budget, by their
+    # times on disc without the cache index. Files still mapped can't
+    # be removed on Windows, they go on a later pass
+    files = []
+    for name in os.listdir(SOURCE_DIR):
+        # Leave other writers' temporary files alone
+        if name.count(".") > 1:
+            continue
+
+        path = os.path.join(SOURCE_DIR, name)
+        try:
+            files.append((os.path.getmtime(path), os.path.getsize(path), path))
+        except OSError:
+            pass
+
+    total = sum(size for mtime, size, path in files)
+
+    for mtime, size, path in sorted(files)[:-1]:
+        if total <= SOURCE_DIR_MAX_BYTES:
+            break
+
+        try:
+            os.remove(path)
+            total -= size
+        except OSError:
+            pass
+
+
+def sourceSize(data, content_type, options):
+    # Get the pixel size loadSource would produce, from headers only
+    if content_type == "application/pdf":
+        # pdfload at its default 72 dpi gives the page size in points
+        page = documentHeader(data, content_type, options.get("page", 0))
+        width, height = trimmedSize(page["width"], page["height"], trimBox(data, content_type, options))
+        scale = vectorScale(width, height, options)
+
+        return int(width * scale), int(height * scale)
+
+    elif content_type == "image/svg+xml":
+        # svgload at its default 72 dpi gives the size in points too
+        header = documentHeader(data, content_type)
+        width, height = trimmedSize(header["width"], header["height"], trimBox(data, content_type, options))
+        scale = vectorScale(width, height, options)
+
+        return int(width * scale), int(height * scale)
+
+    if options.get("source_size") != None:
+        # A proxy, planned at its original's size
+        width, height = trimmedSize(*options["source_size"], trimBox(data, content_type, options))
+        return int(width), int(height)
+
+    # Trim boxes are in the pixels as stored, the plan is upright
+    image = pyvips.Image.new_from_buffer(data, frameOption(content_type, options))
+    width, height = trimmedSize(image.width, image.height, trimBox(data, content_type, options))
+
+    if uprightTurns(imageOrientation(image))[0] % 2:
+        width, height = height, width
+
+    return int(width), int(height)
+
+
+def trimBox(data, content_type, options):
+    # Content area of an upload with its plain margins cut off, or the
+    # area the user picked, which takes the place of trimming
+    # Returns (left, top, width, height) as fractions of the full
+    # image, or None when not trimming
+    area = areaBox(options)
+    if area != None:
+        # Drawn on the upright thumbnail /area shows
+        return storedBox(area, sourceOrientation(data, content_type))
+
+    if not options.get("auto_trim"):
+        return None
+
+    return imageStatistics(data, options.get("page", 0))["trim"]
+
+
+def imageStatistics(data, page=0):
+    # Everything the planner reads from an upload's pixels, from one
+    # decode of a STATISTICS_THUMBNAIL_SIZE thumbnail held in memory so
+    # each reduction over it takes microseconds: per band min, max and
+    # mean, the mean of each CMYK channel, the trim box, whether the
+    # page is blank, whether its alpha is all opaque, whether it's grey
+    # or line art and whether it's hard edged
+    key = (id(data), page)
+
+    with statistics_cache_lock:
+        entry = statistics_cache.get(key)
+        # The entry holds the bytes, so their id can't be reused while
+        # it's cached
+        if entry != None and entry[0] is data:
+            return entry[1]
+
+    with stage("statistics"):
+        thumbnail = pyvips.Image.thumbnail_buffer(data, STATISTICS_THUMBNAIL_SIZE, no_rotate=True,
+                                                  option_string="page=" + str(page) if page else "")
+
+        # Any transparent area bigger than about a 255th of a thumbnail
+        # pixel pulls that pixel's alpha under the maximum
+        opaque = not thumbnail.hasalpha() or thumbnail[thumbnail.bands - 1].min() >= paperWhite(thumbnail)
+
+        # Transparency prints as paper
+        thumbnail = toRGB(thumbnail).copy_memory()
+
+        # stats rows are the bands after an overall row, columns 0, 1
+        # and 4 their min, max and mean
+        stats = thumbnail.stats()
+        minimum = [stats(0, band + 1)[0] for band in range(thumbnail.bands)]
+        maximum = [stats(1, band + 1)[0] for band in range(thumbnail.bands)]
+        mean = [stats(4, band + 1)[0] for band in range(thumbnail.bands)]
+
+        cmyk = thumbnail.colourspace("cmyk").stats()
+        cmyk_mean = [cmyk(4, band + 1)[0] for band in range(4)]
+
+        left, top, width, height = thumbnail.find_trim(threshold=TRIM_THRESHOLD, background=[255, 255, 255])
+
+        # Largest difference between channels anywhere, then the share
+        # of pixels within a quarter of the range of black or white
+        chroma = max((thumbnail[0] - thumbnail[1]).abs().max(), (thumbnail[1] - thumbnail[2]).abs().max(),
+                     (thumbnail[0] - thumbnail[2]).abs().max())
+        grey = thumbnail.colourspace("b-w")
+        extremes = ((grey < 64) | (grey > 191)).avg() / 255
+
+        # One 16 level bin per channel, counting the bins that hold
+        # more than the blend along filtered edges
+        bins = 16
+        histogram = thumbnail.hist_find_ndim(bins=bins)
+        colours = (histogram > thumbnail.width * thumbnail.height * HARD_EDGED_MIN_SHARE).avg() / 255 * bins ** 3
+
+    box = None
+    if width > 0 and height > 0:
+        # Grow by a thumbnail pixel so shrinking never clips the content
+        left, top = max(0, left - 1), max(0, top - 1)
+        width = min(thumbnail.width - left, width + 2)
+        height = min(thumbnail.height - top, height + 2)
+
+        box = (left / thumbnail.width, top / thumbnail.height, width / thumbnail.width, height / thumbnail.height)
+
+    statistics = {"min": minimum, "max": maximum, "mean": mean, "cmyk_mean": cmyk_mean, "trim": box,
+                  "blank": max(high - low for low, high in zip(minimum, maximum)) <= TRIM_THRESHOLD,
+                  "opaque": opaque, "grey": chroma <= GREY_TOLERANCE,
+                  "bilevel": chroma <= GREY_TOLERANCE and extremes >= BILEVEL_FRACTION,
+                  "hard_edged": colours <= HARD_EDGED_MAX_COLOURS}
+
+    with statistics_cache_lock:
+        statistics_cache[key] = (data, statistics)
+
+        while len(statistics_cache) > STATISTICS_CACHE_MAX:
+            statistics_cache.popitem(last=False)
+
+    return statistics
+
+
+def dropOpaqueAlpha(image, data, page=0, probe=True):
+    # Drop an alpha band the statistics thumbnail found fully opaque,
+    # as design tools export, so every later stage handles one band
+    # fewer and nothing premultiplies or flattens. Without probe only
+    # statistics already worked out are used
+    if not image.hasalpha():
+        return image
+
+    if probe:
+        statistics = imageStatistics(data, page)
+    else:
+        with statistics_cache_lock:
+            entry = statistics_cache.get((id(data), page))
+            statistics = entry[1] if entry != None and entry[0] is data else None
+
+    if statistics == None or not statistics["opaque"]:
+        return image
+
+    return image.extract_band(0, n=image.bands - 1)
+
+
+def areaBox(options):
+    # options["area"] as a (left, top, width, height) box of fractions
+    # inside the image, or None for the whole image. Everything after
+    # planning crops to it like a trim box, so pdfs and svgs render
+    # only the area's tiles, at the dpi the area prints at
+    area = options.get("area")
+
+    try:
+        left, top, width, height = [min(max(float(edge), 0), 1) for edge in area]
+    except (TypeError, ValueError):
+        return None
+
+    width = min(width, 1 - left)
+    height = min(height, 1 - top)
+    if width <= 0 or height <= 0 or (width >= 1 and height >= 1):
+        return None
+
+    return left, top, width, height
+
+
+def trimmedSize(width, height, box):
+    # Size left after cropping to a trim box
+    if box == None:
+        return width, height
+
+    return max(1, width * box[2]), max(1, height * box[3])
+
+
+def applyTrim(image, box):
+    # Crop a full size lazy image to a trim box
+    if box == None:
+        return image
+
+    return image.crop(*trimPixels(image.width, image.height, box))
+
+
+def trimPixels(width, height, box):
+    # A trim box as a (left, top, width, height) box of pixels
+    left = min(width - 1, int(box[0] * width))
+    top = min(height - 1, int(box[1] * height))
+
+    return left, top, max(1, min(width - left, round(box[2] * width))), max(1, min(height - top, round(box[3] * height)))
+
+
+def previewSource(data, rotate, width, height, page=0, box=None, shrink=1, linear=False, scale=1, orientation=1):
+    # Render the upload at preview size, or shrink times smaller for a
+    # rough first look. jpeg/webp/avif/jxl shrink on load, avif from
+    # its embedded thumbnail when it's big enough, and pdf/svg
+    # rasterise at the preview scale, so we never decode more pixels
+    # than the preview displays. linear resizes from previewBase in
+    # linear light instead, while the preview is no bigger than it.
+    # Pixels are shrunk as stored and turned upright at the end
+    width_pix, height_pix = previewSize(width, height, scale)
+    width_pix, height_pix = width_pix / shrink, height_pix / shrink
+
+    if uprightTurns(orientation, rotate)[0] % 2:
+        width_pix, height_pix = height_pix, width_pix
+
+    if box != None:
+        # Shrink the whole image so the trimmed area comes out at
+        # the preview size
+        width_pix, height_pix = width_pix / box[2], height_pix / box[3]
+
+    if linear and max(width_pix, height_pix) <= PREVIEW_BASE_SIZE:
+        base = previewBase(data, page)
+        image = base.colourspace("scrgb").resize(max(1, int(width_pix)) / base.width,
+                                                 vscale=max(1, int(height_pix)) / base.height).colourspace("srgb")
+    else:
+        image = ingestMetadata(pyvips.Image.thumbnail_buffer(data, max(1, int(width_pix)),
+                                                             height=max(1, int(height_pix)), size="force",
+                                                             no_rotate=True,
+                                                             option_string="page=" + str(page) if page else ""))
+    # A preview is small, so it only uses an alpha probe that's
+    # already been done rather than decoding the thumbnail for one
+    image = dropOpaqueAlpha(applyTrim(image, box), data, page, probe=False)
+
+    return orient(image, orientation, rotate)
+
+
+def estimateInk(data, content_type, options, width, height):
+    # Ink in ml per CMYK channel for one planned print, from its mean
+    # coverage converted to CMYK. Paper white and transparency take no
+    # ink, so a trimmed print's coverage is the whole image's over the
+    # share of it that's left
+    page = options.get("page", 0) if content_type == "application/pdf" or content_type in framed_images else 0
+    statistics = imageStatistics(data, page)
+
+    box = trimBox(data, content_type, options)
+    area = box[2] * box[3] if box != None else 1
+
+    return [min(1, mean / 255 / area) * width * height * INK_ML_PER_SQUARE_INCH for mean in statistics["cmyk_mean"]]
+
+
+def previewBase(data, page=0):
+    # Upload shrunk in linear light to PREVIEW_BASE_SIZE, once per
+    # upload and page. Linear thumbnails can't shrink on load, so this
+    # is the one full decode a raster preview costs
+    key = (id(data), page)
+
+    with preview_bases_lock:
+        entry = preview_bases.get(key)
+        # The entry holds the bytes, so their id can't be reused while
+        # it's cached
+        if entry != None and entry[0] is data:
+            preview_bases.move_to_end(key)
+            return entry[1]
+
+    with stage("preview_base"):
+        base = ingestMetadata(pyvips.Image.thumbnail_buffer(data, PREVIEW_BASE_SIZE, height=PREVIEW_BASE_SIZE,
+                                                            size="down", linear=True, no_rotate=True,
+                                                            option_string="page=" + str(page) if page else "")) \
+            .copy_memory()
+
+    with preview_bases_lock:
+        preview_bases[key] = (data, base)
+
+        while len(preview_bases) > PREVIEW_BASES_MAX:
+            preview_bases.popitem(last=False)
+
+    return base
+
+
+def vectorScale(width, height, options):
+    # Scale to rasterise a vector page at, relative to its 72 dpi
+    # points. The physical print size is planned from the page shape
+    # first, then we ask for exactly the pixels the print needs
+    if options["specific_dpi"] != None:
+        # Print at the document's own size at the requested dpi
+        return options["specific_dpi"] / 72
+
+    rotate, width_inches, height_inches, dpi = calculateSize(width, height, options)
+
+    # Width of the page once it is turned to its print orientation
+    page_width = height if rotate else width
+
+    print_dpi = min(VECTOR_PRINT_DPI, PRINTER_NATIVE_DPI, optionsPreset(options)["max_dpi"] or math.inf)
+
+    return max(1, width_inches) * print_dpi / page_width
+
+
+def pdfPageCount(data):
+    # Number of pages in a pdf, from its header
+    return documentHeader(data, "application/pdf")["pages"]
+
+
+def documentHeader(data, content_type, page=0):
+    # Size in points of a pdf page or an svg, and the pdf's page count.
+    # poppler and librsvg parse the whole document just to open it,
+    # which for a CAD svg with a few hundred thousand paths is most of
+    # a preview, so each upload and page is parsed for its size once.
+    # Only renders at a new scale parse it again
+    key = (id(data), content_type, page)
+
+    with document_headers_lock:
+        entry = document_headers.get(key)
+        # The entry holds the bytes, so their id can't be reused while
+        # it's cached
+        if entry != None and entry[0] is data:
+            document_headers.move_to_end(key)
+            return entry[1]
+
+    with stage("document_header"):
+        if content_type == "application/pdf":
+            image = pyvips.Image.pdfload_buffer(data, page=page)
+        else:
+            image = pyvips.Image.svgload_buffer(data)
+
+        header = {"width": image.width, "height": image.height,
+                  "pages": image.get("n-pages") if image.get_typeof("n-pages") != 0 else 1}
+
+    with document_headers_lock:
+        document_headers[key] = (data, header)
+
+        while len(document_headers) > DOCUMENT_HEADERS_MAX:
+            document_headers.popitem(last=False)
+
+    return header
+
+
+def frameOption(content_type, options):
+    # Loader option string for an animation's chosen frame. Loaders
+    # decode just that one frame, n defaults to 1
+    page = options.get("page", 0)
+
+    return "page=" + str(page) if content_type in framed_images and page else ""
+
+
+def frameCount(data):
+    # Frames in an animated upload or pages in a tiff, from its header
+    header = pyvips.Image.new_from_buffer(data, "")
+    count = header.get("n-pages") if header.get_typeof("n-pages") != 0 else 1
+
+    # A tiff whose pages halve in size is one image saved as a page
+    # pyramid, its pages are levels for thumbnail to shrink from rather
+    # than pages to pick
+    if count > 1 and header.get("vips-loader").startswith("tiffload"):
+        level = pyvips.Image.new_from_buffer(data, "page=1")
+
+        if abs(header.width / max(1, level.width) - 2) < 0.1 and abs(header.height / max(1, level.height) - 2) < 0.1:
+            return 1
+
+    return count
+
+
+def convertPDF(data, options, access="random"):
+    print("Rendering from PDF...")
+
+    # Read the page size, then reopen the page at the target dpi.
+    # poppler only rasterises tiles as the output pulls them, so
+    # the whole page bitmap is never held at once
+    page_number = options.get("page", 0)
+    page = documentHeader(data, "application/pdf", page_number)
+    scale = vectorScale(*trimmedSize(page["width"], page["height"], trimBox(data, "application/pdf", options)),
+                        options)
+
+    if pdfBackend(data, page_number, page["width"] * scale * page["height"] * scale) == "pdfium":
+        return pdfiumPage(data, page_number, scale)
+
+    image = pyvips.Image.pdfload_buffer(data, page=page_number, dpi=scale * 72, access=access)  # pdf's units are in 1/72 of an inch, picos
+
+    return cloneColumns(image, lambda: pyvips.Image.pdfload_buffer(data, page=page_number, dpi=scale * 72,
+                                                                   access=access, revalidate=True))
+
+
+def cloneColumns(image, clone, drawn=None):
+    # A pdfload or svgload renders its tiles one at a time, its poppler
+    # document or rsvg handle can't be shared between threads, so a big
+    # page gets a load of its own from clone for each column. The vips
+    # workers walk a row of tiles across the columns, each load
+    # rendering its own. Loads clone with revalidate, so the operation
+    # cache doesn't hand back the same one each time. drawn(left, top,
+    # width, height) says whether a cell of a column has anything in
+    # it, cells that don't are left transparent without rendering
+    columns = min(VECTOR_RENDER_CLONES, image.width // VECTOR_CLONE_MIN_WIDTH)
+    if columns < 2 or image.width * image.height < VECTOR_CLONE_MIN_PIXELS:
+        return image
+
+    edges = [image.width * column // columns for column in range(columns + 1)]
+    joined = None
+
+    for left, right in zip(edges, edges[1:]):
+        load = image if joined == None else clone()
+        column = load.crop(left, 0, right - left, image.height)
+
+        if drawn != None:
+            column = cullColumn(column, left, drawn)
+
+        joined = column if joined == None else joined.join(column, "horizontal")
+
+    return joined
+
+
+def cullColumn(column, left, drawn):
+    # column with its empty cells swapped for transparent black
+    cells = []
+    culled = False
+
+    for top in range(0, column.height, SVG_CULL_CELL_HEIGHT):
+        height = min(SVG_CULL_CELL_HEIGHT, column.height - top)
+
+        if drawn(left, top, column.width, height):
+            cells.append(column.crop(0, top, column.width, height))
+        else:
+            cells.append(pyvips.Image.black(column.width, height, bands=column.bands)
+                         .copy(interpretation=column.interpretation))
+            culled = True
+
+    if not culled:
+        return column
+
+    joined = cells[0]
+    for cell in cells[1:]:
+        joined = joined.join(cell, "vertical")
+
+    return joined
+
+
+def pdfBackend(data, page_number, pixels):
+    # Which rasteriser prints a pdf page of this many pixels
+    if pypdfium2 == None or pixels > PDFIUM_MAX_PIXELS or PDF_BACKEND not in ["pdfium", "auto"]:
+        return "poppler"
+
+    if PDF_BACKEND == "pdfium":
+        return "pdfium"
+
+    key = (uploadHash(data), page_number)
+
+    with pdf_backends_lock:
+        if key in pdf_backends:
+            return pdf_backends[key]
+
+    backend = pdfAutoBackend(pdfimage.pageFeatures(data, page_number))
+
+    with pdf_backends_lock:
+        pdf_backends[key] = backend
+
+        while len(pdf_backends) > PDF_BACKENDS_MAX:
+            pdf_backends.popitem(last=False)
+
+    return backend
+
+
+def pdfAutoBackend(features):
+    # auto's rasteriser for a page of pdfimage.pageFeatures, poppler for
+    # pages it couldn't read
+    if features == None or features["path_operators"] < PDFIUM_MIN_PATHS:
+        return "poppler"
+
+    if features["path_operators"] < PDFIUM_PATHS_PER_TEXT * max(1, features["text_operators"]):
+        return "poppler"
+
+    return "pdfium"
+
+
+def pdfiumPage(data, page_number, scale):
+    # A pdf page drawn by pdfium at scale as an sRGB vips image. pdfium
+    # isn't thread safe, so pages draw one at a time, and into memory of
+    # vips' own once drawn so the bitmap can go
+    with pdfium_lock, stage("pdfium_render"):
+        document = pypdfium2.PdfDocument(data)
+
+        try:
+            bitmap = document[page_number].render(scale=scale, rev_byteorder=True,
+                                                  force_bitmap_format=pypdfium2.raw.FPDFBitmap_BGRA)
+            image = pyvips.Image.new_from_memory(bitmap.buffer, bitmap.width, bitmap.height, 4, "uchar") \
+                .extract_band(0, n=3).copy(interpretation="srgb").copy_memory()
+        finally:
+            document.close()
+
+    return image
+
+def convertSVG(data, options, access="random"):
+    print("Rendering from SVG...")
+    # Render the svg straight at its physical print size, the same
+    # planning as pdfs, and keep it as a vips image into the pipeline
+    header = documentHeader(data, "image/svg+xml")
+    scale = vectorScale(*trimmedSize(header["width"], header["height"], trimBox(data, "image/svg+xml", options)),
+                        options)
+
+    image = pyvips.Image.svgload_buffer(data, scale=scale, access=access)
+
+    return cloneColumns(image, lambda: pyvips.Image.svgload_buffer(data, scale=scale, access=access, revalidate=True),
+                        svgDrawn(data, image, scale))
+
+
+def svgDrawn(data, image, scale):
+    # Whether a cell of the svg rendered as image has anything in it,
+    # from the alpha of one small render. Any coverage at all in the
+    # cell's pixels of the small render counts, so hairlines aren't lost
+    if image.width * image.height < VECTOR_CLONE_MIN_PIXELS:
+        return None
+
+    with stage("svg_cull"):
+        mask = pyvips.Image.svgload_buffer(data, scale=scale * SVG_CULL_MASK_WIDTH / image.width)[3] \
+            .copy_memory()
+
+    ratio = mask.width / image.width
+
+    def drawn(left, top, width, height):
+        x = min(mask.width - 1, int(left * ratio))
+        y = min(mask.height - 1, int(top * ratio))
+        region = mask.crop(x, y, max(1, min(mask.width - x, math.ceil(width * ratio) + 1)),
+                           max(1, min(mask.height - y, math.ceil(height * ratio) + 1)))
+        return region.max() > 0
+
+    return drawn
+
+# EXIF orientations as the quarter turns clockwise, then the flip left
+# to right, that put an image upright, as vips autorot applies them
+ORIENTATIONS = {1: (0, False), 2: (0, True), 3: (2, False), 4: (2, True),
+                5: (1, True), 6: (1, False), 7: (3, True), 8: (3, False)}
+
+
+def sourceOrientation(data, content_type):
+    # EXIF orientation of a raster upload from its header, 1 when it's
+    # stored upright
+    if content_type not in supported_images:
+        return 1
+
+    return imageOrientation(pyvips.Image.new_from_buffer(data, ""))
+
+
+def imageOrientation(image):
+    # Orientation tag a loaded image still carries, crops, resizes and
+    # the decoded source cache all keep it
+    return image.get("orientation") if image.get_typeof("orientation") != 0 else 1
+
+
+def uprightTurns(orientation, rotate=False):
+    # Quarter turns clockwise and whether to flip that put an image
+    # upright, then a quarter turn more to print orientation when
+    # rotate is set. A flip then a clockwise turn is an anticlockwise
+    # turn then the flip, so both fold into one rotation
+    turns, flip = ORIENTATIONS.get(orientation, (0, False))
+
+    if rotate:
+        turns += -1 if flip else 1
+
+    return turns % 4, flip
+
+
+def orient(image, orientation, rotate=False):
+    # Turn an image upright and to print orientation with at most one
+    # rotation and one flip, so honouring EXIF costs nothing on top of
+    # the turn a print gets anyway. The tag goes, so nothing turns the
+    # pixels again
+    turns, flip = uprightTurns(orientation, rotate)
+
+    if turns:
+        image = image.rot(["d0", "d90", "d180", "d270"][turns])
+
+    if flip:
+        image = image.fliphor()
+
+    if image.get_typeof("orientation") != 0:
+        image = image.copy()
+        image.remove("orientation")
+
+    return image
+
+
+def uprightSize(image):
+    # Width and height of a loaded image once it's turned upright
+    if uprightTurns(imageOrientation(image))[0] % 2:
+        return image.height, image.width
+
+    return image.width, image.height
+
+
+def storedBox(box, orientation):
+    # A box drawn on the upright image as fractions of the image as
+    # stored, undoing the flip and then each clockwise turn
+    turns, flip = ORIENTATIONS.get(orientation, (0, False))
+    corners = [(box[0], box[1]), (box[0] + box[2], box[1] + box[3])]
+
+    if flip:
+        corners = [(1 - x, y) for x, y in corners]
+
+    for turn in range(turns):
+        corners = [(y, 1 - x) for x, y in corners]
+
+    (x0, y0), (x1, y1) = corners
+
+    return [min(x0, x1), min(y0, y1), abs(x1 - x0), abs(y1 - y0)]
+
+
+def needsRotation(width, height, options):
+    # Flip the image so that the long side is the width
+    if width > height and options["side"] == "short":
+        return True
+
+    if width < height and options["side"] == "long":
+        return True
+
+    return False
+
+
+def calculateSize(width, height, options):
+    # Work out the print size from the source dimensions alone,
+    # so callers can plan a render without touching any pixels
+    # Return whether to rotate, the size in inches, and the dpi
+
+    final_width_inches = 0
+    final_height_inches = 0
+
+    rotate = needsRotation(width, height, options)
+    if rotate:
+        width, height = height, width
+
+    # Case 1: Specific height/width
+    if options["specific_width"] != None or options["specific_height"] != None:
+        # Resize the image to the specified width & height
+        if options["specific_width"] != None and options["specific_height"] == None: #specified width, calculate height
+            # Calc dpi
+            final_dpi = width / options["specific_width"]
+            final_width_inches = options["specific_width"]
+            final_height_inches = height / final_dpi
+
+        elif options["specific_height"] != None and options["specific_width"] == None: #specified height, calculate width
+            # Calc dpi
+            final_dpi = height / options["specific_height"]
+            final_width_inches = width / final_dpi
+            final_height_inches = options["specific_height"]
+
+        else: #specified both, just resize
+            # Determine which is bounding dimension
+            if width / options["specific_width"] > height / options["specific_height"]:
+                # Width is bounding
+                final_dpi = width / options["specific_width"]
+                final_width_inches = options["specific_width"]
+                final_height_inches = height / final_dpi
+            else:
+                # Height is bounding
+                final_dpi = height / options["specific_height"]
+                final_width_inches = width / final_dpi
+                final_height_inches = options["specific_height"]
+
+    # Case 2: Specific DPI
+    elif options["specific_dpi"] != None:
+        # Resize the image to the specified dpi
+        final_dpi = options["specific_dpi"]
+
+        final_width_inches = width / final_dpi
+        final_height_inches = height / final_dpi
+
+    # Case 3: Auto max size
+    else:
+        side_a = 0
+        side_b = 0
+        if (options["side"] == "short" and width > height) or (options["side"] == "long" and width < height):  # shorter sidea
+            side_a = height
+            side_b = width
+        else:
+            side_a = width
+            side_b = height
+
+        final_dpi = side_a / options["paper_width"]
+
+        final_height_inches = side_b / final_dpi
+        final_width_inches = options["paper_width"]
+
+    # Make sure all final sizes are ints
+    final_width_inches = int(final_width_inches)
+    final_height_inches = math.ceil(final_height_inches)
+    final_dpi = int(final_dpi)
+
+    print("Final width: " + str(final_width_inches) + " inches")
+    print("Final height: " + str(final_height_inches) + " inches")
+
+    return rotate, final_width_inches, final_height_inches, final_dpi
+
+
+def setEpsonConfig(printer, width, height):
+    # Only the printer taking the job has its config touched, callers
+    # hold its printer_locks entry while it is installed
+    printers.configure(printer, width, height)
+
+
+def toRGB(image, depth=8):
+    # Flatten any alpha onto white paper and convert to sRGB at 8 or 16
+    # bits, 16-bit and CMYK sources go straight to the output depth in
+    # one conversion
+    if image.hasalpha():
+        image = image.flatten(background=paperWhite(image))
+
+    if depth == 16:
+        return image.colourspace("rgb16").cast("ushort")
+
+    return image.colourspace("srgb").cast("uchar")
+
+
+def toSpool(image, depth=8):
+    # toGrey for prints greyForPrint left one band, else toRGB, so the
+    # stages before the spool keep grey prints grey
+    if PRINT_GREY and image.bands - image.hasalpha() == 1:
+        return toGrey(image, depth)
+
+    return toRGB(image, depth)
+
+
+def paperWhite(image):
+    # White in the image's own range
+    return 65535 if image.format == "ushort" else 255
+
+
+def toPrint(image, depth=8, profile=None):
+    # Colour manage into the printer's paper profile when it has one,
+    # so lcms converts inside the tile pipeline on every vips thread
+    # instead of the driver converting on one. Otherwise plain sRGB
+    if profile == None:
+        return toSpool(image, depth)
+
+    if image.hasalpha():
+        image = image.flatten(background=paperWhite(image))
+
+    # Embedded profiles are used when there is one, untagged images are
+    # taken as sRGB, or CMYK for CMYK images
+    if image.interpretation == "cmyk":
+        input_profile = "cmyk"
+    else:
+        input_profile = "srgb"
+        if image.bands < 3:
+            image = image.colourspace("srgb")
+
+    return image.icc_transform(profile, input_profile=input_profile, embedded=True,
+                               intent=RENDER_INTENT, depth=depth).cast("ushort" if depth == 16 else "uchar")
+
+
+def proofProfile(options):
+    # Paper profile a soft proofed preview of options simulates, that
+    # of the printer and preset the print would go to now, or None
+    if not options.get("soft_proof") or not options.get("paper_width"):
+        return None
+
+    printer = printers.route(printers.selected(), options["paper_width"], printerLoad)
+
+    return presetPrinter(printer, options)["icc_profile"]
+
+
+def softProof(image, profile):
+    # A preview as it prints on the paper: into the paper profile as
+    # toPrint converts it, and back to sRGB for the screen. Only ever
+    # given preview-sized images, so lcms runs over a megapixel or so
+    if profile == None:
+        return image
+
+    if image.interpretation == "cmyk":
+        input_profile = "cmyk"
+    else:
+        input_profile = "srgb"
+        if image.bands - image.hasalpha() < 3:
+            image = image.colourspace("srgb")
+
+    try:
+        with stage("soft_proof"):
+            return image.icc_transform(profile, input_profile=input_profile, embedded=True, intent=RENDER_INTENT) \
+                .icc_transform("srgb", input_profile=profile, intent=SOFT_PROOF_INTENT)
+    except pyvips.Error as e:
+        print("Could not soft proof with " + profile + ": " + str(e))
+        return image
+
+
+def toGrey(image, depth=8):
+    # Flatten any alpha onto white paper and keep one grey band at 8 or
+    # 16 bits
+    if image.hasalpha():
+        image = image.flatten(background=paperWhite(image))
+
+    if depth == 16:
+        return image.colourspace("grey16").cast("ushort")
+
+    return image.colourspace("b-w").cast("uchar")
+
+
+def toRGBA(image):
+    # Convert to 8-bit sRGB, keeping or adding an alpha band
+    image = image.colourspace("srgb")
+
+    if not image.hasalpha():
+        image = image.bandjoin(255)
+
+    return image.cast("uchar")
+
+
+def previewSize(width, height, scale=1):
+    # Size in pixels of the print on the preview mockup drawn scale
+    # times its own size
+    mockup = previewMockup()
+    width_pix = mockup["print_width"] * scale * (width / mockup["max_width"])
+    # Calc height from width
+    height_pix = width_pix * (height/width)
+
+    return width_pix, height_pix
+
+
+def previewFile(timestamp):
+    # Path a preview is saved to in the cache dir
+    timestamp, format = timestamp.rsplit(".", 1)
+    return os.path.join(PREVIEW_DIR, timestamp + "output." + format)
+
+
+def previewFormat(accept):
+    # Preview encoding for a request's Accept header
+    if PREVIEW_FORMAT == "png" or "image/" + PREVIEW_FORMAT in accept:
+        return PREVIEW_FORMAT
+
+    return "jpeg"
+
+
+def encodePreview(image, format=PREVIEW_FORMAT, mockup=False):
+    # Previews are thrown away after a few seconds, so encode for speed
+    # rather than size. jpeg has no alpha, so it's flattened onto the
+    # mockup the preview sits over, or white when it isn't a preview
+    # canvas
+    if format == "webp":
+        return image.webpsave_buffer(Q=85, effort=0)
+    elif format == "jpeg":
+        if mockup:
+            image = mockupBackdrop(image.width, image.height).composite2(image, "over")
+        return image.flatten(background=[255, 255, 255]).jpegsave_buffer(Q=PREVIEW_JPEG_QUALITY, optimize_coding=False,
+                                                                         subsample_mode="on")
+    else:
+        return image.pngsave_buffer(compression=1, filter="none")
+
+
+def mockupBackdrop(width, height):
+    # The display's mockup image at a preview canvas's size
+    image = pyvips.Image.thumbnail(os.path.join("static", "img", previewMockup()["image"]), width, height=height,
+                                   size="force")
+
+    return toRGBA(image)
+
+
+def storePreviewImage(timestamp, buffer):
+    # Keep an encoded preview in memory, spilling the oldest to the
+    # cache dir once over budget, and removing the oldest spilled once
+    # that's over its own. Previews are only ever evicted, a print or
+    # another kiosk tab never clears the ones a browser still shows
+    global preview_images_bytes, preview_spills_bytes
+
+    with preview_images_lock:
+        preview_images[timestamp] = buffer
+        preview_images_bytes += len(buffer)
+
+        while preview_images_bytes > PREVIEW_MEMORY_MAX_BYTES and len(preview_images) > 1:
+            spilled, spilled_buffer = preview_images.popitem(last=False)
+            preview_images_bytes -= len(spilled_buffer)
+
+            # Indexed previews are written out already
+            if not os.path.exists(previewFile(spilled)):
+                with open(previewFile(spilled), "wb") as f:
+                    f.write(spilled_buffer)
+
+            preview_spills[spilled] = len(spilled_buffer)
+            preview_spills_bytes += len(spilled_buffer)
+
+        while preview_spills_bytes > PREVIEW_DIR_MAX_BYTES and len(preview_spills) > 1:
+            removed, removed_bytes = preview_spills.popitem(last=False)
+            preview_spills_bytes -= removed_bytes
+            cache_evictions.inc(cache="preview_file")
+
+            try:
+                os.remove(previewFile(removed))
+            except OSError:
+                pass
+
+
+def previewImage(timestamp):
+    # Encoded preview from memory, or None if it was spilled or cleared
+    with preview_images_lock:
+        return preview_images.get(timestamp)
+
+
+def previewExists(timestamp):
+    return previewImage(timestamp) != None or os.path.exists(previewFile(timestamp))
+
+
+def previewPhoto(image, width, height, paper_width, scale=1):
+    width_pix, height_pix = previewSize(width, height, scale)
+
+    target_width, target_height = max(1, int(width_pix)), max(1, int(height_pix))
+
+    # previewSource already shrinks to the preview size, so usually
+    # only the alpha and cast remain. Opaque images resize without the
+    # premultiply round trip and gain their alpha after, on the small
+    # image, so each tile runs as few operations as possible
+    if image.width != target_width or image.height != target_height:
+        if image.hasalpha():
+            # Premultiply so transparent edges don't bleed
+            image = toRGBA(image).premultiply()
+            image = image.resize(target_width / image.width, vscale=target_height / image.height)
+            image = image.unpremultiply()
+        else:
+            image = image.resize(target_width / image.width, vscale=target_height / image.height)
+
+    image = toRGBA(image)
+
+    # Embed the image on a transparent canvas the size of the mockup so
+    # its bottom right hangs from the mockup's print corner
+    mockup = previewMockup()
+    preview = image.embed(round(mockup["right"] * scale) - int(width_pix), round(mockup["bottom"] * scale) - int(height_pix),
+                          round(mockup["width"] * scale), round(mockup["height"] * scale),
+                          extend="background", background=[255, 255, 255, 0])
+
+    return preview
+
+
+def printPhoto(image, width, height, dpi, directory, job, printer, landscape=False):
+    # Render into the job's own directory, only the hand-off to the
+    # printer is serialised. landscape prints are spooled unturned for
+    # the driver to turn, see driverTurns
+    if memorySpools(image):
+        printFromMemory(image, width, height, dpi, directory, job, printer, landscape)
+    elif PRINT_BACKEND == "direct" and DIRECT_STREAM and getattr(worker_capture, "handoffs", None) == None:
+        streamBands(image, width, height, dpi, directory, job, printer, landscape)
+    elif PRINT_BACKEND == "direct":
+        # Spool bands straight to the printer through GDI
+        with stage("print_encode"):
+            writeBands(image, os.path.join(directory, "output"), dpi, job, printer, landscape)
+
+        handOff(printer, width, height, [os.path.join(directory, "output.json")], ["--direct"], job)
+    else:
+        filename = os.path.join(directory, "output.tif")
+        with stage("print_encode"):
+            writeSpool(image, filename, dpi, jobProgress(job, 0, 1), printer)
+
+        handOff(printer, width, height, [filename], job=job)
+
+    dropVipsCache()
+
+
+def streamBands(image, width, height, dpi, directory, job, printer, landscape=False):
+    # Hand PrintGUI the band manifest before any band is written, so it
+    # draws each band as soon as it lands while the pipeline computes
+    # the rows below. A failed render leaves output.json.failed for
+    # PrintGUI to give up on
+    manifest = os.path.join(directory, "output.json")
+    with contextlib.suppress(FileNotFoundError):
+        os.remove(manifest + ".failed")
+
+    pool = concurrent.futures.ThreadPoolExecutor(max_workers=1)
+    handoff = []
+
+    def started():
+        handoff.append(pool.submit(handOff, printer, width, height, [manifest], ["--direct"], job))
+
+    try:
+        with stage("print_encode"):
+            writeBands(image, os.path.join(directory, "output"), dpi, job, printer, landscape, started)
+    except:
+        open(manifest + ".failed", "w").close()
+        raise
+    finally:
+        pool.shutdown(wait=False)
+
+    # The render is done when the last band is, not at the hand-off
+    if job != None:
+        job.rendered = time.time()
+
+    handoff[0].result()
+
+
+def memorySpools(image):
+    # Whether a direct print is small enough to spool in memory. Only
+    # PrintGUI on this machine can map it, so not for renders done for
+    # a kiosk
+    return PRINT_BACKEND == "direct" and sys.platform == "win32" and \
+        getattr(worker_capture, "handoffs", None) == None and \
+        image.width * image.height * 4 <= MEMORY_SPOOL_MAX_BYTES
+
+
+def printFromMemory(image, width, height, dpi, directory, job, printer, landscape=False):
+    # Spool a direct print in shared memory and hand PrintGUI its
+    # manifest. The memory is released when PrintGUI reports the print
+    # spooled or failed
+    manifest = os.path.join(directory, "output.json")
+
+    with stage("print_encode"):
+        spool = writeMemorySpool(image, manifest, dpi, job, printer, landscape)
+
+    with handoff_condition:
+        memory_spools[handoffPath(manifest)] = spool
+
+    try:
+        handOff(printer, width, height, [manifest], ["--direct"], job)
+    except:
+        with handoff_condition:
+            releaseMemorySpool(manifest)
+        raise
+
+
+def writeMemorySpool(image, manifest, dpi, job, printer, landscape=False):
+    # Render the print with vips_sink_memory straight into one
+    # page-aligned buffer sized from its plan, shared under a name
+    # PrintGUI opens, and write a manifest describing the buffer as
+    # bands of rows so GDI still draws a band at a time. Pixels are
+    # BGRX, the layout of a 32-bit GDI bitmap, whose rows need no
+    # padding. Returns the buffer
+    image = toPrint(image, 8, printer["icc_profile"])
+    if image.bands == 1:
+        image = image.bandjoin([image, image])
+    image = image[2].bandjoin([image[1], image[0]]).bandjoin_const([255])
+
+    name = "Local\\blueprint-" + hashlib.blake2b(handoffPath(manifest).encode(), digest_size=8).hexdigest()
+    spool = mmap.mmap(-1, image.width * image.height * 4, tagname=name)
+
+    target = pyvips.Image.new_from_memory(spool, image.width, image.height, 4, "uchar")
+    watchProgress(image, jobProgress(job, 0, 1))
+    image.write(target)
+    del target
+
+    bands = [{"file": "", "top": top, "height": min(DIRECT_BAND_HEIGHT, image.height - top)}
+             for top in range(0, image.height, DIRECT_BAND_HEIGHT)]
+
+    with open(manifest, "w") as f:
+        json.dump({"dpi": max(1, dpi), "width_pixels": image.width, "height_pixels": image.height, "bands": bands,
+                   "landscape": landscape, "streaming": False, "memory": name, "stride": image.width * 4}, f)
+
+    return spool
+
+
+def releaseMemorySpool(filename):
+    # Free a memory spool and its manifest, which means nothing without
+    # it, so copies of the print render again. Called holding
+    # handoff_condition
+    spool = memory_spools.pop(handoffPath(filename), None)
+    if spool == None:
+        return
+
+    # A view vips hasn't let go of yet keeps it until it's collected
+    with contextlib.suppress(BufferError):
+        spool.close()
+
+    with contextlib.suppress(FileNotFoundError):
+        os.remove(filename)
+
+
+def printBatch(pages, directory, job, printer):
+    # Print several planned pages as one job
+    # pages is a list of (image, width, height, dpi)
+    filenames = [os.path.join(directory, "output-" + str(i) + ".tif") for i in range(len(pages))]
+
+    # Encode the pages concurrently, each write also runs on the
+    # vips threadpool so don't start more pages than it has threads,
+    # less the share kept back for previews
+    with stage("print_encode"):
+        render_pool.map(lambda i: writeSpool(pages[i][0], filenames[i], pages[i][3], jobProgress(job, i, len(pages)),
+                                             printer), range(len(pages)), reserve=PREVIEW_THREADS)
+
+    # One paper configuration has to fit every page
+    handOff(printer, max(page[1] for page in pages), max(page[2] for page in pages), filenames, job=job)
+
+    dropVipsCache()
+
+
+def handOff(printer, width, height, filenames, flags=[], job=None):
+    # Send a rendered print once the printer's previous one is done
+    # with, so the driver config isn't changed under an open dialog
+    # and the next print is ready the moment the operator finishes.
+    # Renders for a kiosk only record theirs, the kiosk hands off
+    captured = getattr(worker_capture, "handoffs", None)
+    if captured != None:
+        captured.append({"width": width, "height": height, "files": filenames, "flags": flags})
+        return
+
+    with printer_locks[printer["id"]]:
+        if job != None:
+            job.status = "waiting"
+            job.rendered = job.rendered or time.time()
+
+        awaitHandoff(printer, job)
+
+        if job != None and job.cancelled:
+            raise Exception("Print cancelled")
+
+        setEpsonConfig(printer, width, height)
+        sendToPrinter(filenames, flags, printer)
+
+    if job != None:
+        with spooled_prints_lock:
+            spooled_prints[job.id] = (printer, width, height, filenames, flags)
+
+            while len(spooled_prints) > SPOOLED_PRINTS_MAX:
+                spooled_prints.popitem(last=False)
+
+
+def awaitHandoff(printer, job=None):
+    # Wait until PrintGUI reports every file of the printer's last
+    # hand-off closed, timed out, spooled or failed, or the job is
+    # cancelled. A PrintGUI that doesn't report isn't waited for
+    deadline = time.time() + HANDOFF_TIMEOUT_SECONDS
+
+    with handoff_condition:
+        while handoff_reporting and (job == None or not job.cancelled) and \
+                not all(handoff_status.get(path) in ["closed", "timeout", "spooled", "failed"]
+                        for path in handoffs.get(printer["id"], [])):
+            if time.time() >= deadline:
+                print(printer["name"] + " previous print never reported back, sending anyway")
+                return
+
+            handoff_condition.wait(deadline - time.time())
+
+
+def packGang(sizes, roll_width):
+    # Shelf pack (width, height) inch rectangles onto a roll, tallest
+    # first, left to right until a shelf is full
+    # Returns each rectangle's (x, y) in inches and the sheet height
+    order = sorted(range(len(sizes)), key=lambda i: -sizes[i][1])
+    positions = [None] * len(sizes)
+
+    x, y, shelf_height = 0, 0, 0
+    for i in order:
+        width, height = sizes[i]
+
+        if x > 0 and x + width > roll_width:
+            # Start a new shelf under the tallest print of the last one
+            x, y = 0, y + shelf_height + GANG_GAP_INCHES
+            shelf_height = 0
+
+        positions[i] = (x, y)
+        x += width + GANG_GAP_INCHES
+        shelf_height = max(shelf_height, height)
+
+    return positions, y + shelf_height
+
+
+def printGang(entries, roll_width, job, printer):
+    # Compose the ganged prints onto one sheet and spool it. Each print
+    # is inserted as a lazy view of its own pipeline, so none of them
+    # is materialised before the sheet is written
+    dpi = min(GANG_DPI, PRINTER_NATIVE_DPI)
+
+    plans = [calculateSize(*sourceSize(entry["data"], entry["content_type"], entry["options"]), entry["options"])
+             for entry in entries]
+    positions, sheet_height = packGang([(plan[1], plan[2]) for plan in plans], roll_width)
+
+    estimate = sum(renderEstimate(entry["data"], entry["content_type"], entry["options"], entry["key"])
+                   for entry in entries)
+
+    with tracing.span("print_gang", prints=len(entries)), profiling.labelled("print_gang"), \
+         renderAdmission(estimate, job):
+        directory = spoolDirectory(job)
+
+        sheet = pyvips.Image.black(math.ceil(roll_width * dpi), math.ceil(sheet_height * dpi)) \
+            .new_from_image([255, 255, 255]).copy(interpretation="srgb")
+
+        for entry, (rotate, width, height, plan_dpi), (x, y) in zip(entries, plans, positions):
+            image, streamed = loadPrintSource(entry["data"], entry["content_type"], entry["options"], entry["key"])
+
+            # Every print at the sheet's dpi, at its planned size
+            scale = width * dpi / turnedWidth(image, rotate)
+            image = toRGB(turnForPrint(image, rotate, scale, lambda image: image.resize(scale), streamed))
+
+            sheet = sheet.insert(image, round(x * dpi), round(y * dpi))
+
+        filename = os.path.join(directory, "output.tif")
+        with stage("print_encode"):
+            writeSpool(sheet, filename, dpi, jobProgress(job, 0, 1), printer)
+
+        handOff(printer, roll_width, math.ceil(sheet_height), [filename], job=job)
+
+        dropVipsCache()
+
+    return {"width": roll_width, "height": math.ceil(sheet_height), "dpi": dpi, "printer": printer["id"],
+            "prints": len(entries)}
+
+
+def writeSpool(image, filename, dpi, progress=None, printer=None):
+    # Convert to RGB (for images saved in CMYK the driver can't take),
+    # or grey for grey prints, at the depth and in the paper profile of
+    # the printer
+    if printer == None:
+        printer = printers.selected()[0]
+
+    # Line art goes to 1-bit only now, after any resampling
+    bilevel = image.get_typeof("blueprint-bilevel") != 0
+    image = toPrint(image, printer["spool_depth"], printer["icc_profile"])
+
+    # vips packs 1-bit samples from the top bit of 8-bit ones
+    bits = {}
+    if bilevel and image.bands == 1:
+        image = toGrey(image, 8)
+        bits = {"bitdepth": 1}
+
+    watchProgress(image, progress)
+
+    # Only switch to BigTIFF when the file could pass 4 GB, the
+    # Windows photo printing decoder can't open it
+    bigtiff = image.width * image.height * image.bands * format_sizes[image.format] > 4 * 1024 * 1024 * 1024 - 1024 * 1024
+
+    # Tiled tiff, written by vips_sink_disc across all cores, with
+    # the print dpi recorded so the driver knows the physical size.
+    # Each tile is compressed on its own, so compressed spools don't
+    # serialise on one deflate stream the way png does
+    compression = printPreset(printer)["compression"] or SPOOL_COMPRESSION
+    level = {"level": SPOOL_COMPRESSION_LEVEL} if SPOOL_COMPRESSION_LEVEL > 0 and compression != "none" else {}
+
+    tile_size = spoolTileSize(image)
+
+    # Predictors don't apply to 1-bit samples
+    predictor = "horizontal" if compression != "none" and not bits else "none"
+
+    image.tiffsave(filename, tile=True, tile_width=tile_size, tile_height=tile_size,
+                   compression=compression, predictor=predictor,
+                   bigtiff=bigtiff, xres=max(1, dpi) / 25.4, yres=max(1, dpi) / 25.4, **level, **bits)
+
+
+def loadTileTuning():
+    # This machine's tuned tile sizes, by loader
+    try:
+        with open(TILE_TUNING_FILE) as f:
+            return json.load(f).get(platform.node(), {})
+    except (OSError, ValueError):
+        return {}
+
+
+tile_tuning = loadTileTuning()
+
+
+def spoolTileSize(image):
+    # Tile size to spool a print with, tuned for the pipeline's source
+    # loader when this machine has been benchmarked
+    if "BLUEPRINT_SPOOL_TILE_SIZE" in os.environ or image.get_typeof("vips-loader") == 0:
+        return SPOOL_TILE_SIZE
+
+    return tile_tuning.get(image.get("vips-loader"), SPOOL_TILE_SIZE)
+
+
+def writeBands(image, prefix, dpi, job, printer, landscape=False, started=None):
+    # Write the print as horizontal bands plus a manifest for the
+    # direct backend. Each band is an extract_area view of the same
+    # pipeline, and PrintGUI only decodes one band at a time. Bands
+    # are always 8-bit for GDI. A render for a kiosk splitting the
+    # print writes just its share of the bands, see splitPrint. With
+    # started, the manifest is written first and started() called
+    # before any band, see streamBands. Bands an earlier print of the
+    # same revision wrote are linked from its spool rather than
+    # rendered, all but those under either print's label
+    revision = image.get("blueprint-revision") if image.get_typeof("blueprint-revision") != 0 else None
+    label = labelRows(image)
+    image = toPrint(image, 8, printer["icc_profile"])
+
+    band_count = math.ceil(image.height / DIRECT_BAND_HEIGHT)
+    first, last = 0, band_count
+
+    share = getattr(worker_capture, "band_share", None)
+    if share != None:
+        index, shares = share
+        first, last = band_count * index // shares, band_count * (index + 1) // shares
+
+    # Band files are named relative to the manifest
+    bands = [{"file": os.path.basename(prefix) + "-band-" + str(i) + ".tif", "top": i * DIRECT_BAND_HEIGHT,
+              "height": min(DIRECT_BAND_HEIGHT, image.height - i * DIRECT_BAND_HEIGHT)} for i in range(first, last)]
+
+    manifest = {"dpi": max(1, dpi), "width_pixels": image.width, "height_pixels": image.height, "bands": bands,
+                "landscape": landscape, "streaming": started != None}
+
+    with band_revisions_lock:
+        earlier = band_revisions.get(revision) if revision != None and share == None else None
+
+    if earlier != None and (earlier["width"], earlier["height"]) != (image.width, image.height):
+        earlier = None
+
+    if started != None:
+        with open(prefix + ".json", "w") as f:
+            json.dump(manifest, f)
+        started()
+
+    for i, band in enumerate(bands):
+        filename = os.path.join(os.path.dirname(prefix), band["file"])
+
+        # Each band only gets its name once it's complete, so a resumed
+        # job keeps the bands it already has and PrintGUI never opens
+        # one half written
+        if job != None and job.id in resumed_jobs and os.path.exists(filename):
+            continue
+
+        if earlier != None and reuseBand(earlier, band, label, filename):
+            cache_hits.inc(cache="band")
+            continue
+
+        if earlier != None:
+            cache_misses.inc(cache="band")
+
+        crop = image.crop(0, band["top"], image.width, band["height"])
+        watchProgress(crop, jobProgress(job, i, len(bands)))
+        crop.tiffsave(filename + ".part.tif", compression="none")
+        os.replace(filename + ".part.tif", filename)
+
+    if started == None:
+        with open(prefix + ".json", "w") as f:
+            json.dump(manifest, f)
+
+    if revision != None and share == None:
+        with band_revisions_lock:
+            band_revisions[revision] = {"directory": os.path.dirname(prefix), "width": image.width,
+                                        "height": image.height, "label": label,
+                                        "bands": {band["top"]: band["file"] for band in bands}}
+            band_revisions.move_to_end(revision)
+
+            while len(band_revisions) > BAND_REVISIONS_MAX:
+                band_revisions.popitem(last=False)
+
+
+def reuseBand(earlier, band, label, filename):
+    # Link a band from an earlier print of the revision, True when it
+    # could be. Bands under either print's label are rendered, as are
+    # ones whose file has been cleaned up since
+    for rows in (label, earlier["label"]):
+        if rows != None and rows[0] < band["top"] + band["height"] and band["top"] < rows[0] + rows[1]:
+            return False
+
+    source = earlier["bands"].get(band["top"])
+    if source == None:
+        return False
+
+    try:
+        with contextlib.suppress(FileNotFoundError):
+            os.remove(filename + ".part.tif")
+        os.link(os.path.join(earlier["directory"], source), filename + ".part.tif")
+    except OSError:
+        return False
+
+    os.replace(filename + ".part.tif", filename)
+    return True
+
+
+def jobProgress(job, part, parts):
+    # Progress callback reporting one of a job's writes, or None when
+    # there is no job to report to
+    if job == None:
+        return None
+
+    return lambda percent, eta: job.report(part, parts, percent, eta)
+
+
+def watchProgress(image, progress):
+    # Have vips call progress(percent, eta) as the image is written,
+    # from the VipsProgress attached to its eval signal. progress
+    # returns False to kill the write. Print writes also give way to
+    # previews from here
+    def onEval(image, status):
+        with tracing.span("yield to previews"):
+            yieldToPreviews()
+
+        tracing.counter("write progress", percent=status.percent)
+
+        # Stop the write if the callback says the job was cancelled
+        if progress != None and not progress(status.percent, status.eta):
+            image.set_kill(True)
+
+    image.set_progress(True)
+    image.signal_connect("eval", onEval)
+
+    if progress != None:
+        image.signal_connect("posteval", lambda image, status: progress(100, 0))
+
+
+@contextlib.contextmanager
+def previewPriority():
+    # Mark a preview as rendering so print writes pause for it
+    global previews_active
+
+    with preview_priority:
+        previews_active += 1
+
+    try:
+        yield
+    finally:
+        with preview_priority:
+            previews_active -= 1
+            preview_priority.notify_all()
+
+
+def yieldToPreviews():
+    # Called between tiles of a print write. While previews are
+    # rendering, hold the print's threadpool so the previews get the
+    # cores, for at most PRINT_YIELD_SECONDS per tile
+    with preview_priority:
+        deadline = time.time() + PRINT_YIELD_SECONDS
+
+        while previews_active > 0 and time.time() < deadline:
+            preview_priority.wait(deadline - time.time())
+
+
+def spoolerName(printer):
+    # Windows name of the printer's device, empty for the default one
+    # when there is only the one printer
+    return printer["name"] if printer != None and len(print_queues) > 1 else PRINTER_NAME
+
+
+def sendToPrinter(filenames, flags=[], printer=None):
+    # Print the image
+    # Call PrintGUI/Executable/PrintGUI.exe
+    current_dir = os.path.dirname(os.path.realpath(__file__))
+
+    path = "PrintGUI/Executable/PrintGUI.exe"
+
+    # Get cwd
+    cwd = os.getcwd()
+
+    print("Printing...")
+    paths = [os.path.join(cwd, filename) for filename in filenames]
+    print(paths)
+
+    # Tell PrintGUI where to report the hand-off, and which device to
+    # use when jobs are routed between several
+    printer_name = spoolerName(printer)
+    env = dict(os.environ, BLUEPRINT_STATUS_URL=SERVER_URL + "/printStatus", BLUEPRINT_PRINTER_NAME=printer_name)
+
+    start = time.time()
+    if sendToHelper(path, flags, paths, printer_name):
+        handoff_seconds.observe(time.time() - start, phase="pipe")
+    else:
+        p = subprocess.Popen([path] + flags + paths, shell=False, env=env)
+        handoff_seconds.observe(time.time() - start, phase="popen")
+
+    if printer != None:
+        with handoff_condition:
+            handoffs[printer["id"]] = [handoffPath(path) for path in paths]
+            for path in paths:
+                handoff_status[handoffPath(path)] = "sent"
+
+
+def sendToHelper(path, flags, paths, printer_name):
+    # Queue a hand-off on the PrintGUI helper, True once it has taken
+    # it. When the helper isn't running, one is started for the prints
+    # after this and False is returned so this one is spawned as before
+    global printgui_helper
+
+    if not PRINTGUI_HELPER:
+        return False
+
+    command = {"flags": flags, "files": paths, "printer_name": printer_name}
+
+    try:
+        with printgui_helper_lock, open(PRINTGUI_PIPE, "r+b", buffering=0) as pipe:
+            pipe.write((json.dumps(command) + "\n").encode())
+            reply = pipe.readline().decode().strip()
+    except OSError:
+        with printgui_helper_lock:
+            if printgui_helper == None or printgui_helper.poll() != None:
+                print("Starting the PrintGUI helper")
+                printgui_helper = subprocess.Popen([path, "--serve"], shell=False,
+                                                   env=dict(os.environ, BLUEPRINT_STATUS_URL=SERVER_URL + "/printStatus"))
+        return False
+
+    if reply != "ok":
+        print("PrintGUI helper refused the hand-off: " + reply)
+        return False
+
+    return True
+
+
+def handoffPath(filename):
+    # Key for a handed-off file however PrintGUI spells its path
+    return os.path.normcase(os.path.abspath(filename))
+
+
+def dropVipsCache():
+    # Empty the vips operation cache once a print is handed off, its
+    # full-resolution operations won't be reused. Setting the limit
+    # to zero trims every entry
+    pyvips.cache_set_max(0)
+    pyvips.cache_set_max(VIPS_CACHE_MAX)
+
+
+# Tiny documents for warming up the pdf and svg loaders, the text
+# makes fontconfig build its cache
+WARM_UP_PDF = (b"%PDF-1.4\n1 0 obj<</Type/Catalog/Pages 2 0 R>>endobj\n"
+               b"2 0 obj<</Type/Pages/Kids[3 0 R]/Count 1>>endobj\n"
+               b"3 0 obj<</Type/Page/Parent 2 0 R/MediaBox[0 0 72 72]>>endobj\n"
+               b"trailer<</Root 1 0 R>>\n%%EOF\n")
+WARM_UP_SVG = (b'<svg xmlns="http://www.w3.org/2000/svg" width="64" height="64">'
+               b'<text x="4" y="32" font-size="12">Warm up</text></svg>')
+
+# Set once warmUp has finished
+ready = threading.Event()
+
+
+def warmUp():
+    # Pay the first-request costs at startup: loading the vips foreign
+    # modules and their DLLs, priming fontconfig, building lcms colour
+    # transforms and compiling the orc kernels of a small render
+    start_time = time.time()
+
+    steps = [
+        ("raster", lambda: [pyvips.Image.new_from_buffer(pyvips.Image.black(64, 64, bands=3).write_to_buffer(suffix), "")
+                            .avg() for suffix in [".jpg", ".png", ".webp", ".tif", ".gif"]]),
+        ("pdf", lambda: pyvips.Image.pdfload_buffer(WARM_UP_PDF, dpi=72).avg()),
+        ("svg", lambda: pyvips.Image.svgload_buffer(WARM_UP_SVG).avg()),
+        ("icc", lambda: pyvips.Image.black(64, 64, bands=3).copy(interpretation="srgb").icc_transform("srgb").avg()),
+        ("render", lambda: encodePreview(previewPhoto(pyvips.Image.thumbnail_buffer(
+            pyvips.Image.black(256, 256, bands=3).jpegsave_buffer(), 64), 17, 17, 17))),
+    ]
+
+    for name, step in steps:
+        try:
+            with stage("warm_up_" + name):
+                step()
+        except Exception as e:
+            print("Warm up step " + name + " failed: " + str(e))
+
+    print("Warmed up in " + str(time.time() - start_time) + " seconds")
+    ready.set()
+
+
+def recycleWhenIdle(exit_code):
+    # Exit with exit_code for serve.py to start a fresh worker
+    # once vips has peaked over RECYCLE_HIGHWATER_BYTES, waiting for a
+    # moment with no requests, jobs or hand-offs in flight. Freed
+    # memory doesn't always go back to the OS, a new process starts
+    # lean, and decoded sources it needs are still in SOURCE_DIR
+    while True:
+        time.sleep(RECYCLE_CHECK_SECONDS)
+
+        if pyvips.vips_lib.vips_tracked_get_mem_highwater() < RECYCLE_HIGHWATER_BYTES:
+            continue
+
+        with active_requests_lock, handoff_condition:
+            if not serverIdle():
+                continue
+
+            print("vips highwater " + str(pyvips.vips_lib.vips_tracked_get_mem_highwater() // (1024 * 1024)) +
+                  " MB, recycling worker")
+            sys.stdout.flush()
+            os._exit(exit_code)
+
+
+def serverIdle():
+    # Whether no requests, print jobs or hand-offs are in flight, called
+    # holding active_requests_lock and handoff_condition. A hand-off
+    # counts until PrintGUI closes its dialog, when it reports at all
+    settled = not handoff_reporting or all(handoff_status.get(path) in ["closed", "timeout", "spooled", "failed"]
+                  for paths in handoffs.values() for path in paths)
+
+    return active_requests == 0 and settled and all(queue.load() == 0 for queue in print_queues.values())
+
+
+def maintainWhenIdle():
+    # Give memory back after busy spells, once per idle spell
+    maintained = 0
+
+    while True:
+        time.sleep(MAINTENANCE_IDLE_SECONDS / 4)
+
+        with active_requests_lock, handoff_condition:
+            quiet_since = last_request_end
+            idle = serverIdle() and time.time() - quiet_since >= MAINTENANCE_IDLE_SECONDS
+
+        if idle and quiet_since > maintained:
+            maintained = quiet_since
+            maintain()
+
+
+def maintain():
+    global source_cache_bytes
+
+    start_time = time.time()
+    dropVipsCache()
+
+    # Cold sources are dropped from memory, spilled ones map back from
+    # SOURCE_DIR if they're wanted again
+    with source_cache_lock:
+        for key in [key for key, entry in source_cache.items() if start_time - entry["used"] > COLD_SOURCE_SECONDS]:
+            source_cache_bytes -= source_cache.pop(key)["bytes"]
+            cache_evictions.inc(cache="source")
+
+    with preview_bases_lock:
+        preview_bases.clear()
+
+    # Entries hold their upload's bytes, which may be evicted by now
+    with document_headers_lock:
+        document_headers.clear()
+
+    trimHeap()
+
+    print("Idle maintenance in " + str(time.time() - start_time) + " seconds, vips holds " +
+          str(trackedMemory() // (1024 * 1024)) + " MB")
+
+
+class ProcessMemoryCounters(ctypes.Structure):
+    # PROCESS_MEMORY_COUNTERS from psapi.h
+    _fields_ = [("cb", ctypes.c_ulong), ("PageFaultCount", ctypes.c_ulong),
+                ("PeakWorkingSetSize", ctypes.c_size_t), ("WorkingSetSize", ctypes.c_size_t),
+                ("QuotaPeakPagedPoolUsage", ctypes.c_size_t), ("QuotaPagedPoolUsage", ctypes.c_size_t),
+                ("QuotaPeakNonPagedPoolUsage", ctypes.c_size_t), ("QuotaNonPagedPoolUsage", ctypes.c_size_t),
+                ("PagefileUsage", ctypes.c_size_t), ("PeakPagefileUsage", ctypes.c_size_t)]
+
+
+def residentMemory():
+    # Bytes of this process in RAM, its working set on Windows
+    if sys.platform == "win32":
+        counters = ProcessMemoryCounters()
+        counters.cb = ctypes.sizeof(counters)
+        ctypes.windll.psapi.GetProcessMemoryInfo(ctypes.windll.kernel32.GetCurrentProcess(),
+                                                 ctypes.byref(counters), counters.cb)
+        return counters.WorkingSetSize
+
+    with open("/proc/self/statm") as f:
+        return int(f.read().split()[1]) * os.sysconf("SC_PAGE_SIZE")
+
+
+def hugePageMemory():
+    # Bytes of this process backed by transparent huge pages, 0 where
+    # there are none to count
+    try:
+        with open("/proc/self/smaps_rollup") as f:
+            for line in f:
+                if line.startswith("AnonHugePages:"):
+                    return int(line.split()[1]) * 1024
+    except OSError:
+        pass
+
+    return 0
+
+
+def trimHeap():
+    # Return freed heap pages to the OS. glib and vips allocate through
+    # the C runtime, which keeps what they free for reuse
+    try:
+        if sys.platform == "win32":
+            # The vips-dev build links msvcrt, then compact the process
+            # heap under it
+            ctypes.cdll.msvcrt._heapmin()
+            ctypes.windll.kernel32.HeapCompact(ctypes.windll.kernel32.GetProcessHeap(), 0)
+        else:
+            ctypes.CDLL(None).malloc_trim(0)
+    except (OSError, AttributeError) as e:
+        print("Could not trim the heap: " + str(e))
+
+
+def removeOrphans():
+    # Clear out what a crashed process left behind: previews spilled
+    # before this start that the cache index doesn't hold, which
+    # nothing can reach now, and old temporary files in the source
+    # store and BLUEPRINT's own temp dir
+    try:
+        indexed = cache_index.paths("preview") if cache_index != None else set()
+    except sqlite3.Error as e:
+        print("Could not read the cache index: " + str(e))
+        indexed = set()
+
+    for name in os.listdir(PREVIEW_DIR):
+        if os.path.join(PREVIEW_DIR, name) not in indexed:
+            os.remove(os.path.join(PREVIEW_DIR, name))
+
+    candidates = []
+    if os.path.isdir(SOURCE_DIR):
+        candidates += [os.path.join(SOURCE_DIR, name) for name in os.listdir(SOURCE_DIR) if name.count(".") > 1]
+    if TEMP_DIR:
+        candidates += [os.path.join(TEMP_DIR, name) for name in os.listdir(TEMP_DIR) if name.startswith("vips-")]
+
+    removed = 0
+    for path in candidates:
+        try:
+            if time.time() - os.path.getmtime(path) > ORPHAN_SECONDS:
+                os.remove(path)
+                removed += 1
+        except OSError:
+            pass
+
+    if removed:
+        print("Removed " + str(removed) + " orphaned temporary files")
+
+    adoptSources()
+
+
+def adoptSources():
+    # Index spilled sources the cache index doesn't know of yet, written
+    # before it existed, so its trimming covers them too. Only files
+    # missing from it are looked at
+    if cache_index == None or not os.path.isdir(SOURCE_DIR):
+        return
+
+    try:
+        indexed = cache_index.paths("source")
+
+        for name in os.listdir(SOURCE_DIR):
+            path = os.path.join(SOURCE_DIR, name)
+
+            if name.count(".") == 1 and path not in indexed:
+                try:
+                    cache_index.put("source", name, path=path, bytes=os.path.getsize(path), used=os.path.getmtime(path))
+                except OSError:
+                    pass
+    except sqlite3.Error as e:
+        print("Could not index spilled sources: " + str(e))
+
+
+def traceMemory():
+    # vips memory and requests in flight as a graph under every trace
+    while True:
+        tracing.counter("vips memory", memory=trackedMemory(), requests=active_requests)
+        time.sleep(TRACE_MEMORY_SAMPLE_SECONDS)
+
+
+def prepare():
+    # Create the cache folder if it doesn't exist
+    if not os.path.exists(PREVIEW_DIR):
+        os.makedirs(PREVIEW_DIR)
+
+    removeOrphans()
+
+    # Compress static files changed since the last start
+    precompress.precompress(app.static_folder)
+
+    # Warm up alongside the server, /ready reports when it's done
+    threading.Thread(target=warmUp, name="warm-up", daemon=True).start()
+
+    threading.Thread(target=maintainWhenIdle, name="maintenance", daemon=True).start()
+
+    if tracing.SLOW_SECONDS > 0:
+        threading.Thread(target=traceMemory, name="trace-memory", daemon=True).start()
+
+    # Carry on with long prints a restart cut short
+    if not WORKER_MODE:
+        resumePrints()
+
+    # Poll printer readiness for routing and render order
+    if not WORKER_MODE:
+        printerstate.start(printers.selected(), spoolerName, readinessChanged)
+
+    # Office uploads convert on the kiosk, workers only get their pdfs
+    if officeconvert.enabled() and not WORKER_MODE:
+        officeconvert.start()
+
+
+if __name__ == "__main__":
+    prepare()
 
-if __name__ == "__main__":
-    # Create the cache folder if it doesn't exist
-    if not os.path.exists("cache"):
-        os.makedirs("cache")
     app.run()
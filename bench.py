@@ -0,0 +1,735 @@
+import os
+import sys
+import json
+import math
+import time
+import platform
+import shutil
+import subprocess
+import tempfile
+
+# Benchmark the render pipeline over a fixed synthetic corpus
+#
+#   python bench.py            run every case and compare with the last run
+#   python bench.py --quick    one repeat, 17 in and 44 in only
+#   python bench.py --tune-tiles
+#                              time the print spool at each of
+#                              TUNE_TILE_SIZES and save the fastest for
+#                              each source loader to app's tile tuning
+#   python bench.py --binding  ns and allocations per call of pyvips
+#                              itself on tiny images, where the binding
+#                              costs more than the pixels
+#   python bench.py --scaling  speedup of SCALING_PIPELINES over vips
+#                              worker counts 1 to the cores, for each
+#                              sink and tile size, to see where adding
+#                              cores stops helping
+#   python bench.py --golden   render GOLDEN_CASES through each print
+#                              path and compare their pixels with the
+#                              golden outputs, and their time with the
+#                              last run
+#   python bench.py --golden-update
+#                              the same, saving the outputs as the new
+#                              goldens
+#
+# Each case runs in its own process so peak RSS and the vips high-water
+# mark belong to that case alone. Results are appended to
+# bench_results.jsonl so regressions show up run to run.
+
+CORPUS_DIR = "bench_corpus"
+RESULTS_FILE = "bench_results.jsonl"
+
+# Paper widths offered in index.html
+PAPER_WIDTHS = [17, 24, 36, 44]
+
+# Spool encoder settings swept by the print_<name> modes, as
+# (compression, level). Level 0 is the encoder's default
+SPOOL_SETTINGS = {
+    "lzw": ("lzw", 0),
+    "deflate1": ("deflate", 1),
+    "deflate6": ("deflate", 6),
+    "zstd1": ("zstd", 1),
+}
+
+# pdf rasterisers compared by the print_<name> modes on pdf cases, the
+# auto policy's pick for each page is reported alongside
+PDF_BACKENDS = ["poppler", "pdfium"]
+
+# Calls each --binding case is timed over, best of BINDING_ROUNDS
+BINDING_CALLS = 2000
+BINDING_ROUNDS = 5
+
+# --scaling pipelines, by the corpus file each reads
+SCALING_PIPELINES = {
+    "pdf_raster": "multipage_pdf",
+    "jpeg_resize": "large_jpeg",
+    "icc_transform": "cmyk_jpeg",
+    "tiff_save": "tiff_16bit",
+}
+# How --scaling pulls the pixels: vips_sink_memory in full width
+# strips, or tiffsave's vips_sink_disc in strips or in tiles of each of
+# SCALING_TILE_SIZES. These stand in for the demand styles, which the
+# operations choose and python can't set
+SCALING_SINKS = ["memory", "strip", "tiled"]
+SCALING_TILE_SIZES = [128, 256, 512]
+SCALING_FILE = "bench_scaling.jsonl"
+
+# --golden cases, name: (corpus file, path, paper width). print is the
+# default render to spool, grey scans taking the one band fast path,
+# upscaled enlarges to the printer's native dpi and sharpens,
+# jpeg_turn is jpegtran's lossless turn and preview the kiosk's preview
+GOLDEN_CASES = {
+    "jpeg_print": ("large_jpeg", "print", 44),
+    "tiff16_print": ("tiff_16bit", "print", 36),
+    "cmyk_print": ("cmyk_jpeg", "print", 24),
+    "pdf_print": ("multipage_pdf", "print", 36),
+    "svg_print": ("complex_svg", "print", 24),
+    "grey_print": ("grey_scan", "print", 36),
+    "webp_upscaled": ("webp", "upscaled", 24),
+    "gif_upscaled": ("animated_gif", "upscaled", 17),
+    "jpeg_turn": ("large_jpeg", "jpeg_turn", 24),
+    "jpeg_preview": ("large_jpeg", "preview", 24),
+    "pdf_preview": ("multipage_pdf", "preview", 24),
+}
+# Goldens keep a full resolution crop from the centre of each output,
+# which any change to a kernel shows in, and the whole output box
+# filtered down to about this many pixels across, for geometry and
+# colour. Full prints would be gigabytes each
+GOLDEN_CROP = 1024
+GOLDEN_OVERVIEW = 1024
+GOLDEN_DIR = "bench_golden"
+GOLDEN_RESULTS_FILE = os.path.join(GOLDEN_DIR, "timings.jsonl")
+# Lowest PSNR to the golden that still passes, in dB. Unchanged
+# pipelines match exactly, this leaves room for rounding differences
+# between vips builds
+GOLDEN_PSNR = 50
+# Sharpening the upscaled cases print with, in device pixels, so the
+# sharpen after the resize is covered
+GOLDEN_SHARPEN_SIGMA = 1.0
+
+# Spool tile sizes tried by --tune-tiles
+TUNE_TILE_SIZES = [128, 256, 512, 1024]
+
+# Slower than the last run on this machine by more than this is flagged
+REGRESSION_THRESHOLD = 0.15
+
+# name: (filename, content type)
+CORPUS = {
+    "large_jpeg": ("large.jpg", "image/jpeg"),
+    "tiff_16bit": ("16bit.tif", "image/tiff"),
+    "cmyk_jpeg": ("cmyk.jpg", "image/jpeg"),
+    "multipage_pdf": ("multipage.pdf", "application/pdf"),
+    "text_pdf": ("text.pdf", "application/pdf"),
+    "complex_svg": ("complex.svg", "image/svg+xml"),
+    "animated_gif": ("animated.gif", "image/gif"),
+    "webp": ("photo.webp", "image/webp"),
+    "grey_scan": ("greyscan.tif", "image/tiff"),
+}
+
+
+def makePDF(pages, text=False):
+    # Minimal multi-page pdf of 24x36 inch pages covered in vector
+    # shapes, or with text, in lines of small print like a spec sheet
+    objects = ["<< /Type /Catalog /Pages 2 0 R >>", None]
+    kids = []
+    resources = ""
+
+    if text:
+        objects.append("<< /Type /Font /Subtype /Type1 /BaseFont /Helvetica >>")
+        resources = " /Resources << /Font << /F1 " + str(len(objects)) + " 0 R >> >>"
+
+    for page in range(pages):
+        shapes = []
+        if text:
+            for i in range(300):
+                shapes.append("BT /F1 7 Tf 36 %d Td (Sheet %d line %d: general notes, tolerances and finishes "
+                              "as specified unless noted otherwise) Tj ET" % (2550 - i * 8, page + 1, i))
+        else:
+            for i in range(400):
+                shapes.append("%.2f %.2f %.2f rg %d %d %d %d re f" % (
+                    (i * 7 % 255) / 255, (i * 13 % 255) / 255, (page * 50 % 255) / 255,
+                    (i * 37) % 1700, (i * 53) % 2500, 20 + i % 80, 20 + i % 120))
+        content = "\n".join(shapes)
+
+        objects.append("<< /Length " + str(len(content)) + " >>\nstream\n" + content + "\nendstream")
+        objects.append("<< /Type /Page /Parent 2 0 R /MediaBox [0 0 1728 2592] /Contents " +
+                       str(len(objects)) + " 0 R" + resources + " >>")
+        kids.append(str(len(objects)) + " 0 R")
+
+    objects[1] = "<< /Type /Pages /Kids [" + " ".join(kids) + "] /Count " + str(pages) + " >>"
+
+    out = "%PDF-1.4\n"
+    offsets = []
+    for number, body in enumerate(objects, 1):
+        offsets.append(len(out))
+        out += str(number) + " 0 obj\n" + body + "\nendobj\n"
+
+    xref = len(out)
+    out += "xref\n0 " + str(len(objects) + 1) + "\n0000000000 65535 f \n"
+    out += "".join("%010d 00000 n \n" % offset for offset in offsets)
+    out += "trailer\n<< /Size " + str(len(objects) + 1) + " /Root 1 0 R >>\nstartxref\n" + str(xref) + "\n%%EOF\n"
+
+    return out.encode("latin-1")
+
+
+def makeSVG():
+    # Thousands of overlapping translucent shapes and some text
+    shapes = []
+    for i in range(5000):
+        shapes.append('<circle cx="%d" cy="%d" r="%d" fill="rgb(%d,%d,%d)" fill-opacity="0.5"/>' % (
+            (i * 37) % 2400, (i * 53) % 3600, 5 + i % 60, i % 255, (i * 3) % 255, (i * 7) % 255))
+    for i in range(50):
+        shapes.append('<text x="100" y="%d" font-size="48">Blueprint benchmark line %d</text>' % (100 + i * 70, i))
+
+    return ('<svg xmlns="http://www.w3.org/2000/svg" width="24in" height="36in" viewBox="0 0 2400 3600">' +
+            "".join(shapes) + "</svg>").encode()
+
+
+def makeCorpus(pyvips):
+    # Generate the corpus once, it's deterministic so runs compare
+    os.makedirs(CORPUS_DIR, exist_ok=True)
+
+    def noise(width, height, bands):
+        image = pyvips.Image.gaussnoise(width, height, mean=128, sigma=40, seed=1)
+        return image.bandjoin([image.rot180()] * (bands - 1)).cast("uchar") if bands > 1 else image.cast("uchar")
+
+    def animation(frames):
+        # Frames stacked vertically with page-height set, how vips
+        # holds animations
+        image = pyvips.Image.arrayjoin([noise(800, 600, 3).rot("d180" if i % 2 else "d0") for i in range(frames)],
+                                       across=1).copy()
+        image.set_type(pyvips.GValue.gint_type, "page-height", 600)
+        return image
+
+    makers = {
+        "large.jpg": lambda: noise(12000, 8000, 3).jpegsave_buffer(Q=90),
+        "16bit.tif": lambda: (noise(6000, 4000, 3).cast("ushort") * 256).cast("ushort")
+            .copy(interpretation="rgb16").tiffsave_buffer(),
+        "cmyk.jpg": lambda: noise(6000, 4000, 4).copy(interpretation="cmyk").jpegsave_buffer(Q=90),
+        "multipage.pdf": lambda: makePDF(8),
+        "text.pdf": lambda: makePDF(4, text=True),
+        "complex.svg": makeSVG,
+        "animated.gif": lambda: animation(10).gifsave_buffer(),
+        "photo.webp": lambda: noise(8000, 6000, 3).webpsave_buffer(Q=85),
+        # A grey drawing scanned as RGB, for the grey fast path
+        "greyscan.tif": lambda: noise(7200, 4800, 1).bandjoin([noise(7200, 4800, 1)] * 2)
+            .copy(interpretation="srgb").tiffsave_buffer(compression="lzw"),
+    }
+
+    for filename, make in makers.items():
+        path = os.path.join(CORPUS_DIR, filename)
+
+        if not os.path.exists(path):
+            print("Generating " + path)
+            with open(path, "wb") as f:
+                f.write(make())
+
+
+def benchOptions(paper_width):
+    # Default options the frontend sends for an auto-sized print
+    return {"side": "short", "max_size": True, "specific_width": None, "specific_height": None,
+            "specific_dpi": None, "paper_width": paper_width, "all_pages": False, "print": False}
+
+
+def runCase(name, mode, paper_width):
+    # Run one case in this process and print its measurements as json
+    import app
+
+    filename, content_type = CORPUS[name]
+    with open(os.path.join(CORPUS_DIR, filename), "rb") as f:
+        data = f.read()
+
+    options = benchOptions(paper_width)
+    key = app.uploadHash(data)
+
+    if mode[len("print_"):] in PDF_BACKENDS:
+        app.PDF_BACKEND = mode[len("print_"):]
+
+    start = time.time()
+
+    if mode == "preview":
+        body, status, headers = app.renderPreviewImage(data, content_type, options, key)
+    else:
+        image, streamed = app.loadPrintSource(data, content_type, options, key)
+        rotate, width, height, dpi = app.calculateSize(*app.uprightSize(image), options)
+
+        if mode == "print_upscaled":
+            # Server side enlarging to the printer's native dpi
+            app.PRINT_UPSCALE_DPI = app.PRINTER_NATIVE_DPI
+            image, dpi = app.upscaleForPrint(image, dpi, None, rotate, streamed)
+        else:
+            image = app.turnForPrint(image, rotate, 1, lambda image: image, streamed)
+
+            if mode[len("print_"):] in SPOOL_SETTINGS:
+                app.SPOOL_COMPRESSION, app.SPOOL_COMPRESSION_LEVEL = SPOOL_SETTINGS[mode[len("print_"):]]
+
+        with tempfile.TemporaryDirectory() as directory:
+            filename = os.path.join(directory, "output.tif")
+            app.writeSpool(image, filename, dpi)
+            spool_bytes = os.path.getsize(filename)
+
+    wall = time.time() - start
+
+    result = {"wall_seconds": wall, "vips_highwater_bytes": app.trackedMemoryStats()["highwater"],
+              "peak_rss_bytes": peakRSS(), "loader": None}
+
+    if mode != "preview" and image.get_typeof("vips-loader") != 0:
+        result["loader"] = image.get("vips-loader")
+
+    if mode != "preview":
+        result["spool_bytes"] = spool_bytes
+
+    if content_type == "application/pdf":
+        # The rasteriser the page printed with, poppler in place of a
+        # pypdfium2 that isn't installed, and the one auto would pick
+        result["pdf_backend"] = app.pdfBackend(data, 0, 0) if mode != "preview" else "poppler"
+        result["pdf_auto"] = app.pdfAutoBackend(app.pdfimage.pageFeatures(data, 0))
+
+    print(json.dumps(result))
+
+
+def peakRSS():
+    # Peak resident memory of this process, None where it can't be read
+    try:
+        import resource
+        peak = resource.getrusage(resource.RUSAGE_SELF).ru_maxrss
+        # macOS reports bytes, Linux kilobytes
+        return peak if sys.platform == "darwin" else peak * 1024
+    except ImportError:
+        return None
+
+
+def lastRun(filename=RESULTS_FILE):
+    # Previous results from this machine, keyed by case
+    if not os.path.exists(filename):
+        return {}
+
+    last = {}
+    with open(filename) as f:
+        for line in f:
+            run = json.loads(line)
+            if run["machine"] == platform.node():
+                last = run["cases"]
+
+    return last
+
+
+def runSubprocess(name, mode, width, env=None):
+    # One case in a fresh process, its result or None if it failed
+    output = subprocess.run([sys.executable, __file__, "--case", name, mode, str(width)],
+                            capture_output=True, text=True, env=env)
+    if output.returncode != 0:
+        print(name + "/" + mode + "/" + str(width) + " failed: " + output.stderr.strip().splitlines()[-1])
+        return None
+
+    return json.loads(output.stdout.strip().splitlines()[-1])
+
+
+def tuneTiles():
+    # Time the 36 in print of every corpus file at each tile size and
+    # keep the fastest for each loader, best of two runs
+    import pyvips
+    import app
+
+    makeCorpus(pyvips)
+
+    timings = {}
+    for name in CORPUS:
+        for tile_size in TUNE_TILE_SIZES:
+            env = dict(os.environ, BLUEPRINT_SPOOL_TILE_SIZE=str(tile_size))
+            samples = [sample for sample in [runSubprocess(name, "print", 36, env) for i in range(2)] if sample]
+
+            if not samples:
+                continue
+
+            best = min(sample["wall_seconds"] for sample in samples)
+            loader = samples[0]["loader"]
+            if loader == None:
+                continue
+            timings.setdefault(loader, {}).setdefault(tile_size, []).append(best)
+
+            print("%-16s %-16s %5d  %8.3f s" % (name, loader, tile_size, best))
+
+    # Sum over the corpus files sharing a loader
+    tuned = {loader: min(sizes, key=lambda size: sum(sizes[size])) for loader, sizes in timings.items()}
+
+    tuning = {}
+    if os.path.exists(app.TILE_TUNING_FILE):
+        with open(app.TILE_TUNING_FILE) as f:
+            tuning = json.load(f)
+
+    tuning[platform.node()] = tuned
+
+    with open(app.TILE_TUNING_FILE, "w") as f:
+        json.dump(tuning, f, indent=4)
+
+    print("Saved " + json.dumps(tuned) + " to " + app.TILE_TUNING_FILE)
+
+
+def bindingCases(pyvips):
+    # name: call, each on an image small enough that vips does next to
+    # no pixel work
+    image = pyvips.Image.black(8, 8, bands=3).copy_memory()
+
+    return {
+        "image_copy": lambda: image.copy(),
+        "expression": lambda: (image * 2 + 1) / 3,
+        "options": lambda: image.resize(0.5, kernel="linear", vscale=0.5),
+        "call": lambda: pyvips.Operation.call("invert", image),
+        "metadata_set": lambda: image.copy().set_type(pyvips.GValue.gint_type, "blueprint-bench", 1),
+        "pixel": lambda: image.crop(0, 0, 1, 1).avg(),
+    }
+
+
+def binding():
+    # Time each binding case, and count the python blocks and vips
+    # buffers its results hold per call. Results are kept until counted,
+    # so what one call allocates for its result shows up, though not
+    # the temporaries it frees before returning
+    import gc
+    import tracemalloc
+    import pyvips
+
+    pyvips.cache_set_max(0)
+
+    for name, call in bindingCases(pyvips).items():
+        best = None
+        for i in range(BINDING_ROUNDS):
+            start = time.perf_counter_ns()
+            for j in range(BINDING_CALLS):
+                call()
+            elapsed = (time.perf_counter_ns() - start) / BINDING_CALLS
+            best = elapsed if best == None else min(best, elapsed)
+
+        gc.collect()
+        vips_before = pyvips.vips_lib.vips_tracked_get_allocs()
+        tracemalloc.start()
+        before = tracemalloc.take_snapshot()
+
+        results = [call() for j in range(BINDING_CALLS)]
+
+        after = tracemalloc.take_snapshot()
+        tracemalloc.stop()
+        vips_after = pyvips.vips_lib.vips_tracked_get_allocs()
+        del results
+
+        stats = after.compare_to(before, "filename")
+        blocks = sum(stat.count_diff for stat in stats if stat.count_diff > 0)
+        size = sum(stat.size_diff for stat in stats if stat.size_diff > 0)
+
+        print("%-16s %10.0f ns/op  %8.2f py allocs/op  %8.0f B/op  %6.2f vips allocs/op" % (
+            name, best, blocks / BINDING_CALLS, size / BINDING_CALLS, (vips_after - vips_before) / BINDING_CALLS))
+
+
+def scalingCase(pipeline, sink, tile_size):
+    # Run one --scaling pipeline in this process, under the worker count
+    # VIPS_CONCURRENCY gives it, and print its seconds
+    import pyvips
+
+    filename, content_type = CORPUS[SCALING_PIPELINES[pipeline]]
+    path = os.path.join(CORPUS_DIR, filename)
+
+    pyvips.cache_set_max(0)
+    start = time.time()
+
+    if pipeline == "pdf_raster":
+        image = pyvips.Image.pdfload(path, dpi=150)
+    elif pipeline == "jpeg_resize":
+        image = pyvips.Image.new_from_file(path).resize(0.5)
+    elif pipeline == "icc_transform":
+        image = pyvips.Image.new_from_file(path).icc_transform("srgb")
+    else:
+        image = pyvips.Image.new_from_file(path).cast("uchar", shift=True)
+
+    if sink == "memory":
+        image.copy_memory()
+    else:
+        with tempfile.TemporaryDirectory() as directory:
+            image.tiffsave(os.path.join(directory, "scaling.tif"), tile=sink == "tiled", tile_width=tile_size,
+                           tile_height=tile_size)
+
+    print(json.dumps({"wall_seconds": time.time() - start}))
+
+
+def scaling():
+    # Time every pipeline, sink and tile size at 1, 2, 4 ... workers up
+    # to the cores, best of two, and print each one's speedup over one
+    # worker
+    import pyvips
+
+    makeCorpus(pyvips)
+
+    cores = os.cpu_count() or 1
+    counts = sorted(set([2 ** n for n in range(cores.bit_length()) if 2 ** n <= cores] + [cores]))
+    curves = {}
+
+    for pipeline in SCALING_PIPELINES:
+        for sink in SCALING_SINKS:
+            for tile_size in SCALING_TILE_SIZES if sink == "tiled" else [0]:
+                name = pipeline + "/" + sink + ("/" + str(tile_size) if tile_size else "")
+                seconds = {}
+
+                for count in counts:
+                    env = dict(os.environ, VIPS_CONCURRENCY=str(count))
+                    timings = []
+
+                    for i in range(2):
+                        output = subprocess.run([sys.executable, __file__, "--scaling-case", pipeline, sink,
+                                                 str(tile_size)], capture_output=True, text=True, env=env)
+                        if output.returncode != 0:
+                            print(name + " at " + str(count) + " failed: " + output.stderr.strip().splitlines()[-1])
+                            break
+
+                        timings.append(json.loads(output.stdout.strip().splitlines()[-1])["wall_seconds"])
+
+                    if timings:
+                        seconds[count] = min(timings)
+
+                if 1 not in seconds:
+                    continue
+
+                curves[name] = seconds
+                print("%-30s " % name + "  ".join("%d: %5.2fx" % (count, seconds[1] / seconds[count])
+                                                  for count in counts if count in seconds))
+
+    with open(SCALING_FILE, "a") as f:
+        f.write(json.dumps({"time": time.time(), "machine": platform.node(), "cores": cores, "curves": curves}) + "\n")
+
+
+def goldenCase(name, directory):
+    # Render one --golden case in this process, save the crop and
+    # overview of its output to directory and print its seconds
+    import pyvips
+    import app
+    import jpegtransform
+
+    source, path, paper_width = GOLDEN_CASES[name]
+    filename, content_type = CORPUS[source]
+    with open(os.path.join(CORPUS_DIR, filename), "rb") as f:
+        data = f.read()
+
+    if path == "jpeg_turn" and not jpegtransform.enabled():
+        print(json.dumps({"skipped": "BLUEPRINT_JPEGTRAN isn't set"}))
+        return
+
+    options = benchOptions(paper_width)
+    key = app.uploadHash(data)
+    printer = app.presetPrinter(app.printers.selected()[0], options)
+
+    with tempfile.TemporaryDirectory() as spool:
+        start = time.time()
+
+        if path == "preview":
+            # png so the golden isn't blurred by the preview's own codec
+            options["preview_format"] = "png"
+            body, status, headers = app.renderPreviewImage(data, content_type, options, key)
+            image = pyvips.Image.new_from_buffer(app.previewImage(body["image_url"].rsplit("/", 1)[-1]), "")
+        elif path == "jpeg_turn":
+            turned = jpegtransform.transform(data, 1, False)
+            if turned == None:
+                raise Exception("jpegtran couldn't turn " + filename)
+
+            image = pyvips.Image.new_from_buffer(turned, "")
+        else:
+            if path == "upscaled":
+                app.PRINT_UPSCALE_DPI = app.PRINTER_NATIVE_DPI
+                printer = dict(printer, sharpen_sigma=GOLDEN_SHARPEN_SIGMA)
+
+            image, plan, spool_dpi, landscape = app.fittedPrint(data, content_type, options, key, printer)
+
+            output = os.path.join(spool, "output.tif")
+            app.writeSpool(image, output, spool_dpi, printer=printer)
+            image = pyvips.Image.new_from_file(output)
+
+        # Only the path's own work is timed, not decoding its output
+        wall = time.time() - start
+
+        # shrink by a whole factor is a plain box filter, which none of
+        # the paths under test use
+        factor = max(1, math.ceil(max(image.width, image.height) / GOLDEN_OVERVIEW))
+        image.shrink(factor, factor).pngsave(os.path.join(directory, name + "-overview.png"))
+
+        width, height = min(GOLDEN_CROP, image.width), min(GOLDEN_CROP, image.height)
+        image.crop((image.width - width) // 2, (image.height - height) // 2, width, height) \
+            .pngsave(os.path.join(directory, name + "-crop.png"))
+
+    print(json.dumps({"wall_seconds": wall, "width": image.width, "height": image.height}))
+
+
+def goldenDifference(image, golden):
+    # PSNR of image to its golden in dB, inf when they're identical, and
+    # the largest difference of any sample. None for both when their
+    # sizes or formats differ
+    if (image.width, image.height, image.bands, image.format) != \
+            (golden.width, golden.height, golden.bands, golden.format):
+        return None, None
+
+    # Row 0 of stats is over all bands: min, max, sum, sum of squares
+    stats = image.subtract(golden).stats()
+    low, high, squares = stats(0, 0)[0], stats(1, 0)[0], stats(3, 0)[0]
+    error = max(abs(low), abs(high))
+
+    mse = squares / (image.width * image.height * image.bands)
+    if mse == 0:
+        return math.inf, error
+
+    peak = 65535 if golden.format == "ushort" else 255
+
+    return 10 * math.log10(peak ** 2 / mse), error
+
+
+def golden(update):
+    # Run every golden case, best of two, and compare its pixels with
+    # its golden, or save them as the golden with update or when there
+    # isn't one yet, and its time with the last run. A case whose pixels
+    # fall under GOLDEN_PSNR fails, and any failure exits non-zero
+    import pyvips
+
+    makeCorpus(pyvips)
+    os.makedirs(GOLDEN_DIR, exist_ok=True)
+
+    previous = lastRun(GOLDEN_RESULTS_FILE)
+    cases = {}
+    failed = []
+
+    for name in GOLDEN_CASES:
+        with tempfile.TemporaryDirectory() as directory:
+            samples = []
+            for i in range(2):
+                output = subprocess.run([sys.executable, __file__, "--golden-case", name, directory],
+                                        capture_output=True, text=True)
+                if output.returncode != 0:
+                    print(name + " failed: " + output.stderr.strip().splitlines()[-1])
+                    break
+
+                samples.append(json.loads(output.stdout.strip().splitlines()[-1]))
+
+            if len(samples) < 2:
+                failed.append(name)
+                continue
+
+            if "skipped" in samples[0]:
+                print("%-16s skipped, %s" % (name, samples[0]["skipped"]))
+                continue
+
+            best = min(samples, key=lambda sample: sample["wall_seconds"])
+            cases[name] = best
+
+            line = "%-16s %8.3f s  %6d x %-6d" % (name, best["wall_seconds"], best["width"], best["height"])
+
+            for part in ["crop", "overview"]:
+                output_file = os.path.join(directory, name + "-" + part + ".png")
+                golden_file = os.path.join(GOLDEN_DIR, name + "-" + part + ".png")
+
+                if update or not os.path.exists(golden_file):
+                    shutil.copyfile(output_file, golden_file)
+                    line += "  " + part + " saved"
+                    continue
+
+                # From buffers, so no file stays open as the directory
+                # is removed
+                with open(output_file, "rb") as f:
+                    image = pyvips.Image.new_from_buffer(f.read(), "")
+                with open(golden_file, "rb") as f:
+                    psnr, error = goldenDifference(image, pyvips.Image.new_from_buffer(f.read(), ""))
+
+                if psnr == None:
+                    line += "  " + part + " SIZE CHANGED"
+                else:
+                    line += "  %s %s dB (max %d)" % (part, "inf" if psnr == math.inf else "%.1f" % psnr, error)
+
+                if psnr == None or psnr < GOLDEN_PSNR:
+                    line += "  PIXELS CHANGED"
+                    failed.append(name)
+
+            if name in previous:
+                change = best["wall_seconds"] / previous[name]["wall_seconds"] - 1
+                line += "  %+5.1f%%" % (change * 100)
+
+                if change > REGRESSION_THRESHOLD:
+                    line += "  REGRESSION"
+
+            print(line)
+
+    with open(GOLDEN_RESULTS_FILE, "a") as f:
+        f.write(json.dumps({"time": time.time(), "machine": platform.node(), "cases": cases}) + "\n")
+
+    if failed:
+        print("Failed: " + ", ".join(sorted(set(failed))))
+        sys.exit(1)
+
+
+def main(quick):
+    import pyvips
+
+    makeCorpus(pyvips)
+
+    widths = [17, 44] if quick else PAPER_WIDTHS
+    repeats = 1 if quick else 3
+    previous = lastRun()
+
+    cases = {}
+    for name in CORPUS:
+        modes = ["preview", "print", "print_upscaled"] + ["print_" + setting for setting in SPOOL_SETTINGS]
+        if CORPUS[name][1] == "application/pdf":
+            modes += ["print_" + backend for backend in PDF_BACKENDS]
+
+        for mode in modes:
+            for width in widths:
+                case = name + "/" + mode + "/" + str(width)
+                samples = []
+
+                for i in range(repeats):
+                    sample = runSubprocess(name, mode, width)
+                    if sample == None:
+                        break
+
+                    samples.append(sample)
+
+                if not samples:
+                    continue
+
+                # Report the fastest run, the one least disturbed by the machine
+                best = min(samples, key=lambda sample: sample["wall_seconds"])
+                cases[case] = best
+
+                line = "%-32s %8.3f s  rss %6s MB  vips %6d MB" % (
+                    case, best["wall_seconds"],
+                    str(best["peak_rss_bytes"] // (1024 * 1024)) if best["peak_rss_bytes"] else "?",
+                    best["vips_highwater_bytes"] // (1024 * 1024))
+
+                if "spool_bytes" in best:
+                    line += "  spool %6d MB" % (best["spool_bytes"] // (1024 * 1024))
+
+                if "pdf_auto" in best:
+                    line += "  auto " + best["pdf_auto"]
+
+                if case in previous:
+                    change = best["wall_seconds"] / previous[case]["wall_seconds"] - 1
+                    line += "  %+5.1f%%" % (change * 100)
+
+                    if change > REGRESSION_THRESHOLD:
+                        line += "  REGRESSION"
+
+                print(line)
+
+    with open(RESULTS_FILE, "a") as f:
+        f.write(json.dumps({"time": time.time(), "machine": platform.node(), "cases": cases}) + "\n")
+
+
+if __name__ == "__main__":
+    if len(sys.argv) > 1 and sys.argv[1] == "--case":
+        runCase(sys.argv[2], sys.argv[3], int(sys.argv[4]))
+    elif "--tune-tiles" in sys.argv:
+        tuneTiles()
+    elif "--binding" in sys.argv:
+        binding()
+    elif len(sys.argv) > 1 and sys.argv[1] == "--scaling-case":
+        scalingCase(sys.argv[2], sys.argv[3], int(sys.argv[4]))
+    elif "--scaling" in sys.argv:
+        scaling()
+    elif len(sys.argv) > 1 and sys.argv[1] == "--golden-case":
+        goldenCase(sys.argv[2], sys.argv[3])
+    elif "--golden" in sys.argv or "--golden-update" in sys.argv:
+        golden("--golden-update" in sys.argv)
+    else:
+        main("--quick" in sys.argv)
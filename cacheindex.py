@@ -0,0 +1,85 @@
+import json
+import sqlite3
+import threading
+import time
+
+
+class CacheIndex:
+    # What the caches held when the server last ran, kept in sqlite so
+    # a restart starts warm. Each entry is a kind, a key, a file it
+    # points at and a json value. Nothing is checked on start: callers
+    # check an entry's file when they look it up, and forget it if it
+    # has gone
+
+    def __init__(self, path):
+        self.lock = threading.Lock()
+        # Shared by the request threads like the print log's, and with
+        # other worker processes through the file. WAL lets them read
+        # while one writes
+        self.connection = sqlite3.connect(path, check_same_thread=False, timeout=10)
+
+        with self.lock, self.connection:
+            self.connection.execute("PRAGMA journal_mode=WAL")
+            # Losing the last few entries to a power cut only costs
+            # their renders again
+            self.connection.execute("PRAGMA synchronous=NORMAL")
+            self.connection.execute(
+                "CREATE TABLE IF NOT EXISTS entries ("
+                "kind TEXT NOT NULL, "
+                "key TEXT NOT NULL, "
+                "path TEXT, "
+                "value TEXT, "
+                "bytes INTEGER NOT NULL DEFAULT 0, "
+                "used REAL NOT NULL, "
+                "PRIMARY KEY (kind, key))")
+            self.connection.execute("CREATE INDEX IF NOT EXISTS entries_used ON entries (kind, used)")
+
+    def put(self, kind, key, value=None, path=None, bytes=0, used=None):
+        with self.lock, self.connection:
+            self.connection.execute(
+                "INSERT OR REPLACE INTO entries (kind, key, path, value, bytes, used) VALUES (?, ?, ?, ?, ?, ?)",
+                (kind, key, path, json.dumps(value) if value != None else None, bytes,
+                 used if used != None else time.time()))
+
+    def get(self, kind, key):
+        # (value, path) of an entry, marked used, or None
+        with self.lock, self.connection:
+            row = self.connection.execute("SELECT value, path FROM entries WHERE kind = ? AND key = ?",
+                                          (kind, key)).fetchone()
+            if row == None:
+                return None
+
+            self.connection.execute("UPDATE entries SET used = ? WHERE kind = ? AND key = ?", (time.time(), kind, key))
+
+        return (json.loads(row[0]) if row[0] != None else None), row[1]
+
+    def remove(self, kind, key):
+        with self.lock, self.connection:
+            self.connection.execute("DELETE FROM entries WHERE kind = ? AND key = ?", (kind, key))
+
+    def paths(self, kind):
+        with self.lock:
+            return {row[0] for row in self.connection.execute("SELECT path FROM entries WHERE kind = ?", (kind,))}
+
+    def trim(self, kind, count=None, bytes=None):
+        # Forget the least recently used entries of a kind until at most
+        # count are left and they point at no more than bytes, keeping
+        # the newest. Returns (key, path, bytes) of those forgotten
+        with self.lock, self.connection:
+            rows = self.connection.execute("SELECT key, path, bytes FROM entries WHERE kind = ? ORDER BY used DESC",
+                                           (kind,)).fetchall()
+
+            kept, total, removed = 0, 0, []
+            for key, path, size in rows:
+                if not removed and (kept == 0 or ((count == None or kept < count) and
+                                                  (bytes == None or total + size <= bytes))):
+                    kept += 1
+                    total += size
+                    continue
+
+                removed.append((key, path, size))
+
+            self.connection.executemany("DELETE FROM entries WHERE kind = ? AND key = ?",
+                                        [(kind, key) for key, path, size in removed])
+
+        return removed
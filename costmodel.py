@@ -0,0 +1,105 @@
+import threading
+
+# Predicts how long a print takes to render from what its header tells
+# us: the megapixels it prints at, which covers size and dpi, and the
+# megabytes of upload to decode, which stands in for how complex a pdf
+# or svg page is. Fitted per content type by least squares over the
+# renders the print log has timed, and from all types pooled where one
+# type has too few
+
+# Renders of a type needed before it gets a fit of its own
+MIN_SAMPLES = 8
+
+# Added to the fit's diagonal, but for the constant term, so renders
+# that all share one size or one upload still fit instead of being
+# singular
+RIDGE = 1e-6
+
+# Seconds per output megapixel before anything has been timed,
+# roughly what the kiosk managed on jpegs
+DEFAULT_SECONDS_PER_MEGAPIXEL = 0.05
+
+
+def solve(matrix, vector):
+    # Solve a small linear system by Gaussian elimination, None when
+    # it's singular
+    size = len(vector)
+    rows = [list(matrix[i]) + [vector[i]] for i in range(size)]
+
+    for column in range(size):
+        pivot = max(range(column, size), key=lambda row: abs(rows[row][column]))
+        if abs(rows[pivot][column]) < 1e-12:
+            return None
+
+        rows[column], rows[pivot] = rows[pivot], rows[column]
+
+        for row in range(size):
+            if row != column:
+                factor = rows[row][column] / rows[column][column]
+                rows[row] = [a - factor * b for a, b in zip(rows[row], rows[column])]
+
+    return [rows[i][size] / rows[i][i] for i in range(size)]
+
+
+def features(pixels, source_bytes):
+    return [1, pixels / 1e6, source_bytes / 1e6]
+
+
+def fit(samples):
+    # Coefficients of seconds over features for samples of (pixels,
+    # source_bytes, seconds), None without enough of them
+    if len(samples) < MIN_SAMPLES:
+        return None
+
+    normal = [[0] * 3 for i in range(3)]
+    target = [0] * 3
+
+    for pixels, source_bytes, seconds in samples:
+        x = features(pixels, source_bytes)
+        for i in range(3):
+            target[i] += x[i] * seconds
+            for j in range(3):
+                normal[i][j] += x[i] * x[j]
+
+    for i in range(1, 3):
+        normal[i][i] += RIDGE
+
+    return solve(normal, target)
+
+
+class CostModel:
+
+    def __init__(self):
+        self.lock = threading.Lock()
+        self.pooled = None
+        self.by_type = {}
+
+    def train(self, history):
+        # Refit from history, a list of (content_type, pixels,
+        # source_bytes, seconds)
+        by_type = {}
+        for content_type, pixels, source_bytes, seconds in history:
+            by_type.setdefault(content_type, []).append((pixels, source_bytes, seconds))
+
+        fits = {content_type: fit(samples) for content_type, samples in by_type.items()}
+        pooled = fit([sample for samples in by_type.values() for sample in samples])
+
+        with self.lock:
+            self.by_type = {content_type: coefficients for content_type, coefficients in fits.items()
+                            if coefficients != None}
+            self.pooled = pooled
+
+    def fitted(self, content_type):
+        # Whether predictions for content_type come from timed renders
+        with self.lock:
+            return content_type in self.by_type or self.pooled != None
+
+    def predict(self, content_type, pixels, source_bytes):
+        # Predicted render seconds, never less than nothing
+        with self.lock:
+            coefficients = self.by_type.get(content_type) or self.pooled
+
+        if coefficients == None:
+            return pixels / 1e6 * DEFAULT_SECONDS_PER_MEGAPIXEL
+
+        return max(0, sum(c * x for c, x in zip(coefficients, features(pixels, source_bytes))))
@@ -0,0 +1,205 @@
+import threading
+import time
+import uuid
+import collections
+import concurrent.futures
+
+
+class Job:
+    # A unit of background work with status the frontend can poll
+
+    def __init__(self, kind, run, cost=0, job_id=None):
+        self.id = job_id or uuid.uuid4().hex
+        self.kind = kind
+        self.run = run
+        # Predicted seconds to run, what the queue orders jobs by
+        self.cost = cost
+
+        # queued -> running (-> waiting for the printer) -> done, failed
+        # or cancelled
+        self.status = "queued"
+        self.cancelled = False
+        self.progress = 0
+        self.eta = None
+        self.parts = {}
+        self.result = None
+        self.error = None
+        # Memory, files and temp bytes the job used, once it's done
+        self.usage = None
+
+        self.created = time.time()
+        self.started = None
+        # When it finished rendering and first waited for the printer
+        self.rendered = None
+        self.finished = None
+
+    def report(self, part, parts, percent, eta=None):
+        # Record progress for one of several concurrent writes, the
+        # job's progress is the average across all of them
+        self.parts[part] = percent
+        self.progress = round(sum(self.parts.values()) / parts)
+
+        if eta != None:
+            self.eta = eta
+
+        # Tell the writer whether to keep going
+        return not self.cancelled
+
+    def cancel(self):
+        # Running jobs stop at their next progress report
+        self.cancelled = True
+
+    def toDict(self):
+        return {
+            "id": self.id,
+            "kind": self.kind,
+            "status": self.status,
+            "progress": self.progress,
+            "eta": self.eta,
+            "predicted_seconds": round(self.cost),
+            "result": self.result,
+            "error": self.error,
+            "usage": self.usage,
+            "created": self.created,
+            "started": self.started,
+            "finished": self.finished,
+        }
+
+
+class JobQueue:
+    # Queue of jobs run by a pool of worker threads, shortest predicted
+    # first. Waiting counts against a job's cost at ageing seconds per
+    # second, so long jobs still get their turn. Jobs without a cost
+    # run first in first out. Each worker calls initializer first
+
+    def __init__(self, workers, history=200, ageing=1.0, initializer=None):
+        self.queued = []
+        self.initializer = initializer
+        self.ready = threading.Condition()
+        self.ageing = ageing
+        self.jobs = collections.OrderedDict()
+        self.history = history
+        self.lock = threading.Lock()
+
+        for i in range(workers):
+            threading.Thread(target=self.work, name="job-worker-" + str(i), daemon=True).start()
+
+    def submit(self, kind, run, cost=0, job_id=None):
+        # Queue run(job), predicted to take cost seconds, and return the
+        # job straight away. job_id carries a job over from before a
+        # restart
+        job = Job(kind, run, cost, job_id)
+
+        with self.lock:
+            self.jobs[job.id] = job
+
+            # Forget the oldest finished jobs
+            while len(self.jobs) > self.history:
+                oldest = next(iter(self.jobs.values()))
+                if oldest.finished == None:
+                    break
+                self.jobs.popitem(last=False)
+
+        with self.ready:
+            self.queued.append(job)
+            self.ready.notify()
+
+        return job
+
+    def get(self, job_id):
+        with self.lock:
+            return self.jobs.get(job_id)
+
+    def load(self):
+        # Jobs queued or running
+        with self.lock:
+            return sum(1 for job in self.jobs.values() if job.finished == None)
+
+    def take(self):
+        # Wait for the queued job with the least aged cost, ties to the
+        # oldest
+        with self.ready:
+            self.ready.wait_for(lambda: self.queued)
+
+            now = time.time()
+            job = min(self.queued, key=lambda job: (job.cost - self.ageing * (now - job.created), job.created))
+            self.queued.remove(job)
+
+            return job
+
+    def work(self):
+        if self.initializer != None:
+            self.initializer()
+
+        while True:
+            job = self.take()
+
+            if job.cancelled:
+                job.status = "cancelled"
+                job.finished = time.time()
+                continue
+
+            job.status = "running"
+            job.started = time.time()
+
+            try:
+                job.result = job.run(job)
+                job.progress = 100
+                job.eta = 0
+                job.status = "done"
+            except Exception as e:
+                if job.cancelled:
+                    job.status = "cancelled"
+                else:
+                    print("Job " + job.id + " failed: " + str(e))
+                    job.error = str(e)
+                    job.status = "failed"
+
+            job.finished = time.time()
+
+
+class RenderPool:
+    # One set of threads, started once and kept, that a render's fan
+    # out runs on: its pages, strips or statistics thumbnails. At most
+    # threads run at once across every render, and a call with a
+    # reserve leaves that many free for the others, so a print's pages
+    # never take the threads a preview needs
+
+    def __init__(self, threads):
+        self.threads = max(1, threads)
+        self.executor = concurrent.futures.ThreadPoolExecutor(max_workers=self.threads, thread_name_prefix="render",
+                                                              initializer=self.enter)
+        self.slots = threading.Condition()
+        self.busy = 0
+        self.local = threading.local()
+
+    def enter(self):
+        self.local.inside = True
+
+    def map(self, function, items, reserve=0):
+        # function of each item, in order, each call starting once a
+        # thread is free past the reserve. From one of the pool's own
+        # threads, or for one item, it runs inline, so a fan out inside
+        # another never waits on the threads it holds
+        items = list(items)
+        if getattr(self.local, "inside", False) or len(items) <= 1:
+            return [function(item) for item in items]
+
+        limit = max(1, self.threads - reserve)
+        futures = []
+
+        for item in items:
+            with self.slots:
+                self.slots.wait_for(lambda: self.busy < limit)
+                self.busy += 1
+
+            future = self.executor.submit(function, item)
+            future.add_done_callback(self.release)
+            futures.append(future)
+
+        return [future.result() for future in futures]
+
+    def release(self, future):
+        with self.slots:
+            self.busy -= 1
+            self.slots.notify_all()
@@ -0,0 +1,153 @@
+import math
+import struct
+
+# Cuts a baseline jpeg with restart markers into strips of whole MCU
+# rows, each a jpeg of its own, so a huge upload can decode on every
+# core instead of libjpeg's one. The DC predictors reset at each
+# restart marker, so the entropy data between two of them decodes
+# without what came before
+#
+# Each strip repeats the file's segments up to its scan, tables, ICC
+# profile and EXIF included, with the frame's height cut to the strip's
+# and its restart markers renumbered from 0. Progressive, arithmetic
+# coded and multi-scan files, and intervals that don't fall on MCU row
+# boundaries, are None and decode as one
+
+# Markers without a length
+STANDALONE = set(range(0xd0, 0xd8)) | {0x01, 0xd8, 0xd9}
+
+# Baseline and extended sequential Huffman frames
+SEQUENTIAL_FRAMES = {0xc0, 0xc1}
+# Every other start-of-frame, none of which can be split
+OTHER_FRAMES = {0xc2, 0xc3, 0xc5, 0xc6, 0xc7, 0xc9, 0xca, 0xcb, 0xcd, 0xce, 0xcf}
+
+
+def segments(data):
+    # (marker, start, end) of each marker segment up to and including
+    # the first scan's header, and where its entropy data starts
+    if data[:2] != b"\xff\xd8":
+        return None, 0
+
+    found = []
+    offset = 2
+
+    while offset + 4 <= len(data):
+        if data[offset] != 0xff:
+            return None, 0
+
+        marker = data[offset + 1]
+        if marker == 0xff:
+            offset += 1
+            continue
+
+        if marker in STANDALONE:
+            return None, 0
+
+        length = struct.unpack(">H", data[offset + 2:offset + 4])[0]
+        found.append((marker, offset, offset + 2 + length))
+        offset += 2 + length
+
+        if marker == 0xda:
+            return found, offset
+
+    return None, 0
+
+
+def intervals(data, start):
+    # Entropy coded data from start split at its restart markers, and
+    # where the scan ends. Stuffed 0xff00 and fill 0xff bytes are data
+    pieces = []
+    piece = start
+    offset = data.find(b"\xff", start)
+
+    while offset != -1 and offset + 1 < len(data):
+        marker = data[offset + 1]
+
+        if marker == 0x00 or marker == 0xff:
+            offset = data.find(b"\xff", offset + 1)
+            continue
+
+        pieces.append(data[piece:offset])
+
+        if 0xd0 <= marker <= 0xd7:
+            piece = offset + 2
+            offset = data.find(b"\xff", piece)
+            continue
+
+        return pieces, offset
+
+    return None, 0
+
+
+def strips(data, count):
+    # About count standalone jpegs covering data top to bottom, as
+    # (bytes, height), or None when data can't be split
+    found, scan = segments(data)
+    if found == None:
+        return None
+
+    markers = [marker for marker, start, end in found]
+    if any(marker in OTHER_FRAMES for marker in markers) or 0xdd not in markers:
+        return None
+
+    frame = next(((start, end) for marker, start, end in found if marker in SEQUENTIAL_FRAMES), None)
+    if frame == None:
+        return None
+
+    height, width, components = struct.unpack(">HHB", data[frame[0] + 5:frame[0] + 10])
+    if height == 0 or components == 0:
+        return None
+
+    sampling = [data[frame[0] + 11 + 3 * i] for i in range(components)]
+    scan_components = data[next(start for marker, start, end in found if marker == 0xda) + 4]
+
+    # A one component scan isn't interleaved, its MCU is one block
+    if scan_components != components:
+        return None
+
+    mcu_width = 8 * max(factors >> 4 for factors in sampling) if components > 1 else 8
+    mcu_height = 8 * max(factors & 0xf for factors in sampling) if components > 1 else 8
+    row_mcus = math.ceil(width / mcu_width)
+    rows = math.ceil(height / mcu_height)
+
+    dri = next(start for marker, start, end in found if marker == 0xdd)
+    interval = struct.unpack(">H", data[dri + 4:dri + 6])[0]
+    if interval == 0:
+        return None
+
+    # Rows each interval covers, or intervals to a row
+    if interval % row_mcus == 0:
+        interval_rows, row_intervals = interval // row_mcus, 1
+    elif row_mcus % interval == 0:
+        interval_rows, row_intervals = 1, row_mcus // interval
+    else:
+        return None
+
+    pieces, end = intervals(data, scan)
+    if pieces == None or data[end:end + 2] != b"\xff\xd9":
+        return None
+
+    # Whole intervals per strip, whole rows too
+    total_intervals = math.ceil(rows / interval_rows) * row_intervals
+    if len(pieces) != total_intervals or total_intervals < 2:
+        return None
+
+    strip_rows = max(1, math.ceil(rows / count / interval_rows)) * interval_rows
+    header_end = frame[0] + 5
+    result = []
+
+    for first_row in range(0, rows, strip_rows):
+        strip_height = min(strip_rows * mcu_height, height - first_row * mcu_height)
+        first = first_row // interval_rows * row_intervals
+        last = min(total_intervals, (first_row + strip_rows) // interval_rows * row_intervals)
+
+        entropy = bytearray()
+        for number, piece in enumerate(pieces[first:last]):
+            if number > 0:
+                entropy += bytes([0xff, 0xd0 + (number - 1) % 8])
+            entropy += piece
+
+        result.append((data[:header_end] + struct.pack(">H", strip_height) + data[header_end + 2:scan] +
+                       bytes(entropy) + b"\xff\xd9", strip_height))
+
+    return result
@@ -0,0 +1,134 @@
+import os
+import subprocess
+
+import jpegstrips
+
+# Lossless turns, flips and crops of a jpeg in the DCT domain, by
+# jpegtran from mozjpeg or libjpeg-turbo, so a print that only needs
+# turning upright or to print orientation, or cropping to an area,
+# spools the upload's own coefficients instead of a decode, rot90 and
+# re-encode of every pixel
+#
+#   BLUEPRINT_JPEGTRAN=C:\mozjpeg\jpegtran.exe
+#
+# Only exact transforms are made: an edge a turn or flip moves to the
+# top or left, and a crop's top left corner, must fall on the MCU grid.
+# Everything else is None and renders as usual
+
+JPEGTRAN = os.environ.get("BLUEPRINT_JPEGTRAN", "")
+
+# Longest one transform may take before it's given up on
+TIMEOUT_SECONDS = float(os.environ.get("BLUEPRINT_JPEGTRAN_TIMEOUT", "120"))
+
+# jpegtran's switches for clockwise quarter turns and then a flip, the
+# way uprightTurns counts them. A turn and a flip fold into one
+# transform
+TRANSFORMS = {
+    (0, False): [],
+    (1, False): ["-rotate", "90"],
+    (2, False): ["-rotate", "180"],
+    (3, False): ["-rotate", "270"],
+    (0, True): ["-flip", "horizontal"],
+    (1, True): ["-transpose"],
+    (2, True): ["-flip", "vertical"],
+    (3, True): ["-transverse"],
+}
+
+# Frames jpegtran transforms: baseline, extended and progressive Huffman
+FRAMES = {0xc0, 0xc1, 0xc2}
+
+
+def enabled():
+    return JPEGTRAN != ""
+
+
+def mcuSize(data):
+    # (width, height) of a jpeg's MCU, or None when it isn't one
+    # jpegtran can transform
+    found, scan = jpegstrips.segments(data)
+    if found == None:
+        return None
+
+    frame = next((start for marker, start, end in found if marker in FRAMES), None)
+    if frame == None or any(marker in jpegstrips.OTHER_FRAMES - FRAMES for marker, start, end in found):
+        return None
+
+    components = data[frame + 9]
+    if components == 1:
+        return 8, 8
+
+    sampling = [data[frame + 11 + 3 * i] for i in range(components)]
+
+    return 8 * max(factors >> 4 for factors in sampling), 8 * max(factors & 0xf for factors in sampling)
+
+
+def snappedBox(box, width, height, mcu):
+    # A (left, top, width, height) pixel box grown out to the MCU grid,
+    # so every edge of it lands on one after any turn or flip
+    left = box[0] // mcu[0] * mcu[0]
+    top = box[1] // mcu[1] * mcu[1]
+    right = min(width, -(-(box[0] + box[2]) // mcu[0]) * mcu[0])
+    bottom = min(height, -(-(box[1] + box[3]) // mcu[1]) * mcu[1])
+
+    return left, top, right - left, bottom - top
+
+
+def exact(width, height, mcu, turns, flip):
+    # Whether turning and flipping a width by height jpeg moves no
+    # partial MCU at its right or bottom edge to the top or left
+    right = width % mcu[0] == 0
+    bottom = height % mcu[1] == 0
+
+    return {(0, False): True, (1, False): bottom, (2, False): right and bottom, (3, False): right,
+            (0, True): right, (1, True): True, (2, True): bottom, (3, True): right and bottom}[(turns, flip)]
+
+
+def turnedBox(box, width, height, turns, flip):
+    # A pixel box of the stored image in the turned and flipped one's
+    # pixels, turning clockwise and then flipping as orient does
+    left, top, box_width, box_height = box
+
+    for turn in range(turns):
+        left, top, box_width, box_height = height - top - box_height, left, box_height, box_width
+        width, height = height, width
+
+    if flip:
+        left = width - left - box_width
+
+    return left, top, box_width, box_height
+
+
+def transform(data, turns, flip, box=None):
+    # data turned clockwise, flipped and cropped to box, a pixel box of
+    # the image as stored, or None when jpegtran can't do it exactly.
+    # Its EXIF goes with its orientation tag, its JFIF header stays
+    found, scan = jpegstrips.segments(data)
+    mcu = mcuSize(data)
+    if found == None or mcu == None:
+        return None
+
+    frame = next(start for marker, start, end in found if marker in FRAMES)
+    height, width = int.from_bytes(data[frame + 5:frame + 7], "big"), int.from_bytes(data[frame + 7:frame + 9], "big")
+
+    if not exact(width, height, mcu, turns, flip):
+        return None
+
+    arguments = [JPEGTRAN, "-copy", "none", "-perfect"] + TRANSFORMS[(turns, flip)]
+
+    if box != None:
+        if box != snappedBox(box, width, height, mcu):
+            return None
+
+        left, top, box_width, box_height = turnedBox(box, width, height, turns, flip)
+        arguments += ["-crop", str(box_width) + "x" + str(box_height) + "+" + str(left) + "+" + str(top)]
+
+    try:
+        process = subprocess.run(arguments, input=data, stdout=subprocess.PIPE, stderr=subprocess.DEVNULL,
+                                 timeout=TIMEOUT_SECONDS)
+    except (OSError, subprocess.TimeoutExpired):
+        return None
+
+    if process.returncode != 0 or process.stdout[:2] != b"\xff\xd8":
+        return None
+
+    return process.stdout
@@ -0,0 +1,257 @@
+import os
+import sys
+import json
+import time
+import random
+import argparse
+import threading
+import urllib.error
+import urllib.request
+
+# Replay kiosk sessions against a running server to measure capacity
+#
+#   python loadtest.py                       4 users, 20 sessions each
+#   python loadtest.py --users 16 --sessions 5 --url http://kiosk:5000
+#   python loadtest.py --record sessions.jsonl
+#                                            replay recorded sessions
+#   python loadtest.py --print               end sessions with a print,
+#                                            which really prints
+#
+# A session uploads a file, tweaks options as the frontend's
+# triggerChange does, rendering a preview for each tweak and fetching
+# it, then optionally prints. Uploads get distinct trailing bytes so
+# users don't share the server's caches. Reports preview latency
+# percentiles, throughput, errors and the server's RSS over the run,
+# scraped from /metrics
+
+CORPUS_DIR = "bench_corpus"
+
+# Corpus files from bench.py sessions upload, with their content type
+CORPUS = {
+    "large.jpg": "image/jpeg",
+    "16bit.tif": "image/tiff",
+    "cmyk.jpg": "image/jpeg",
+    "multipage.pdf": "application/pdf",
+    "complex.svg": "image/svg+xml",
+    "animated.gif": "image/gif",
+    "photo.webp": "image/webp",
+}
+
+# Option tweaks a synthetic session picks from, each one control the
+# user changes
+TWEAKS = [
+    {"paper_width": 17}, {"paper_width": 24}, {"paper_width": 36}, {"paper_width": 44},
+    {"side": "short"}, {"side": "long"},
+    {"max_size": False, "specific_width": 12}, {"max_size": False, "specific_width": 20},
+    {"max_size": True, "specific_width": None},
+    {"auto_trim": True}, {"auto_trim": False},
+]
+
+# Seconds between RSS samples
+RSS_INTERVAL = 2
+
+
+def defaultOptions():
+    # What getOptions sends for a fresh upload
+    return {"side": "short", "max_size": True, "specific_width": None, "specific_height": None,
+            "specific_dpi": None, "paper_width": 36, "all_pages": False, "auto_trim": False, "panels": False,
+            "print": False, "viewport": {"width": 1280, "height": 800, "dpr": 1}}
+
+
+def syntheticSession(rng, tweaks):
+    # A random corpus file and tweaks options changes
+    name = rng.choice(sorted(CORPUS))
+
+    return {"file": os.path.join(CORPUS_DIR, name), "content_type": CORPUS[name],
+            "tweaks": [rng.choice(TWEAKS) for i in range(tweaks)]}
+
+
+def loadSessions(path):
+    # Recorded sessions, one json object per line with file,
+    # content_type and tweaks, a list of option changes
+    with open(path) as f:
+        return [json.loads(line) for line in f if line.strip()]
+
+
+class Results:
+    # Shared between the user threads
+
+    def __init__(self):
+        self.lock = threading.Lock()
+        self.previews = []
+        self.uploads = []
+        self.errors = {}
+        self.sessions = 0
+
+    def error(self, kind):
+        with self.lock:
+            self.errors[kind] = self.errors.get(kind, 0) + 1
+
+
+def request(url, data=None, headers={}, method=None):
+    # Status and body of one request, errors included
+    try:
+        with urllib.request.urlopen(urllib.request.Request(url, data=data, headers=headers, method=method)) as response:
+            return response.status, response.read()
+    except urllib.error.HTTPError as error:
+        return error.code, error.read()
+
+
+def runSession(url, session, results, rng, print_at_end):
+    with open(session["file"], "rb") as f:
+        data = f.read()
+
+    # Unique bytes after the end of the file, ignored by the decoders
+    data += b"\0" * 16 + rng.randbytes(16)
+
+    start = time.time()
+    status, body = request(url + "/upload", data, {"Content-Type": session["content_type"]})
+
+    with results.lock:
+        results.uploads.append(time.time() - start)
+
+    if status != 200:
+        results.error("upload " + str(status))
+        return
+
+    handle = json.loads(body)["handle"]
+    options = defaultOptions()
+
+    for tweak in [{}] + session["tweaks"]:
+        options.update(tweak)
+
+        start = time.time()
+        status, body = request(url + "/render", json.dumps({"handle": handle, "options": options}).encode(),
+                               {"Content-Type": "application/json", "Accept": "image/webp,*/*"})
+
+        if status == 200:
+            image_url = json.loads(body).get("image_url")
+            if image_url != None:
+                status, image = request(url + image_url, headers={"Accept": "image/webp,*/*"})
+
+        latency = time.time() - start
+
+        if status != 200:
+            results.error("preview " + str(status))
+            continue
+
+        with results.lock:
+            results.previews.append(latency)
+
+        # Users look at each preview before the next change
+        time.sleep(rng.uniform(0.2, 1.0))
+
+    if print_at_end:
+        status, body = request(url + "/render", json.dumps({"handle": handle, "options": dict(options, print=True)}).encode(),
+                               {"Content-Type": "application/json"})
+        if status != 202:
+            results.error("print " + str(status))
+
+    with results.lock:
+        results.sessions += 1
+
+
+def user(url, sessions, results, seed, print_at_end):
+    rng = random.Random(seed)
+
+    for session in sessions:
+        try:
+            runSession(url, session, results, rng, print_at_end)
+        except (OSError, ValueError) as error:
+            results.error(type(error).__name__)
+
+
+def residentMemory(url):
+    # Server RSS from its metrics, None if it can't be read
+    try:
+        status, body = request(url + "/metrics")
+    except OSError:
+        return None
+
+    for line in body.decode().splitlines():
+        if line.startswith("blueprint_process_resident_bytes "):
+            return int(float(line.split()[1]))
+
+    return None
+
+
+def percentile(values, fraction):
+    values = sorted(values)
+    return values[min(len(values) - 1, int(fraction * len(values)))]
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Replay kiosk sessions against a running server")
+    parser.add_argument("--url", default="http://127.0.0.1:5000")
+    parser.add_argument("--users", type=int, default=4, help="concurrent sessions")
+    parser.add_argument("--sessions", type=int, default=20, help="sessions each user runs")
+    parser.add_argument("--tweaks", type=int, default=5, help="option changes in a synthetic session")
+    parser.add_argument("--record", help="jsonl of recorded sessions to replay instead")
+    parser.add_argument("--print", action="store_true", help="end each session with a print")
+    parser.add_argument("--seed", type=int, default=1)
+    arguments = parser.parse_args()
+
+    url = arguments.url.rstrip("/")
+
+    if arguments.record:
+        recorded = loadSessions(arguments.record)
+    elif not os.path.isdir(CORPUS_DIR):
+        sys.exit("No " + CORPUS_DIR + ", run bench.py once to generate it")
+
+    threads = []
+    results = Results()
+
+    for i in range(arguments.users):
+        rng = random.Random(arguments.seed + i)
+
+        if arguments.record:
+            sessions = [recorded[(i + j) % len(recorded)] for j in range(arguments.sessions)]
+        else:
+            sessions = [syntheticSession(rng, arguments.tweaks) for j in range(arguments.sessions)]
+
+        threads.append(threading.Thread(target=user, args=(url, sessions, results, arguments.seed + i,
+                                                           arguments.print), daemon=True))
+
+    rss = []
+    start = time.time()
+
+    for thread in threads:
+        thread.start()
+
+    while any(thread.is_alive() for thread in threads):
+        sample = residentMemory(url)
+        if sample != None:
+            rss.append((time.time() - start, sample))
+            print("%7.1f s  rss %6d MB  %d previews" % (rss[-1][0], sample // (1024 * 1024), len(results.previews)))
+
+        for thread in threads:
+            thread.join(timeout=RSS_INTERVAL / len(threads))
+
+    wall = time.time() - start
+    requests = len(results.previews) + sum(results.errors.values())
+
+    print()
+    print("%d users, %d sessions in %.1f s" % (arguments.users, results.sessions, wall))
+
+    if results.previews:
+        print("preview  p50 %6.3f s  p95 %6.3f s  p99 %6.3f s  max %6.3f s" % (
+            percentile(results.previews, 0.5), percentile(results.previews, 0.95),
+            percentile(results.previews, 0.99), max(results.previews)))
+        print("throughput %.2f previews/s" % (len(results.previews) / wall))
+
+    if results.uploads:
+        print("upload   p50 %6.3f s  p95 %6.3f s" % (percentile(results.uploads, 0.5),
+                                                    percentile(results.uploads, 0.95)))
+
+    print("errors %d of %d (%.1f%%) %s" % (sum(results.errors.values()), max(1, requests),
+                                            100 * sum(results.errors.values()) / max(1, requests),
+                                            json.dumps(results.errors) if results.errors else ""))
+
+    if rss:
+        print("rss start %d MB  peak %d MB  end %d MB" % (rss[0][1] // (1024 * 1024),
+                                                         max(sample for at, sample in rss) // (1024 * 1024),
+                                                         rss[-1][1] // (1024 * 1024)))
+
+
+if __name__ == "__main__":
+    main()
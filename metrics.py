@@ -0,0 +1,141 @@
+import threading
+import time
+import contextlib
+
+
+class Counter:
+    # Count that only goes up, optionally split by labels
+
+    def __init__(self, name, help):
+        self.name = name
+        self.help = help
+        self.values = {}
+        self.lock = threading.Lock()
+
+    def inc(self, amount=1, **labels):
+        key = tuple(sorted(labels.items()))
+
+        with self.lock:
+            self.values[key] = self.values.get(key, 0) + amount
+
+    def render(self):
+        lines = ["# HELP " + self.name + " " + self.help, "# TYPE " + self.name + " counter"]
+
+        with self.lock:
+            values = dict(self.values) or {(): 0}
+
+        for key, value in values.items():
+            lines.append(self.name + labelString(key) + " " + str(value))
+
+        return lines
+
+
+class Gauge:
+    # Value read from a callback each time metrics are scraped
+
+    def __init__(self, name, help, read):
+        self.name = name
+        self.help = help
+        self.read = read
+
+    def render(self):
+        lines = ["# HELP " + self.name + " " + self.help, "# TYPE " + self.name + " gauge"]
+
+        try:
+            lines.append(self.name + " " + str(self.read()))
+        except Exception as e:
+            print("Error reading gauge " + self.name + ": " + str(e))
+
+        return lines
+
+
+class Histogram:
+    # Distribution of observed values in cumulative buckets, optionally
+    # split by labels
+
+    def __init__(self, name, help, buckets):
+        self.name = name
+        self.help = help
+        self.buckets = sorted(buckets)
+        self.values = {}
+        self.lock = threading.Lock()
+
+    def observe(self, value, **labels):
+        key = tuple(sorted(labels.items()))
+
+        with self.lock:
+            if key not in self.values:
+                self.values[key] = {"counts": [0] * len(self.buckets), "sum": 0, "count": 0}
+
+            series = self.values[key]
+            for i, bound in enumerate(self.buckets):
+                if value <= bound:
+                    series["counts"][i] += 1
+
+            series["sum"] += value
+            series["count"] += 1
+
+    @contextlib.contextmanager
+    def time(self, **labels):
+        # Observe how long the block takes, in seconds
+        start = time.time()
+
+        try:
+            yield
+        finally:
+            self.observe(time.time() - start, **labels)
+
+    def render(self):
+        lines = ["# HELP " + self.name + " " + self.help, "# TYPE " + self.name + " histogram"]
+
+        with self.lock:
+            values = {key: dict(series, counts=list(series["counts"])) for key, series in self.values.items()}
+
+        for key, series in values.items():
+            for bound, count in zip(self.buckets, series["counts"]):
+                lines.append(self.name + "_bucket" + labelString(key + (("le", bound),)) + " " + str(count))
+
+            lines.append(self.name + "_bucket" + labelString(key + (("le", "+Inf"),)) + " " + str(series["count"]))
+            lines.append(self.name + "_sum" + labelString(key) + " " + str(series["sum"]))
+            lines.append(self.name + "_count" + labelString(key) + " " + str(series["count"]))
+
+        return lines
+
+
+def labelString(key):
+    # {name="value",...} for a sorted label tuple
+    if not key:
+        return ""
+
+    return "{" + ",".join(name + '="' + str(value) + '"' for name, value in key) + "}"
+
+
+# Every metric, in the order they're exposed
+registry = []
+
+
+def counter(name, help):
+    metric = Counter(name, help)
+    registry.append(metric)
+    return metric
+
+
+def gauge(name, help, read):
+    metric = Gauge(name, help, read)
+    registry.append(metric)
+    return metric
+
+
+def histogram(name, help, buckets):
+    metric = Histogram(name, help, buckets)
+    registry.append(metric)
+    return metric
+
+
+def render():
+    # All metrics in the Prometheus text exposition format
+    lines = []
+    for metric in registry:
+        lines.extend(metric.render())
+
+    return "\n".join(lines) + "\n"
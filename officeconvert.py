@@ -0,0 +1,264 @@
+import os
+import sys
+import json
+import queue
+import signal
+import shutil
+import hashlib
+import tempfile
+import threading
+import subprocess
+
+# Office documents converted to pdf by a pool of LibreOffice processes
+# started with the server, so an upload doesn't pay the suite's multi
+# second start. Each converter is officeworker.py under LibreOffice's
+# own python, holding a headless soffice of its own open over UNO
+#
+#   BLUEPRINT_OFFICE=C:\Program Files\LibreOffice\program
+#
+# Converted pdfs are kept by the hash of the document, so the same
+# poster uploaded again, or from another kiosk tab, converts once
+
+OFFICE_DIR = os.environ.get("BLUEPRINT_OFFICE", "")
+CONVERTERS = int(os.environ.get("BLUEPRINT_OFFICE_CONVERTERS", "2"))
+
+# Longest one conversion may take before its converter is restarted
+TIMEOUT_SECONDS = float(os.environ.get("BLUEPRINT_OFFICE_TIMEOUT", "120"))
+
+CACHE_DIR = os.environ.get("BLUEPRINT_OFFICE_CACHE", "office_cache")
+CACHE_MAX = 64
+
+# Types converted, by the extension LibreOffice picks its filter from
+TYPES = {
+    "application/vnd.openxmlformats-officedocument.presentationml.presentation": "pptx",
+    "application/vnd.openxmlformats-officedocument.wordprocessingml.document": "docx",
+    "application/vnd.ms-powerpoint": "ppt",
+    "application/msword": "doc",
+    "application/vnd.oasis.opendocument.presentation": "odp",
+    "application/vnd.oasis.opendocument.text": "odt",
+}
+
+WORKER_SCRIPT = os.path.join(os.path.dirname(os.path.realpath(__file__)), "officeworker.py")
+
+# Idle converters, and the documents converting by hash so a second
+# upload of one waits for the first
+idle = queue.Queue()
+converting = {}
+converting_lock = threading.Lock()
+
+
+class ConversionError(Exception):
+    pass
+
+
+def enabled():
+    return OFFICE_DIR != ""
+
+
+def officePython():
+    # LibreOffice's bundled python has its uno module, a packaged
+    # suite's is the system one
+    for name in ["python.exe", "python"]:
+        path = os.path.join(OFFICE_DIR, name)
+        if os.path.exists(path):
+            return path
+
+    return sys.executable
+
+
+def officeBinary():
+    for name in ["soffice.exe", "soffice"]:
+        path = os.path.join(OFFICE_DIR, name)
+        if os.path.exists(path):
+            return path
+
+    return "soffice"
+
+
+class Converter:
+
+    def __init__(self, index, generation=0):
+        # generation counts the restarts of converter index. Each
+        # restart gets a profile of its own, in case an soffice that
+        # couldn't be killed still holds the last one's lock
+        self.index = index
+        self.generation = generation
+        self.process = None
+        self.office_pid = None
+        self.profile = os.path.join(tempfile.gettempdir(), "blueprint-office-" + str(index) +
+                                    ("-" + str(generation) if generation else ""))
+
+    def start(self):
+        # Start the worker and wait for its soffice to be connected and
+        # warmed up, raising ConversionError when it can't be
+        pipe = "blueprint-office-" + str(os.getpid()) + "-" + str(self.index) + "-" + str(self.generation)
+
+        self.process = subprocess.Popen([officePython(), WORKER_SCRIPT, officeBinary(), self.profile, pipe],
+                                        stdin=subprocess.PIPE, stdout=subprocess.PIPE, text=True)
+
+        reply = self.reply()
+        self.office_pid = reply.get("pid")
+
+        if reply.get("error"):
+            self.stop()
+            raise ConversionError(reply["error"])
+
+    def reply(self):
+        # The worker's next line, killing it and its soffice if none
+        # comes in time
+        timer = threading.Timer(TIMEOUT_SECONDS, self.stop)
+        timer.start()
+
+        try:
+            line = self.process.stdout.readline()
+        finally:
+            timer.cancel()
+
+        if not line:
+            return {"error": "converter exited"}
+
+        return json.loads(line)
+
+    def convert(self, input_path, output_path):
+        try:
+            self.process.stdin.write(json.dumps({"input": input_path, "output": output_path}) + "\n")
+            self.process.stdin.flush()
+        except OSError:
+            return {"error": "converter exited"}
+
+        return self.reply()
+
+    def stop(self):
+        # Kill the worker and its soffice. Killed, the worker can't
+        # shut soffice down itself
+        if self.process != None and self.process.poll() == None:
+            self.process.kill()
+
+        if self.office_pid != None:
+            killOffice(self.office_pid)
+            self.office_pid = None
+
+        if self.generation:
+            shutil.rmtree(self.profile, ignore_errors=True)
+
+
+def killOffice(pid):
+    # On Windows soffice.exe is a launcher for soffice.bin, so its whole
+    # tree goes
+    try:
+        if sys.platform == "win32":
+            subprocess.run(["taskkill", "/F", "/T", "/PID", str(pid)], capture_output=True)
+        else:
+            os.kill(pid, signal.SIGKILL)
+    except OSError:
+        pass
+
+
+def startConverter(index, generation=0):
+    converter = Converter(index, generation)
+
+    try:
+        converter.start()
+    except (OSError, ConversionError) as error:
+        print("Couldn't start office converter " + str(index) + ": " + str(error))
+        return
+
+    idle.put(converter)
+
+
+def start():
+    # Start the pool alongside the server
+    for index in range(CONVERTERS):
+        threading.Thread(target=startConverter, args=(index,), name="office-" + str(index), daemon=True).start()
+
+
+def cachedPath(key):
+    return os.path.join(CACHE_DIR, key + ".pdf")
+
+
+def trimCache():
+    # Keep the CACHE_MAX most recently converted pdfs
+    try:
+        paths = [os.path.join(CACHE_DIR, name) for name in os.listdir(CACHE_DIR) if name.endswith(".pdf")]
+    except OSError:
+        return
+
+    paths.sort(key=lambda path: os.path.getmtime(path), reverse=True)
+
+    for path in paths[CACHE_MAX:]:
+        try:
+            os.remove(path)
+        except OSError:
+            pass
+
+
+def convert(data, content_type):
+    # The pdf an Office document converts to, from the cache when it
+    # has been converted before. Raises ConversionError
+    key = hashlib.blake2b(data, digest_size=16).hexdigest()
+
+    with converting_lock:
+        event = converting.get(key)
+        first = event == None
+        if first:
+            event = converting[key] = threading.Event()
+
+    if not first:
+        event.wait()
+
+    try:
+        with open(cachedPath(key), "rb") as f:
+            pdf = f.read()
+        os.utime(cachedPath(key))
+        return pdf
+    except OSError:
+        if not first:
+            raise ConversionError("conversion failed")
+
+    try:
+        return convertNow(data, content_type, key)
+    finally:
+        with converting_lock:
+            del converting[key]
+        event.set()
+
+
+def convertNow(data, content_type, key):
+    # Convert on the next idle converter, replacing it if it fails
+    try:
+        converter = idle.get(timeout=TIMEOUT_SECONDS)
+    except queue.Empty:
+        raise ConversionError("no office converter is running")
+
+    directory = tempfile.mkdtemp(prefix="blueprint-office-")
+    input_path = os.path.join(directory, "upload." + TYPES[content_type])
+    output_path = os.path.join(directory, "upload.pdf")
+
+    try:
+        with open(input_path, "wb") as f:
+            f.write(data)
+
+        reply = converter.convert(input_path, output_path)
+
+        if reply.get("error"):
+            raise ConversionError(reply["error"])
+
+        with open(output_path, "rb") as f:
+            pdf = f.read()
+    finally:
+        shutil.rmtree(directory, ignore_errors=True)
+
+        if converter.process.poll() == None:
+            idle.put(converter)
+        else:
+            converter.stop()
+            threading.Thread(target=startConverter, args=(converter.index, converter.generation + 1),
+                             name="office-" + str(converter.index), daemon=True).start()
+
+    os.makedirs(CACHE_DIR, exist_ok=True)
+    with open(cachedPath(key) + ".part", "wb") as f:
+        f.write(pdf)
+    os.replace(cachedPath(key) + ".part", cachedPath(key))
+    trimCache()
+
+    return pdf
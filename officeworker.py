@@ -0,0 +1,118 @@
+import sys
+import json
+import time
+import subprocess
+
+import uno
+from com.sun.star.beans import PropertyValue
+
+# One office converter of officeconvert's pool, run under LibreOffice's
+# python for its uno module
+#
+#   python officeworker.py SOFFICE PROFILE PIPE
+#
+# Starts a headless soffice listening on PIPE, connects and warms up
+# the impress and writer modules, then says {"ready": true, "pid"} with
+# soffice's pid, for the pool to kill it if this is killed. After that
+# each line in is {"input", "output"} paths and each line out is {} or
+# {"error"}. soffice is shut down when stdin closes
+
+CONNECT_SECONDS = 60
+
+# pdf export filter by the service the loaded document offers
+EXPORT_FILTERS = [
+    ("com.sun.star.presentation.PresentationDocument", "impress_pdf_Export"),
+    ("com.sun.star.drawing.DrawingDocument", "draw_pdf_Export"),
+    ("com.sun.star.sheet.SpreadsheetDocument", "calc_pdf_Export"),
+    ("com.sun.star.text.TextDocument", "writer_pdf_Export"),
+]
+
+
+def properties(**values):
+    return tuple(PropertyValue(Name=name, Value=value) for name, value in values.items())
+
+
+def connect(soffice, profile, pipe):
+    # Start soffice and return it with its desktop once it answers
+    process = subprocess.Popen([soffice, "--headless", "--invisible", "--nologo", "--norestore", "--nodefault",
+                                "--nolockcheck", "-env:UserInstallation=" + uno.systemPathToFileUrl(profile),
+                                "--accept=pipe,name=" + pipe + ";urp;StarOffice.ComponentContext"])
+
+    local = uno.getComponentContext()
+    resolver = local.ServiceManager.createInstanceWithContext("com.sun.star.bridge.UnoUrlResolver", local)
+    deadline = time.time() + CONNECT_SECONDS
+
+    while True:
+        try:
+            context = resolver.resolve("uno:pipe,name=" + pipe + ";urp;StarOffice.ComponentContext")
+            break
+        except Exception:
+            if process.poll() != None or time.time() > deadline:
+                process.kill()
+                raise
+
+            time.sleep(0.25)
+
+    return process, context.ServiceManager.createInstanceWithContext("com.sun.star.frame.Desktop", context)
+
+
+def warmUp(desktop):
+    # Open and close an empty presentation and text document, which
+    # loads their modules so the first real upload doesn't
+    for factory in ["private:factory/simpress", "private:factory/swriter"]:
+        desktop.loadComponentFromURL(factory, "_blank", 0, properties(Hidden=True)).close(True)
+
+
+def convert(desktop, input_path, output_path):
+    document = desktop.loadComponentFromURL(uno.systemPathToFileUrl(input_path), "_blank", 0,
+                                            properties(Hidden=True, ReadOnly=True))
+    if document == None:
+        raise ValueError("LibreOffice couldn't open the document")
+
+    try:
+        export = next((name for service, name in EXPORT_FILTERS if document.supportsService(service)), None)
+        if export == None:
+            raise ValueError("Not a document that prints")
+
+        document.storeToURL(uno.systemPathToFileUrl(output_path), properties(FilterName=export))
+    finally:
+        document.close(True)
+
+
+def reply(message):
+    sys.stdout.write(json.dumps(message) + "\n")
+    sys.stdout.flush()
+
+
+def main():
+    soffice, profile, pipe = sys.argv[1:4]
+
+    try:
+        process, desktop = connect(soffice, profile, pipe)
+        warmUp(desktop)
+    except Exception as error:
+        reply({"error": str(error)})
+        return
+
+    reply({"ready": True, "pid": process.pid})
+
+    try:
+        for line in sys.stdin:
+            request = json.loads(line)
+
+            try:
+                convert(desktop, request["input"], request["output"])
+            except Exception as error:
+                reply({"error": str(error)})
+                continue
+
+            reply({})
+    finally:
+        try:
+            desktop.terminate()
+        except Exception:
+            process.kill()
+
+
+if __name__ == "__main__":
+    main()
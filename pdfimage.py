@@ -0,0 +1,413 @@
+import re
+import zlib
+
+# Finds pdfs that are only a wrapper round one picture, the single
+# full-page jpeg a scanner or Photoshop writes, and gives back the
+# picture's own bytes so it prints and previews as the raster it is,
+# at its native resolution and with shrink-on-load, instead of being
+# rasterised again by poppler
+#
+# Only as much of pdf is read as such files use: plain and compressed
+# object streams, Flate content streams, and a page drawing one
+# DCTDecode or JPXDecode image over the whole of it with nothing else.
+# Anything else is None, and prints through pdfload as before. The
+# same reading gives pageFeatures, what app's rasteriser policy picks
+# a backend from
+
+OBJECT = re.compile(rb"(\d+)\s+(\d+)\s+obj\b")
+REFERENCE = re.compile(rb"(\d+)\s+(\d+)\s+R(?![^\s()<>\[\]{}/%])")
+TOKEN = re.compile(rb"[^\s()<>\[\]{}/%]+")
+NAME = re.compile(rb"/([^\s()<>\[\]{}/%]*)")
+SPACE = b" \t\r\n\f\0"
+
+# Content operators a picture's page draws with, besides its one Do
+DRAWING = {"q", "Q", "cm", "gs"}
+
+# Slack in where the picture sits and its shape, as a share of the page
+TOLERANCE = 0.01
+
+# jpeg APP2 segments carry at most this much ICC profile each
+ICC_CHUNK = 65519
+
+TEXT_OPERATORS = re.compile(rb"(?<![^\s\])>])(Tj|TJ|'|\")(?![^\s()<>\[\]{}/%])")
+PATH_OPERATORS = re.compile(rb"(?<=\s)(m|l|c|v|y|re)(?![^\s()<>\[\]{}/%])")
+
+
+class Name(str):
+    pass
+
+
+class Operator(str):
+    pass
+
+
+class Reference(int):
+    pass
+
+
+class Stream:
+
+    def __init__(self, dictionary, data):
+        self.dictionary = dictionary
+        self.data = data
+
+
+def skipSpace(data, pos):
+    while pos < len(data):
+        if data[pos] in SPACE:
+            pos += 1
+        elif data[pos] == ord("%"):
+            while pos < len(data) and data[pos] not in b"\r\n":
+                pos += 1
+        else:
+            break
+
+    return pos
+
+
+def parseString(data, pos):
+    # A literal string, its escapes left as they are, nothing here
+    # reads one
+    depth = 0
+    start = pos
+
+    while pos < len(data):
+        if data[pos] == ord("\\"):
+            pos += 2
+            continue
+
+        if data[pos] == ord("("):
+            depth += 1
+        elif data[pos] == ord(")"):
+            depth -= 1
+            if depth == 0:
+                return data[start + 1:pos], pos + 1
+
+        pos += 1
+
+    raise ValueError("unterminated string")
+
+
+def parseObject(data, pos):
+    # The pdf object at pos and the position after it
+    pos = skipSpace(data, pos)
+
+    if data.startswith(b"<<", pos):
+        dictionary = {}
+        pos += 2
+
+        while True:
+            pos = skipSpace(data, pos)
+            if data.startswith(b">>", pos):
+                return dictionary, pos + 2
+
+            key, pos = parseObject(data, pos)
+            value, pos = parseObject(data, pos)
+            dictionary[key] = value
+
+    if data.startswith(b"[", pos):
+        array = []
+        pos += 1
+
+        while True:
+            pos = skipSpace(data, pos)
+            if data.startswith(b"]", pos):
+                return array, pos + 1
+
+            value, pos = parseObject(data, pos)
+            array.append(value)
+
+    if data.startswith(b"/", pos):
+        match = NAME.match(data, pos)
+        return Name(match.group(1).decode("latin-1")), match.end()
+
+    if data.startswith(b"(", pos):
+        return parseString(data, pos)
+
+    if data.startswith(b"<", pos):
+        end = data.index(b">", pos)
+        return bytes.fromhex(re.sub(rb"\s", b"", data[pos + 1:end]).decode()), end + 1
+
+    match = REFERENCE.match(data, pos)
+    if match:
+        return Reference(int(match.group(1))), match.end()
+
+    match = TOKEN.match(data, pos)
+    if not match:
+        raise ValueError("bad token at " + str(pos))
+
+    token = match.group(0).decode("latin-1")
+
+    if re.fullmatch(r"[+-]?\d+", token):
+        return int(token), match.end()
+    if re.fullmatch(r"[+-]?(\d+\.\d*|\.\d+|\d+\.)", token):
+        return float(token), match.end()
+
+    return {"true": True, "false": False, "null": None}.get(token, Operator(token)), match.end()
+
+
+def readObjects(data):
+    # Every numbered object in the file, later definitions replacing
+    # earlier ones as incremental updates do
+    objects = {}
+    deferred = []
+    pos = 0
+
+    while True:
+        match = OBJECT.search(data, pos)
+        if not match:
+            break
+
+        value, pos = parseObject(data, match.end())
+        pos = skipSpace(data, pos)
+
+        if isinstance(value, dict) and data.startswith(b"stream", pos):
+            pos += len(b"stream")
+            pos += 2 if data.startswith(b"\r\n", pos) else 1
+
+            length = value.get("Length")
+            end = pos + length if isinstance(length, int) and not isinstance(length, Reference) else \
+                data.index(b"endstream", pos)
+
+            deferred.append((int(match.group(1)), value, pos, end))
+            pos = end
+
+        else:
+            objects[int(match.group(1))] = value
+
+    # Stream lengths can be objects of their own, defined later on
+    for number, dictionary, start, end in deferred:
+        length = dictionary.get("Length")
+        if isinstance(length, Reference) and isinstance(objects.get(length), int):
+            end = start + objects[length]
+
+        objects[number] = Stream(dictionary, data[start:end])
+
+    # Objects packed into object streams
+    for value in list(objects.values()):
+        if isinstance(value, Stream) and value.dictionary.get("Type") == "ObjStm":
+            packed = decode(value)
+            first = value.dictionary["First"]
+            header = [int(token) for token in packed[:first].split()]
+
+            for i in range(0, len(header) - 1, 2):
+                if header[i] not in objects:
+                    objects[header[i]] = parseObject(packed, first + header[i + 1])[0]
+
+    return objects
+
+
+def decode(stream):
+    # A stream's data, inflated when it's Flate, which is all pages and
+    # object streams use in the files this reads
+    filters = stream.dictionary.get("Filter")
+    filters = filters if isinstance(filters, list) else [filters] if filters != None else []
+
+    data = stream.data
+    for name in filters:
+        if name != "FlateDecode" or stream.dictionary.get("DecodeParms"):
+            raise ValueError("unsupported filter " + str(name))
+        data = zlib.decompress(data)
+
+    return data
+
+
+def resolve(objects, value):
+    while isinstance(value, Reference):
+        value = objects.get(value)
+
+    return value
+
+
+def pages(objects, node, inherited, seen):
+    # Page dictionaries under a page tree node, with the attributes
+    # they inherit filled in
+    node = resolve(objects, node)
+    if not isinstance(node, dict) or id(node) in seen:
+        return []
+
+    seen.add(id(node))
+    inherited = dict(inherited, **{key: node[key] for key in ["Resources", "MediaBox", "CropBox", "Rotate"]
+                                   if key in node})
+
+    if node.get("Type") == "Page":
+        return [dict(node, **inherited)]
+
+    return [page for kid in resolve(objects, node.get("Kids")) or [] for page in pages(objects, kid, inherited, seen)]
+
+
+def multiply(m, n):
+    # m then n, as pdf matrices [a b c d e f]
+    return [m[0] * n[0] + m[1] * n[2], m[0] * n[1] + m[1] * n[3],
+            m[2] * n[0] + m[3] * n[2], m[2] * n[1] + m[3] * n[3],
+            m[4] * n[0] + m[5] * n[2] + n[4], m[4] * n[1] + m[5] * n[3] + n[5]]
+
+
+def drawnImage(objects, page):
+    # (name, matrix) of the one image the page draws, None when it draws
+    # anything else
+    contents = resolve(objects, page.get("Contents"))
+    contents = contents if isinstance(contents, list) else [contents]
+    data = b"\n".join(decode(resolve(objects, part)) for part in contents)
+
+    matrix = [1, 0, 0, 1, 0, 0]
+    saved = []
+    operands = []
+    drawn = None
+    pos = skipSpace(data, 0)
+
+    while pos < len(data):
+        value, pos = parseObject(data, pos)
+        pos = skipSpace(data, pos)
+
+        if not isinstance(value, Operator):
+            operands.append(value)
+            continue
+
+        if value == "q":
+            saved.append(matrix)
+        elif value == "Q":
+            matrix = saved.pop()
+        elif value == "cm":
+            matrix = multiply(operands, matrix)
+        elif value == "Do" and drawn == None:
+            drawn = (operands[0], matrix)
+        elif value not in DRAWING:
+            return None
+
+        operands = []
+
+    return drawn
+
+
+def plainGraphicsState(objects, resources):
+    # No transparency or blending in the page's graphics states
+    for state in (resolve(objects, resources.get("ExtGState")) or {}).values():
+        state = resolve(objects, state) or {}
+
+        if state.get("SMask") not in [None, "None"] or state.get("BM") not in [None, "Normal", "Compatible"] or \
+                state.get("CA", 1) != 1 or state.get("ca", 1) != 1:
+            return False
+
+    return True
+
+
+def covers(matrix, box, width, height):
+    # Whether an image drawn by matrix fills the box, the right way up
+    # and in its own shape
+    a, b, c, d, e, f = matrix
+    left, bottom, right, top = [float(edge) for edge in box]
+    box_width, box_height = right - left, top - bottom
+
+    if b != 0 or c != 0 or a <= 0 or d <= 0 or box_width <= 0 or box_height <= 0:
+        return False
+
+    return abs(e - left) <= TOLERANCE * box_width and abs(f - bottom) <= TOLERANCE * box_height and \
+        abs(a - box_width) <= TOLERANCE * box_width and abs(d - box_height) <= TOLERANCE * box_height and \
+        abs(width / height - a / d) <= TOLERANCE * width / height
+
+
+def withProfile(jpeg, profile):
+    # A jpeg with an ICC profile embedded in APP2 segments after its
+    # SOI, unless it has one of its own already
+    if b"ICC_PROFILE\0" in jpeg[:65536]:
+        return jpeg
+
+    chunks = [profile[i:i + ICC_CHUNK] for i in range(0, len(profile), ICC_CHUNK)]
+    segments = b""
+
+    for i, chunk in enumerate(chunks):
+        payload = b"ICC_PROFILE\0" + bytes([i + 1, len(chunks)]) + chunk
+        segments += b"\xff\xe2" + (len(payload) + 2).to_bytes(2, "big") + payload
+
+    return jpeg[:2] + segments + jpeg[2:]
+
+
+def embeddedImage(data):
+    # (content_type, bytes) of the picture a single page pdf is a
+    # wrapper round, or None
+    if re.search(rb"/Encrypt\b", data):
+        return None
+
+    try:
+        objects = readObjects(data)
+
+        catalog = next((value for number, value in sorted(objects.items(), reverse=True)
+                        if isinstance(value, dict) and value.get("Type") == "Catalog"), None)
+        if catalog == None:
+            return None
+
+        found = pages(objects, catalog.get("Pages"), {}, set())
+        if len(found) != 1 or found[0].get("Rotate", 0) % 360 != 0:
+            return None
+
+        page = found[0]
+        resources = resolve(objects, page.get("Resources")) or {}
+        drawn = drawnImage(objects, page)
+        if drawn == None or not plainGraphicsState(objects, resources):
+            return None
+
+        name, matrix = drawn
+        image = resolve(objects, (resolve(objects, resources.get("XObject")) or {}).get(name))
+        if not isinstance(image, Stream):
+            return None
+
+        info = image.dictionary
+        filters = info.get("Filter")
+        filters = filters if isinstance(filters, list) else [filters]
+
+        if info.get("Subtype") != "Image" or len(filters) != 1 or filters[0] not in ["DCTDecode", "JPXDecode"] or \
+                info.get("ImageMask") or info.get("SMask") != None or info.get("Mask") != None or \
+                info.get("Decode") != None:
+            return None
+
+        box = [resolve(objects, edge) for edge in resolve(objects, page.get("CropBox") or page.get("MediaBox"))]
+        if not covers(matrix, box, resolve(objects, info["Width"]), resolve(objects, info["Height"])):
+            return None
+
+        colour_space = resolve(objects, info.get("ColorSpace"))
+
+        if filters[0] == "JPXDecode":
+            # jp2 carries its own colour, a pdf space over it is an
+            # override this doesn't follow
+            return ("image/jp2", image.data) if colour_space == None else None
+
+        if colour_space in ["DeviceRGB", "DeviceGray", "DeviceCMYK"]:
+            return "image/jpeg", image.data
+
+        # An ICC space's profile goes into the jpeg, so Adobe RGB
+        # scans print as Adobe RGB
+        if isinstance(colour_space, list) and len(colour_space) == 2 and colour_space[0] == "ICCBased":
+            profile = resolve(objects, colour_space[1])
+            if isinstance(profile, Stream):
+                return "image/jpeg", withProfile(image.data, decode(profile))
+
+        return None
+    except (ValueError, IndexError, KeyError, TypeError, AttributeError, zlib.error, RecursionError):
+        return None
+
+
+def pageFeatures(data, page_number):
+    # What a page is made of from its content stream, counted without
+    # drawing it: {"fonts", "content_bytes", "text_operators",
+    # "path_operators"}, or None when the file can't be read here
+    try:
+        objects = readObjects(data)
+
+        catalog = next((value for number, value in sorted(objects.items(), reverse=True)
+                        if isinstance(value, dict) and value.get("Type") == "Catalog"), None)
+        found = pages(objects, catalog.get("Pages"), {}, set()) if catalog != None else []
+        if page_number >= len(found):
+            return None
+
+        page = found[page_number]
+        resources = resolve(objects, page.get("Resources")) or {}
+        contents = resolve(objects, page.get("Contents"))
+        contents = contents if isinstance(contents, list) else [contents]
+        content = b"\n".join(decode(resolve(objects, part)) for part in contents if part != None)
+
+        return {"fonts": len(resolve(objects, resources.get("Font")) or {}), "content_bytes": len(content),
+                "text_operators": len(TEXT_OPERATORS.findall(content)),
+                "path_operators": len(PATH_OPERATORS.findall(content))}
+    except (ValueError, IndexError, KeyError, TypeError, AttributeError, zlib.error, RecursionError):
+        return None
@@ -0,0 +1,120 @@
+import os
+import sys
+import gzip
+import ctypes
+import ctypes.util
+
+# Brotli and gzip copies of the text files under static/, written next
+# to each file as .br and .gz so the server sends them without
+# compressing anything per request
+#
+#   python precompress.py      refresh the copies of static/
+#
+# The server also refreshes them when it starts, only files changed
+# since their copies were written are compressed again
+
+# Types worth compressing, images are compressed already
+COMPRESSED_TYPES = [".html", ".css", ".js", ".svg", ".webmanifest", ".xml"]
+
+# Encodings by preference, with the suffix their copies are saved under
+ENCODINGS = [("br", ".br"), ("gzip", ".gz")]
+
+BROTLI_QUALITY = 11
+BROTLI_WINDOW_BITS = 22
+BROTLI_MODE_TEXT = 1
+
+
+def loadBrotli():
+    # libbrotlienc from vips-dev-8.14/bin on Windows, or the system's,
+    # None where there isn't one
+    for name in ["libbrotlienc.dll", ctypes.util.find_library("brotlienc"), "libbrotlienc.so.1"]:
+        if name == None:
+            continue
+
+        try:
+            library = ctypes.CDLL(name)
+        except OSError:
+            continue
+
+        library.BrotliEncoderMaxCompressedSize.restype = ctypes.c_size_t
+        library.BrotliEncoderMaxCompressedSize.argtypes = [ctypes.c_size_t]
+        library.BrotliEncoderCompress.restype = ctypes.c_int
+        library.BrotliEncoderCompress.argtypes = [ctypes.c_int, ctypes.c_int, ctypes.c_int, ctypes.c_size_t,
+                                                  ctypes.c_char_p, ctypes.POINTER(ctypes.c_size_t),
+                                                  ctypes.c_char_p]
+        return library
+
+    return None
+
+
+brotli = loadBrotli()
+
+
+def compress(data, encoding):
+    # data in encoding, or None if it can't be encoded here
+    if encoding == "gzip":
+        # mtime 0 so the copy only changes when the file does
+        return gzip.compress(data, 9, mtime=0)
+
+    if encoding == "br" and brotli != None:
+        size = ctypes.c_size_t(brotli.BrotliEncoderMaxCompressedSize(len(data)) or len(data) + 1024)
+        output = ctypes.create_string_buffer(size.value)
+
+        if brotli.BrotliEncoderCompress(BROTLI_QUALITY, BROTLI_WINDOW_BITS, BROTLI_MODE_TEXT, len(data), data,
+                                        ctypes.byref(size), output):
+            return output.raw[:size.value]
+
+    return None
+
+
+def compressible(path):
+    return os.path.splitext(path)[1] in COMPRESSED_TYPES
+
+
+def precompress(directory):
+    # Refresh the compressed copies of every text file under directory,
+    # returning how many were written
+    written = 0
+
+    for root, directories, files in os.walk(directory):
+        for name in files:
+            path = os.path.join(root, name)
+
+            if not compressible(path):
+                continue
+
+            with open(path, "rb") as f:
+                data = None
+
+                for encoding, suffix in ENCODINGS:
+                    copy = path + suffix
+
+                    if os.path.exists(copy) and os.path.getmtime(copy) >= os.path.getmtime(path):
+                        continue
+
+                    if data == None:
+                        data = f.read()
+
+                    encoded = compress(data, encoding)
+
+                    # A copy no smaller than the file isn't worth sending
+                    if encoded == None or len(encoded) >= len(data):
+                        if os.path.exists(copy):
+                            os.remove(copy)
+                        continue
+
+                    # Written aside and renamed so a request never reads
+                    # half a copy
+                    with open(copy + ".tmp", "wb") as out:
+                        out.write(encoded)
+                    os.replace(copy + ".tmp", copy)
+                    written += 1
+
+    return written
+
+
+if __name__ == "__main__":
+    directory = sys.argv[1] if len(sys.argv) > 1 else os.path.join(os.path.dirname(os.path.abspath(__file__)), "static")
+
+    print("Wrote " + str(precompress(directory)) + " compressed copies" +
+          ("" if brotli != None else ", gzip only as libbrotlienc wasn't found"))
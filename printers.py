@@ -0,0 +1,84 @@
+import os
+
+import ucf
+
+# Printers BLUEPRINT can set up, selected with BLUEPRINT_PRINTERS.
+# template is the pristine UCF config shipped beside app.py, config is
+# where the Epson driver reads it from, and fields are the offsets of
+# its paper size fields
+PRINTERS = {
+    "p8000": {
+        "name": "EPSON SC-P8000",
+        "template": "E_31CL01LE.UCF.bak",
+        "config": "C:\\ProgramData\\EPSON\\EPSON SC-P8000 Series\\E_31CL01LE.UCF",
+        "fields": ucf.EPSON_FIELDS,
+        "max_width": 44,
+        "native_dpi": 360,
+        # Paper profile for colour managed output, None for sRGB
+        "icc_profile": os.environ.get("BLUEPRINT_ICC_P8000") or None,
+        # Only tiff spool files are written today
+        "spool_format": "tiff",
+        # Bits per channel the driver takes, 8 or 16
+        "spool_depth": int(os.environ.get("BLUEPRINT_SPOOL_DEPTH_P8000", "8")),
+        # Sigma in device pixels of the output sharpening enlarged
+        # prints get for this printer's media, 0 for none
+        "sharpen_sigma": float(os.environ.get("BLUEPRINT_SHARPEN_P8000", "0")),
+        # Whether the driver turns landscape pages itself, so rotated
+        # direct prints spool unturned
+        "driver_rotates": os.environ.get("BLUEPRINT_DRIVER_ROTATES_P8000", "1") == "1",
+        # Preview mockup in static/img, in its own pixels: its size, the
+        # bottom right corner prints hang from and the width of a
+        # max_width print
+        "mockup": {"image": "p8000.jpg", "width": 1000, "height": 862, "right": 705, "bottom": 669, "print_width": 420},
+    },
+    "p9900": {
+        "name": "EPSON Stylus Pro 9900",
+        "template": "E_FCL0EHE.UCF.bak",
+        "config": "C:\\ProgramData\\EPSON\\EPSON Stylus Pro 9900\\E_FCL0EHE.UCF",
+        "fields": ucf.EPSON_FIELDS,
+        "max_width": 44,
+        "native_dpi": 360,
+        "icc_profile": os.environ.get("BLUEPRINT_ICC_P9900") or None,
+        "spool_format": "tiff",
+        "spool_depth": int(os.environ.get("BLUEPRINT_SPOOL_DEPTH_P9900", "8")),
+        "sharpen_sigma": float(os.environ.get("BLUEPRINT_SHARPEN_P9900", "0")),
+        "driver_rotates": os.environ.get("BLUEPRINT_DRIVER_ROTATES_P9900", "1") == "1",
+        # No mockup of its own yet, the P8000's is the same size of roll
+        "mockup": {"image": "p8000.jpg", "width": 1000, "height": 862, "right": 705, "bottom": 669, "print_width": 420},
+    },
+}
+
+
+def selected():
+    # Profiles for the printers this kiosk drives, comma separated
+    names = os.environ.get("BLUEPRINT_PRINTERS", "p8000")
+
+    return [dict(PRINTERS[name.strip()], id=name.strip()) for name in names.split(",") if name.strip()]
+
+
+def route(candidates, width, load):
+    # Printer for a roll width inches wide: the least loaded of those
+    # that take it without clamping, or of all of them when none do.
+    # Ties go to the first in the selection
+    fitting = [printer for printer in candidates if printer["max_width"] >= width] or candidates
+
+    return min(fitting, key=load)
+
+
+def clampPaper(printer, width, height):
+    # Scale prints wider than the printer takes down to fit
+    newWidth = min(printer["max_width"], width)
+    height = int(height * (newWidth / width))
+    width = newWidth
+
+    return width, height
+
+
+def configure(printer, width, height):
+    # Install the paper size in a printer's driver config
+    width, height = clampPaper(printer, width, height)
+
+    print("Setting " + printer["name"] + " config to " + str(width) + " inches wide and " + str(height) + " inches tall")
+
+    if not ucf.install(printer["template"], printer["config"], width, height, printer["fields"]):
+        print(printer["name"] + " config already set")
@@ -0,0 +1,233 @@
+import os
+import sys
+import time
+import socket
+import ctypes
+import threading
+
+# Printer readiness, polled in the background from the Windows spooler
+# and, for printers given an SNMP host, from the printer itself
+#
+#   BLUEPRINT_SNMP_HOST_P8000=10.0.4.20
+#
+# Prints route away from printers that aren't ready, and renders for
+# them give way to renders for printers that can print now
+
+POLL_SECONDS = float(os.environ.get("BLUEPRINT_PRINTER_POLL", "15"))
+SNMP_COMMUNITY = os.environ.get("BLUEPRINT_SNMP_COMMUNITY", "public")
+SNMP_TIMEOUT_SECONDS = 2
+
+# A printer that can't be asked counts as ready, so a kiosk without a
+# spooler or SNMP prints as it always has
+RANKS = {"ready": 0, "unknown": 0, "busy": 1, "offline": 2}
+
+# PRINTER_STATUS_* bits of the spooler: paused, error, paper jam,
+# paper out, paper problem, offline, not available, no toner, user
+# intervention and door open
+SPOOLER_OFFLINE = 0x1 | 0x2 | 0x8 | 0x10 | 0x40 | 0x80 | 0x1000 | 0x40000 | 0x100000 | 0x400000
+# Busy, printing, processing, initializing and warming up, as the
+# Epson driver reports head cleaning
+SPOOLER_BUSY = 0x200 | 0x400 | 0x4000 | 0x8000 | 0x10000
+
+# Host Resources MIB hrDeviceStatus and hrPrinterStatus of device 1
+HR_DEVICE_STATUS = "1.3.6.1.2.1.25.3.2.1.5.1"
+HR_PRINTER_STATUS = "1.3.6.1.2.1.25.3.5.1.1.1"
+
+# Latest state of each printer by id, with where it came from and when
+states = {}
+lock = threading.Lock()
+
+
+def state(printer_id):
+    # ready, busy, offline or unknown, unknown once a poll is overdue
+    with lock:
+        entry = states.get(printer_id)
+
+    if entry == None or time.time() - entry["time"] > 3 * POLL_SECONDS:
+        return "unknown"
+
+    return entry["state"]
+
+
+def rank(printer_id):
+    # Lower for printers better able to print now
+    return RANKS[state(printer_id)]
+
+
+def snapshot():
+    with lock:
+        return {printer_id: dict(entry) for printer_id, entry in states.items()}
+
+
+def spoolerStatus(name):
+    # PRINTER_STATUS_* bits of a Windows printer, the default one when
+    # name is empty, None where there is no spooler to ask
+    if sys.platform != "win32":
+        return None
+
+    winspool = ctypes.WinDLL("winspool.drv")
+
+    if not name:
+        size = ctypes.c_uint32(0)
+        winspool.GetDefaultPrinterW(None, ctypes.byref(size))
+        buffer = ctypes.create_unicode_buffer(size.value)
+        if not winspool.GetDefaultPrinterW(buffer, ctypes.byref(size)):
+            return None
+        name = buffer.value
+
+    handle = ctypes.c_void_p()
+    if not winspool.OpenPrinterW(name, ctypes.byref(handle), None):
+        return None
+
+    try:
+        # PRINTER_INFO_6 is just the status
+        status = ctypes.c_uint32(0)
+        needed = ctypes.c_uint32(0)
+        if not winspool.GetPrinterW(handle, 6, ctypes.byref(status), ctypes.sizeof(status), ctypes.byref(needed)):
+            return None
+
+        return status.value
+    finally:
+        winspool.ClosePrinter(handle)
+
+
+def ber(tag, payload):
+    # One BER element
+    if len(payload) < 0x80:
+        length = bytes([len(payload)])
+    else:
+        encoded = len(payload).to_bytes((len(payload).bit_length() + 7) // 8, "big")
+        length = bytes([0x80 | len(encoded)]) + encoded
+
+    return bytes([tag]) + length + payload
+
+
+def berOID(oid):
+    parts = [int(part) for part in oid.split(".")]
+    encoded = bytes([40 * parts[0] + parts[1]])
+
+    for part in parts[2:]:
+        chunk = [part & 0x7f]
+        part >>= 7
+        while part:
+            chunk.insert(0, 0x80 | (part & 0x7f))
+            part >>= 7
+        encoded += bytes(chunk)
+
+    return ber(0x06, encoded)
+
+
+def berElements(data):
+    # (tag, payload) of each element in data
+    elements = []
+    offset = 0
+
+    while offset < len(data):
+        tag = data[offset]
+        length = data[offset + 1]
+        offset += 2
+
+        if length & 0x80:
+            size = length & 0x7f
+            length = int.from_bytes(data[offset:offset + size], "big")
+            offset += size
+
+        elements.append((tag, data[offset:offset + length]))
+        offset += length
+
+    return elements
+
+
+def snmpGet(host, oids):
+    # Integer values of oids from an SNMPv1 agent, in order, raising
+    # OSError or ValueError when it doesn't answer them
+    request_id = int(time.time() * 1000) & 0x7fffffff
+    bindings = b"".join(ber(0x30, berOID(oid) + ber(0x05, b"")) for oid in oids)
+    pdu = ber(0x02, request_id.to_bytes(4, "big")) + ber(0x02, b"\0") + ber(0x02, b"\0") + ber(0x30, bindings)
+    message = ber(0x30, ber(0x02, b"\0") + ber(0x04, SNMP_COMMUNITY.encode()) + ber(0xa0, pdu))
+
+    with socket.socket(socket.AF_INET, socket.SOCK_DGRAM) as s:
+        s.settimeout(SNMP_TIMEOUT_SECONDS)
+        s.sendto(message, (host, 161))
+        response = s.recv(4096)
+
+    version, community, response_pdu = berElements(berElements(response)[0][1])
+    request, error, index, bindings = berElements(response_pdu[1])
+
+    if int.from_bytes(error[1], "big") != 0:
+        raise ValueError("SNMP error " + str(int.from_bytes(error[1], "big")))
+
+    values = [berElements(binding)[1] for tag, binding in berElements(bindings[1])]
+    if any(tag != 0x02 for tag, value in values):
+        raise ValueError("SNMP value isn't an integer")
+
+    return [int.from_bytes(value, "big") for tag, value in values]
+
+
+def snmpState(host):
+    # State from the printer's Host Resources MIB: a down device is
+    # offline, and one doing anything but idling is busy. Epson reports
+    # cleaning as other
+    device, printer = snmpGet(host, [HR_DEVICE_STATUS, HR_PRINTER_STATUS])
+
+    if device == 5:
+        return "offline"
+    if printer == 3:
+        return "ready"
+    if printer in (1, 4, 5):
+        return "busy"
+
+    return "unknown"
+
+
+def spoolerState(name):
+    status = spoolerStatus(name)
+
+    if status == None:
+        return "unknown"
+    if status & SPOOLER_OFFLINE:
+        return "offline"
+    if status & SPOOLER_BUSY:
+        return "busy"
+
+    return "ready"
+
+
+def poll(printer, spooler_name):
+    # The worse of what the spooler and SNMP report
+    found = {"spooler": spoolerState(spooler_name)}
+
+    host = os.environ.get("BLUEPRINT_SNMP_HOST_" + printer["id"].upper())
+    if host:
+        try:
+            found["snmp"] = snmpState(host)
+        except (OSError, ValueError) as error:
+            print("Couldn't query " + printer["id"] + " over SNMP: " + str(error))
+
+    worst = max(found.values(), key=lambda found_state: (RANKS[found_state], found_state != "unknown"))
+
+    with lock:
+        previous = states.get(printer["id"], {}).get("state")
+        states[printer["id"]] = {"state": worst, "sources": found, "time": time.time()}
+
+    if previous != worst:
+        print("Printer " + printer["id"] + " is " + worst)
+
+
+def monitor(printers, spoolerName, changed=None):
+    # Poll every printer forever, calling changed() after each round
+    while True:
+        for printer in printers:
+            try:
+                poll(printer, spoolerName(printer))
+            except Exception as error:
+                print("Couldn't poll " + printer["id"] + ": " + str(error))
+
+        if changed != None:
+            changed()
+
+        time.sleep(POLL_SECONDS)
+
+
+def start(printers, spoolerName, changed=None):
+    threading.Thread(target=monitor, args=(printers, spoolerName, changed), name="printer-state", daemon=True).start()
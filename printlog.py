@@ -0,0 +1,177 @@
+import json
+import sqlite3
+import threading
+import time
+
+
+class PrintLog:
+    # Append-only record of every print, kept in sqlite so it survives
+    # the kiosk browser and pages in constant time however long it gets
+
+    def __init__(self, path):
+        self.lock = threading.Lock()
+        # One connection shared by the request threads, serialised by
+        # the lock
+        self.connection = sqlite3.connect(path, check_same_thread=False)
+
+        with self.lock, self.connection:
+            self.connection.execute("PRAGMA journal_mode=WAL")
+            self.connection.execute(
+                "CREATE TABLE IF NOT EXISTS prints ("
+                "id INTEGER PRIMARY KEY AUTOINCREMENT, "
+                "timestamp REAL NOT NULL, "
+                "college_id TEXT, "
+                "name TEXT, "
+                "email TEXT, "
+                "paper_width REAL, "
+                "options TEXT)")
+            self.connection.execute("CREATE INDEX IF NOT EXISTS prints_timestamp ON prints (timestamp, id)")
+            self.connection.execute("CREATE INDEX IF NOT EXISTS prints_college_id ON prints (college_id, timestamp, id)")
+            # What each print job cost the server, by the upload's type
+            self.connection.execute(
+                "CREATE TABLE IF NOT EXISTS job_usage ("
+                "job_id TEXT PRIMARY KEY, "
+                "timestamp REAL NOT NULL, "
+                "content_type TEXT, "
+                "memory_bytes INTEGER, "
+                "files INTEGER, "
+                "temp_bytes INTEGER, "
+                "concurrent INTEGER)")
+            self.connection.execute("CREATE INDEX IF NOT EXISTS job_usage_content_type ON job_usage (content_type)")
+            # What each print job rendered, enough for replay.py to run
+            # it again given the upload
+            self.connection.execute(
+                "CREATE TABLE IF NOT EXISTS job_inputs ("
+                "job_id TEXT PRIMARY KEY, "
+                "timestamp REAL NOT NULL, "
+                "upload_hash TEXT, "
+                "content_type TEXT, "
+                "printer TEXT, "
+                "options TEXT)")
+            # How long each print took to render against what its
+            # header predicted it from, for the render cost model
+            self.connection.execute(
+                "CREATE TABLE IF NOT EXISTS job_costs ("
+                "job_id TEXT PRIMARY KEY, "
+                "timestamp REAL NOT NULL, "
+                "content_type TEXT, "
+                "pixels INTEGER, "
+                "source_bytes INTEGER, "
+                "seconds REAL)")
+
+    def append(self, entries):
+        # Add entries, each a dict with timestamp in seconds, college_id,
+        # name, email and the print's options
+        rows = []
+        for entry in entries:
+            options = entry.get("options") or {}
+            timestamp = entry.get("timestamp")
+
+            rows.append((timestamp if timestamp != None else time.time(), entry.get("college_id"), entry.get("name"),
+                         entry.get("email"), options.get("paper_width"), json.dumps(options)))
+
+        with self.lock, self.connection:
+            self.connection.executemany(
+                "INSERT INTO prints (timestamp, college_id, name, email, paper_width, options) "
+                "VALUES (?, ?, ?, ?, ?, ?)", rows)
+
+    def appendUsage(self, job_id, content_type, usage):
+        # Record a print job's usage, a dict of memory, files,
+        # temp_bytes and how many jobs ran concurrently with it
+        with self.lock, self.connection:
+            self.connection.execute(
+                "INSERT OR REPLACE INTO job_usage (job_id, timestamp, content_type, memory_bytes, files, temp_bytes, "
+                "concurrent) VALUES (?, ?, ?, ?, ?, ?, ?)",
+                (job_id, time.time(), content_type, usage["memory"], usage["files"], usage["temp_bytes"],
+                 usage["concurrent"]))
+
+    def appendJob(self, job_id, upload_hash, content_type, printer, options):
+        # Record a print job's input, options already normalised
+        with self.lock, self.connection:
+            self.connection.execute(
+                "INSERT OR REPLACE INTO job_inputs (job_id, timestamp, upload_hash, content_type, printer, options) "
+                "VALUES (?, ?, ?, ?, ?, ?)", (job_id, time.time(), upload_hash, content_type, printer,
+                                              json.dumps(options, sort_keys=True)))
+
+    def appendCost(self, job_id, content_type, pixels, source_bytes, seconds):
+        # Record how long a print job's render took
+        with self.lock, self.connection:
+            self.connection.execute(
+                "INSERT OR REPLACE INTO job_costs (job_id, timestamp, content_type, pixels, source_bytes, seconds) "
+                "VALUES (?, ?, ?, ?, ?, ?)", (job_id, time.time(), content_type, pixels, source_bytes, seconds))
+
+    def costHistory(self, limit=1000):
+        # The latest timed renders, as (content_type, pixels,
+        # source_bytes, seconds)
+        with self.lock:
+            return self.connection.execute(
+                "SELECT content_type, pixels, source_bytes, seconds FROM job_costs "
+                "ORDER BY timestamp DESC LIMIT ?", (limit,)).fetchall()
+
+    def job(self, job_id):
+        # A recorded job's input, or None
+        with self.lock:
+            row = self.connection.execute(
+                "SELECT job_id, timestamp, upload_hash, content_type, printer, options FROM job_inputs "
+                "WHERE job_id = ?", (job_id,)).fetchone()
+
+        if row == None:
+            return None
+
+        return {"job_id": row[0], "timestamp": row[1], "upload_hash": row[2], "content_type": row[3],
+                "printer": row[4], "options": json.loads(row[5])}
+
+    def usageByType(self):
+        # Average and peak usage of print jobs for each content type
+        with self.lock:
+            rows = self.connection.execute(
+                "SELECT content_type, COUNT(*), AVG(memory_bytes), MAX(memory_bytes), AVG(temp_bytes), "
+                "MAX(temp_bytes) FROM job_usage GROUP BY content_type").fetchall()
+
+        return {row[0]: {"jobs": row[1], "memory_mean": row[2], "memory_max": row[3], "temp_bytes_mean": row[4],
+                         "temp_bytes_max": row[5]} for row in rows}
+
+    def page(self, limit, before=None, college_id=None, offset=0):
+        # Newest entries first, up to limit of them. before is the
+        # cursor returned with the previous page, so each page is one
+        # index range scan, or offset skips that many of the newest to
+        # jump straight to a range. Returns the entries and the next
+        # cursor, None on the last page
+        query = "SELECT id, timestamp, college_id, name, email, paper_width, options FROM prints"
+        conditions = []
+        parameters = []
+
+        if college_id != None:
+            conditions.append("college_id = ?")
+            parameters.append(college_id)
+
+        if before != None:
+            conditions.append("(timestamp, id) < (?, ?)")
+            parameters.extend(before)
+
+        if conditions:
+            query += " WHERE " + " AND ".join(conditions)
+
+        query += " ORDER BY timestamp DESC, id DESC LIMIT ? OFFSET ?"
+        parameters.extend([limit + 1, offset])
+
+        with self.lock:
+            rows = self.connection.execute(query, parameters).fetchall()
+
+        entries = [{"id": row[0], "timestamp": row[1], "college_id": row[2], "name": row[3], "email": row[4],
+                    "paper_width": row[5], "options": json.loads(row[6])} for row in rows[:limit]]
+
+        following = None
+        if len(rows) > limit:
+            following = [entries[-1]["timestamp"], entries[-1]["id"]]
+
+        return entries, following
+
+    def count(self, college_id=None):
+        # Entries in the log, or one user's, counted off an index
+        with self.lock:
+            if college_id != None:
+                return self.connection.execute("SELECT COUNT(*) FROM prints WHERE college_id = ?",
+                                               (college_id,)).fetchone()[0]
+
+            return self.connection.execute("SELECT COUNT(*) FROM prints").fetchone()[0]
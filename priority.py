@@ -0,0 +1,39 @@
+import os
+import sys
+import ctypes
+import threading
+
+# Threads that only do print and speculative work run at background
+# priority, so previews and the kiosk's browser keep the cores while a
+# big print renders. On Windows that's the thread's background mode,
+# which lowers its I/O and memory priority as well as its cpu's, and
+# elsewhere a nice of NICE. Either lasts the thread's life: lowering a
+# nice again needs privileges. 0 leaves them at normal priority
+#
+# vips' worker threads are shared by every render and can't be told
+# apart from here, so they stay as they are. Print writes give way to
+# previews between their tiles instead, see yieldToPreviews
+NICE = int(os.environ.get("BLUEPRINT_BACKGROUND_NICE", "10"))
+
+# From winbase.h
+THREAD_MODE_BACKGROUND_BEGIN = 0x00010000
+
+
+def background():
+    # Put the calling thread at background priority, as a thread pool's
+    # initializer
+    if NICE <= 0:
+        return
+
+    try:
+        if sys.platform == "win32":
+            kernel32 = ctypes.windll.kernel32
+            if not kernel32.SetThreadPriority(kernel32.GetCurrentThread(), THREAD_MODE_BACKGROUND_BEGIN):
+                raise OSError("SetThreadPriority failed")
+        elif sys.platform.startswith("linux"):
+            # Linux nices each thread on its own, and the threads it
+            # starts inherit it
+            thread = threading.get_native_id()
+            os.setpriority(os.PRIO_PROCESS, thread, max(NICE, os.getpriority(os.PRIO_PROCESS, thread)))
+    except (OSError, AttributeError) as e:
+        print("Could not lower thread priority: " + str(e))
@@ -0,0 +1,133 @@
+import threading
+import time
+import os
+import contextlib
+
+# vips operations are only profiled with BLUEPRINT_PROFILE=1. Every
+# operation call is counted and timed under the kind of request that
+# made it, along with whether the operation cache answered its build
+enabled = os.environ.get("BLUEPRINT_PROFILE", "") == "1"
+
+# Per kind of request, per operation: calls, cache hits, seconds in
+# vips_cache_operation_build and seconds in the whole call
+operations = {}
+lock = threading.Lock()
+
+# What the current thread is working for, such as the request
+# endpoint or "print"
+local = threading.local()
+
+
+@contextlib.contextmanager
+def labelled(kind):
+    # Profile operations in the block under kind
+    previous = getattr(local, "kind", None)
+    local.kind = kind
+
+    try:
+        yield
+    finally:
+        local.kind = previous
+
+
+def label(kind):
+    # Profile this thread's operations under kind from now on
+    local.kind = kind
+
+
+def entry(name):
+    kind = getattr(local, "kind", None) or "other"
+
+    table = operations.setdefault(kind, {})
+    if name not in table:
+        table[name] = {"calls": 0, "hits": 0, "build_seconds": 0, "miss_build_seconds": 0, "call_seconds": 0}
+
+    return table[name]
+
+
+class BuildHook:
+    # Stands in for pyvips' vips_lib inside its operation module, to
+    # see each vips_cache_operation_build. The cache answers a build by
+    # returning the operation it already holds instead of the new one
+
+    def __init__(self, lib):
+        self.lib = lib
+
+    def __getattr__(self, name):
+        return getattr(self.lib, name)
+
+    def vips_cache_operation_build(self, pointer):
+        begin = time.perf_counter()
+        result = self.lib.vips_cache_operation_build(pointer)
+        seconds = time.perf_counter() - begin
+
+        local.build = (result != pointer, seconds)
+
+        return result
+
+
+def profileOperations(pyvips):
+    # Wrap pyvips so every vips operation call is profiled
+    if not enabled:
+        return
+
+    call = pyvips.Operation.call
+
+    def profiledCall(operation_name, *args, **kwargs):
+        local.build = None
+        begin = time.perf_counter()
+
+        try:
+            return call(operation_name, *args, **kwargs)
+        finally:
+            seconds = time.perf_counter() - begin
+            build = local.build
+
+            with lock:
+                stats = entry(operation_name)
+                stats["calls"] += 1
+                stats["call_seconds"] += seconds
+
+                if build != None:
+                    hit, build_seconds = build
+                    stats["build_seconds"] += build_seconds
+
+                    if hit:
+                        stats["hits"] += 1
+                    else:
+                        stats["miss_build_seconds"] += build_seconds
+
+    pyvips.Operation.call = staticmethod(profiledCall)
+
+    # pyvips calls the build through the vips_lib its operation module
+    # imported
+    voperation = getattr(pyvips, "voperation", None)
+    if voperation != None and hasattr(voperation, "vips_lib"):
+        voperation.vips_lib = BuildHook(voperation.vips_lib)
+
+
+def report():
+    # Operations for each kind of request, most build time first. A
+    # hit saves about the average build of a miss, saved_seconds
+    # estimates what the operation cache saved
+    with lock:
+        snapshot = {kind: {name: dict(stats) for name, stats in table.items()} for kind, table in operations.items()}
+
+    result = {}
+    for kind, table in snapshot.items():
+        ranked = []
+
+        for name, stats in table.items():
+            misses = stats["calls"] - stats["hits"]
+            stats["saved_seconds"] = stats["hits"] * stats["miss_build_seconds"] / misses if misses else 0
+            ranked.append(dict(stats, operation=name))
+
+        ranked.sort(key=lambda stats: stats["build_seconds"], reverse=True)
+        result[kind] = ranked
+
+    return result
+
+
+def reset():
+    with lock:
+        operations.clear()
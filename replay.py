@@ -0,0 +1,174 @@
+import os
+import sys
+import json
+import time
+import hashlib
+import argparse
+import tempfile
+import subprocess
+
+# Re-run a recorded print job on a dev box, without printing
+#
+#   python replay.py JOB_ID --file drawing.pdf
+#   python replay.py JOB_ID --corpus uploads/
+#                               find the upload by its hash
+#   python replay.py JOB_ID --file drawing.pdf \
+#       --variant tiles256:BLUEPRINT_SPOOL_TILE_SIZE=256 \
+#       --variant tiles1024:BLUEPRINT_SPOOL_TILE_SIZE=1024,VIPS_CONCURRENCY=4
+#                               compare engine settings
+#
+# Jobs are read from the print log, which records every print's upload
+# hash and normalised options. Each run is its own process with tracing
+# on, so its timing, vips memory high-water mark and peak RSS belong to
+# it alone, and its trace is saved for chrome://tracing or Perfetto.
+# The render goes through printUpload as in production, up to the
+# spool, and the hand-off to the printer is skipped
+
+PRINT_LOG_FILE = os.environ.get("BLUEPRINT_PRINT_LOG", "print_log.sqlite3")
+
+
+def uploadHash(data):
+    # As app.uploadHash, without importing app
+    return hashlib.blake2b(data, digest_size=16).hexdigest()
+
+
+def findUpload(directory, upload_hash):
+    # The file under directory with upload_hash, or None
+    for root, directories, files in os.walk(directory):
+        for name in files:
+            path = os.path.join(root, name)
+
+            with open(path, "rb") as f:
+                if uploadHash(f.read()) == upload_hash:
+                    return path
+
+    return None
+
+
+def runJob(job_path, upload_path, trace_path):
+    # Render the job in this process and print its measurements as json
+    import app
+
+    with open(job_path) as f:
+        job = json.load(f)
+    with open(upload_path, "rb") as f:
+        data = f.read()
+
+    spooled = []
+    app.handOff = lambda printer, width, height, filenames, flags=[], job=None: spooled.extend(filenames)
+
+    printer = next((printer for printer in app.printers.selected() if printer["id"] == job["printer"]),
+                   app.printers.selected()[0])
+    options = dict(job["options"], print=True)
+
+    start = time.time()
+    app.printUpload(data, job["content_type"], options, job["upload_hash"], None, printer)
+    wall = time.time() - start
+
+    with open(trace_path, "w") as f:
+        json.dump(app.tracing.export(), f)
+
+    print(json.dumps({"wall_seconds": wall, "vips_highwater_bytes": app.trackedMemoryStats()["highwater"],
+                      "peak_rss_bytes": peakRSS(),
+                      "spool_bytes": sum(os.path.getsize(path) for path in spooled if os.path.exists(path))}))
+
+
+def peakRSS():
+    # Peak resident memory of this process, None where it can't be read
+    try:
+        import resource
+        peak = resource.getrusage(resource.RUSAGE_SELF).ru_maxrss
+        # macOS reports bytes, Linux kilobytes
+        return peak if sys.platform == "darwin" else peak * 1024
+    except ImportError:
+        return None
+
+
+def parseVariant(text):
+    # name:NAME=value,NAME=value into (name, env)
+    name, _, settings = text.partition(":")
+    env = {}
+
+    for setting in filter(None, settings.split(",")):
+        key, _, value = setting.partition("=")
+        env[key] = value
+
+    return name, env
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Re-run a recorded print job without printing")
+    parser.add_argument("job_id")
+    parser.add_argument("--file", help="the job's upload")
+    parser.add_argument("--corpus", help="directory to find the upload in by its hash")
+    parser.add_argument("--log", default=PRINT_LOG_FILE, help="print log the job was recorded in")
+    parser.add_argument("--variant", action="append", default=[],
+                        help="name:ENV=value,... engine settings to compare, repeatable")
+    parser.add_argument("--repeat", type=int, default=3)
+    arguments = parser.parse_args()
+
+    import printlog
+
+    job = printlog.PrintLog(arguments.log).job(arguments.job_id)
+    if job == None:
+        sys.exit("No job " + arguments.job_id + " in " + arguments.log)
+
+    upload = arguments.file or (findUpload(arguments.corpus, job["upload_hash"]) if arguments.corpus else None)
+    if upload == None:
+        sys.exit("Pass --file, or --corpus holding the upload with hash " + job["upload_hash"])
+
+    with open(upload, "rb") as f:
+        if uploadHash(f.read()) != job["upload_hash"]:
+            sys.exit(upload + " isn't the job's upload, its hash doesn't match")
+
+    print("Job " + job["job_id"] + ": " + job["content_type"] + " on " + str(job["printer"]) + " " +
+          json.dumps(job["options"], sort_keys=True))
+
+    variants = [parseVariant(variant) for variant in arguments.variant] or [("baseline", {})]
+    first = None
+
+    with tempfile.TemporaryDirectory() as directory:
+        job_path = os.path.join(directory, "job.json")
+        with open(job_path, "w") as f:
+            json.dump(job, f)
+
+        for name, settings in variants:
+            samples = []
+
+            for i in range(arguments.repeat):
+                trace_path = "replay-" + job["job_id"] + "-" + name + ".json"
+                env = dict(os.environ, BLUEPRINT_TRACE="1", BLUEPRINT_SPOOL_DIR=os.path.join(directory, "spool"),
+                           BLUEPRINT_PRINT_LOG=os.path.join(directory, "replay_log.sqlite3"), **settings)
+
+                output = subprocess.run([sys.executable, __file__, "--run", job_path, upload, trace_path],
+                                        capture_output=True, text=True, env=env)
+                if output.returncode != 0:
+                    print(name + " failed: " + (output.stderr.strip().splitlines() or ["no output"])[-1])
+                    break
+
+                samples.append(json.loads(output.stdout.strip().splitlines()[-1]))
+
+            if not samples:
+                continue
+
+            # The fastest run is the one least disturbed by the machine
+            best = min(samples, key=lambda sample: sample["wall_seconds"])
+
+            line = "%-16s %8.3f s  rss %6s MB  vips %6d MB  spool %6d MB" % (
+                name, best["wall_seconds"],
+                str(best["peak_rss_bytes"] // (1024 * 1024)) if best["peak_rss_bytes"] else "?",
+                best["vips_highwater_bytes"] // (1024 * 1024), best["spool_bytes"] // (1024 * 1024))
+
+            if first == None:
+                first = best
+            else:
+                line += "  %+5.1f%%" % ((best["wall_seconds"] / first["wall_seconds"] - 1) * 100)
+
+            print(line + "  trace " + trace_path)
+
+
+if __name__ == "__main__":
+    if len(sys.argv) > 1 and sys.argv[1] == "--run":
+        runJob(sys.argv[2], sys.argv[3], sys.argv[4])
+    else:
+        main()
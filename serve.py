@@ -0,0 +1,70 @@
+import os
+import sys
+import subprocess
+import threading
+
+# Production server for kiosks
+#
+#   python serve.py            serve app.py under waitress in a worker
+#                              process, starting a new worker whenever
+#                              the last one exits to be recycled
+#
+# One worker process serves every request on BLUEPRINT_SERVER_THREADS
+# threads. pyvips drops the GIL inside libvips, so renders on those
+# threads run in parallel, while print queues, hand-offs and upload
+# handles stay in the one process that drives the printers. Decoded
+# sources outlive a worker in app.SOURCE_DIR as mmap'd .v files
+
+HOST = os.environ.get("BLUEPRINT_SERVER_HOST", "127.0.0.1")
+PORT = int(os.environ.get("BLUEPRINT_SERVER_PORT", "5000"))
+THREADS = int(os.environ.get("BLUEPRINT_SERVER_THREADS", "8"))
+
+# Exit code of a worker that wants replacing
+RECYCLE_EXIT_CODE = 75
+
+# Back the worker's large allocations with transparent huge pages on
+# Linux. vips pixel buffers come from malloc, which maps the big ones
+# on their own, and glibc 2.35 and later madvise those maps huge so a
+# multi-GB copy_memory or rotate buffer takes far fewer TLB misses.
+# Older glibc ignores the tunable and the kernel's THP setting still
+# has the last word, blueprint_process_huge_page_bytes shows whether
+# it took
+HUGE_PAGES = os.environ.get("BLUEPRINT_HUGE_PAGES", "0") == "1"
+
+
+def worker():
+    import waitress
+    import app
+
+    app.prepare()
+
+    if app.RECYCLE_HIGHWATER_BYTES > 0:
+        threading.Thread(target=app.recycleWhenIdle, args=(RECYCLE_EXIT_CODE,), name="recycle", daemon=True).start()
+
+    waitress.serve(app.app, host=HOST, port=PORT, threads=THREADS)
+
+
+def workerEnvironment():
+    env = dict(os.environ)
+
+    if HUGE_PAGES and sys.platform.startswith("linux"):
+        env["GLIBC_TUNABLES"] = ":".join(filter(None, [env.get("GLIBC_TUNABLES"), "glibc.malloc.hugetlb=1"]))
+
+    return env
+
+
+def supervise():
+    while True:
+        code = subprocess.run([sys.executable, __file__, "--worker"], env=workerEnvironment()).returncode
+
+        if code != RECYCLE_EXIT_CODE:
+            sys.exit(code)
+
+        print("Starting a fresh worker")
+
+
+if __name__ == "__main__":
+    if "--worker" in sys.argv:
+        worker()
+    else:
+        supervise()
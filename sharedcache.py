@@ -0,0 +1,136 @@
+import os
+import json
+import shutil
+import threading
+
+# A cache tier shared by the kiosks, a directory on the lab server
+# every kiosk mounts
+#
+#   BLUEPRINT_SHARED_CACHE=\\labserver\blueprint-cache
+#
+# Entries are named by the hash of what they were made from, so two
+# kiosks can never disagree about one and nothing needs locking: each
+# is written under a temporary name and renamed into place, and a
+# kiosk writing an entry another already wrote writes the same bytes.
+# Kiosks look here after their own caches and before a decode, and
+# write here behind their renders
+
+DIRECTORY = os.environ.get("BLUEPRINT_SHARED_CACHE", "")
+
+# Bytes of each kind kept, the least recently used going first
+MAX_BYTES = int(os.environ.get("BLUEPRINT_SHARED_CACHE_MB", "32768")) * 1024 * 1024
+
+# One trim at a time from this kiosk
+trim_lock = threading.Lock()
+
+
+def enabled():
+    return DIRECTORY != ""
+
+
+def entryPath(kind, name):
+    return os.path.join(DIRECTORY, kind, name)
+
+
+def lookup(kind, name):
+    # Path of an entry, marked used, or None
+    path = entryPath(kind, name)
+
+    try:
+        os.utime(path)
+    except OSError:
+        return None
+
+    return path
+
+
+def temporaryPath(path):
+    # Unique per kiosk and thread, trimming leaves names like it alone
+    return path + "." + str(os.getpid()) + "." + str(threading.get_ident()) + ".part"
+
+
+def store(kind, name, source):
+    # Copy a file in as an entry, unless it's there already
+    path = entryPath(kind, name)
+    if os.path.exists(path):
+        return
+
+    os.makedirs(os.path.dirname(path), exist_ok=True)
+    temp = temporaryPath(path)
+
+    try:
+        shutil.copyfile(source, temp)
+        os.replace(temp, path)
+    except OSError:
+        # Another kiosk's copy is in place, or the share went away
+        try:
+            os.remove(temp)
+        except OSError:
+            pass
+        return
+
+    trim(kind)
+
+
+def getJson(kind, name):
+    # An entry's json, or None
+    path = lookup(kind, name)
+    if path == None:
+        return None
+
+    try:
+        with open(path) as f:
+            return json.load(f)
+    except (OSError, ValueError):
+        return None
+
+
+def putJson(kind, name, value):
+    path = entryPath(kind, name)
+    if os.path.exists(path):
+        return
+
+    os.makedirs(os.path.dirname(path), exist_ok=True)
+    temp = temporaryPath(path)
+
+    with open(temp, "w") as f:
+        json.dump(value, f)
+
+    try:
+        os.replace(temp, path)
+    except OSError:
+        os.remove(temp)
+        return
+
+    trim(kind)
+
+
+def trim(kind):
+    # Remove the least recently used entries of a kind until it's under
+    # MAX_BYTES. An entry another kiosk has mapped can't be removed on
+    # Windows, it goes on a later pass
+    with trim_lock:
+        directory = os.path.join(DIRECTORY, kind)
+        entries = []
+
+        for name in os.listdir(directory):
+            if name.endswith(".part"):
+                continue
+
+            path = os.path.join(directory, name)
+            try:
+                entries.append((os.path.getmtime(path), os.path.getsize(path), path))
+            except OSError:
+                pass
+
+        total = sum(size for used, size, path in entries)
+
+        for used, size, path in sorted(entries)[:-1]:
+            if total <= MAX_BYTES:
+                break
+
+            try:
+                os.remove(path)
+                total -= size
+            except OSError:
+                pass
@@ -5,12 +5,52 @@ var state = {
     image_obj: null,
     history: {},
     file: null,
+    stitch_files: null,
+    handle: null,
+    job_id: null,
     isPDF: false,
+    frame: 0,
+    frames: 1,
+    area: null,
+    area_drag: null,
+    proxy: false,
+    gang_sheet: null,
+    plan: null,
+    estimate: null,
+    // Upright texture previews are recomposed from, and the object
+    // url of the last one composed
+    texture: null,
+    composed_url: null,
     paper_width: 36,
     college_id: null,
     user_data: null,
+    // Print the server is rendering while the confirmation is open
+    rehearsal: null,
+    // Files picked together, each uploading behind the one shown
+    queue: [],
 }
 
+// Photos bigger than this preview from a downscaled proxy, PROXY_SIZE
+// pixels along the long side, until the original is needed to print
+const PROXY_MIN_BYTES = 4 * 1024 * 1024;
+const PROXY_SIZE = 2048;
+
+// Files bigger than this upload in CHUNK_BYTES pieces, so a dropped
+// connection resumes where it stopped instead of starting again
+const CHUNKED_MIN_BYTES = 16 * 1024 * 1024;
+const CHUNK_BYTES = 8 * 1024 * 1024;
+const CHUNK_RETRIES = 5;
+
+// svgs and pdfs are gzipped before upload when a sample this big of
+// them shrinks to under COMPRESS_MIN_RATIO, which CAD exports' plain
+// text does many times over and pdfs of compressed streams don't
+const COMPRESS_TYPES = ["image/svg+xml", "application/pdf"];
+const COMPRESS_SAMPLE_BYTES = 1024 * 1024;
+const COMPRESS_MIN_RATIO = 0.5;
+
+// Queued files upload this many at a time
+const QUEUE_UPLOADS = 3;
+
 const image_area = {
     top_left: { x: 293, y: 405 },
     top_right: { x: 696, y: 405 },
@@ -40,179 +80,1281 @@ function openFile() {
 }
 
 function loadFile(event) {
-    // If the file name starts with ._ (macOS hidden file), return
-    if (event.target.files[0].name.startsWith("._")) {
+    openFiles(event.target.files);
+}
+
+function dropHandler(event) {
+    document.getElementById("display").classList.remove("fileover");
+
+    event.preventDefault();
+    openFiles(event.dataTransfer.files);
+}
+
+function openFiles(files) {
+    // One file opens by itself, several are queued and upload together
+    // while the first is previewed. macOS ._ files are skipped
+    files = Array.from(files).filter(function (file) {
+        return !file.name.startsWith("._");
+    });
+
+    if (files.length == 0) {
         alert("Error: Invalid file");
         return;
     }
 
-    state.history = {};
-    state.file = event.target.files[0];
+    queueFiles(files.length > 1 ? files : []);
+    selectFile(files[0]);
+}
+
+function selectFile(file, stitch_files=null) {
+    // Show file, or the scan stitched from stitch_files. A queued
+    // file keeps its previews for when it's picked again
+    const entry = stitch_files ? null : queuedEntry(file);
+
+    state.history = entry ? entry.history : {};
+    state.texture = null;
+    state.file = file;
+    state.stitch_files = stitch_files;
+    state.handle = null;
+    state.proxy = false;
+    resetFrames();
+    resetArea();
+
+    for (const queued of state.queue) {
+        queued.element.classList.toggle("selected", queued == entry);
+    }
+    document.getElementById("queue-stitch").classList.toggle("selected", stitch_files != null);
 
-    // if it's a pdf
-    if (state.file.type == "application/pdf") {
+    // if it's a pdf, or an Office document the server converts to one
+    if (pagedDocument(state.file)) {
         state.isPDF = true;
         // Disable dpi button
         document.getElementById("specific_dpi").disabled = true;
+        document.getElementById("pages-input").classList.remove("hidden");
     } else {
         state.isPDF = false;
         // Enable dpi button
         document.getElementById("specific_dpi").disabled = false;
+        document.getElementById("pages-input").classList.add("hidden");
     }
 
     renderPreview();
 }
 
-function dropHandler(event) {
-    document.getElementById("display").classList.remove("fileover");
+function queueFiles(files) {
+    // List files in the queue view and start uploading them, a few at
+    // a time. Each shows its thumbnail as soon as its upload is in
+    const queue = state.queue = files.map(function (file) {
+        return { file: file, upload: null, history: {}, element: document.createElement("button") };
+    });
+
+    const list = document.getElementById("queue-list");
+    list.innerHTML = "";
+
+    for (const entry of queue) {
+        let name = document.createElement("span");
+        name.innerText = entry.file.name;
+
+        entry.element.className = "queue-item uploading";
+        entry.element.title = entry.file.name;
+        entry.element.append(document.createElement("img"), name);
+        entry.element.onclick = function () {
+            if (entry.file != state.file || state.stitch_files) {
+                selectFile(entry.file);
+            }
+        };
+        list.append(entry.element);
+    }
+
+    document.getElementById("queue-stitch").classList.toggle("hidden", stitchFiles(files) == null);
+    document.getElementById("queue-input").classList.toggle("hidden", queue.length == 0);
+
+    let next = 0;
+
+    for (let i = 0; i < Math.min(QUEUE_UPLOADS, queue.length); i++) {
+        (async function () {
+            // Stop once another pick replaces this queue
+            while (state.queue == queue && next < queue.length) {
+                const entry = queue[next++];
+
+                try {
+                    await showThumbnail(entry, await queuedUpload(entry));
+                } catch (error) {
+                    console.log("Queued upload failed: " + error);
+                    entry.upload = null;
+                    entry.element.classList.replace("uploading", "failed");
+                }
+            }
+        })();
+    }
+}
+
+function queuedEntry(file) {
+    return state.queue.find(function (entry) {
+        return entry.file == file;
+    });
+}
+
+function queuedUpload(entry) {
+    // The queued file's upload, started now unless it's under way
+    if (!entry.upload) {
+        entry.upload = uploadOne(entry.file, true);
+    }
+
+    return entry.upload;
+}
+
+async function showThumbnail(entry, result) {
+    // Thumbnail of a queued file once it's uploaded, the server began
+    // decoding it as the upload was stored
+    if (result.status != 200) {
+        entry.element.classList.replace("uploading", "failed");
+        return;
+    }
+
+    const response = await fetch("/thumbnail", {
+        method: "POST",
+        headers: { "Content-Type": "application/json", "Accept": preview_accept },
+        body: JSON.stringify({ handle: result.handle }),
+    });
+
+    entry.element.classList.remove("uploading");
+
+    if (response.status == 200) {
+        entry.element.querySelector("img").src = (await response.json()).sheet_url;
+    }
+}
+
+function stitchQueue() {
+    // Show the queued images stitched into one scan
+    const files = stitchFiles(state.queue.map(function (entry) {
+        return entry.file;
+    }));
+
+    if (files && !state.stitch_files) {
+        selectFile(files[0], files);
+    }
+}
+
+function stitchFiles(files) {
+    // Several images picked together are sections of one scan, joined
+    // in file name order. null for a single file
+    files = Array.from(files).filter(function (file) {
+        return fileType(file).startsWith("image/") && !file.name.startsWith("._");
+    });
+
+    if (files.length < 2) {
+        return null;
+    }
+
+    return files.sort(function (a, b) {
+        return a.name.localeCompare(b.name, undefined, { numeric: true });
+    });
+}
+
+async function uploadStitch() {
+    // Upload each section, then have the server stitch them into one
+    // upload that renders like any other
+    let handles = [];
+
+    for (const file of state.stitch_files) {
+        // Queued sections are stitched from their own upload unless it
+        // was a proxy
+        const entry = queuedEntry(file);
+        const queued = entry ? await queuedUpload(entry) : null;
+
+        if (queued && queued.status == 200 && !queued.proxy) {
+            handles.push(queued.handle);
+            continue;
+        }
+
+        const response = await sendUpload("", file, fileType(file));
+
+        if (response.status != 200) {
+            return response.status;
+        }
+
+        handles.push((await response.json()).handle);
+    }
+
+    const response = await fetch("/stitch", {
+        method: "POST",
+        headers: { "Content-Type": "application/json" },
+        body: JSON.stringify({ handles: handles }),
+    });
+
+    if (response.status == 200) {
+        state.handle = (await response.json()).handle;
+        state.proxy = false;
+    }
+
+    return response.status;
+}
+
+async function uploadFile() {
+    // Upload the file once, later renders only send its handle. A
+    // queued file's upload may already be under way
+    if (state.stitch_files) {
+        return uploadStitch();
+    }
+
+    const entry = queuedEntry(state.file);
+    const result = await (entry ? queuedUpload(entry) : uploadOne(state.file));
+
+    if (result.status == 200) {
+        state.handle = result.handle;
+        state.proxy = result.proxy;
+    }
+
+    return result.status;
+}
+
+async function uploadOne(file, thumbnail=false) {
+    // Upload file as the raw request body, resolving to the status and
+    // the handle. Large photos send a proxy instead. A thumbnail upload
+    // has the server start on the queue's thumbnail of it
+    const query = thumbnail ? "thumbnail=1" : "";
+    let proxy = await makeProxy(file);
+
+    if (proxy) {
+        const response = await sendUpload("?original_width=" + proxy.width + "&original_height=" + proxy.height +
+            (query ? "&" + query : ""), proxy.blob, proxy.blob.type);
+
+        if (response.status == 200) {
+            return { status: response.status, handle: (await response.json()).handle, proxy: true };
+        }
+    }
+
+    const response = await sendUpload(query ? "?" + query : "", file, fileType(file));
+
+    if (response.status != 200) {
+        return { status: response.status, handle: null, proxy: false };
+    }
 
+    return { status: response.status, handle: (await response.json()).handle, proxy: false };
+}
+
+function gzip(blob) {
+    return new Response(blob.stream().pipeThrough(new CompressionStream("gzip"))).blob();
+}
+
+async function compressUpload(blob, type) {
+    // blob gzipped when it's text that's worth it, else null
+    if (typeof CompressionStream == "undefined" || !COMPRESS_TYPES.includes(type)) {
+        return null;
+    }
+
+    const sample = blob.slice(0, COMPRESS_SAMPLE_BYTES);
+    if ((await gzip(sample)).size > sample.size * COMPRESS_MIN_RATIO) {
+        return null;
+    }
+
+    return gzip(blob);
+}
+
+async function sendUpload(query, blob, type) {
+    // POST blob to /upload with query, or in chunks when it's large.
+    // Either way resolves to the response holding the handle. Text is
+    // sent gzipped, the server inflates it as it arrives
+    const compressed = await compressUpload(blob, type);
+    const encoding = compressed ? { "Content-Encoding": "gzip" } : {};
+    blob = compressed ?? blob;
+
+    if (blob.size < CHUNKED_MIN_BYTES) {
+        return fetch("/upload" + query, {
+            method: "POST",
+            headers: { "Content-Type": type, ...encoding },
+            body: blob,
+        });
+    }
+
+    const start = await fetch("/uploads" + query, {
+        method: "POST",
+        headers: { "Content-Type": "application/json" },
+        body: JSON.stringify({ size: blob.size, content_type: type, content_encoding: compressed ? "gzip" : null }),
+    });
+
+    if (start.status != 200) {
+        return start;
+    }
+
+    const upload_id = (await start.json()).upload_id;
+    let offset = 0;
+    let failures = 0;
+
+    while (true) {
+        try {
+            const response = await fetch("/uploads/" + upload_id + "?offset=" + offset, {
+                method: "PUT",
+                headers: { "Content-Type": "application/octet-stream" },
+                body: blob.slice(offset, offset + CHUNK_BYTES),
+            });
+
+            if (response.status == 409) {
+                // Out of step with the server, carry on from its count
+                offset = (await response.json()).received;
+                continue;
+            }
+
+            // The last chunk answers with the handle
+            if (response.status != 200 || offset + CHUNK_BYTES >= blob.size) {
+                return response;
+            }
+
+            offset = (await response.json()).received;
+            failures = 0;
+        } catch (error) {
+            if (++failures > CHUNK_RETRIES) {
+                throw error;
+            }
+
+            // Wait out the drop, then ask how much arrived
+            await new Promise(function (resolve) {
+                setTimeout(resolve, 1000 * failures);
+            });
+
+            try {
+                const status = await fetch("/uploads/" + upload_id);
+
+                if (status.status != 200) {
+                    return status;
+                }
+
+                const received = await status.json();
+                if (received.handle) {
+                    return new Response(JSON.stringify(received), { status: 200 });
+                }
+                offset = received.received;
+            } catch (error) {
+                console.log("Upload status failed, retrying: " + error);
+            }
+        }
+    }
+}
+
+async function makeProxy(file) {
+    // Downscaled jpeg of a large photo and the original's pixel size,
+    // or null to upload the original straight away. Animated types
+    // keep every frame so they never get a proxy
+    if (file.size < PROXY_MIN_BYTES || (file.type != "image/jpeg" && file.type != "image/png") ||
+        !window.createImageBitmap) {
+        return null;
+    }
+
+    try {
+        // The server reads pixels unrotated, so the proxy must be too
+        let bitmap = await createImageBitmap(file, { imageOrientation: "none" });
+        let scale = Math.min(1, PROXY_SIZE / Math.max(bitmap.width, bitmap.height));
+
+        let canvas = document.createElement("canvas");
+        canvas.width = Math.max(1, Math.round(bitmap.width * scale));
+        canvas.height = Math.max(1, Math.round(bitmap.height * scale));
+        canvas.getContext("2d").drawImage(bitmap, 0, 0, canvas.width, canvas.height);
+
+        let blob = await new Promise(function (resolve) {
+            canvas.toBlob(resolve, "image/jpeg", 0.92);
+        });
+
+        let proxy = { blob: blob, width: bitmap.width, height: bitmap.height };
+        bitmap.close();
+
+        return blob ? proxy : null;
+    } catch (error) {
+        console.log("Proxy failed, uploading the original: " + error);
+        return null;
+    }
+}
+
+async function ensureOriginal() {
+    // Upload the original behind a proxy, the server prints and zooms
+    // from it under the proxy's handle
+    if (!state.proxy) {
+        return 200;
+    }
+
+    const response = await sendUpload("?proxy=" + state.handle, state.file, fileType(state.file));
+
+    if (response.status == 200) {
+        state.proxy = false;
+
+        const entry = queuedEntry(state.file);
+        if (entry) {
+            entry.upload = Promise.resolve({ status: 200, handle: state.handle, proxy: false });
+        }
+    }
+
+    return response.status;
+}
+
+function resetFrames() {
+    state.frame = 0;
+    state.frames = 1;
+    document.getElementById("frames-input").classList.add("hidden");
+}
+
+// Image formats the server may encode previews in, webp where the
+// browser can show it and jpeg otherwise
+const preview_accept = "application/json, " +
+    (document.createElement("canvas").toDataURL("image/webp").startsWith("data:image/webp") ? "image/webp, " : "") +
+    "image/jpeg";
+
+function requestFrames() {
+    // Offer a frame picker for animations and multi-page tiffs, from a
+    // contact sheet of their frames
+    if (!["image/gif", "image/webp", "image/tiff"].includes(state.file.type)) {
+        return;
+    }
+
+    fetch("/frames", {
+        method: "POST",
+        headers: { "Content-Type": "application/json", "Accept": preview_accept },
+        body: JSON.stringify({ handle: state.handle }),
+    }).then(async function (response) {
+        if (response.status != 200) {
+            return;
+        }
+
+        let frames = await response.json();
+        if (frames.frames < 2) {
+            return;
+        }
+
+        state.frames = frames.frames;
+        state.frames_across = frames.across;
+        state.frames_shown = frames.shown;
+
+        let paged = state.file.type == "image/tiff";
+        document.getElementById("frames-title").innerText = paged ? "Page" : "Animation Frame";
+        document.getElementById("frames-explain").innerText = paged ? "Click the page to print." :
+            "Click the frame of the animation to print.";
+        document.getElementById("frames-sheet").src = frames.sheet_url;
+        document.getElementById("frames-input").classList.remove("hidden");
+        updateFrameLabel();
+    });
+}
+
+function pickFrame(event) {
+    // Pick the frame under the click on the contact sheet
+    let sheet = event.target;
+    let rows = Math.ceil(state.frames_shown / state.frames_across);
+    let col = Math.floor(event.offsetX / sheet.clientWidth * state.frames_across);
+    let row = Math.floor(event.offsetY / sheet.clientHeight * rows);
+    let frame = row * state.frames_across + col;
+
+    if (frame < state.frames_shown && frame != state.frame) {
+        state.frame = frame;
+        updateFrameLabel();
+        triggerChange();
+    }
+}
+
+function requestArea() {
+    // Offer the area picker over a thumbnail of the upload as the
+    // server reads it
+    fetch("/area", {
+        method: "POST",
+        headers: { "Content-Type": "application/json", "Accept": preview_accept },
+        body: JSON.stringify({ handle: state.handle, page: state.frame }),
+    }).then(async function (response) {
+        if (response.status != 200) {
+            return;
+        }
+
+        document.getElementById("area-sheet").src = (await response.json()).sheet_url;
+        document.getElementById("area-input").classList.remove("hidden");
+    });
+}
+
+function areaPoint(event) {
+    // Pointer position as fractions of the area sheet
+    let rect = document.getElementById("area-sheet").getBoundingClientRect();
+
+    return {
+        x: Math.min(Math.max((event.clientX - rect.left) / rect.width, 0), 1),
+        y: Math.min(Math.max((event.clientY - rect.top) / rect.height, 0), 1),
+    };
+}
+
+function startArea(event) {
     event.preventDefault();
-    state.history = {};
-    state.file = event.dataTransfer.files[0];
+    event.target.setPointerCapture(event.pointerId);
+    state.area_drag = areaPoint(event);
+}
 
-    // if it's a pdf
-    if (state.file.type == "application/pdf") {
-        state.isPDF = true;
-        // Disable dpi button
-        document.getElementById("specific_dpi").disabled = true;
+function dragArea(event) {
+    if (state.area_drag) {
+        showArea(dragBox(state.area_drag, areaPoint(event)));
+    }
+}
+
+function endArea(event) {
+    // Print just the dragged area, a click picks the whole image again
+    if (!state.area_drag) {
+        return;
+    }
+
+    let box = dragBox(state.area_drag, areaPoint(event));
+    state.area_drag = null;
+
+    if (box[2] < 0.01 || box[3] < 0.01) {
+        clearArea();
+        return;
+    }
+
+    state.area = box;
+    showArea(box);
+    triggerChange();
+}
+
+function dragBox(start, end) {
+    // [left, top, width, height] between two points
+    return [Math.min(start.x, end.x), Math.min(start.y, end.y), Math.abs(end.x - start.x), Math.abs(end.y - start.y)];
+}
+
+function showArea(box) {
+    let el = document.getElementById("area-box");
+
+    el.style.left = box[0] * 100 + "%";
+    el.style.top = box[1] * 100 + "%";
+    el.style.width = box[2] * 100 + "%";
+    el.style.height = box[3] * 100 + "%";
+    el.classList.remove("hidden");
+}
+
+function clearArea() {
+    let changed = state.area != null;
+
+    state.area = null;
+    document.getElementById("area-box").classList.add("hidden");
+
+    if (changed) {
+        triggerChange();
+    }
+}
+
+function resetArea() {
+    state.area = null;
+    state.area_drag = null;
+    document.getElementById("area-box").classList.add("hidden");
+    document.getElementById("area-input").classList.add("hidden");
+}
+
+function updateFrameLabel() {
+    document.getElementById("frames-label").innerText = (state.file.type == "image/tiff" ? "Page " : "Frame ") + (state.frame + 1) + " of " + state.frames;
+}
+
+function fileType(file) {
+    // Some browsers leave the type empty for newer formats, go by the
+    // file extension for those
+    const types = {
+        avif: "image/avif",
+        jxl: "image/jxl",
+        pptx: "application/vnd.openxmlformats-officedocument.presentationml.presentation",
+        docx: "application/vnd.openxmlformats-officedocument.wordprocessingml.document",
+        ppt: "application/vnd.ms-powerpoint",
+        doc: "application/msword",
+        odp: "application/vnd.oasis.opendocument.presentation",
+        odt: "application/vnd.oasis.opendocument.text",
+    };
+
+    return file.type || types[file.name.split(".").pop().toLowerCase()] || "application/octet-stream";
+}
+
+function pagedDocument(file) {
+    // Whether a file prints as pdf pages, Office documents upload as
+    // the pdf the server converts them to
+    let type = fileType(file);
+
+    return type == "application/pdf" || type.startsWith("application/vnd.") || type == "application/msword";
+}
+
+function showRenderError(status) {
+    console.error("Error: " + status);
+
+    clearTimeout(loading_timeout);
+    document.getElementById("image-loading-container").classList.add("hidden");
+
+    if (status == 415) {
+        alert("Error: File type not supported. Please upload a PDF, SVG, or supported image file (JPEG, PNG, GIF, TIFF, WebP, AVIF or JPEG XL).");
+    } else if (status == 413) {
+        alert("Error: File is too large to print. Please upload a smaller image.");
+    } else if (status == 429) {
+        alert("Error: The kiosk is busy with other uploads. Please try again in a moment.");
+    } else if (status == 422) {
+        alert("Error: The scans could not be lined up. Check they overlap and are picked in order.");
     } else {
-        state.isPDF = false;
-        // Enable dpi button
-        document.getElementById("specific_dpi").disabled = false;
+        alert("Error: " + status);
+    }
+}
+
+async function requestNewRender(options, show=true) {
+    console.log("Requesting new render");
+    disableRenderButtons();
+
+    if (!state.handle) {
+        let status = await uploadFile();
+
+        if (status != 200) {
+            showRenderError(status);
+            return;
+        }
+
+        requestFrames();
+        requestArea();
+    }
+
+    if (options.print) {
+        let status = await ensureOriginal();
+
+        if (status != 200) {
+            showRenderError(status);
+            return;
+        }
+    }
+
+    // Request a new render of the uploaded file. Previews stream a
+    // rough first phase before the finished one
+    let xhr = new XMLHttpRequest();
+    xhr.open("POST", "/render", true);
+    xhr.setRequestHeader("Content-Type", "application/json");
+    xhr.setRequestHeader("Accept", preview_accept);
+    xhr.send(JSON.stringify({
+        handle: state.handle,
+        options: options,
+        progressive: !options.print,
+        // Previews come back with their image, one request a tweak
+        inline: !options.print,
+        // Prints reuse the plan of the preview they were made from
+        plan_id: options.print && state.image_obj ? state.image_obj.plan_id : null,
+    }));
+
+    xhr.onprogress = function () {
+        let events = renderEvents(xhr);
+        let renders = events.filter(function (event) { return !event.queued; });
+
+        // Say where the preview is in the server's line while it waits
+        if (show && events.length && events[events.length - 1].queued) {
+            showQueued(events[events.length - 1]);
+        }
+
+        // Show the rough phase while the finished preview renders
+        if (show && renders.length == 1 && renders[0].status == 200) {
+            clearTimeout(loading_timeout);
+            document.getElementById("image-loading-container").classList.add("hidden");
+            showPreview(renders[0]);
+        }
+    }
+
+    xhr.onload = function () {
+        let status = xhr.status;
+        let response = null;
+
+        showQueued(null);
+
+        if (isEventStream(xhr)) {
+            // The last event is the finished render
+            response = renderEvents(xhr).pop();
+            status = response.status;
+        } else if (xhr.response) {
+            response = inlineImage(JSON.parse(xhr.response));
+        }
+
+        if (status == 200) {
+            state.history[JSON.stringify(options)] = response;
+
+            document.getElementById("display").classList.add("loaded");
+
+            clearTimeout(loading_timeout);
+            document.getElementById("image-loading-container").classList.add("hidden");
+
+            if (show) {
+                state.image_obj = response;
+                enableRenderButtons();
+
+                showPreview(state.image_obj, false);
+
+                // Later changes that only move the print compose from it
+                if (!options.print) {
+                    requestTexture(options);
+                }
+            }
+        } else if (status == 202) {
+            // Print was queued, follow the job until it finishes. A
+            // duplicate is the same print already queued moments ago
+            enableRenderButtons();
+            if (response.duplicate) {
+                console.log("Print already queued as " + response.job_id);
+            }
+            pollJob(response.job_id);
+        } else if (status == 409) {
+            // A newer render of this upload replaced this one
+            console.log("Render superseded");
+        } else if (status == 429) {
+            // The server is at capacity, ask again when it says to
+            showQueued(response);
+            setTimeout(function () { requestNewRender(options, show); }, response.retry_after * 1000);
+        } else if (status == 404) {
+            // Server no longer holds the upload, send it again
+            state.handle = null;
+
+            const entry = queuedEntry(state.file);
+            if (entry) {
+                entry.upload = null;
+            }
+            requestNewRender(options, show);
+        } else if (status == 428) {
+            // Server dropped the original behind the proxy, send it again
+            state.proxy = true;
+            requestNewRender(options, show);
+        } else {
+            showRenderError(status);
+        }
+    }
+}
+
+function showQueued(event) {
+    // Put a preview's place in the server's line on the loading modal,
+    // or with no event put back what it says while rendering
+    let text = document.querySelector("#image-loading-text h3");
+
+    if (!event) {
+        text.innerText = "Rendering image...";
+        return;
+    }
+
+    document.getElementById("image-loading-container").classList.remove("hidden");
+    text.innerText = event.queued ?
+        "Waiting for the server, " + event.position + " in line (about " + Math.ceil(event.eta) + "s)..." :
+        "The server is busy, trying again in " + event.retry_after + "s...";
+}
+
+function isEventStream(xhr) {
+    return (xhr.getResponseHeader("Content-Type") || "").startsWith("text/event-stream");
+}
+
+function renderEvents(xhr) {
+    // Complete server-sent events received so far, each parsed once
+    if (!isEventStream(xhr)) {
+        return [];
+    }
+
+    // Anything after the last blank line is still arriving
+    let events = xhr.responseText.split("\n\n").slice(0, -1).filter(function (event) {
+        return event.startsWith("data: ");
+    });
+
+    xhr.parsed_events = xhr.parsed_events || [];
+    for (let event of events.slice(xhr.parsed_events.length)) {
+        xhr.parsed_events.push(inlineImage(JSON.parse(event.slice(6))));
+    }
+
+    return xhr.parsed_events.slice();
+}
+
+function inlineImage(response) {
+    // Point image_url at the image a response carries inline, so it
+    // shows without another request
+    if (response.image_data) {
+        let bytes = Uint8Array.from(atob(response.image_data), function (c) { return c.charCodeAt(0); });
+        response.image_url = URL.createObjectURL(new Blob([bytes], { type: response.image_type }));
+        delete response.image_data;
+    }
+
+    return response;
+}
+
+function pollJob(job_id) {
+    // Follow a background print job through its event stream
+    let progress = document.getElementById("print-progress");
+    progress.innerText = "Queued";
+
+    state.job_id = job_id;
+    document.getElementById("cancel-print").classList.remove("hidden");
+    document.getElementById("print-copy").classList.add("hidden");
+
+    let events = new EventSource("/jobs/" + job_id + "/events");
+
+    events.onmessage = function (event) {
+        let job = JSON.parse(event.data);
+
+        if (job.status == "queued") {
+            progress.innerText = "Queued";
+
+            if (job.predicted_seconds) {
+                progress.innerText += ", rendering takes about " + job.predicted_seconds + "s";
+            }
+        } else if (job.status == "running") {
+            progress.innerText = "Rendering " + job.progress + "%";
+
+            if (job.eta) {
+                progress.innerText += ", about " + job.eta + "s left";
+            } else if (job.predicted_seconds && job.started) {
+                let left = Math.round(job.predicted_seconds - (Date.now() / 1000 - job.started));
+                if (left > 0) {
+                    progress.innerText += ", about " + left + "s left";
+                }
+            }
+        } else if (job.status == "waiting") {
+            progress.innerText = "Ready, waiting for the printer";
+        } else if (job.status == "done") {
+            progress.innerText = "Sent to printer";
+            events.close();
+            document.getElementById("cancel-print").classList.add("hidden");
+            document.getElementById("print-copy").classList.remove("hidden");
+        } else if (job.status == "cancelled") {
+            events.close();
+            closeGif();
+        } else if (job.status == "failed") {
+            events.close();
+            closeGif();
+            alert("Printing failed: " + job.error);
+        }
+    }
+
+    events.onerror = function () {
+        // Server went away mid-job, stop retrying
+        events.close();
+    }
+}
+
+function cancelPrint() {
+    // Stop the print job the loading modal is following
+    if (state.job_id) {
+        fetch("/jobs/" + state.job_id + "/cancel", { method: "POST" });
+    }
+}
+
+async function renderPreview(options=false) {
+    loading_timeout = setTimeout(function () {
+        document.getElementById("image-loading-container").classList.remove("hidden");
+    }, 100);
+
+    if (!options) {
+        // Render the preview
+        options = getOptions();
+    }
+    options["preview"] = true;
+
+    if (state.history[JSON.stringify(options)]) {
+        console.log("Using cached render");
+        state.image_obj = state.history[JSON.stringify(options)];
+        showPreview(state.image_obj);
+        // Stop loading_timeout
+        clearTimeout(loading_timeout);
+        document.getElementById("image-loading-container").classList.add("hidden");
+    } else {
+        await requestNewRender(JSON.parse(JSON.stringify(options)), show=true);
+    }
+}
+
+function updateInfoBox(plan=state.image_obj) {
+    let info = document.getElementById("info-box");
+
+    let width = plan.width;
+    let height = plan.height;
+    let dpi = plan.dpi;
+
+    if (dpi < 50) {
+        dpi += " <span class='red'>(WARNING - Low DPI)</span>";
+    }
+
+    let pages = "";
+
+    if (plan.pages) {
+        pages = `<br>Pages: ${plan.pages.length}`;
+    }
+
+    if (state.estimate) {
+        const ink = state.estimate.ink_ml;
+        pages += `<br>Roll: ${state.estimate.roll_inches} inches<br>` +
+            `Ink: C ${ink.cyan} M ${ink.magenta} Y ${ink.yellow} K ${ink.black} ml`;
+
+        if (state.estimate.skipped_pages.length > 0) {
+            pages += `<br>Skipping blank pages: ${state.estimate.skipped_pages.map(page => page + 1).join(", ")}`;
+        } else if (state.estimate.blank_pages.length > 0) {
+            pages += `<br><span class='red'>Blank pages: ${state.estimate.blank_pages.map(page => page + 1).join(", ")}</span>`;
+        }
+    }
+
+    if (plan.panels) {
+        pages += `<br>Panels: ${plan.panels}`;
+    } else if (plan.panels === 0) {
+        pages += "<br><span class='red'>Wider than the printer, will shrink to fit</span>";
+    }
+
+    if (width <= 5 || height <= 5) {
+        document.getElementById("print").disabled = true;
+        info.innerHTML = `Size: ${width}x${height} inches<br>DPI: ${dpi}${pages}<br><span class='red'>Image is too small to print</span>`;
+    } else {
+        document.getElementById("print").disabled = false;
+        info.innerHTML = `Size: ${width}x${height} inches<br>DPI: ${dpi}${pages}`;
+    }
+}
+
+function showPreviewTemp(side) {
+    let options = getOptions();
+
+    options["side"] = side;
+    options["preview"] = true;
+
+    let url = state.history[JSON.stringify(options)];
+
+    if (url != undefined) {
+        showPreview(url);
+    }
+}
+
+
+function showPreview(image) {
+    // Display the image
+    const img = document.getElementById("preview");
+    updateInfoBox();
+    img.style.backgroundImage = `url(${image.image_url})`;
+}
+
+function clearPreview() {
+    // Clear the preview
+    const img = document.getElementById("preview");
+
+    img.style.backgroundImage = "";
+
+    if (state.image_obj) {
+        showPreview(state.image_obj);
+    }
+}
+
+async function triggerChange() {
+    let options = getOptions();
+    let planned = requestPlan(options);
+
+    // Options that only move or scale the print are composed here from
+    // the texture, without asking the server for a preview
+    if (state.texture && state.texture.key == pixelKey(options)) {
+        let plan = await planned;
+
+        if (plan && !plan.pages && JSON.stringify(options) == JSON.stringify(getOptions())) {
+            composePreview(plan, options);
+            return;
+        }
     }
 
     renderPreview();
 }
 
-async function requestNewRender(options, show=true) {
-    console.log("Requesting new render");
-    disableRenderButtons();
-    let formData = new FormData();
+function pixelKey(options) {
+    // The options a preview's pixels depend on, besides where the
+    // print sits on the mockup and how big it is
+    let pixels = Object.assign({}, options);
+
+    for (let name of ["side", "max_size", "specific_width", "specific_height", "specific_dpi", "paper_width",
+                      "panels", "quality", "print", "preview"]) {
+        // A soft proof is of the paper and preset the print goes to
+        if (!options.soft_proof || (name != "paper_width" && name != "quality")) {
+            delete pixels[name];
+        }
+    }
+
+    return JSON.stringify(pixels);
+}
+
+async function requestTexture(options) {
+    // Fetch the upright texture previews recompose from, once per
+    // change of their pixels
+    let key = pixelKey(options);
+
+    if (options.all_pages || (state.texture && state.texture.key == key)) {
+        return;
+    }
+
+    let response = await fetch("/texture", {
+        method: "POST",
+        headers: { "Content-Type": "application/json", "Accept": preview_accept },
+        body: JSON.stringify({ handle: state.handle, options: options }),
+    });
+
+    if (response.status != 200) {
+        return;
+    }
+
+    let texture = await response.json();
+    texture.key = key;
+    texture.image = new Image();
+    texture.image.src = texture.image_url;
+    await texture.image.decode();
+
+    // Only if the pixels haven't changed while it loaded
+    if (pixelKey(getOptions()) == key) {
+        state.texture = texture;
+    }
+}
+
+function composePreview(plan, options) {
+    // Draw the preview the server would, from the texture: the print
+    // at its planned size, turned clockwise when it prints on its
+    // side, hanging from the mockup's print corner on a transparent
+    // canvas the size of the mockup
+    let texture = state.texture;
+    let mockup = texture.mockup;
+    let scale = texture.scale;
+
+    let canvas = document.createElement("canvas");
+    canvas.width = Math.round(mockup.width * scale);
+    canvas.height = Math.round(mockup.height * scale);
+
+    let width_pix = mockup.print_width * scale * (plan.width / mockup.max_width);
+    let height_pix = width_pix * (plan.height / plan.width);
+
+    let context = canvas.getContext("2d");
+    context.imageSmoothingQuality = "high";
+    context.translate(Math.round(mockup.right * scale) - Math.floor(width_pix),
+                      Math.round(mockup.bottom * scale) - Math.floor(height_pix));
+
+    if (plan.rotate) {
+        context.translate(width_pix, 0);
+        context.rotate(Math.PI / 2);
+        context.drawImage(texture.image, 0, 0, height_pix, width_pix);
+    } else {
+        context.drawImage(texture.image, 0, 0, width_pix, height_pix);
+    }
+
+    canvas.toBlob(function (blob) {
+        if (state.composed_url) {
+            URL.revokeObjectURL(state.composed_url);
+        }
+        state.composed_url = URL.createObjectURL(blob);
+
+        // No plan_id, prints of a composed preview plan on the server
+        state.image_obj = Object.assign({}, plan, { image_url: state.composed_url });
+        options["preview"] = true;
+        state.history[JSON.stringify(options)] = state.image_obj;
+
+        clearTimeout(loading_timeout);
+        document.getElementById("image-loading-container").classList.add("hidden");
+        showPreview(state.image_obj);
+    });
+}
+
+function requestPlan(options) {
+    // Update the info box from the header-only plan while the
+    // preview renders. Resolves to the plan, or null
+    if (!state.handle) {
+        return Promise.resolve(null);
+    }
+
+    state.estimate = null;
+
+    let planned = fetch("/plan", {
+        method: "POST",
+        headers: { "Content-Type": "application/json" },
+        body: JSON.stringify({ handle: state.handle, options: options }),
+    }).then(async function (response) {
+        if (response.status != 200) {
+            return null;
+        }
+
+        let plan = await response.json();
+        state.plan = plan;
+        updateInfoBox(plan);
+
+        return plan;
+    });
+
+    // Ink and roll estimate, it needs a thumbnail so it comes after
+    const body = JSON.stringify({ handle: state.handle, options: options });
+    fetch("/estimate", {
+        method: "POST",
+        headers: { "Content-Type": "application/json" },
+        body: body,
+    }).then(function (response) {
+        if (response.status == 200) {
+            response.json().then(function (estimate) {
+                // Only if the options haven't changed since
+                if (JSON.stringify({ handle: state.handle, options: getOptions() }) == body) {
+                    state.estimate = estimate;
+                    updateInfoBox(state.plan ?? state.image_obj);
+                }
+            });
+        }
+    });
+
+    return planned;
+}
+
+function disableRenderButtons() {
+    document.getElementById("print").disabled = true;
+    document.getElementById("inspect").disabled = true;
+}
+
+function enableRenderButtons() {
+    document.getElementById("print").disabled = false;
+    document.getElementById("inspect").disabled = false;
+}
+
+var zoom = null;
 
-    formData.append("file", state.file);
-    formData.append("options", JSON.stringify(options));
+async function openZoom() {
+    // Open the detail viewer on the print-resolution image
+    let status = await ensureOriginal();
 
-    // Request a new render
-    let xhr = new XMLHttpRequest();
-    xhr.open("POST", "/renderImage", true);
-    xhr.send(formData);
+    if (status != 200) {
+        showRenderError(status);
+        return;
+    }
 
-    xhr.onload = function () {
-        if (xhr.status == 200) {
-            state.history[JSON.stringify(options)] = JSON.parse(xhr.response);
+    let response = await fetch("/zoom", {
+        method: "POST",
+        headers: { "Content-Type": "application/json" },
+        body: JSON.stringify({ handle: state.handle, options: getOptions() }),
+    });
 
-            document.getElementById("display").classList.add("loaded");
+    if (response.status != 200) {
+        showRenderError(response.status);
+        return;
+    }
 
-            clearTimeout(loading_timeout);
-            document.getElementById("image-loading-container").classList.add("hidden");
+    zoom = await response.json();
+    zoom.tiles = {};
 
-            if (show) {
-                state.image_obj = JSON.parse(xhr.response);
-                enableRenderButtons();
+    // Tiles still painting come back as stand-ins, fetch each again
+    // when the server says it's painted
+    zoom.events = new EventSource("/zoom/" + zoom.zoom_id + "/events");
+    zoom.events.onmessage = function (event) {
+        let tile = zoom && zoom.tiles[event.data];
+        if (tile) {
+            tile.src = "/zoom/" + zoom.zoom_id + "/" + event.data + ".jpg?painted";
+        }
+    };
 
-                showPreview(state.image_obj, false);
-            }
-        } else {
-            console.error("Error: " + xhr.status);
+    document.getElementById("zoom-container").classList.remove("hidden");
 
-            clearTimeout(loading_timeout);
-            document.getElementById("image-loading-container").classList.add("hidden");
+    // Start with the whole image in view
+    let viewer = document.getElementById("zoom-viewer");
+    zoom.scale = Math.min(viewer.clientWidth / zoom.width, viewer.clientHeight / zoom.height);
+    zoom.x = (zoom.width - viewer.clientWidth / zoom.scale) / 2;
+    zoom.y = (zoom.height - viewer.clientHeight / zoom.scale) / 2;
 
-            if (xhr.status == 415) {
-                alert("Error: File type not supported. Please upload a PDF, SVG, or supported image file.");
-            } else {
-                alert("Error: " + xhr.status);
-            }
-        }
-    }
+    drawZoom();
 }
 
-async function renderPreview(options=false) {
-    loading_timeout = setTimeout(function () {
-        document.getElementById("image-loading-container").classList.remove("hidden");
-    }, 100);
-
-    if (!options) {
-        // Render the preview
-        options = getOptions();
-    }
-    options["preview"] = true;
+function closeZoom() {
+    document.getElementById("zoom-container").classList.add("hidden");
+    document.getElementById("zoom-viewer").innerHTML = "";
 
-    if (state.history[JSON.stringify(options)]) {
-        console.log("Using cached render");
-        state.image_obj = state.history[JSON.stringify(options)];
-        showPreview(state.image_obj);
-        // Stop loading_timeout
-        clearTimeout(loading_timeout);
-        document.getElementById("image-loading-container").classList.add("hidden");
-    } else {
-        await requestNewRender(JSON.parse(JSON.stringify(options)), show=true);
+    if (zoom) {
+        zoom.events.close();
     }
+    zoom = null;
 }
 
-function updateInfoBox() {
-    let info = document.getElementById("info-box");
+function zoomBy(factor, center_x=null, center_y=null) {
+    // Zoom around a point in the viewer, the middle by default
+    let viewer = document.getElementById("zoom-viewer");
+    center_x = center_x ?? viewer.clientWidth / 2;
+    center_y = center_y ?? viewer.clientHeight / 2;
 
-    let width = state.image_obj.width;
-    let height = state.image_obj.height;
-    let dpi = state.image_obj.dpi;
+    // Never past one screen pixel per print pixel
+    let scale = Math.min(1, zoom.scale * factor);
 
-    if (dpi < 50) {
-        dpi += " <span class='red'>(WARNING - Low DPI)</span>";
-    }
+    zoom.x += center_x / zoom.scale - center_x / scale;
+    zoom.y += center_y / zoom.scale - center_y / scale;
+    zoom.scale = scale;
 
-    if (width <= 5 || height <= 5) {
-        document.getElementById("print").disabled = true;
-        info.innerHTML = `Size: ${width}x${height} inches<br>DPI: ${dpi}<br><span class='red'>Image is too small to print</span>`;
-    } else {
-        document.getElementById("print").disabled = false;
-        info.innerHTML = `Size: ${width}x${height} inches<br>DPI: ${dpi}`;
-    }
+    drawZoom();
 }
 
-function showPreviewTemp(side) {
-    let options = getOptions();
+function drawZoom() {
+    // Show the tiles of the level that best matches the zoom, only
+    // those in view are ever requested
+    let viewer = document.getElementById("zoom-viewer");
+    let level = Math.max(0, Math.min(zoom.max_level, zoom.max_level + Math.ceil(Math.log2(zoom.scale))));
+    let level_scale = Math.pow(2, level - zoom.max_level);
+    let level_width = Math.ceil(zoom.width * level_scale);
+    let level_height = Math.ceil(zoom.height * level_scale);
+
+    let size = zoom.tile_size;
+    let overlap = zoom.overlap;
+
+    let first_col = Math.max(0, Math.floor(zoom.x * level_scale / size));
+    let last_col = Math.min(Math.ceil(level_width / size) - 1,
+                            Math.floor((zoom.x + viewer.clientWidth / zoom.scale) * level_scale / size));
+    let first_row = Math.max(0, Math.floor(zoom.y * level_scale / size));
+    let last_row = Math.min(Math.ceil(level_height / size) - 1,
+                            Math.floor((zoom.y + viewer.clientHeight / zoom.scale) * level_scale / size));
+
+    let shown = {};
+
+    for (let col = first_col; col <= last_col; col++) {
+        for (let row = first_row; row <= last_row; row++) {
+            let name = level + "/" + col + "_" + row;
+            shown[name] = true;
+
+            let tile = zoom.tiles[name];
+            if (!tile) {
+                tile = document.createElement("img");
+                tile.src = "/zoom/" + zoom.zoom_id + "/" + name + ".jpg";
+                viewer.appendChild(tile);
+                zoom.tiles[name] = tile;
+            }
 
-    options["side"] = side;
-    options["preview"] = true;
+            // Tiles after the first carry overlap pixels on their left and top
+            let left = col * size - (col > 0 ? overlap : 0);
+            let top = row * size - (row > 0 ? overlap : 0);
+            let width = Math.min(size + overlap * (col > 0 ? 2 : 1), level_width - left);
+            let height = Math.min(size + overlap * (row > 0 ? 2 : 1), level_height - top);
 
-    let url = state.history[JSON.stringify(options)];
+            tile.style.left = (left / level_scale - zoom.x) * zoom.scale + "px";
+            tile.style.top = (top / level_scale - zoom.y) * zoom.scale + "px";
+            tile.style.width = width / level_scale * zoom.scale + "px";
+            tile.style.height = height / level_scale * zoom.scale + "px";
+        }
+    }
 
-    if (url != undefined) {
-        showPreview(url);
+    // Drop tiles that are out of view or from other levels
+    for (let name in zoom.tiles) {
+        if (!shown[name]) {
+            zoom.tiles[name].remove();
+            delete zoom.tiles[name];
+        }
     }
 }
 
+window.addEventListener("load", function () {
+    migrateLog();
 
-function showPreview(image) {
-    // Display the image
-    const img = document.getElementById("preview");
-    updateInfoBox();
-    img.style.backgroundImage = `url(${image.image_url})`;
-}
+    // Drag to pan and scroll to zoom the detail viewer
+    let viewer = document.getElementById("zoom-viewer");
+    let drag = null;
 
-function clearPreview() {
-    // Clear the preview
-    const img = document.getElementById("preview");
+    viewer.addEventListener("pointerdown", function (event) {
+        drag = { x: event.clientX, y: event.clientY };
+        viewer.setPointerCapture(event.pointerId);
+    });
 
-    img.style.backgroundImage = "";
+    viewer.addEventListener("pointermove", function (event) {
+        if (!drag || !zoom) {
+            return;
+        }
 
-    if (state.image_obj) {
-        showPreview(state.image_obj);
-    }
-}
+        zoom.x -= (event.clientX - drag.x) / zoom.scale;
+        zoom.y -= (event.clientY - drag.y) / zoom.scale;
+        drag = { x: event.clientX, y: event.clientY };
 
-function triggerChange() {
-    renderPreview();
-}
+        drawZoom();
+    });
 
-function disableRenderButtons() {
-    document.getElementById("print").disabled = true;
-}
+    viewer.addEventListener("pointerup", function () {
+        drag = null;
+    });
 
-function enableRenderButtons() {
-    document.getElementById("print").disabled = false;
-}
+    viewer.addEventListener("wheel", function (event) {
+        event.preventDefault();
+
+        if (zoom) {
+            let bounds = viewer.getBoundingClientRect();
+            zoomBy(event.deltaY < 0 ? 1.25 : 0.8, event.clientX - bounds.left, event.clientY - bounds.top);
+        }
+    }, { passive: false });
+});
 
 function disableDPIButton() {
     document.getElementById("specific_dpi").disabled = true;
@@ -282,6 +1424,71 @@ function setBoundedValue(el, override_max=false, override_min=false) {
     triggerChange();
 }
 
+function setPages(index) {
+    const el = document.getElementById("pages-select");
+
+    for (let i = 0; i < el.children.length; i++) {
+        if (i === index) {
+            el.children[i].classList.add("selected");
+        } else {
+            el.children[i].classList.remove("selected");
+        }
+    }
+    triggerChange();
+}
+
+function setTrim(index) {
+    const el = document.getElementById("trim-select");
+
+    for (let i = 0; i < el.children.length; i++) {
+        if (i === index) {
+            el.children[i].classList.add("selected");
+        } else {
+            el.children[i].classList.remove("selected");
+        }
+    }
+    triggerChange();
+}
+
+function setPanels(index) {
+    const el = document.getElementById("panels-select");
+
+    for (let i = 0; i < el.children.length; i++) {
+        if (i === index) {
+            el.children[i].classList.add("selected");
+        } else {
+            el.children[i].classList.remove("selected");
+        }
+    }
+    triggerChange();
+}
+
+function setQuality(index) {
+    const el = document.getElementById("quality-select");
+
+    for (let i = 0; i < el.children.length; i++) {
+        if (i === index) {
+            el.children[i].classList.add("selected");
+        } else {
+            el.children[i].classList.remove("selected");
+        }
+    }
+    triggerChange();
+}
+
+function setProof(index) {
+    const el = document.getElementById("proof-select");
+
+    for (let i = 0; i < el.children.length; i++) {
+        if (i === index) {
+            el.children[i].classList.add("selected");
+        } else {
+            el.children[i].classList.remove("selected");
+        }
+    }
+    triggerChange();
+}
+
 function setSide(index) {
     const el = document.getElementById("side-select");
 
@@ -313,6 +1520,12 @@ function getOptions() {
         specific_height: null,
         specific_dpi: null,
         paper_width: null,
+        all_pages: false,
+        auto_trim: false,
+        panels: false,
+        quality: "standard",
+        soft_proof: false,
+        area: state.area,
         print: false,
     };
 
@@ -336,6 +1549,23 @@ function getOptions() {
     }
 
     options.paper_width = Number(valueOfSelectedChildren(document.getElementById("size-select")));
+    options.all_pages = state.isPDF && valueOfSelectedChildren(document.getElementById("pages-select")) == "all";
+    options.auto_trim = valueOfSelectedChildren(document.getElementById("trim-select")) == "trim";
+    options.panels = valueOfSelectedChildren(document.getElementById("panels-select")) == "panels";
+    options.quality = valueOfSelectedChildren(document.getElementById("quality-select"));
+    options.soft_proof = valueOfSelectedChildren(document.getElementById("proof-select")) == "proof";
+
+    if (state.frames > 1) {
+        options.page = state.frame;
+    }
+
+    // The server renders previews at the display's size in device pixels
+    const display = document.getElementById("display");
+    options.viewport = {
+        width: display.clientWidth,
+        height: display.clientHeight,
+        dpr: window.devicePixelRatio || 1,
+    };
 
     return options;
 }
@@ -344,6 +1574,49 @@ function openPrintConfirmation() {
     // Open confirmation modal
     document.getElementById("id-input").getElementsByTagName("input")[0].value = "";
     document.getElementById("print-confirmation-container").classList.remove("hidden");
+
+    rehearsePrint();
+}
+
+function cancelPrintConfirmation() {
+    // Closed without printing, the server can drop the rehearsal
+    cancelRehearsal();
+    closePrintConfirmation();
+}
+
+async function rehearsePrint() {
+    // Have the server render the print up to its label while the ID
+    // is typed in, the print then picks up what it rendered
+    if (!state.handle || (await ensureOriginal()) != 200) {
+        return;
+    }
+
+    let options = getOptions();
+    options["print"] = true;
+    // The label is stamped at print time, but whether there is one
+    // decides how the print is turned
+    options.label = { college_id: null, file_name: state.file ? state.file.name : null };
+
+    const response = await fetch("/rehearsals", {
+        method: "POST",
+        headers: { "Content-Type": "application/json" },
+        body: JSON.stringify({
+            handle: state.handle,
+            options: options,
+            plan_id: state.image_obj ? state.image_obj.plan_id : null,
+        }),
+    });
+
+    if (response.status == 202) {
+        state.rehearsal = (await response.json()).rehearsal_id;
+    }
+}
+
+function cancelRehearsal() {
+    if (state.rehearsal) {
+        fetch("/rehearsals/" + state.rehearsal + "/cancel", { method: "POST" });
+        state.rehearsal = null;
+    }
 }
 
 function closePrintConfirmation() {
@@ -351,20 +1624,99 @@ function closePrintConfirmation() {
     document.getElementById("print-confirmation-container").classList.add("hidden");
 }
 
-async function printImage() {
-    // Print the image
+async function printImage(another_copy=false) {
+    // Print the image, the server answers a repeat of the same print
+    // with the job already running unless another copy is asked for
     let options = getOptions();
     options["print"] = true;
+    options["another_copy"] = another_copy;
 
     // Log print
     await logPrint(options);
 
+    // Stamped on the print's footer
+    options.label = {
+        college_id: (state.user_data ?? {}).college_id ?? state.college_id,
+        file_name: state.file ? state.file.name : null,
+    };
+
+    // The print claims the rehearsal on the server
+    state.rehearsal = null;
     await requestNewRender(options);
 
     closePrintConfirmation();
     openLoadingModal();
 }
 
+async function printCopy() {
+    // Print the last job again from its spool files, rendering it
+    // again only once the server has cleared them out
+    const response = await fetch("/jobs/" + state.job_id + "/copy", { method: "POST" });
+
+    if (response.status == 202) {
+        pollJob((await response.json()).job_id);
+    } else {
+        await printImage(true);
+    }
+}
+
+async function gangImage() {
+    // Hold this print for a gang sheet shared with other small prints
+    // on the same roll, printed together from printGang
+    let options = getOptions();
+    options["print"] = true;
+
+    await logPrint(options);
+
+    let status = await ensureOriginal();
+    if (status != 200) {
+        showRenderError(status);
+        return;
+    }
+
+    // Gang sheets render on their own
+    cancelRehearsal();
+
+    const response = await fetch("/gang", {
+        method: "POST",
+        headers: { "Content-Type": "application/json" },
+        body: JSON.stringify({ handle: state.handle, options: options }),
+    });
+
+    closePrintConfirmation();
+
+    if (response.status == 409) {
+        alert("The gang sheet is full, print it first.");
+        return;
+    } else if (response.status != 200) {
+        showRenderError(response.status);
+        return;
+    }
+
+    let sheet = await response.json();
+    state.gang_sheet = sheet.sheet;
+
+    let button = document.getElementById("print-gang");
+    button.innerText = "Print Gang Sheet (" + sheet.count + ")";
+    button.classList.remove("hidden");
+}
+
+async function printGang() {
+    // Print every print held on the gang sheet as one job
+    const response = await fetch("/gang/" + state.gang_sheet + "/print", { method: "POST" });
+
+    document.getElementById("print-gang").classList.add("hidden");
+    state.gang_sheet = null;
+
+    if (response.status != 202) {
+        showRenderError(response.status);
+        return;
+    }
+
+    openLoadingModal();
+    pollJob((await response.json()).job_id);
+}
+
 function closeGif() {
     // Close loading modal
     document.getElementById("gif-container").classList.add("hidden");
@@ -375,17 +1727,50 @@ function openLoadingModal() {
     document.getElementById("gif-container").classList.remove("hidden");
 }
 
-async function logPrint(options) {
-    // Log print
-    const log_data = {
-        id_number: state.college_id ?? "Unknown",
-        user_info: state.user_data ?? "Unknown",
+function logEntry(user_info, options, timestamp) {
+    // Print log entry as the server stores it
+    return {
+        timestamp: timestamp / 1000,
+        college_id: user_info.college_id ?? null,
+        name: user_info.name ?? null,
+        email: user_info.college_email ?? null,
         options: options,
-        timestamp: Date.now(),
     };
+}
+
+async function logPrint(options) {
+    // Log print to the server's print log
+    const user_info = state.user_data ?? { college_id: state.college_id ?? "Unknown" };
 
-    // Store log in indexedDB using localforage by timestamp
-    await localforage.setItem(log_data.timestamp, log_data);
+    await fetch("/log", {
+        method: "POST",
+        headers: { "Content-Type": "application/json" },
+        body: JSON.stringify(logEntry(user_info, options, Date.now())),
+    });
+}
+
+async function migrateLog() {
+    // Move prints logged to this browser's indexedDB before the log
+    // moved to the server, then drop them from the browser
+    let entries = [];
+    await localforage.iterate((value) => {
+        entries.push(logEntry(typeof value.user_info == "object" ? value.user_info : { college_id: value.id_number },
+                              value.options, value.timestamp));
+    });
+
+    if (entries.length == 0) {
+        return;
+    }
+
+    const response = await fetch("/log", {
+        method: "POST",
+        headers: { "Content-Type": "application/json" },
+        body: JSON.stringify(entries),
+    });
+
+    if (response.status == 200) {
+        await localforage.clear();
+    }
 }
 
 async function checkID() {
@@ -437,9 +1822,11 @@ function setAbleToPrint(able) {
     if (able) {
         document.getElementById("id-input").getElementsByTagName("input")[0].classList.remove("error");
         document.getElementById("print-confirmation-yes").disabled = false;
+        document.getElementById("print-confirmation-gang").disabled = false;
     } else {
         document.getElementById("id-input").getElementsByTagName("input")[0].classList.add("error");
         document.getElementById("print-confirmation-yes").disabled = true;
+        document.getElementById("print-confirmation-gang").disabled = true;
     }
 }
 
@@ -459,65 +1846,136 @@ function parseCollegeID(collegeID) {
     }
 }
 
+// The print log draws only the rows in view, each LOG_ROW_HEIGHT
+// pixels tall as main.css sets them, from pages of LOG_PAGE_ROWS
+// fetched by offset as they scroll into view
+const LOG_ROW_HEIGHT = 32;
+const LOG_PAGE_ROWS = 100;
+const LOG_OVERSCAN_ROWS = 10;
+
+let log_view = null;
+let log_frame = null;
+
 function openLog() {
     const log_el = document.getElementById("log-container");
-    const log_content_el = document.getElementById("log-content");
-
-    // Loop through all items in indexedDB using localforage
-    let rows = [];
-    localforage.iterate((value, key, iterationNumber) => {
-        console.log([key, value]);
-
-        // Create table row
-        const tr = document.createElement("tr");
-
-        // Create table data
-        const td1 = document.createElement("td");
-        const td2 = document.createElement("td");
-        const td3 = document.createElement("td");
-        const td4 = document.createElement("td");
-        const td5 = document.createElement("td");
-
-        // Set inner HTML
-        td1.innerHTML = new Date(value.timestamp).toLocaleString();
-        td2.innerHTML = value.user_info.college_id
-        td3.innerHTML = value.user_info.name;
-        td4.innerHTML = value.user_info.college_email;
-        td5.innerHTML = value.options.paper_width + " inches";
-
-        // Append to table row
-        tr.appendChild(td1);
-        tr.appendChild(td2);
-        tr.appendChild(td3);
-        tr.appendChild(td4);
-        tr.appendChild(td5);
-
-        rows = [tr, ...rows];        
-    }).then(() => {
-        // Clear log content
-        log_content_el.innerHTML = `
-        <tr>
-            <th>Timestamp</th>
-            <th>College ID</th>
-            <th>Name</th>
-            <th>Email</th>
-            <th>Roll Width</th>
-        </tr>
-        `;
-
-        // Append rows to log content
-        rows.forEach(row => {
-            log_content_el.appendChild(row);
+
+    log_view = { total: 0, pages: new Map() };
+    document.getElementById("log-window").style.height = "0px";
+    document.getElementById("log-content").replaceChildren();
+
+    // Shown first, so the first page knows how many rows fit
+    log_el.classList.remove("hidden");
+    log_el.scrollTop = 0;
+
+    loadLogPage(log_view, 0);
+}
+
+async function loadLogPage(view, page) {
+    // Fetch one page of the server's print log, newest first, and draw
+    // it if it's still in view. The first also counts the entries
+    view.pages.set(page, null);
+
+    let url = "/log?limit=" + LOG_PAGE_ROWS + "&offset=" + page * LOG_PAGE_ROWS;
+    if (page == 0) {
+        url += "&total=1";
+    }
+
+    const response = await fetch(url);
+    const body = response.status == 200 ? await response.json() : { entries: [] };
+
+    view.pages.set(page, body.entries);
+
+    if (body.total != null) {
+        view.total = body.total;
+        document.getElementById("log-window").style.height = view.total * LOG_ROW_HEIGHT + "px";
+    }
+
+    if (view == log_view) {
+        drawLog();
+    }
+}
+
+function scrollLog() {
+    // Redraw the rows in view once a frame at most
+    if (!log_frame) {
+        log_frame = requestAnimationFrame(() => {
+            log_frame = null;
+            drawLog();
         });
+    }
+}
+
+function drawLog() {
+    // Replace the drawn rows with those in view and a few either side,
+    // fetching the pages they're on. Rows still loading are blank
+    if (!log_view) {
+        return;
+    }
+
+    const log_el = document.getElementById("log-container");
+    const window_el = document.getElementById("log-window");
+    const content_el = document.getElementById("log-content");
+
+    // How far the log has scrolled past the top of the first row
+    const top = Math.max(0, log_el.getBoundingClientRect().top - window_el.getBoundingClientRect().top);
+    const first = Math.max(0, Math.floor(top / LOG_ROW_HEIGHT) - LOG_OVERSCAN_ROWS);
+    const last = Math.min(log_view.total, Math.ceil((top + log_el.clientHeight) / LOG_ROW_HEIGHT) + LOG_OVERSCAN_ROWS);
+
+    const fragment = document.createDocumentFragment();
+
+    for (let index = first; index < last; index++) {
+        const page = Math.floor(index / LOG_PAGE_ROWS);
+
+        if (!log_view.pages.has(page)) {
+            loadLogPage(log_view, page);
+        }
+
+        const entries = log_view.pages.get(page);
+        fragment.appendChild(logRow(entries ? entries[index % LOG_PAGE_ROWS] : null));
+    }
+
+    content_el.replaceChildren(fragment);
+    content_el.style.transform = "translateY(" + first * LOG_ROW_HEIGHT + "px)";
+}
 
-        log_el.classList.remove("hidden");
+function logRow(entry) {
+    // One print's row, or a blank one while its page loads
+    const tr = document.createElement("tr");
+
+    const values = entry ? [
+        new Date(entry.timestamp * 1000).toLocaleString(),
+        entry.college_id,
+        entry.name,
+        entry.email,
+        entry.paper_width + " inches",
+    ] : ["", "", "", "", ""];
+
+    values.forEach(value => {
+        const td = document.createElement("td");
+        td.textContent = entry ? value ?? "Unknown" : "";
+        tr.appendChild(td);
     });
+
+    return tr;
 }
 
 function closeLog() {
     document.getElementById("log-container").classList.add("hidden");
+    log_view = null;
 }
 
+// Previews are rendered for the display's size, so render again once
+// a resize settles
+let resize_timeout = null;
+window.addEventListener("resize", function () {
+    clearTimeout(resize_timeout);
+    resize_timeout = setTimeout(function () {
+        if (state.handle) {
+            renderPreview();
+        }
+    }, 300);
+});
+
 document.addEventListener("keydown", function (event) {
     if (event.key == "Enter") {
         renderPreview();
@@ -1,4 +1,4 @@
-def encodedDistance(inches):
+def encodedDistanceLoop(inches):
     start = 65535
     vector = [0, 1, 0, 1, 1, 0, 1, 0, 1, 1,
               0, 1, 0, 1, 1, 0, 1, 0, 1, 1, 0, 1, 1]
@@ -22,6 +22,23 @@ def encodedDistance(inches):
 
     return int(hex(result[i-1]), 16)
 
+from ucf import encodedDistance
+
+# The closed form must match the loop for every print length, the
+# loop misreads 0 inches as 1 step so that's skipped
+for inches in range(1, 1001):
+    assert encodedDistance(inches) == encodedDistanceLoop(inches), inches
+print("encodedDistance matches for 1-1000 inches")
+
+from ucf import DISTANCE_FIELDS, MAX_DISTANCE_INCHES
+
+# The table holds each length's encodedDistance wherever it fits a
+# 16 bit field
+for inches in range(1, MAX_DISTANCE_INCHES + 1):
+    if 0 <= encodedDistance(inches) <= 0xFFFF:
+        assert DISTANCE_FIELDS[inches] == encodedDistance(inches).to_bytes(2, byteorder="big"), inches
+print("DISTANCE_FIELDS matches for 1-" + str(MAX_DISTANCE_INCHES) + " inches")
+
 width = 24
 height = 30
 newWidth = min(44, width)
@@ -29,4 +46,50 @@ height = int(height * (newWidth / width))
 width = newWidth
 
 print("height:", hex(encodedDistance(height)))
-print("width:", hex(encodedDistance(width)))
\ No newline at end of file
+print("width:", hex(encodedDistance(width)))
+import os
+import tempfile
+
+import pyvips
+
+import app
+
+
+def printOptions(paper_width):
+    # Options the frontend sends for an auto-sized print, with its label
+    return {"side": "short", "max_size": True, "specific_width": None, "specific_height": None,
+            "specific_dpi": None, "paper_width": paper_width, "all_pages": False, "print": True,
+            "label": {"college_id": None, "file_name": "test.png"}}
+
+
+def spoolPrint(data, content_type, options):
+    # Render an upload the way printAdmitted does, uncached so it
+    # streams, and return its spool as written
+    printer = app.presetPrinter(app.printers.selected()[0], options)
+    image, plan, spool_dpi, landscape = app.fittedPrint(data, content_type, options, None, printer)
+    image = app.labelForPrint(image, options, spool_dpi, printer)
+
+    with tempfile.TemporaryDirectory() as directory:
+        filename = os.path.join(directory, "output.tif")
+        app.writeSpool(image, filename, spool_dpi, printer=printer)
+
+        return plan, pyvips.Image.new_from_buffer(open(filename, "rb").read(), "")
+
+
+# A labelled print streamed from a sequential png loader with no turn
+# to buffer it must spool top to bottom, without the label reading its
+# foot first
+options = printOptions(24)
+data = (pyvips.Image.black(2400, 3600, bands=3) + [200, 120, 40]).cast("uchar").pngsave_buffer()
+assert app.printStreams(data, "image/png", options)
+
+(rotate, width, height, dpi), spool = spoolPrint(data, "image/png", options)
+assert not rotate
+assert (spool.width, spool.height) == (2400, 3600), (spool.width, spool.height)
+print("Labelled streamed png spools")
+
+# A grey upload stays one band through its label to the spool
+data = (pyvips.Image.black(2400, 3600, bands=3) + 90).cast("uchar").pngsave_buffer()
+(rotate, width, height, dpi), spool = spoolPrint(data, "image/png", options)
+assert spool.bands == 1, spool.bands
+print("Labelled grey print spools one band")
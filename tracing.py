@@ -0,0 +1,120 @@
+import threading
+import time
+import os
+import json
+import collections
+import contextlib
+
+# Spans are only recorded with BLUEPRINT_TRACE=1, recording every
+# vips operation is too slow to leave on
+enabled = os.environ.get("BLUEPRINT_TRACE", "") == "1"
+
+# Or, with BLUEPRINT_TRACE_SLOW_SECONDS, recorded into the ring for
+# every request and kept only for requests slower than that, as a
+# trace file each in SLOW_DIR. The newest SLOW_MAX are kept
+SLOW_SECONDS = float(os.environ.get("BLUEPRINT_TRACE_SLOW_SECONDS", "0"))
+SLOW_DIR = os.environ.get("BLUEPRINT_TRACE_SLOW_DIR", "slow_traces")
+SLOW_MAX = 100
+
+recording = enabled or SLOW_SECONDS > 0
+
+# Oldest events are dropped past this many
+MAX_EVENTS = 200000
+
+events = collections.deque(maxlen=MAX_EVENTS)
+lock = threading.Lock()
+start = time.perf_counter()
+
+
+def now():
+    # Microseconds since the server started, the unit trace viewers use
+    return (time.perf_counter() - start) * 1000000
+
+
+def record(event):
+    event["pid"] = os.getpid()
+    event["tid"] = threading.get_ident()
+
+    with lock:
+        events.append(event)
+
+
+@contextlib.contextmanager
+def span(name, category="stage", **args):
+    # Record how long the block takes as a complete event
+    if not recording:
+        yield
+        return
+
+    begin = now()
+
+    try:
+        yield
+    finally:
+        record({"name": name, "cat": category, "ph": "X", "ts": begin, "dur": now() - begin, "args": args})
+
+
+def instant(name, category="stage", **args):
+    # Record a point in time, such as a cache miss
+    if recording:
+        record({"name": name, "cat": category, "ph": "i", "s": "t", "ts": now(), "args": args})
+
+
+def counter(name, **values):
+    # Record values drawn as a graph, such as a write's progress
+    if recording:
+        record({"name": name, "ph": "C", "ts": now(), "args": values})
+
+
+def traceOperations(pyvips):
+    # Wrap pyvips so every vips operation that is built gets a span
+    if not recording:
+        return
+
+    call = pyvips.Operation.call
+
+    def tracedCall(operation_name, *args, **kwargs):
+        with span(operation_name, "vips"):
+            return call(operation_name, *args, **kwargs)
+
+    pyvips.Operation.call = staticmethod(tracedCall)
+
+
+def export():
+    # Everything recorded so far in the Chrome trace event format,
+    # loads in chrome://tracing and Perfetto
+    with lock:
+        return {"traceEvents": list(events), "displayTimeUnit": "ms"}
+
+
+def slow(seconds):
+    # Whether a request that took seconds should have its trace kept
+    return SLOW_SECONDS > 0 and seconds >= SLOW_SECONDS
+
+
+def keepSlow(name, begin, end, **args):
+    # Write the events from begin to end, on every thread, as a trace
+    # of their own with args describing the request. Other requests
+    # running alongside show up too, they're often why it was slow
+    with lock:
+        window = [event for event in events if event["ts"] <= end and event["ts"] + event.get("dur", 0) >= begin]
+
+    window.append({"name": name, "cat": "request", "ph": "X", "ts": begin, "dur": end - begin,
+                   "pid": os.getpid(), "tid": threading.get_ident(), "args": args})
+
+    os.makedirs(SLOW_DIR, exist_ok=True)
+    path = os.path.join(SLOW_DIR, time.strftime("%Y%m%d-%H%M%S") + "-" + name + "-" +
+                        str(round((end - begin) / 1000)) + "ms.json")
+
+    with open(path, "w") as f:
+        json.dump({"traceEvents": window, "displayTimeUnit": "ms", "metadata": args}, f, default=str)
+
+    # Keep the newest SLOW_MAX
+    traces = sorted(os.path.join(SLOW_DIR, file) for file in os.listdir(SLOW_DIR) if file.endswith(".json"))
+    for old in traces[:-SLOW_MAX]:
+        try:
+            os.remove(old)
+        except OSError:
+            pass
+
+    return path
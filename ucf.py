@@ -0,0 +1,118 @@
+import os
+import threading
+
+# Epson UCF paper configs. The driver reads the custom paper size
+# from three big-endian 16 bit fields near the end of the file
+EPSON_FIELDS = {"orientation": 0x41736, "width": 0x41738, "height": 0x4173C}
+
+# Change in the encoded distance for each inch, the pattern repeats
+# every 23 inches
+DISTANCE_STEPS = [25600 if step else -39935 for step in [0, 1, 0, 1, 1, 0, 1, 0, 1, 1,
+                                                           0, 1, 0, 1, 1, 0, 1, 0, 1, 1, 0, 1, 1]]
+# Sum of the steps for each number of inches into a repeat
+DISTANCE_OFFSETS = [sum(DISTANCE_STEPS[:i]) for i in range(len(DISTANCE_STEPS))]
+DISTANCE_CYCLE = sum(DISTANCE_STEPS)
+
+# Longest distance the kiosk plans, prints are at most 500 inches tall
+MAX_DISTANCE_INCHES = 500
+
+# Template bytes by path, read from disc once
+templates = {}
+templates_lock = threading.Lock()
+
+
+def encodedDistance(inches):
+    # Encoded distance starts at 65535 and takes one step per inch,
+    # so it's worked out from whole repeats plus the offset into the
+    # last one. 0 inches is the starting value
+    repeats, remainder = divmod(inches, len(DISTANCE_STEPS))
+
+    return 65535 + repeats * DISTANCE_CYCLE + DISTANCE_OFFSETS[remainder]
+
+
+def encodedField(inches):
+    # Field bytes for a distance. encodedDistance is hundredths of an
+    # inch stored little-endian, read back big-endian, but the repeat
+    # drifts from that past 86 inches and some lengths no longer fit 16
+    # bits. Those are written as the hundredths the rest agree with
+    encoded = encodedDistance(inches)
+
+    if 0 <= encoded <= 0xFFFF:
+        return encoded.to_bytes(2, byteorder="big")
+
+    return (inches * 100).to_bytes(2, byteorder="little")
+
+
+# Field bytes for every whole inch from 0 to MAX_DISTANCE_INCHES, and
+# for each orientation, worked out once. The encoding is the same for
+# every printer model, only the offsets differ
+DISTANCE_FIELDS = [encodedField(inches) for inches in range(MAX_DISTANCE_INCHES + 1)]
+PORTRAIT_FIELD = (0x00).to_bytes(2, byteorder="big")
+LANDSCAPE_FIELD = (0x01).to_bytes(2, byteorder="big")
+
+
+def distanceField(inches):
+    # Field bytes for a whole number of inches, from the table when
+    # it's in range
+    if 0 <= inches <= MAX_DISTANCE_INCHES:
+        return DISTANCE_FIELDS[inches]
+
+    return encodedField(inches)
+
+
+def template(path):
+    # Pristine config for a printer, kept in memory after the first read
+    with templates_lock:
+        if path not in templates:
+            with open(path, "rb") as f:
+                templates[path] = f.read()
+
+        return templates[path]
+
+
+def fields(width, height, offsets=EPSON_FIELDS):
+    # Bytes for the orientation, width and height fields
+    return [(offsets["orientation"], PORTRAIT_FIELD if height > width else LANDSCAPE_FIELD),
+            (offsets["width"], distanceField(width)),
+            (offsets["height"], distanceField(height))]
+
+
+def patch(template_path, width, height, offsets=EPSON_FIELDS):
+    # Template with the paper size patched in, without touching disc
+    config = bytearray(template(template_path))
+
+    for offset, value in fields(width, height, offsets):
+        config[offset:offset + len(value)] = value
+
+    return bytes(config)
+
+
+def matches(location, width, height, offsets=EPSON_FIELDS):
+    # Whether the installed config already holds this paper size
+    try:
+        with open(location, "rb") as f:
+            for offset, value in fields(width, height, offsets):
+                f.seek(offset)
+                if f.read(len(value)) != value:
+                    return False
+    except OSError:
+        return False
+
+    return True
+
+
+def install(template_path, location, width, height, offsets=EPSON_FIELDS):
+    # Write the patched config to the driver's location in one step so
+    # it never reads a half-written file. Skips the write when the
+    # installed config already has this size
+    # Returns whether the file was written
+    if matches(location, width, height, offsets):
+        return False
+
+    temp = location + ".tmp"
+    with open(temp, "wb") as f:
+        f.write(patch(template_path, width, height, offsets))
+
+    os.replace(temp, location)
+
+    return True
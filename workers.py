@@ -0,0 +1,166 @@
+import io
+import os
+import json
+import tarfile
+import hashlib
+import threading
+import urllib.error
+import urllib.request
+
+# Render workers: lab workstations running this same server with
+# BLUEPRINT_WORKER=1. The kiosk sends them prints and gets the spool
+# files back, then only hands off to the printer itself
+#
+#   BLUEPRINT_RENDER_WORKERS=http://lab-1:5000,http://lab-2:5000
+#
+# Each upload has an owner among the workers, picked by its content
+# hash, so the same upload renders where it's already decoded and its
+# document handles are open, unless the owner is busy, see pick
+
+WORKERS = [url.strip().rstrip("/") for url in os.environ.get("BLUEPRINT_RENDER_WORKERS", "").split(",") if url.strip()]
+
+# Shared secret sent to workers and checked by them, empty for none
+TOKEN = os.environ.get("BLUEPRINT_WORKER_TOKEN", "")
+
+# Seconds to wait on a worker before rendering locally instead. Renders
+# of long banners can take minutes, so this is long
+TIMEOUT_SECONDS = float(os.environ.get("BLUEPRINT_WORKER_TIMEOUT", "900"))
+
+# Prints at least this many inches long split into bands rendered
+# across every worker at once, on the direct backend where a print
+# spools as bands anyway
+SPLIT_INCHES = float(os.environ.get("BLUEPRINT_WORKER_SPLIT_INCHES", "72"))
+
+# Renders in flight on an upload's owner before its prints spill to
+# the least loaded worker instead
+BUSY_RENDERS = int(os.environ.get("BLUEPRINT_WORKER_BUSY", "1"))
+
+# Renders this server has in flight on each worker
+in_flight = {}
+in_flight_lock = threading.Lock()
+
+# Written first in every spool archive, the hand-offs and result of the
+# render the files belong to
+MANIFEST = "worker.json"
+
+
+class WorkerError(Exception):
+    pass
+
+
+def ranked(key, workers=WORKERS):
+    # Workers by their rendezvous hash of key and worker, highest first
+    return sorted(workers, key=lambda worker: hashlib.blake2b((worker + "/" + key).encode(), digest_size=8).digest(),
+                  reverse=True)
+
+
+def owner(key, workers=WORKERS):
+    # Worker an upload renders on: the highest rendezvous hash, so
+    # adding or losing a worker only moves the uploads it owns
+    if not workers:
+        return None
+
+    return ranked(key, workers)[0]
+
+
+def pick(key, workers=WORKERS):
+    # Worker to render an upload on and whether it spilled from the
+    # owner: the owner unless it's busy, then the least loaded, ties
+    # in rendezvous order so a spilled upload keeps to the same
+    # second choice while it can
+    candidates = ranked(key, workers)
+
+    with in_flight_lock:
+        if in_flight.get(candidates[0], 0) < BUSY_RENDERS:
+            return candidates[0], False
+
+        worker = min(candidates, key=lambda worker: in_flight.get(worker, 0))
+
+    return worker, worker != candidates[0]
+
+
+def request(worker, path, data=None, headers={}, method=None):
+    # Open a request to a worker, raising WorkerError with its status
+    # for anything but success
+    headers = dict(headers, **({"X-Blueprint-Worker-Token": TOKEN} if TOKEN else {}))
+
+    try:
+        return urllib.request.urlopen(urllib.request.Request(worker + path, data=data, headers=headers, method=method),
+                                      timeout=TIMEOUT_SECONDS)
+    except urllib.error.HTTPError as error:
+        raise WorkerError(error.code)
+
+
+def render(worker, key, data, content_type, body, directory):
+    # Render a print on a worker, sending the upload only when the
+    # worker doesn't hold it already, and unpack the spool files it
+    # streams back into directory. Returns the worker's manifest
+    path = "/worker/render/" + key
+    request_body = json.dumps(dict(body, content_type=content_type)).encode()
+    headers = {"Content-Type": "application/json"}
+
+    with in_flight_lock:
+        in_flight[worker] = in_flight.get(worker, 0) + 1
+
+    try:
+        try:
+            response = request(worker, path, request_body, headers)
+        except WorkerError as error:
+            if error.args[0] != 428:
+                raise
+
+            request(worker, "/worker/uploads/" + key, data, {"Content-Type": content_type}, "PUT").close()
+            response = request(worker, path, request_body, headers)
+
+        with response:
+            try:
+                return unpack(response, directory)
+            except tarfile.TarError as error:
+                raise WorkerError(str(error))
+    finally:
+        with in_flight_lock:
+            in_flight[worker] -= 1
+
+
+def pack(directory, manifest, out):
+    # Stream the manifest and every file of the job's spool directory
+    # into out as an uncompressed tar, spools are compressed already.
+    # Band and vector manifests name files beside them, so everything
+    # goes, not just the files handed off
+    with tarfile.open(fileobj=out, mode="w|") as archive:
+        encoded = json.dumps(manifest).encode()
+        info = tarfile.TarInfo(MANIFEST)
+        info.size = len(encoded)
+        archive.addfile(info, io.BytesIO(encoded))
+
+        for name in sorted(os.listdir(directory)):
+            archive.add(os.path.join(directory, name), arcname=name)
+
+
+def unpack(stream, directory):
+    # Unpack a spool archive as it arrives, only plain files and only
+    # into directory. Returns the manifest
+    manifest = None
+
+    with tarfile.open(fileobj=stream, mode="r|") as archive:
+        for member in archive:
+            if not member.isfile():
+                continue
+
+            source = archive.extractfile(member)
+
+            if member.name == MANIFEST:
+                manifest = json.load(source)
+                continue
+
+            with open(os.path.join(directory, os.path.basename(member.name)), "wb") as f:
+                while True:
+                    chunk = source.read(1024 * 1024)
+                    if not chunk:
+                        break
+                    f.write(chunk)
+
+    if manifest == None:
+        raise WorkerError("no manifest")
+
+    return manifest